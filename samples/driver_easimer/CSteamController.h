@@ -1,25 +1,66 @@
 // === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
 
 #pragma once
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include "spsc_queue.h"
 extern "C" {
 #include <steamcontroller.h>
 }
 
+// Full scale of the gyro in degrees per second
+#define STEAMCONTROLLER_GYRO_FULL_SCALE_DPS 2000.0
+// Raw accelerometer reading of 1 g
+#define STEAMCONTROLLER_ACCEL_ONE_G 16384.0
+// Capacity of the reader thread -> RunFrames queue; must be a power of two
+#define STEAMCONTROLLER_EVENT_QUEUE_SIZE 256
+// How long the reader thread blocks on the device before checking
+// whether it should exit, in milliseconds
+#define STEAMCONTROLLER_READ_TIMEOUT_MS 50
+// Most reports read or dispatched at once
+#define STEAMCONTROLLER_BATCH_SIZE 32
+
+struct SteamControllerStats_t {
+	uint64_t ulReceived;	// Reports read from the device
+	uint64_t ulDropped;		// Reports lost because the queue was full (not replays)
+	uint64_t ulCoalesced;	// Updates merged into a newer one
+};
+
 class CSteamController {
 public:
+	typedef std::chrono::steady_clock clock;
+
 	CSteamController() : m_pDevice(NULL) {
+		Init();
 	}
 
 	CSteamController(const SteamControllerDeviceEnum* pDeviceEnum)
-		: m_pDevice(SteamController_Open(pDeviceEnum)) {
+		: CSteamController(SteamController_Open(pDeviceEnum)) {
 	}
 
-	~CSteamController() {
+	// Takes ownership of an opened device, e.g. a replay.
+	// fnActivity is called on the reader thread whenever reports arrive; such
+	// a controller only counts updates instead of queueing them, so that the
+	// queue keeps room for connection and battery events however rarely it
+	// is drained.
+	CSteamController(SteamControllerDevice* pDevice, std::function<void()> fnActivity = nullptr)
+		: m_pDevice(pDevice), m_fnActivity(fnActivity) {
+		Init();
+		StartReader();
+	}
+
+	virtual ~CSteamController() {
+		StopReader();
 		if (m_pDevice) {
 			SteamController_Close(m_pDevice);
 		}
 	}
 
+	CSteamController(const CSteamController&) = delete;
+	void operator=(const CSteamController&) = delete;
+
 	bool IsWirelessDongle() {
 		return SteamController_IsWirelessDongle(m_pDevice);
 	}
@@ -60,29 +101,215 @@ public:
 		SteamController_PlayMelody(m_pDevice, melody);
 	}
 
-	virtual void OnUpdate(const SteamControllerUpdateEvent& ev) {}
+	// Called with the motion data of every update report, in order, and
+	// when the last one of the batch was read
+	virtual void OnSamples(const SteamControllerUpdateBatch&, clock::time_point) {}
+	// Called for updates after coalescing, with when the reader thread
+	// read the report
+	virtual void OnUpdate(const SteamControllerUpdateEvent&, clock::time_point) {}
 	virtual void OnDisconnect() {}
-	virtual void OnBattery(uint16_t voltage) {}
+	// Battery voltage in millivolts
+	virtual void OnBattery(uint16_t) {}
 
+	// Merge runs of updates with the same buttons into the newest one
+	// before OnUpdate; OnSamples still sees all of them
+	void SetCoalesceUpdates(bool bCoalesce) { m_bCoalesce = bCoalesce; }
+
+	// Dispatch every report the reader thread queued since the last call
 	void RunFrames() {
+		SteamControllerEvent aEvents[STEAMCONTROLLER_BATCH_SIZE];
+		clock::time_point atReceived[STEAMCONTROLLER_BATCH_SIZE];
+		while (m_pDevice != NULL) {
+			uint32_t unCount = 0;
+			clock::time_point tNewest;
+			QueuedEvent_t item;
+			while (unCount < STEAMCONTROLLER_BATCH_SIZE && m_queue.Pop(item)) {
+				atReceived[unCount] = item.tReceived;
+				aEvents[unCount++] = item.ev;
+				if (item.ev.eventType == STEAMCONTROLLER_EVENT_UPDATE) {
+					tNewest = item.tReceived;
+				}
+			}
+			if (unCount == 0) {
+				break;
+			}
+
+			m_batch.count = 0;
+			SteamController_DecodeUpdates(aEvents, unCount, &m_batch);
+			if (m_batch.count > 0) {
+				OnSamples(m_batch, tNewest);
+			}
+			DispatchEvents(aEvents, atReceived, unCount);
+		}
+	}
+
+	void GetStats(SteamControllerStats_t& stats) const {
+		stats.ulReceived = m_ulReceived.load(std::memory_order_relaxed);
+		stats.ulDropped = m_ulDropped.load(std::memory_order_relaxed);
+		stats.ulCoalesced = m_ulCoalesced.load(std::memory_order_relaxed);
+	}
+
+	bool IsConnected() const { return m_pDevice; }
+
+	// Ask the reader thread to stop without waiting for it; the controller
+	// can be destroyed without blocking once IsReaderStopped returns true
+	void RequestStop() { m_bReaderExiting.store(true, std::memory_order_relaxed); }
+	bool IsReaderStopped() const { return m_bReaderStopped.load(std::memory_order_acquire); }
+
+protected:
+	// Stop and join the reader thread; safe to call more than once
+	void StopReader() {
+		RequestStop();
+		if (m_reader.joinable()) {
+			m_reader.join();
+		}
+	}
+
+private:
+	struct QueuedEvent_t {
 		SteamControllerEvent ev;
+		clock::time_point tReceived;
+	};
+
+	void Init() {
+		m_batch.capacity = STEAMCONTROLLER_BATCH_SIZE;
+		m_batch.count = 0;
+		m_batch.timeStamp = m_aunBatchTimeStamp;
+		m_batch.buttons = m_aunBatchButtons;
+		m_batch.orientation = m_aBatchOrientation;
+		m_batch.acceleration = m_aBatchAcceleration;
+		m_batch.angularVelocity = m_aBatchAngularVelocity;
+		m_bCoalesce = true;
+		m_bWaitForRoom = m_pDevice != NULL && SteamController_IsReplay(m_pDevice);
+		m_bReaderExiting.store(false, std::memory_order_relaxed);
+		m_bReaderStopped.store(true, std::memory_order_relaxed);
+		m_ulReceived.store(0, std::memory_order_relaxed);
+		m_ulDropped.store(0, std::memory_order_relaxed);
+		m_ulCoalesced.store(0, std::memory_order_relaxed);
+	}
+
+	void StartReader() {
 		if (m_pDevice != NULL) {
-			if (SteamController_ReadEvent(m_pDevice, &ev)) {
-				if (ev.eventType == STEAMCONTROLLER_EVENT_UPDATE) {
-					OnUpdate(ev.update);
+			m_bReaderStopped.store(false, std::memory_order_relaxed);
+			m_reader = std::thread(&CSteamController::ReaderThreadFunction, this);
+		}
+	}
+
+	// Hand updates to OnUpdate after coalescing and handle the other events
+	void DispatchEvents(const SteamControllerEvent* pEvents, const clock::time_point* ptReceived, uint32_t unCount) {
+		const SteamControllerUpdateEvent* pPending = NULL;
+		clock::time_point tPending;
+		for (uint32_t i = 0; i < unCount; i++) {
+			auto const& ev = pEvents[i];
+			if (ev.eventType == STEAMCONTROLLER_EVENT_UPDATE) {
+				if (pPending != NULL) {
+					// Button changes are never merged away
+					if (m_bCoalesce && pPending->buttons == ev.update.buttons) {
+						m_ulCoalesced.fetch_add(1, std::memory_order_relaxed);
+					} else {
+						OnUpdate(*pPending, tPending);
+					}
+				}
+				pPending = &ev.update;
+				tPending = ptReceived[i];
+				continue;
+			}
+
+			if (pPending != NULL) {
+				OnUpdate(*pPending, tPending);
+				pPending = NULL;
+			}
+			if (ev.eventType == STEAMCONTROLLER_EVENT_CONNECTION) {
+				if (ev.connection.details == 1) {
+					// The reader thread stops by itself after a disconnect
+					StopReader();
+					SteamController_Close(m_pDevice);
+					m_pDevice = NULL;
+					OnDisconnect();
+					return;
 				}
-				else if (ev.eventType == STEAMCONTROLLER_EVENT_CONNECTION) {
-					if (ev.connection.details == 1) {
-						SteamController_Close(m_pDevice);
-						m_pDevice = NULL;
-						OnDisconnect();
+			}
+			else if (ev.eventType == STEAMCONTROLLER_EVENT_BATTERY) {
+				OnBattery(ev.battery.voltage);
+			}
+		}
+		if (pPending != NULL) {
+			OnUpdate(*pPending, tPending);
+		}
+	}
+
+	void ReaderThreadFunction() {
+		ReadReports();
+		m_bReaderStopped.store(true, std::memory_order_release);
+	}
+
+	// Block on the device and queue every report as it arrives, so that
+	// none pile up in the OS between two frames
+	void ReadReports() {
+		SteamControllerEvent aEvents[STEAMCONTROLLER_BATCH_SIZE];
+		QueuedEvent_t item;
+		while (!m_bReaderExiting.load(std::memory_order_relaxed)) {
+			auto tStart = clock::now();
+			auto unCount = SteamController_ReadEvents(m_pDevice, aEvents, STEAMCONTROLLER_BATCH_SIZE, STEAMCONTROLLER_READ_TIMEOUT_MS * 1000);
+			if (unCount == 0) {
+				// A failing device returns at once; don't spin on it
+				auto tWait = std::chrono::milliseconds(STEAMCONTROLLER_READ_TIMEOUT_MS) - (clock::now() - tStart);
+				if (tWait > clock::duration::zero()) {
+					std::this_thread::sleep_for(tWait);
+				}
+				continue;
+			}
+
+			item.tReceived = clock::now();
+			m_ulReceived.fetch_add(unCount, std::memory_order_relaxed);
+			bool bDisconnected = false;
+			for (uint32_t i = 0; i < unCount && !bDisconnected; i++) {
+				item.ev = aEvents[i];
+				bDisconnected = item.ev.eventType == STEAMCONTROLLER_EVENT_CONNECTION && item.ev.connection.details == 1;
+				if (m_fnActivity && item.ev.eventType == STEAMCONTROLLER_EVENT_UPDATE) {
+					continue;
+				}
+				while (!m_queue.Push(item)) {
+					if (!m_bWaitForRoom || m_bReaderExiting.load(std::memory_order_relaxed)) {
+						m_ulDropped.fetch_add(1, std::memory_order_relaxed);
+						break;
 					}
+					// A replay can produce reports faster than frames take
+					// them; losing some would make runs differ
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
 				}
 			}
+			// Signal only once the events are queued, so that whoever wakes
+			// up sees them
+			if (m_fnActivity) {
+				m_fnActivity();
+			}
+			if (bDisconnected) {
+				return;
+			}
 		}
 	}
 
-	bool IsConnected() const { return m_pDevice; }
-private:
 	SteamControllerDevice* m_pDevice;
+	std::function<void()> m_fnActivity;
+
+	bool m_bCoalesce;
+	// Apply backpressure instead of dropping reports; set for replays
+	bool m_bWaitForRoom;
+	std::thread m_reader;
+	std::atomic<bool> m_bReaderExiting;
+	std::atomic<bool> m_bReaderStopped;
+	CSPSCQueue<QueuedEvent_t, STEAMCONTROLLER_EVENT_QUEUE_SIZE> m_queue;
+
+	std::atomic<uint64_t> m_ulReceived;
+	std::atomic<uint64_t> m_ulDropped;
+	std::atomic<uint64_t> m_ulCoalesced;
+
+	// Storage of the batch handed to OnSamples
+	SteamControllerUpdateBatch m_batch;
+	uint32_t m_aunBatchTimeStamp[STEAMCONTROLLER_BATCH_SIZE];
+	uint32_t m_aunBatchButtons[STEAMCONTROLLER_BATCH_SIZE];
+	SteamControllerVector m_aBatchOrientation[STEAMCONTROLLER_BATCH_SIZE];
+	SteamControllerVector m_aBatchAcceleration[STEAMCONTROLLER_BATCH_SIZE];
+	SteamControllerVector m_aBatchAngularVelocity[STEAMCONTROLLER_BATCH_SIZE];
 };
@@ -0,0 +1,537 @@
+// === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
+
+#include "control_channel.h"
+#include "driverlog.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// epoll tags of the two descriptors that aren't clients; client ids
+// start at 1
+static const uint64_t k_ulTagListen = UINT64_MAX;
+static const uint64_t k_ulTagWake = UINT64_MAX - 1;
+
+#define CONTROL_EPOLL_EVENTS 16
+#define CONTROL_READ_CHUNK 4096
+
+static const char* const k_pchHelp =
+    "{\"commands\":[\"subscribe\",\"unsubscribe\",\"stats\",\"reset\",\"reload\",\"recalibrate\","
+    "\"gc-budget [us]\",\"get <name.field...>\",\"help\"]}";
+
+CControlChannel::CControlChannel() :
+    m_bExiting(false),
+    m_bIdle(false),
+    m_fdListen(-1),
+    m_fdEpoll(-1),
+    m_fdWake(-1),
+    m_unNextClient(1),
+    m_unInFlight(0),
+    m_unSubscribers(0),
+    m_unDropped(0) {
+}
+
+CControlChannel::~CControlChannel() {
+    Stop();
+}
+
+std::string CControlChannel::GetDefaultPath() {
+    auto pchRuntimeDir = getenv("XDG_RUNTIME_DIR");
+    if (pchRuntimeDir != NULL && pchRuntimeDir[0] != 0) {
+        return std::string(pchRuntimeDir) + "/driver_easimer.sock";
+    }
+#if defined(__linux__)
+    char achPath[64];
+    snprintf(achPath, sizeof(achPath), "/tmp/driver_easimer-%u.sock", (unsigned)getuid());
+    return achPath;
+#else
+    return std::string();
+#endif
+}
+
+#if defined(__linux__)
+
+static void CloseDescriptor(int& fd) {
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+// Whether another process answers on a socket path that is in use
+static bool IsSocketLive(const sockaddr_un& addr) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+    auto bLive = connect(fd, (const sockaddr*)&addr, sizeof(addr)) == 0;
+    close(fd);
+    return bLive;
+}
+
+bool CControlChannel::Start(const std::string& sPath) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (sPath.empty() || sPath.size() >= sizeof(addr.sun_path)) {
+        DriverLogAt(DRIVERLOG_SEVERITY_ERROR, "Control socket path '%s' is empty or too long", sPath.c_str());
+        return false;
+    }
+    memcpy(addr.sun_path, sPath.c_str(), sPath.size() + 1);
+
+    m_fdListen = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_fdListen < 0) {
+        DriverLogAt(DRIVERLOG_SEVERITY_ERROR, "Can't create control socket: %s", strerror(errno));
+        return false;
+    }
+
+    if (bind(m_fdListen, (const sockaddr*)&addr, sizeof(addr)) != 0) {
+        // A socket left behind by a driver that didn't shut down is
+        // replaced; one that still answers belongs to another server
+        auto bRebound = errno == EADDRINUSE && !IsSocketLive(addr) &&
+            unlink(sPath.c_str()) == 0 && bind(m_fdListen, (const sockaddr*)&addr, sizeof(addr)) == 0;
+        if (!bRebound) {
+            DriverLogAt(DRIVERLOG_SEVERITY_ERROR, "Can't bind control socket %s: %s", sPath.c_str(), strerror(errno));
+            Stop();
+            return false;
+        }
+    }
+    m_sPath = sPath;
+
+    // Only the user running the server may connect
+    chmod(sPath.c_str(), 0600);
+    if (listen(m_fdListen, CONTROL_MAX_CLIENTS) != 0) {
+        DriverLogAt(DRIVERLOG_SEVERITY_ERROR, "Can't listen on control socket %s: %s", sPath.c_str(), strerror(errno));
+        Stop();
+        return false;
+    }
+
+    m_fdWake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    m_fdEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (m_fdWake < 0 || m_fdEpoll < 0) {
+        DriverLogAt(DRIVERLOG_SEVERITY_ERROR, "Can't set up the control thread: %s", strerror(errno));
+        Stop();
+        return false;
+    }
+
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = k_ulTagListen;
+    epoll_ctl(m_fdEpoll, EPOLL_CTL_ADD, m_fdListen, &ev);
+    ev.data.u64 = k_ulTagWake;
+    epoll_ctl(m_fdEpoll, EPOLL_CTL_ADD, m_fdWake, &ev);
+
+    DriverLog("Control socket listening on %s", sPath.c_str());
+    m_bExiting = false;
+    m_thread = std::thread(&CControlChannel::ThreadFunction, this);
+    return true;
+}
+
+void CControlChannel::Stop() {
+    if (m_thread.joinable()) {
+        m_bExiting = true;
+        uint64_t ulOne = 1;
+        if (write(m_fdWake, &ulOne, sizeof(ulOne)) < 0) {
+            DriverLogAt(DRIVERLOG_SEVERITY_ERROR, "Can't wake the control thread: %s", strerror(errno));
+        }
+        m_thread.join();
+    }
+
+    for (auto& client : m_clients) {
+        CloseDescriptor(client.fd);
+    }
+    m_clients.clear();
+    m_unSubscribers = 0;
+
+    CloseDescriptor(m_fdListen);
+    CloseDescriptor(m_fdEpoll);
+    CloseDescriptor(m_fdWake);
+    if (!m_sPath.empty()) {
+        unlink(m_sPath.c_str());
+        m_sPath.clear();
+    }
+}
+
+// Signal the control thread if it went to sleep with empty queues
+void CControlChannel::Wake() {
+    // Pairs with the fence in ThreadFunction: either the control thread
+    // sees what was just queued, or this sees it idle
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_bIdle.exchange(false)) {
+        uint64_t ulOne = 1;
+        if (write(m_fdWake, &ulOne, sizeof(ulOne)) < 0) {
+            // The counter is already nonzero; the thread is being woken
+        }
+    }
+}
+
+void CControlChannel::ThreadFunction() {
+    epoll_event aEvents[CONTROL_EPOLL_EVENTS];
+
+    while (!m_bExiting) {
+        DrainQueues();
+
+        // Clients are only removed here so that everything above can hold
+        // on to them
+        for (auto& client : m_clients) {
+            if (client.bClosing && client.unPending == 0 && client.asDeferred.empty() && client.sOutput.empty()) {
+                Disconnect(client);
+            }
+        }
+        m_clients.erase(std::remove_if(m_clients.begin(), m_clients.end(), [](const Client_t& client) {
+            return client.fd < 0;
+        }), m_clients.end());
+
+        m_bIdle.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (HasQueued()) {
+            m_bIdle.store(false);
+            continue;
+        }
+
+        auto nEvents = epoll_wait(m_fdEpoll, aEvents, CONTROL_EPOLL_EVENTS, -1);
+        m_bIdle.store(false);
+        if (nEvents < 0 && errno != EINTR) {
+            DriverLogAt(DRIVERLOG_SEVERITY_ERROR, "Control thread epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < nEvents; i++) {
+            auto const& ev = aEvents[i];
+            if (ev.data.u64 == k_ulTagListen) {
+                Accept();
+                continue;
+            }
+            if (ev.data.u64 == k_ulTagWake) {
+                uint64_t ulCount;
+                if (read(m_fdWake, &ulCount, sizeof(ulCount)) < 0) {
+                    // Already reset by an earlier event
+                }
+                continue;
+            }
+
+            auto pClient = FindClient((uint32_t)ev.data.u64);
+            if (pClient == NULL) {
+                continue;
+            }
+            if (ev.events & (EPOLLHUP | EPOLLERR)) {
+                // Gone entirely; nobody is left to read answers, but what
+                // it wrote before closing still runs, e.g. echo reload | nc
+                if (ev.events & EPOLLIN) {
+                    Receive(*pClient);
+                }
+                Disconnect(*pClient);
+                continue;
+            }
+            if (ev.events & EPOLLIN) {
+                Receive(*pClient);
+            }
+            if (pClient->fd >= 0 && (ev.events & EPOLLOUT)) {
+                Flush(*pClient);
+            }
+        }
+    }
+}
+
+bool CControlChannel::HasQueued() const {
+    return !m_responses.IsEmpty() || !m_telemetry.IsEmpty();
+}
+
+void CControlChannel::Accept() {
+    for (;;) {
+        int fd = accept4(m_fdListen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        if (m_clients.size() >= CONTROL_MAX_CLIENTS) {
+            DriverLogEvery(DRIVERLOG_SEVERITY_WARNING, 1000, "Control socket has too many clients, refusing one");
+            close(fd);
+            continue;
+        }
+
+        Client_t client;
+        client.fd = fd;
+        client.unId = m_unNextClient++;
+        client.bSubscribed = false;
+        client.bClosing = false;
+        client.bWaitWritable = false;
+        client.unPending = 0;
+
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = client.unId;
+        if (epoll_ctl(m_fdEpoll, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            close(fd);
+            continue;
+        }
+        DebugDriverLog("Control client #%u connected", client.unId);
+        m_clients.push_back(std::move(client));
+    }
+}
+
+void CControlChannel::Receive(Client_t& client) {
+    char achBuffer[CONTROL_READ_CHUNK];
+    for (;;) {
+        auto nRead = recv(client.fd, achBuffer, sizeof(achBuffer), 0);
+        if (nRead > 0) {
+            client.sInput.append(achBuffer, (size_t)nRead);
+            // Run each chunk at once so that a client can't grow the input
+            // past one overlong command
+            ProcessInput(client);
+            if (client.fd < 0) {
+                return;
+            }
+            continue;
+        }
+        if (nRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (nRead < 0) {
+            Disconnect(client);
+            return;
+        }
+
+        // Shut down for writing; answer what it sent, then let it go
+        client.bClosing = true;
+        UpdateInterest(client);
+        break;
+    }
+}
+
+// Run every complete line of input
+void CControlChannel::ProcessInput(Client_t& client) {
+    size_t unStart = 0;
+    for (;;) {
+        auto unEnd = client.sInput.find('\n', unStart);
+        if (unEnd == std::string::npos) {
+            break;
+        }
+        auto sCommand = client.sInput.substr(unStart, unEnd - unStart);
+        unStart = unEnd + 1;
+        if (!sCommand.empty() && sCommand.back() == '\r') {
+            sCommand.pop_back();
+        }
+        if (sCommand.empty()) {
+            continue;
+        }
+        if (client.unPending > 0) {
+            if (client.asDeferred.size() >= CONTROL_MAX_DEFERRED) {
+                DriverLogEvery(DRIVERLOG_SEVERITY_WARNING, 1000, "Control client #%u queued too many commands", client.unId);
+                Disconnect(client);
+                return;
+            }
+            client.asDeferred.push_back(sCommand);
+        } else {
+            HandleCommand(client, sCommand);
+        }
+    }
+    client.sInput.erase(0, unStart);
+
+    if (client.sInput.size() >= CONTROL_MAX_COMMAND) {
+        DriverLogEvery(DRIVERLOG_SEVERITY_WARNING, 1000, "Control client #%u sent an overlong command", client.unId);
+        Disconnect(client);
+        return;
+    }
+    if (!client.sOutput.empty()) {
+        Flush(client);
+    }
+}
+
+void CControlChannel::HandleCommand(Client_t& client, const std::string& sCommand) {
+    const char* pchResponse = NULL;
+    if (sCommand == "subscribe") {
+        if (!client.bSubscribed) {
+            client.bSubscribed = true;
+            m_unSubscribers++;
+        }
+        pchResponse = "{\"subscribed\":true}";
+    } else if (sCommand == "unsubscribe") {
+        if (client.bSubscribed) {
+            client.bSubscribed = false;
+            m_unSubscribers--;
+        }
+        pchResponse = "{\"subscribed\":false}";
+    } else if (sCommand == "help") {
+        pchResponse = k_pchHelp;
+    } else if (sCommand.size() >= CONTROL_MAX_COMMAND) {
+        pchResponse = "{\"error\":\"command too long\"}";
+    } else if (m_unInFlight >= CONTROL_RESPONSE_QUEUE_SIZE - 1) {
+        pchResponse = "{\"error\":\"busy\"}";
+    } else {
+        ControlCommand_t command;
+        command.unClient = client.unId;
+        memcpy(command.achCommand, sCommand.c_str(), sCommand.size() + 1);
+        if (m_commands.Push(command)) {
+            client.unPending++;
+            m_unInFlight++;
+            return;
+        }
+        pchResponse = "{\"error\":\"busy\"}";
+    }
+
+    Send(client, k_unControlMsg_Response, pchResponse, (uint32_t)strlen(pchResponse));
+}
+
+void CControlChannel::Send(Client_t& client, uint16_t unType, const void* pData, uint32_t unSize) {
+    ControlMessageHeader_t header;
+    header.unSize = unSize;
+    header.unType = unType;
+    header.unVersion = CONTROL_PROTOCOL_VERSION;
+    client.sOutput.append((const char*)&header, sizeof(header));
+    client.sOutput.append((const char*)pData, unSize);
+}
+
+void CControlChannel::Flush(Client_t& client) {
+    size_t unSent = 0;
+    while (unSent < client.sOutput.size()) {
+        auto nSent = send(client.fd, client.sOutput.data() + unSent, client.sOutput.size() - unSent, MSG_NOSIGNAL);
+        if (nSent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nSent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (nSent < 0) {
+            Disconnect(client);
+            return;
+        }
+        unSent += (size_t)nSent;
+    }
+    client.sOutput.erase(0, unSent);
+
+    if (client.bWaitWritable != !client.sOutput.empty()) {
+        client.bWaitWritable = !client.sOutput.empty();
+        UpdateInterest(client);
+    }
+}
+
+// Listen for input until the client shuts down its side, and for the
+// socket becoming writable while output is left over
+void CControlChannel::UpdateInterest(Client_t& client) {
+    epoll_event ev;
+    ev.events = 0;
+    if (!client.bClosing) {
+        ev.events |= EPOLLIN;
+    }
+    if (client.bWaitWritable) {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.u64 = client.unId;
+    epoll_ctl(m_fdEpoll, EPOLL_CTL_MOD, client.fd, &ev);
+}
+
+void CControlChannel::Disconnect(Client_t& client) {
+    if (client.fd < 0) {
+        return;
+    }
+    DebugDriverLog("Control client #%u disconnected", client.unId);
+    if (client.bSubscribed) {
+        client.bSubscribed = false;
+        m_unSubscribers--;
+    }
+    epoll_ctl(m_fdEpoll, EPOLL_CTL_DEL, client.fd, NULL);
+    CloseDescriptor(client.fd);
+}
+
+CControlChannel::Client_t* CControlChannel::FindClient(uint32_t unId) {
+    for (auto& client : m_clients) {
+        if (client.unId == unId && client.fd >= 0) {
+            return &client;
+        }
+    }
+    return NULL;
+}
+
+void CControlChannel::DrainQueues() {
+    ControlResponse_t response;
+    while (m_responses.Pop(response)) {
+        m_unInFlight--;
+        // Dropped if the client went away while its command ran
+        auto pClient = FindClient(response.unClient);
+        if (pClient == NULL) {
+            continue;
+        }
+        Send(*pClient, k_unControlMsg_Response, response.achText, response.unSize);
+        pClient->unPending--;
+        while (pClient->unPending == 0 && !pClient->asDeferred.empty()) {
+            auto sCommand = pClient->asDeferred.front();
+            pClient->asDeferred.erase(pClient->asDeferred.begin());
+            HandleCommand(*pClient, sCommand);
+        }
+    }
+
+    ControlTelemetry_t telemetry;
+    while (m_telemetry.Pop(telemetry)) {
+        for (auto& client : m_clients) {
+            if (client.fd >= 0 && client.bSubscribed && client.sOutput.size() < CONTROL_MAX_BACKLOG) {
+                Send(client, k_unControlMsg_Telemetry, &telemetry, sizeof(telemetry));
+            }
+        }
+    }
+
+    for (auto& client : m_clients) {
+        if (client.fd >= 0 && !client.sOutput.empty()) {
+            Flush(client);
+        }
+    }
+}
+
+void CControlChannel::Respond(uint32_t unClient, const std::string& sResponse) {
+    ControlResponse_t response;
+    response.unClient = unClient;
+    if (sResponse.size() < sizeof(response.achText)) {
+        memcpy(response.achText, sResponse.c_str(), sResponse.size());
+        response.unSize = (uint32_t)sResponse.size();
+    } else {
+        response.unSize = (uint32_t)snprintf(response.achText, sizeof(response.achText),
+            "{\"error\":\"response needs %u bytes\"}", (uint32_t)sResponse.size());
+    }
+
+    // Can't be full; the control thread limits the commands in flight
+    if (!m_responses.Push(response)) {
+        DriverLogAt(DRIVERLOG_SEVERITY_ERROR, "Control response queue is full, dropping an answer to client #%u", unClient);
+        return;
+    }
+    Wake();
+}
+
+void CControlChannel::Publish(ControlTelemetry_t& telemetry) {
+    telemetry.unDropped = m_unDropped;
+    if (!m_telemetry.Push(telemetry)) {
+        m_unDropped++;
+        return;
+    }
+    Wake();
+}
+
+#else
+
+bool CControlChannel::Start(const std::string& sPath) {
+    DriverLog("The control socket is only supported on Linux");
+    return false;
+}
+
+void CControlChannel::Stop() {
+}
+
+void CControlChannel::Respond(uint32_t unClient, const std::string& sResponse) {
+}
+
+void CControlChannel::Publish(ControlTelemetry_t& telemetry) {
+}
+
+#endif
@@ -0,0 +1,202 @@
+// === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
+
+#pragma once
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "spsc_queue.h"
+
+// Wire protocol of the control socket
+//
+// A client writes commands as lines of text. The driver answers with
+// messages, each a ControlMessageHeader_t followed by unSize bytes of
+// payload in host byte order:
+// - k_unControlMsg_Response: the JSON answer to one command, in the
+//   order the commands were sent
+// - k_unControlMsg_Telemetry: a ControlTelemetry_t for every script
+//   frame, while the client is subscribed; frames a slow client can't
+//   keep up with are skipped, which shows as a gap in ulFrame
+//
+// Commands answered by the control thread itself:
+//   subscribe, unsubscribe, help
+// Commands run by the thread that owns the script, between two frames:
+//   stats, reset, reload, recalibrate, gc-budget [us], get <name.field...>
+#define CONTROL_PROTOCOL_VERSION 1
+
+// Longest command line accepted, including the terminator
+#define CONTROL_MAX_COMMAND 256
+// Longest response the script owner can hand to the control thread
+#define CONTROL_MAX_RESPONSE 8192
+// Capacity of the queues between the control thread and the script owner;
+// must be powers of two
+#define CONTROL_COMMAND_QUEUE_SIZE 8
+#define CONTROL_RESPONSE_QUEUE_SIZE 8
+#define CONTROL_TELEMETRY_QUEUE_SIZE 64
+// Output a client may leave unread before telemetry to it is skipped
+#define CONTROL_MAX_BACKLOG (256 * 1024)
+#define CONTROL_MAX_CLIENTS 16
+// Commands a client may queue behind one that is still running
+#define CONTROL_MAX_DEFERRED 64
+
+enum ControlMessageType_t {
+	k_unControlMsg_Response = 1,
+	k_unControlMsg_Telemetry = 2,
+};
+
+struct ControlMessageHeader_t {
+	uint32_t unSize;
+	uint16_t unType;
+	uint16_t unVersion;
+};
+
+// Parts of a script frame timed for telemetry
+enum ControlStage_t {
+	k_unControlStage_SwapScript = 0,
+	k_unControlStage_Events,
+	k_unControlStage_Controllers,
+	k_unControlStage_GetPose,
+	k_unControlStage_DevicePoses,
+	k_unControlStage_Submit,
+	k_unControlStage_GC,
+	k_unControlStage_Max
+};
+
+// One script frame; laid out without implicit padding so that clients can
+// read it as is
+struct ControlTelemetry_t {
+	// Counts every frame run, whether it was sent or not
+	uint64_t ulFrame;
+	// Steady clock at the start of the frame, in nanoseconds
+	uint64_t ulTimestampNs;
+	uint64_t ulHeapBytes;
+
+	// HMD pose handed to the server; rotation is w, x, y, z
+	double adPosition[3];
+	double adRotation[4];
+	double adVelocity[3];
+	double adAngularVelocity[3];
+	double dPoseTimeOffset;
+	int32_t nTrackingResult;
+	uint32_t unPoseValid;
+
+	// Duration of every ControlStage_t and of the whole frame, in
+	// nanoseconds
+	uint32_t aunStageNs[k_unControlStage_Max];
+	uint32_t unFrameNs;
+	// Frames the control thread couldn't take in time, since startup
+	uint32_t unDropped;
+
+	// Last update of the first controller
+	uint32_t unControllers;
+	uint32_t unButtons;
+	int16_t anLeftXY[2];
+	int16_t anRightXY[2];
+	uint8_t aunTriggers[2];
+	uint16_t unDevices;
+};
+
+static_assert(sizeof(ControlTelemetry_t) % 8 == 0, "ControlTelemetry_t must not end in padding");
+
+struct ControlCommand_t {
+	uint32_t unClient;
+	char achCommand[CONTROL_MAX_COMMAND];
+};
+
+struct ControlResponse_t {
+	uint32_t unClient;
+	uint32_t unSize;
+	char achText[CONTROL_MAX_RESPONSE];
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: local Unix socket serving telemetry and commands to tools
+// outside of SteamVR. The socket is served by an epoll thread of its own;
+// the only contact with the thread that owns the script are the queues
+// below, so a stuck client never stalls a frame. The script owner picks up
+// commands with PollCommand between frames and answers them with Respond.
+// Only implemented on Linux.
+//-----------------------------------------------------------------------------
+
+class CControlChannel {
+public:
+	CControlChannel();
+	~CControlChannel();
+
+	CControlChannel(const CControlChannel&) = delete;
+	void operator=(const CControlChannel&) = delete;
+
+	// $XDG_RUNTIME_DIR/driver_easimer.sock, or a per-user path in /tmp
+	static std::string GetDefaultPath();
+
+	// Listen on a socket at sPath, replacing a stale one; false if the
+	// socket can't be opened
+	bool Start(const std::string& sPath);
+	// Stop the thread, disconnect every client and remove the socket
+	void Stop();
+
+	// Script owner
+	bool PollCommand(ControlCommand_t& command) { return m_commands.Pop(command); }
+	void Respond(uint32_t unClient, const std::string& sResponse);
+	bool HasSubscribers() const { return m_unSubscribers.load(std::memory_order_relaxed) > 0; }
+	void Publish(ControlTelemetry_t& telemetry);
+
+private:
+	struct Client_t {
+		int fd;
+		uint32_t unId;
+		bool bSubscribed;
+		// The client shut down its side; it is disconnected once every
+		// command it sent is answered
+		bool bClosing;
+		bool bWaitWritable;
+		// Commands handed to the script owner and not answered yet; the
+		// control thread holds back its own answers meanwhile to keep
+		// them in order
+		uint32_t unPending;
+		std::vector<std::string> asDeferred;
+		std::string sInput;
+		std::string sOutput;
+	};
+
+	void ThreadFunction();
+	void Wake();
+	bool HasQueued() const;
+	void Accept();
+	void Receive(Client_t& client);
+	void ProcessInput(Client_t& client);
+	void HandleCommand(Client_t& client, const std::string& sCommand);
+	void Send(Client_t& client, uint16_t unType, const void* pData, uint32_t unSize);
+	void Flush(Client_t& client);
+	void Disconnect(Client_t& client);
+	Client_t* FindClient(uint32_t unId);
+	void DrainQueues();
+	void UpdateInterest(Client_t& client);
+
+	std::string m_sPath;
+	std::thread m_thread;
+	std::atomic<bool> m_bExiting;
+	// Set while the control thread sleeps with nothing queued; the script
+	// owner only signals the eventfd then
+	std::atomic<bool> m_bIdle;
+	int m_fdListen;
+	int m_fdEpoll;
+	int m_fdWake;
+
+	// Owned by the control thread
+	std::vector<Client_t> m_clients;
+	uint32_t m_unNextClient;
+	// Commands handed to the script owner and not answered yet, over all
+	// clients; kept below the capacity of the response queue so that the
+	// script owner never finds it full
+	uint32_t m_unInFlight;
+
+	std::atomic<uint32_t> m_unSubscribers;
+	// Written by the script owner
+	uint32_t m_unDropped;
+
+	CSPSCQueue<ControlCommand_t, CONTROL_COMMAND_QUEUE_SIZE> m_commands;
+	CSPSCQueue<ControlResponse_t, CONTROL_RESPONSE_QUEUE_SIZE> m_responses;
+	CSPSCQueue<ControlTelemetry_t, CONTROL_TELEMETRY_QUEUE_SIZE> m_telemetry;
+};
@@ -0,0 +1,164 @@
+// === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
+
+#include "controller_monitor.h"
+#include "driverlog.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <time.h>
+
+CControllerMonitor::CControllerMonitor() :
+    m_flReplaySpeed(1.0f),
+    m_bReplayOpened(false),
+    m_bListenOnly(false),
+    m_bExiting(false),
+    m_unNextId(1) {
+}
+
+CControllerMonitor::~CControllerMonitor() {
+    Stop();
+}
+
+void CControllerMonitor::SetReplay(const std::string& sPath, float flSpeed) {
+    m_sReplayPath = sPath;
+    m_flReplaySpeed = flSpeed;
+}
+
+void CControllerMonitor::SetRecordDirectory(const std::string& sDirectory) {
+    m_sRecordDirectory = sDirectory;
+}
+
+void CControllerMonitor::Start() {
+    m_bExiting = false;
+    m_thread = std::thread(&CControllerMonitor::ThreadFunction, this);
+}
+
+void CControllerMonitor::Stop() {
+    if (m_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m_mtxExit);
+            m_bExiting = true;
+        }
+        m_cvExit.notify_one();
+        m_thread.join();
+    }
+
+    // The frame thread is gone by now too
+    ControllerChange_t change;
+    while (m_changes.Pop(change)) {
+        if (change.bAdded) {
+            SteamController_Close(change.pDevice);
+        }
+    }
+}
+
+void CControllerMonitor::Release(uint32_t unId) {
+    if (!m_released.Push(unId)) {
+        DriverLog("Controller monitor queue is full, controller #%u won't be reopened", unId);
+    }
+}
+
+void CControllerMonitor::ThreadFunction() {
+    std::unique_lock<std::mutex> lock(m_mtxExit);
+    while (!m_bExiting) {
+        lock.unlock();
+        Scan();
+        lock.lock();
+        m_cvExit.wait_for(lock, std::chrono::milliseconds(CONTROLLER_RESCAN_INTERVAL_MS), [&]() { return m_bExiting; });
+    }
+}
+
+void CControllerMonitor::Scan() {
+    uint32_t unId;
+    while (m_released.Pop(unId)) {
+        m_known.erase(std::remove_if(m_known.begin(), m_known.end(), [&](const KnownController_t& known) {
+            return known.unId == unId;
+        }), m_known.end());
+    }
+
+    if (!m_sReplayPath.empty()) {
+        OpenReplay();
+        return;
+    }
+
+    std::vector<std::string> present;
+    auto it = SteamController_EnumControllerDevices();
+    while (it != NULL) {
+        std::string sPath = SteamController_GetDevicePath(it);
+        present.push_back(sPath);
+
+        auto bKnown = std::any_of(m_known.begin(), m_known.end(), [&](const KnownController_t& known) {
+            return known.sPath == sPath;
+        });
+        if (!bKnown) {
+            auto pDevice = Open(it, m_unNextId);
+            if (pDevice != NULL) {
+                if (Announce(true, m_unNextId, pDevice)) {
+                    DriverLog("Steam Controller #%u found at %s", m_unNextId, sPath.c_str());
+                    m_known.push_back({ sPath, m_unNextId++ });
+                } else {
+                    // Try again with the next scan
+                    SteamController_Close(pDevice);
+                }
+            }
+        }
+
+        it = SteamController_NextControllerDevice(it);
+    }
+
+    for (auto iter = m_known.begin(); iter != m_known.end();) {
+        if (std::find(present.begin(), present.end(), iter->sPath) == present.end() && Announce(false, iter->unId, NULL)) {
+            DriverLog("Steam Controller #%u was unplugged", iter->unId);
+            iter = m_known.erase(iter);
+        } else {
+            ++iter;
+        }
+    }
+}
+
+void CControllerMonitor::OpenReplay() {
+    if (m_bReplayOpened) {
+        return;
+    }
+
+    auto pDevice = SteamController_OpenReplay(m_sReplayPath.c_str(), m_flReplaySpeed);
+    if (pDevice == NULL) {
+        DriverLog("Couldn't open controller recording %s", m_sReplayPath.c_str());
+        m_bReplayOpened = true;
+        return;
+    }
+    if (!Announce(true, m_unNextId, pDevice)) {
+        SteamController_Close(pDevice);
+        return;
+    }
+    DriverLog("Replaying controller recording %s at speed %g as #%u", m_sReplayPath.c_str(), m_flReplaySpeed, m_unNextId);
+    m_unNextId++;
+    m_bReplayOpened = true;
+}
+
+SteamControllerDevice* CControllerMonitor::Open(const SteamControllerDeviceEnum* pEnum, uint32_t unId) {
+    auto pDevice = m_bListenOnly ? SteamController_OpenListenOnly(pEnum) : SteamController_Open(pEnum);
+    if (pDevice == NULL || m_sRecordDirectory.empty()) {
+        return pDevice;
+    }
+
+    // Controllers are opened again after a reconnect; every opening gets
+    // its own file
+    char achPath[1024];
+    snprintf(achPath, sizeof(achPath), "%s/controller-%lld-%u.screc",
+        m_sRecordDirectory.c_str(), (long long)time(NULL), unId);
+    if (SteamController_StartRecording(pDevice, achPath)) {
+        DriverLog("Recording controller traffic to %s", achPath);
+    } else {
+        DriverLog("Couldn't record controller traffic to %s", achPath);
+    }
+    return pDevice;
+}
+
+bool CControllerMonitor::Announce(bool bAdded, uint32_t unId, SteamControllerDevice* pDevice) {
+    ControllerChange_t change;
+    change.bAdded = bAdded;
+    change.unId = unId;
+    change.pDevice = pDevice;
+    return m_changes.Push(change);
+}
@@ -0,0 +1,94 @@
+// === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
+
+#pragma once
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "spsc_queue.h"
+extern "C" {
+#include <steamcontroller.h>
+}
+
+// How often the monitor looks for controllers that came or went, in
+// milliseconds
+#define CONTROLLER_RESCAN_INTERVAL_MS 1000
+// Capacity of the queues between the monitor and the frame thread; must be
+// a power of two
+#define CONTROLLER_MONITOR_QUEUE_SIZE 16
+
+struct ControllerChange_t {
+	bool bAdded;
+	// Identifies the controller for as long as it stays plugged in
+	uint32_t unId;
+	// Opened device for an added controller, owned by the receiver
+	SteamControllerDevice* pDevice;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: watches for Steam Controllers on a background thread so that
+// enumerating and opening one never stalls a frame. Every controller found
+// is opened and handed over through PollChange; a controller that goes away
+// is announced the same way. The frame thread hands back controllers it
+// closed by itself with Release, so that they are opened again when they
+// reconnect.
+// Alternatively a recording is opened once in place of real controllers.
+//-----------------------------------------------------------------------------
+
+class CControllerMonitor {
+public:
+	CControllerMonitor();
+	~CControllerMonitor();
+
+	CControllerMonitor(const CControllerMonitor&) = delete;
+	void operator=(const CControllerMonitor&) = delete;
+
+	// Replay a recording instead of enumerating controllers; must be set
+	// before Start
+	void SetReplay(const std::string& sPath, float flSpeed);
+	// Record every controller opened into a new file in this directory;
+	// must be set before Start
+	void SetRecordDirectory(const std::string& sDirectory);
+	// Open controllers only to read them and leave their setup to the
+	// process that drives them; must be set before Start
+	void SetListenOnly(bool bListenOnly) { m_bListenOnly = bListenOnly; }
+
+	void Start();
+	// Stop the thread and close devices nobody picked up
+	void Stop();
+
+	// Frame thread
+	bool PollChange(ControllerChange_t& change) { return m_changes.Pop(change); }
+	void Release(uint32_t unId);
+
+private:
+	struct KnownController_t {
+		std::string sPath;
+		uint32_t unId;
+	};
+
+	void ThreadFunction();
+	void Scan();
+	void OpenReplay();
+	SteamControllerDevice* Open(const SteamControllerDeviceEnum* pEnum, uint32_t unId);
+	bool Announce(bool bAdded, uint32_t unId, SteamControllerDevice* pDevice);
+
+	std::string m_sReplayPath;
+	float m_flReplaySpeed;
+	bool m_bReplayOpened;
+	std::string m_sRecordDirectory;
+	bool m_bListenOnly;
+
+	std::thread m_thread;
+	std::mutex m_mtxExit;
+	std::condition_variable m_cvExit;
+	bool m_bExiting;
+
+	// Owned by the monitor thread
+	std::vector<KnownController_t> m_known;
+	uint32_t m_unNextId;
+
+	CSPSCQueue<ControllerChange_t, CONTROLLER_MONITOR_QUEUE_SIZE> m_changes;
+	CSPSCQueue<uint32_t, CONTROLLER_MONITOR_QUEUE_SIZE> m_released;
+};
@@ -0,0 +1,145 @@
+// === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
+
+#include "distortion_grid.h"
+
+#include <algorithm>
+#include <thread>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define DISTORTION_SSE 1
+#include <xmmintrin.h>
+#endif
+
+using namespace vr;
+
+// Vertices evaluated by one worker at least. A vertex takes around 10 ns
+// and starting a thread tens of microseconds, so grids of the default
+// resolution are built inline.
+#define DISTORTION_MIN_VERTICES_PER_TASK (64 * 1024)
+
+CDistortionGrid::CDistortionGrid() : m_unResolution(0) {
+}
+
+void CDistortionGrid::Resize(uint32_t unResolution) {
+    if (unResolution < 1) {
+        unResolution = 1;
+    }
+    m_unResolution = unResolution;
+    auto unVertices = (size_t)(unResolution + 1) * (unResolution + 1);
+    for (int i = 0; i < 2; i++) {
+        m_aflVertices[i].assign(unVertices * k_nVertexStride, 0.0f);
+    }
+}
+
+void CDistortionGrid::BuildPolynomialRows(int nEye, const DistortionPolynomial_t& poly, uint32_t unFirstRow, uint32_t unLastRow) {
+    auto flStep = 1.0f / m_unResolution;
+    for (auto y = unFirstRow; y < unLastRow; y++) {
+        auto fV = y * flStep;
+        for (uint32_t x = 0; x <= m_unResolution; x++) {
+            auto fU = x * flStep;
+            auto dU = fU - poly.aflCenter[0];
+            auto dV = fV - poly.aflCenter[1];
+            auto r2 = dU * dU + dV * dV;
+            auto pVertex = Vertex(nEye, x, y);
+            for (int c = 0; c < k_unDistortionChannel_Max; c++) {
+                auto const& k = poly.aflK[c];
+                auto flScale = 1.0f + r2 * (k[0] + r2 * (k[1] + r2 * k[2]));
+                pVertex[2 * c + 0] = poly.aflCenter[0] + dU * flScale;
+                pVertex[2 * c + 1] = poly.aflCenter[1] + dV * flScale;
+            }
+        }
+    }
+}
+
+void CDistortionGrid::BuildPolynomial(const DistortionPolynomial_t aPolynomials[2]) {
+    auto unRows = m_unResolution + 1;
+    auto unMinRows = (DISTORTION_MIN_VERTICES_PER_TASK + unRows - 1) / unRows;
+    // Both eyes fit into one task
+    if (2 * unRows <= unMinRows) {
+        BuildPolynomialRows(0, aPolynomials[0], 0, unRows);
+        BuildPolynomialRows(1, aPolynomials[1], 0, unRows);
+        return;
+    }
+
+    auto unWorkers = std::max(1u, std::thread::hardware_concurrency());
+    auto unRowsPerTask = std::max(unMinRows, (2 * unRows + unWorkers - 1) / unWorkers);
+
+    std::vector<std::thread> workers;
+    for (int nEye = 0; nEye < 2; nEye++) {
+        for (uint32_t unFirst = 0; unFirst < unRows; unFirst += unRowsPerTask) {
+            auto unLast = std::min(unRows, unFirst + unRowsPerTask);
+            workers.emplace_back(&CDistortionGrid::BuildPolynomialRows, this, nEye, std::cref(aPolynomials[nEye]), unFirst, unLast);
+        }
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+void CDistortionGrid::BuildPolynomial(EVREye eEye, const DistortionPolynomial_t& poly) {
+    BuildPolynomialRows(eEye == Eye_Right ? 1 : 0, poly, 0, m_unResolution + 1);
+}
+
+void CDistortionGrid::SetVertex(EVREye eEye, uint32_t unX, uint32_t unY, const DistortionCoordinates_t& coords) {
+    auto pVertex = Vertex(eEye == Eye_Right ? 1 : 0, unX, unY);
+    pVertex[k_nRedU] = coords.rfRed[0];
+    pVertex[k_nRedV] = coords.rfRed[1];
+    pVertex[k_nGreenU] = coords.rfGreen[0];
+    pVertex[k_nGreenV] = coords.rfGreen[1];
+    pVertex[k_nBlueU] = coords.rfBlue[0];
+    pVertex[k_nBlueV] = coords.rfBlue[1];
+}
+
+DistortionCoordinates_t CDistortionGrid::Lookup(EVREye eEye, float fU, float fV) const {
+    DistortionCoordinates_t ret;
+    if (m_unResolution == 0) {
+        ret.rfRed[0] = ret.rfGreen[0] = ret.rfBlue[0] = fU;
+        ret.rfRed[1] = ret.rfGreen[1] = ret.rfBlue[1] = fV;
+        return ret;
+    }
+
+    auto nEye = eEye == Eye_Right ? 1 : 0;
+    auto fX = std::min(std::max(fU, 0.0f), 1.0f) * m_unResolution;
+    auto fY = std::min(std::max(fV, 0.0f), 1.0f) * m_unResolution;
+    auto unX = std::min((uint32_t)fX, m_unResolution - 1);
+    auto unY = std::min((uint32_t)fY, m_unResolution - 1);
+    auto tX = fX - unX;
+    auto tY = fY - unY;
+
+    auto p00 = Vertex(nEye, unX, unY);
+    auto p10 = Vertex(nEye, unX + 1, unY);
+    auto p01 = Vertex(nEye, unX, unY + 1);
+    auto p11 = Vertex(nEye, unX + 1, unY + 1);
+
+    float w00 = (1 - tX) * (1 - tY);
+    float w10 = tX * (1 - tY);
+    float w01 = (1 - tX) * tY;
+    float w11 = tX * tY;
+
+    float aflOut[k_nVertexStride];
+#if defined(DISTORTION_SSE)
+    auto v00 = _mm_set1_ps(w00);
+    auto v10 = _mm_set1_ps(w10);
+    auto v01 = _mm_set1_ps(w01);
+    auto v11 = _mm_set1_ps(w11);
+    for (int i = 0; i < k_nVertexStride; i += 4) {
+        auto acc = _mm_mul_ps(_mm_loadu_ps(p00 + i), v00);
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(p10 + i), v10));
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(p01 + i), v01));
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(p11 + i), v11));
+        _mm_storeu_ps(aflOut + i, acc);
+    }
+#else
+    for (int i = 0; i < k_nBlueV + 1; i++) {
+        aflOut[i] = p00[i] * w00 + p10[i] * w10 + p01[i] * w01 + p11[i] * w11;
+    }
+#endif
+
+    ret.rfRed[0] = aflOut[k_nRedU];
+    ret.rfRed[1] = aflOut[k_nRedV];
+    ret.rfGreen[0] = aflOut[k_nGreenU];
+    ret.rfGreen[1] = aflOut[k_nGreenV];
+    ret.rfBlue[0] = aflOut[k_nBlueU];
+    ret.rfBlue[1] = aflOut[k_nBlueV];
+    return ret;
+}
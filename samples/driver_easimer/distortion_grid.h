@@ -0,0 +1,67 @@
+// === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
+
+#pragma once
+#include <openvr_driver.h>
+#include <vector>
+
+// Grid resolution used when the settings don't specify one
+#define DISTORTION_DEFAULT_RESOLUTION 64
+
+enum DistortionChannel_t {
+	k_unDistortionChannel_Red = 0,
+	k_unDistortionChannel_Green,
+	k_unDistortionChannel_Blue,
+	k_unDistortionChannel_Max
+};
+
+// Radial distortion of one eye: for every channel
+//   out = center + (in - center) * (1 + k1 r^2 + k2 r^4 + k3 r^6)
+struct DistortionPolynomial_t {
+	float aflCenter[2];
+	float aflK[k_unDistortionChannel_Max][3];
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: per-eye lookup grid of distorted RGB UV coordinates
+// The grid has unResolution cells per side, so (unResolution + 1)^2
+// vertices per eye. Lookups interpolate bilinearly between vertices.
+//-----------------------------------------------------------------------------
+
+class CDistortionGrid {
+public:
+	CDistortionGrid();
+
+	void Resize(uint32_t unResolution);
+	uint32_t GetResolution() const { return m_unResolution; }
+
+	// Evaluate polynomials into the grid, in parallel across eyes and rows
+	// if the grid is large enough for that to pay off
+	void BuildPolynomial(const DistortionPolynomial_t aPolynomials[2]);
+	// Evaluate the polynomial of one eye into its half of the grid
+	void BuildPolynomial(vr::EVREye eEye, const DistortionPolynomial_t& poly);
+
+	// Set one vertex; used when the distortion is computed elsewhere
+	void SetVertex(vr::EVREye eEye, uint32_t unX, uint32_t unY, const vr::DistortionCoordinates_t& coords);
+
+	vr::DistortionCoordinates_t Lookup(vr::EVREye eEye, float fU, float fV) const;
+
+private:
+	// Components of a vertex; padded to 8 floats so that a vertex is two
+	// aligned 4-wide vectors
+	enum {
+		k_nRedU = 0, k_nRedV, k_nGreenU, k_nGreenV, k_nBlueU, k_nBlueV,
+		k_nVertexStride = 8
+	};
+
+	float* Vertex(int nEye, uint32_t unX, uint32_t unY) {
+		return &m_aflVertices[nEye][(unY * (m_unResolution + 1) + unX) * k_nVertexStride];
+	}
+	const float* Vertex(int nEye, uint32_t unX, uint32_t unY) const {
+		return &m_aflVertices[nEye][(unY * (m_unResolution + 1) + unX) * k_nVertexStride];
+	}
+
+	void BuildPolynomialRows(int nEye, const DistortionPolynomial_t& poly, uint32_t unFirstRow, uint32_t unLastRow);
+
+	uint32_t m_unResolution;
+	std::vector<float> m_aflVertices[2];
+};
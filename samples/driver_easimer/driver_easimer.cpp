@@ -4,6 +4,8 @@
 #include "driverlog.h"
 #include "driver_easimer.h"
 
+#include <algorithm>
+
 #if defined( _WINDOWS )
 #include <windows.h>
 #endif
@@ -24,7 +26,6 @@ using namespace vr;
 
 static CServerDriver g_serverDriver;
 static CWatchdogDriver g_watchdog;
-static bool g_bExiting = false;
 
 HMD_DLL_EXPORT void* HmdDriverFactory(const char* pInterfaceName, int* pReturnCode)
 {
@@ -43,13 +44,6 @@ HMD_DLL_EXPORT void* HmdDriverFactory(const char* pInterfaceName, int* pReturnCo
 	return NULL;
 }
 
-void WatchdogThreadFunction() {
-	while (!g_bExiting) {
-		std::this_thread::sleep_for(std::chrono::microseconds(500));
-		vr::VRWatchdogHost()->WatchdogWakeUp(vr::TrackedDeviceClass_HMD);
-	}
-}
-
 CServerDriver::CServerDriver() : m_pHMD(NULL) {}
 
 vr::EVRInitError CServerDriver::Init(vr::IVRDriverContext* pDriverContext) {
@@ -60,6 +54,12 @@ vr::EVRInitError CServerDriver::Init(vr::IVRDriverContext* pDriverContext) {
 	m_pHMD = new CLuaHMDDriver(HMD_SCRIPT_PATH);
 	if (m_pHMD) {
 		VRServerDriverHost()->TrackedDeviceAdded(m_pHMD->GetSerialNumber().c_str(), vr::TrackedDeviceClass_HMD, m_pHMD);
+
+		// Devices the script drives next to the HMD
+		for (auto pDevice : m_pHMD->GetDevices()) {
+			auto const& desc = pDevice->GetDesc();
+			VRServerDriverHost()->TrackedDeviceAdded(desc.sSerialNumber.c_str(), desc.eClass, pDevice);
+		}
 	}
 
 	return m_pHMD != NULL ? VRInitError_None : VRInitError_Driver_HmdDisplayNotFound;
@@ -84,20 +84,155 @@ void CServerDriver::RunFrame() {
 	}
 }
 
+CWatchdogDriver::CWatchdogDriver() :
+	m_bExiting(false),
+	m_bActivity(false),
+	m_tQuietUntil(0),
+	m_heartbeat(WATCHDOG_DEFAULT_HEARTBEAT_MS),
+	m_bWatchControllers(true) {
+}
+
 vr::EVRInitError CWatchdogDriver::Init(vr::IVRDriverContext* pDriverContext) {
 	VR_INIT_WATCHDOG_DRIVER_CONTEXT(pDriverContext);
 	InitDriverLog(vr::VRDriverLog());
 
+	EVRSettingsError err = VRSettingsError_None;
+	auto nHeartbeat = VRSettings()->GetInt32(SETTINGS_SECTION, SETTINGS_WATCHDOG_HEARTBEAT, &err);
+	m_heartbeat = std::chrono::milliseconds(err == VRSettingsError_None ? std::max(nHeartbeat, 0) : WATCHDOG_DEFAULT_HEARTBEAT_MS);
+	err = VRSettingsError_None;
+	auto bWatchControllers = VRSettings()->GetBool(SETTINGS_SECTION, SETTINGS_WATCHDOG_CONTROLLERS, &err);
+	m_bWatchControllers = err == VRSettingsError_None ? bWatchControllers : true;
+	DriverLog("Watchdog heartbeat is %d ms, waking on controller activity is %s",
+		(int)m_heartbeat.count(), m_bWatchControllers ? "on" : "off");
+
+	if (m_bWatchControllers) {
+		// vrserver sets the controllers up once it starts
+		m_controllerMonitor.SetListenOnly(true);
+		m_controllerMonitor.Start();
+	}
+
 	DriverLog("Creating watchdog thread\n");
-	g_bExiting = false;
-	m_watchdogThread = std::thread(WatchdogThreadFunction);
+	m_bExiting = false;
+	m_bActivity = false;
+	m_watchdogThread = std::thread(&CWatchdogDriver::WatchdogThreadFunction, this);
 
 	return VRInitError_None;
 }
 
 void CWatchdogDriver::Cleanup() {
-	g_bExiting = true;
+	{
+		std::lock_guard<std::mutex> lock(m_mtxWake);
+		m_bExiting = true;
+	}
+	m_cvWake.notify_one();
 	DriverLog("Joining watchdog thread");
 	m_watchdogThread.join();
 	DriverLog("Joined watchdog thread");
+
+	for (auto& watched : m_controllers) {
+		delete watched.pController;
+	}
+	m_controllers.clear();
+	m_controllerMonitor.Stop();
+
+	CleanupDriverLog();
+}
+
+void CWatchdogDriver::NotifyActivity() {
+	// A controller in use sends hundreds of reports per second
+	if (clock::now().time_since_epoch().count() < m_tQuietUntil.load(std::memory_order_relaxed)) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_mtxWake);
+		m_bActivity = true;
+	}
+	m_cvWake.notify_one();
+}
+
+void CWatchdogDriver::WatchdogThreadFunction() {
+	auto tLastWakeUp = clock::now();
+	auto tReport = tLastWakeUp + std::chrono::seconds(WATCHDOG_REPORT_INTERVAL_S);
+	uint32_t unActivityWakeUps = 0, unHeartbeatWakeUps = 0, unThreadWakeUps = 0;
+
+	std::unique_lock<std::mutex> lock(m_mtxWake);
+	while (!m_bExiting) {
+		auto tDeadline = tReport;
+		if (m_heartbeat.count() > 0) {
+			tDeadline = std::min(tDeadline, tLastWakeUp + m_heartbeat);
+		}
+		if (m_bWatchControllers) {
+			// Controllers the monitor opened are picked up at the same rate
+			// it looks for them
+			tDeadline = std::min(tDeadline, clock::now() + std::chrono::milliseconds(CONTROLLER_RESCAN_INTERVAL_MS));
+		}
+		m_cvWake.wait_until(lock, tDeadline, [&]() { return m_bExiting || m_bActivity; });
+		if (m_bExiting) {
+			break;
+		}
+		auto bActivity = m_bActivity;
+		m_bActivity = false;
+		lock.unlock();
+
+		unThreadWakeUps++;
+		if (m_bWatchControllers) {
+			PumpControllers();
+		}
+
+		auto tNow = clock::now();
+		auto bHeartbeat = m_heartbeat.count() > 0 && tNow >= tLastWakeUp + m_heartbeat;
+		if (bActivity || bHeartbeat) {
+			vr::VRWatchdogHost()->WatchdogWakeUp(vr::TrackedDeviceClass_HMD);
+			tLastWakeUp = tNow;
+			if (bActivity) {
+				unActivityWakeUps++;
+				m_tQuietUntil.store((tNow + std::chrono::milliseconds(WATCHDOG_MIN_ACTIVITY_INTERVAL_MS)).time_since_epoch().count(), std::memory_order_relaxed);
+			} else {
+				unHeartbeatWakeUps++;
+			}
+		}
+
+		if (tNow >= tReport) {
+			auto flSeconds = std::chrono::duration<double>(tNow - tReport).count() + WATCHDOG_REPORT_INTERVAL_S;
+			DriverLog("Watchdog: %.2f wake-ups/s (%u on controller activity, %u heartbeats), thread woke %.2f times/s",
+				(unActivityWakeUps + unHeartbeatWakeUps) / flSeconds, unActivityWakeUps, unHeartbeatWakeUps,
+				unThreadWakeUps / flSeconds);
+			unActivityWakeUps = unHeartbeatWakeUps = unThreadWakeUps = 0;
+			tReport = tNow + std::chrono::seconds(WATCHDOG_REPORT_INTERVAL_S);
+		}
+
+		lock.lock();
+	}
+}
+
+void CWatchdogDriver::PumpControllers() {
+	ControllerChange_t change;
+	while (m_controllerMonitor.PollChange(change)) {
+		if (change.bAdded) {
+			auto pController = new CSteamController(change.pDevice, [this]() { NotifyActivity(); });
+			m_controllers.push_back({ change.unId, pController });
+			// Plugging a controller in counts as using it
+			NotifyActivity();
+		} else {
+			for (auto it = m_controllers.begin(); it != m_controllers.end(); ++it) {
+				if (it->unId == change.unId) {
+					delete it->pController;
+					m_controllers.erase(it);
+					break;
+				}
+			}
+		}
+	}
+
+	for (auto it = m_controllers.begin(); it != m_controllers.end();) {
+		// Updates are only counted; this catches the disconnects
+		it->pController->RunFrames();
+		if (!it->pController->IsConnected()) {
+			m_controllerMonitor.Release(it->unId);
+			delete it->pController;
+			it = m_controllers.erase(it);
+		} else {
+			++it;
+		}
+	}
 }
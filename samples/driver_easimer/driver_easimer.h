@@ -2,20 +2,68 @@
 
 #pragma once
 #include <openvr_driver.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <thread>
+#include <vector>
+#include "controller_monitor.h"
 #include "hmd_lua.h"
 
+// Longest time between two wake-ups of the server when no controller is
+// used, in milliseconds; 0 wakes it up on controller activity only
+#define SETTINGS_WATCHDOG_HEARTBEAT "watchdogHeartbeatMilliseconds"
+// Wake the server up when a Steam Controller sends a report (default on)
+#define SETTINGS_WATCHDOG_CONTROLLERS "watchdogWakeOnController"
+
+#define WATCHDOG_DEFAULT_HEARTBEAT_MS 1000
+// Controller reports closer together than this cause a single wake-up
+#define WATCHDOG_MIN_ACTIVITY_INTERVAL_MS 100
+// How often the wake-up rate is logged, in seconds
+#define WATCHDOG_REPORT_INTERVAL_S 30
+
 //-----------------------------------------------------------------------------
-// Purpose: Watchdog driver that periodically wakes up the server
+// Purpose: Watchdog driver that wakes up the server on a heartbeat and when
+// a Steam Controller is used. The watchdog thread sleeps on a condition
+// variable in between.
 //-----------------------------------------------------------------------------
 
 class CWatchdogDriver : public vr::IVRWatchdogProvider {
 public:
+	typedef std::chrono::steady_clock clock;
+
+	CWatchdogDriver();
+
 	virtual vr::EVRInitError Init(vr::IVRDriverContext* pCtx) override;
 	virtual void Cleanup() override;
 
+	// A controller sent a report; may be called from any thread
+	void NotifyActivity();
+
 private:
+	struct WatchedController_t {
+		uint32_t unId;
+		CSteamController* pController;
+	};
+
+	void WatchdogThreadFunction();
+	// Attach and detach controllers and discard what they read
+	void PumpControllers();
+
 	std::thread m_watchdogThread;
+	std::mutex m_mtxWake;
+	std::condition_variable m_cvWake;
+	bool m_bExiting;
+	bool m_bActivity;
+	// Activity is ignored until then, in clock ticks
+	std::atomic<clock::rep> m_tQuietUntil;
+
+	std::chrono::milliseconds m_heartbeat;
+	bool m_bWatchControllers;
+	CControllerMonitor m_controllerMonitor;
+	// Owned by the watchdog thread
+	std::vector<WatchedController_t> m_controllers;
 };
 
 //-----------------------------------------------------------------------------
@@ -2,59 +2,448 @@
 
 #include "driverlog.h"
 
+#include <condition_variable>
+#include <mutex>
 #include <stdio.h>
-#include <stdarg.h>
+#include <thread>
+#include <vector>
+
+static_assert( ( DRIVERLOG_RING_SIZE & ( DRIVERLOG_RING_SIZE - 1 ) ) == 0, "DRIVERLOG_RING_SIZE must be a power of two" );
+
+// Severity of the space skipped at the end of a ring when a message
+// doesn't fit there
+#define DRIVERLOG_RECORD_PADDING 0xFF
+
+struct DriverLogRecord_t
+{
+	// Including this header and the alignment after the arguments
+	uint32_t unSize;
+	uint8_t unSeverity;
+	uint8_t unArgs;
+	uint16_t unReserved;
+	int64_t nTimestamp;
+	const char *pchFormat;
+};
+
+// --------------------------------------------------------------------------
+// Purpose: Single producer, single consumer byte ring. The owning thread
+// appends records, the log thread consumes them. Head and tail only ever
+// grow; the buffer between them keeps the two on separate cache lines.
+// --------------------------------------------------------------------------
+struct DriverLogRing_t
+{
+	std::atomic<uint64_t> unHead;
+	// Where the head moves on commit; owning thread only
+	uint64_t unPendingHead;
+	std::atomic<uint32_t> unDropped;
+	// Set when the owning thread exits; the ring is freed once drained
+	std::atomic<bool> bAbandoned;
+
+	uint8_t abBuffer[DRIVERLOG_RING_SIZE];
+
+	std::atomic<uint64_t> unTail;
+};
+
+struct DriverLogRingOwner_t
+{
+	DriverLogRing_t *pRing = NULL;
+
+	~DriverLogRingOwner_t()
+	{
+		if ( pRing )
+			pRing->bAbandoned.store( true, std::memory_order_release );
+	}
+};
 
 static vr::IVRDriverLog * s_pLogFile = NULL;
+static std::atomic<bool> s_bEnabled( false );
 
-#if !defined( WIN32)
-#define vsnprintf_s vsnprintf
-#endif
+static std::mutex s_mtxRings;
+static std::vector<DriverLogRing_t *> s_rings;
+static thread_local DriverLogRingOwner_t t_ringOwner;
 
-bool InitDriverLog( vr::IVRDriverLog *pDriverLog )
+static std::thread s_logThread;
+static std::mutex s_mtxExit;
+static std::condition_variable s_cvExit;
+static bool s_bExiting = false;
+
+static DriverLogRing_t *CreateRing()
 {
-	if( s_pLogFile )
-		return false;
-	s_pLogFile = pDriverLog;
-	return s_pLogFile != NULL;
+	auto pRing = new DriverLogRing_t;
+	pRing->unHead.store( 0, std::memory_order_relaxed );
+	pRing->unPendingHead = 0;
+	pRing->unDropped.store( 0, std::memory_order_relaxed );
+	pRing->bAbandoned.store( false, std::memory_order_relaxed );
+	pRing->unTail.store( 0, std::memory_order_relaxed );
+
+	std::lock_guard<std::mutex> lock( s_mtxRings );
+	s_rings.push_back( pRing );
+	return pRing;
 }
 
-void CleanupDriverLog()
+uint8_t *DriverLogReserve( size_t unArgsSize, int nSeverity, const char *pchFormat, uint32_t unArgs )
 {
-	s_pLogFile = NULL;
+	if ( !s_bEnabled.load( std::memory_order_relaxed ) )
+		return NULL;
+
+	auto pRing = t_ringOwner.pRing;
+	if ( !pRing )
+		pRing = t_ringOwner.pRing = CreateRing();
+
+	uint64_t unSize = ( sizeof( DriverLogRecord_t ) + unArgsSize + 7 ) & ~(uint64_t)7;
+	uint64_t unHead = pRing->unHead.load( std::memory_order_relaxed );
+	uint64_t unTail = pRing->unTail.load( std::memory_order_acquire );
+	uint64_t unOffset = unHead & ( DRIVERLOG_RING_SIZE - 1 );
+	uint64_t unPadding = unOffset + unSize > DRIVERLOG_RING_SIZE ? DRIVERLOG_RING_SIZE - unOffset : 0;
+	if ( unHead - unTail + unPadding + unSize > DRIVERLOG_RING_SIZE )
+	{
+		pRing->unDropped.fetch_add( 1, std::memory_order_relaxed );
+		return NULL;
+	}
+
+	if ( unPadding > 0 )
+	{
+		// Records are 8-byte aligned, so there's room for the two fields
+		auto pPadding = (DriverLogRecord_t *)( pRing->abBuffer + unOffset );
+		pPadding->unSize = (uint32_t)unPadding;
+		pPadding->unSeverity = DRIVERLOG_RECORD_PADDING;
+		unHead += unPadding;
+		unOffset = 0;
+	}
+
+	auto pRecord = (DriverLogRecord_t *)( pRing->abBuffer + unOffset );
+	pRecord->unSize = (uint32_t)unSize;
+	pRecord->unSeverity = (uint8_t)nSeverity;
+	pRecord->unArgs = (uint8_t)unArgs;
+	pRecord->unReserved = 0;
+	pRecord->nTimestamp = std::chrono::steady_clock::now().time_since_epoch().count();
+	pRecord->pchFormat = pchFormat;
+	pRing->unPendingHead = unHead + unSize;
+	return (uint8_t *)( pRecord + 1 );
 }
 
-static void DriverLogVarArgs( const char *pMsgFormat, va_list args )
+void DriverLogCommit()
+{
+	auto pRing = t_ringOwner.pRing;
+	pRing->unHead.store( pRing->unPendingHead, std::memory_order_release );
+}
+
+struct DriverLogArgValue_t
+{
+	EDriverLogArg eType;
+	union
+	{
+		int64_t n;
+		uint64_t un;
+		double fl;
+	};
+	const char *psz;
+};
+
+class CDriverLogArgReader
+{
+public:
+	CDriverLogArgReader( const uint8_t *p, uint32_t unArgs ) : m_p( p ), m_unLeft( unArgs ) {}
+
+	bool Next( DriverLogArgValue_t &arg )
+	{
+		if ( m_unLeft == 0 )
+			return false;
+		m_unLeft--;
+
+		arg.eType = (EDriverLogArg)*m_p++;
+		arg.psz = NULL;
+		if ( arg.eType == DriverLogArg_String )
+		{
+			uint16_t unLen;
+			memcpy( &unLen, m_p, 2 );
+			arg.psz = (const char *)m_p + 2;
+			m_p += 2 + unLen + 1;
+		}
+		else
+		{
+			memcpy( &arg.un, m_p, 8 );
+			m_p += 8;
+		}
+		return true;
+	}
+
+private:
+	const uint8_t *m_p;
+	uint32_t m_unLeft;
+};
+
+static long long ArgAsSigned( const DriverLogArgValue_t &arg )
+{
+	switch ( arg.eType )
+	{
+	case DriverLogArg_Double: return (long long)arg.fl;
+	case DriverLogArg_String: return 0;
+	default: return (long long)arg.n;
+	}
+}
+
+static unsigned long long ArgAsUnsigned( const DriverLogArgValue_t &arg )
+{
+	switch ( arg.eType )
+	{
+	case DriverLogArg_Double: return (unsigned long long)arg.fl;
+	case DriverLogArg_String: return 0;
+	default: return (unsigned long long)arg.un;
+	}
+}
+
+static double ArgAsDouble( const DriverLogArgValue_t &arg )
+{
+	switch ( arg.eType )
+	{
+	case DriverLogArg_Int: return (double)arg.n;
+	case DriverLogArg_UInt:
+	case DriverLogArg_Pointer: return (double)arg.un;
+	case DriverLogArg_Double: return arg.fl;
+	default: return 0.0;
+	}
+}
+
+// --------------------------------------------------------------------------
+// Purpose: printf with the arguments taken from a record. Length modifiers
+// in the format are ignored; the recorded argument types decide how wide a
+// value is, so a mismatched argument is printed sensibly instead of
+// reading garbage.
+// --------------------------------------------------------------------------
+static void FormatRecord( const DriverLogRecord_t *pRecord, char *pchOut, size_t cubOut )
+{
+	CDriverLogArgReader args( (const uint8_t *)( pRecord + 1 ), pRecord->unArgs );
+	DriverLogArgValue_t arg;
+	size_t unLen = 0;
+	const char *pch = pRecord->pchFormat;
+
+	while ( *pch && unLen + 1 < cubOut )
+	{
+		if ( *pch != '%' )
+		{
+			pchOut[unLen++] = *pch++;
+			continue;
+		}
+		pch++;
+		if ( *pch == '%' )
+		{
+			pchOut[unLen++] = *pch++;
+			continue;
+		}
+
+		char szSpec[48];
+		size_t unSpec = 0;
+		szSpec[unSpec++] = '%';
+		while ( *pch && strchr( "-+ #0", *pch ) && unSpec < 8 )
+			szSpec[unSpec++] = *pch++;
+		for ( int nField = 0; nField < 2; nField++ )
+		{
+			if ( nField == 1 )
+			{
+				if ( *pch != '.' )
+					break;
+				szSpec[unSpec++] = *pch++;
+			}
+			if ( *pch == '*' )
+			{
+				pch++;
+				int nValue = args.Next( arg ) ? (int)ArgAsSigned( arg ) : 0;
+				unSpec += snprintf( szSpec + unSpec, 12, "%d", nValue );
+			}
+			else
+			{
+				while ( *pch >= '0' && *pch <= '9' && unSpec < 24 )
+					szSpec[unSpec++] = *pch++;
+			}
+		}
+		while ( *pch && strchr( "hlLqjzt", *pch ) )
+			pch++;
+		char chConversion = *pch;
+		if ( !chConversion )
+			break;
+		pch++;
+
+		int nWritten = 0;
+		size_t cubLeft = cubOut - unLen;
+		bool bHaveArg = args.Next( arg );
+		switch ( chConversion )
+		{
+		case 'd': case 'i':
+			strcpy( szSpec + unSpec, "lld" );
+			nWritten = snprintf( pchOut + unLen, cubLeft, szSpec, bHaveArg ? ArgAsSigned( arg ) : 0LL );
+			break;
+		case 'u': case 'o': case 'x': case 'X':
+			szSpec[unSpec++] = 'l';
+			szSpec[unSpec++] = 'l';
+			szSpec[unSpec++] = chConversion;
+			szSpec[unSpec] = 0;
+			nWritten = snprintf( pchOut + unLen, cubLeft, szSpec, bHaveArg ? ArgAsUnsigned( arg ) : 0ULL );
+			break;
+		case 'c':
+			strcpy( szSpec + unSpec, "c" );
+			nWritten = snprintf( pchOut + unLen, cubLeft, szSpec, bHaveArg ? (int)ArgAsSigned( arg ) : '?' );
+			break;
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+			szSpec[unSpec++] = chConversion;
+			szSpec[unSpec] = 0;
+			nWritten = snprintf( pchOut + unLen, cubLeft, szSpec, bHaveArg ? ArgAsDouble( arg ) : 0.0 );
+			break;
+		case 's':
+			strcpy( szSpec + unSpec, "s" );
+			nWritten = snprintf( pchOut + unLen, cubLeft, szSpec,
+				!bHaveArg ? "(missing)" : arg.eType != DriverLogArg_String ? "(not a string)" : arg.psz );
+			break;
+		case 'p':
+			strcpy( szSpec + unSpec, "p" );
+			nWritten = snprintf( pchOut + unLen, cubLeft, szSpec, bHaveArg ? (void *)(uintptr_t)ArgAsUnsigned( arg ) : NULL );
+			break;
+		default:
+			// Not a conversion this logger knows; print it as written
+			nWritten = snprintf( pchOut + unLen, cubLeft, "%%%c", chConversion );
+			break;
+		}
+		if ( nWritten > 0 )
+			unLen += std::min( (size_t)nWritten, cubLeft - 1 );
+	}
+
+	pchOut[unLen] = 0;
+}
+
+static void WriteRecord( const DriverLogRecord_t *pRecord )
 {
 	char buf[1024];
-	vsnprintf_s( buf, sizeof(buf), pMsgFormat, args );
+	size_t unPrefix = 0;
+	if ( pRecord->unSeverity >= DRIVERLOG_SEVERITY_ERROR )
+		unPrefix = snprintf( buf, sizeof( buf ), "Error: " );
+	else if ( pRecord->unSeverity == DRIVERLOG_SEVERITY_WARNING )
+		unPrefix = snprintf( buf, sizeof( buf ), "Warning: " );
+	FormatRecord( pRecord, buf + unPrefix, sizeof( buf ) - unPrefix );
 
-	if( s_pLogFile )
+	if ( s_pLogFile )
 		s_pLogFile->Log( buf );
 }
 
+// Oldest record waiting in the ring before unHead, skipping padding; NULL
+// if there is none
+static const DriverLogRecord_t *PeekRecord( DriverLogRing_t *pRing, uint64_t unHead )
+{
+	uint64_t unTail = pRing->unTail.load( std::memory_order_relaxed );
+	while ( unTail != unHead )
+	{
+		auto pRecord = (const DriverLogRecord_t *)( pRing->abBuffer + ( unTail & ( DRIVERLOG_RING_SIZE - 1 ) ) );
+		if ( pRecord->unSeverity != DRIVERLOG_RECORD_PADDING )
+			return pRecord;
+		unTail += pRecord->unSize;
+		pRing->unTail.store( unTail, std::memory_order_release );
+	}
+	return NULL;
+}
 
-void DriverLog( const char *pMsgFormat, ... )
+// --------------------------------------------------------------------------
+// Purpose: Write out everything the threads queued so far, oldest first
+// across all rings
+// --------------------------------------------------------------------------
+static void Flush()
 {
-	va_list args;
-	va_start( args, pMsgFormat );
+	std::vector<DriverLogRing_t *> rings;
+	std::vector<bool> abandoned;
+	{
+		std::lock_guard<std::mutex> lock( s_mtxRings );
+		rings = s_rings;
+	}
 
-	DriverLogVarArgs( pMsgFormat, args );
+	// A ring abandoned before its head is read won't get more records
+	std::vector<uint64_t> heads( rings.size() );
+	for ( size_t i = 0; i < rings.size(); i++ )
+	{
+		abandoned.push_back( rings[i]->bAbandoned.load( std::memory_order_acquire ) );
+		heads[i] = rings[i]->unHead.load( std::memory_order_acquire );
+	}
 
-	va_end(args);
-}
+	for ( ;; )
+	{
+		const DriverLogRecord_t *pOldest = NULL;
+		size_t iOldest = 0;
+		for ( size_t i = 0; i < rings.size(); i++ )
+		{
+			auto pRecord = PeekRecord( rings[i], heads[i] );
+			if ( pRecord && ( !pOldest || pRecord->nTimestamp < pOldest->nTimestamp ) )
+			{
+				pOldest = pRecord;
+				iOldest = i;
+			}
+		}
+		if ( !pOldest )
+			break;
+
+		WriteRecord( pOldest );
+		auto pRing = rings[iOldest];
+		pRing->unTail.store( pRing->unTail.load( std::memory_order_relaxed ) + pOldest->unSize, std::memory_order_release );
+	}
 
+	for ( size_t i = 0; i < rings.size(); i++ )
+	{
+		uint32_t unDropped = rings[i]->unDropped.exchange( 0, std::memory_order_relaxed );
+		if ( unDropped > 0 && s_pLogFile )
+		{
+			char buf[128];
+			snprintf( buf, sizeof( buf ), "Warning: %u log messages were dropped, a thread logs faster than they are written", unDropped );
+			s_pLogFile->Log( buf );
+		}
 
-void DebugDriverLog( const char *pMsgFormat, ... )
+		if ( abandoned[i] )
+		{
+			std::lock_guard<std::mutex> lock( s_mtxRings );
+			s_rings.erase( std::find( s_rings.begin(), s_rings.end(), rings[i] ) );
+			delete rings[i];
+		}
+	}
+}
+
+static void LogThreadFunction()
 {
-#ifdef _DEBUG
-	va_list args;
-	va_start( args, pMsgFormat );
+	std::unique_lock<std::mutex> lock( s_mtxExit );
+	while ( !s_bExiting )
+	{
+		s_cvExit.wait_for( lock, std::chrono::milliseconds( DRIVERLOG_FLUSH_INTERVAL_MS ), [&]() { return s_bExiting; } );
+		lock.unlock();
+		Flush();
+		lock.lock();
+	}
 
-	DriverLogVarArgs( pMsgFormat, args );
+	// The exit flag may have been set before the first pass of the loop
+	lock.unlock();
+	Flush();
+}
 
-	va_end(args);
-#endif
+bool InitDriverLog( vr::IVRDriverLog *pDriverLog )
+{
+	if( s_pLogFile )
+		return false;
+	s_pLogFile = pDriverLog;
+	if ( !s_pLogFile )
+		return false;
+
+	s_bExiting = false;
+	s_logThread = std::thread( LogThreadFunction );
+	s_bEnabled.store( true, std::memory_order_relaxed );
+	return true;
 }
 
+void CleanupDriverLog()
+{
+	if ( !s_pLogFile )
+		return;
+
+	s_bEnabled.store( false, std::memory_order_relaxed );
+	{
+		std::lock_guard<std::mutex> lock( s_mtxExit );
+		s_bExiting = true;
+	}
+	s_cvExit.notify_one();
+	// The thread flushes once more on its way out
+	s_logThread.join();
 
+	s_pLogFile = NULL;
+}
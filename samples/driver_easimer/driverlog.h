@@ -5,21 +5,255 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <string.h>
 #include <string>
+#include <type_traits>
 #include <openvr_driver.h>
 
-extern void DriverLog( const char *pchFormat, ... );
+// --------------------------------------------------------------------------
+// Severities. Messages below DRIVERLOG_MIN_SEVERITY are compiled out
+// together with the evaluation of their arguments.
+// --------------------------------------------------------------------------
+#define DRIVERLOG_SEVERITY_DEBUG	0
+#define DRIVERLOG_SEVERITY_INFO		1
+#define DRIVERLOG_SEVERITY_WARNING	2
+#define DRIVERLOG_SEVERITY_ERROR	3
+
+#ifndef DRIVERLOG_MIN_SEVERITY
+#ifdef _DEBUG
+#define DRIVERLOG_MIN_SEVERITY DRIVERLOG_SEVERITY_DEBUG
+#else
+#define DRIVERLOG_MIN_SEVERITY DRIVERLOG_SEVERITY_INFO
+#endif
+#endif
+
+// Bytes of the ring each logging thread queues its messages in; a message
+// that doesn't fit is dropped and counted. Must be a power of two.
+#define DRIVERLOG_RING_SIZE ( 64 * 1024 )
+// String arguments are cut to this many bytes
+#define DRIVERLOG_MAX_STRING 1023
+// How often the log thread writes out queued messages
+#define DRIVERLOG_FLUSH_INTERVAL_MS 10
+
+
+// --------------------------------------------------------------------------
+// Purpose: Log a printf-style message. The calling thread only copies the
+// format pointer and the arguments into its own ring; the log thread
+// formats and writes the message later. Because of that the format must
+// be a string literal, and only scalars, pointers and C strings may be
+// passed.
+// --------------------------------------------------------------------------
+#define DriverLogAt( nSeverity, ... ) \
+	do { \
+		if ( ( nSeverity ) >= DRIVERLOG_MIN_SEVERITY ) { \
+			DriverLogWrite( ( nSeverity ), __VA_ARGS__ ); \
+		} \
+	} while ( 0 )
+
+#define DriverLog( ... ) DriverLogAt( DRIVERLOG_SEVERITY_INFO, __VA_ARGS__ )
 
 
 // --------------------------------------------------------------------------
 // Purpose: Write to the log file only in debug builds
 // --------------------------------------------------------------------------
-extern void DebugDriverLog( const char *pchFormat, ... );
+#define DebugDriverLog( ... ) DriverLogAt( DRIVERLOG_SEVERITY_DEBUG, __VA_ARGS__ )
+
+
+// --------------------------------------------------------------------------
+// Purpose: Log at most once every unIntervalMs from this call site; the
+// number of messages skipped in between is logged with the next one
+// --------------------------------------------------------------------------
+#define DriverLogEvery( nSeverity, unIntervalMs, ... ) \
+	do { \
+		if ( ( nSeverity ) >= DRIVERLOG_MIN_SEVERITY ) { \
+			static CDriverLogRateLimit s_driverLogRateLimit( unIntervalMs ); \
+			uint32_t unDriverLogSuppressed; \
+			if ( s_driverLogRateLimit.Allow( unDriverLogSuppressed ) ) { \
+				if ( unDriverLogSuppressed > 0 ) { \
+					DriverLogWrite( ( nSeverity ), "%u similar messages were suppressed", unDriverLogSuppressed ); \
+				} \
+				DriverLogWrite( ( nSeverity ), __VA_ARGS__ ); \
+			} \
+		} \
+	} while ( 0 )
 
 
 extern bool InitDriverLog( vr::IVRDriverLog *pDriverLog );
+// Writes out everything still queued and stops the log thread
 extern void CleanupDriverLog();
 
 
+// --------------------------------------------------------------------------
+// Implementation details of the macros above
+// --------------------------------------------------------------------------
+
+enum EDriverLogArg
+{
+	DriverLogArg_Int,
+	DriverLogArg_UInt,
+	DriverLogArg_Double,
+	DriverLogArg_Pointer,
+	// Length as uint16_t, then the bytes and a terminating zero
+	DriverLogArg_String,
+};
+
+// Space for a message in the calling thread's ring, past the record header;
+// NULL if logging is off or the ring is full
+extern uint8_t *DriverLogReserve( size_t unArgsSize, int nSeverity, const char *pchFormat, uint32_t unArgs );
+// Hands the message last reserved on this thread to the log thread
+extern void DriverLogCommit();
+
+class CDriverLogRateLimit
+{
+public:
+	explicit CDriverLogRateLimit( uint32_t unIntervalMs )
+		: m_nInterval( std::chrono::duration_cast<std::chrono::steady_clock::duration>( std::chrono::milliseconds( unIntervalMs ) ).count() )
+		, m_nNext( 0 )
+		, m_unSuppressed( 0 )
+	{
+	}
+
+	bool Allow( uint32_t &unSuppressed )
+	{
+		auto nNow = std::chrono::steady_clock::now().time_since_epoch().count();
+		auto nNext = m_nNext.load( std::memory_order_relaxed );
+		if ( nNow < nNext || !m_nNext.compare_exchange_strong( nNext, nNow + m_nInterval, std::memory_order_relaxed ) )
+		{
+			m_unSuppressed.fetch_add( 1, std::memory_order_relaxed );
+			return false;
+		}
+		unSuppressed = m_unSuppressed.exchange( 0, std::memory_order_relaxed );
+		return true;
+	}
+
+private:
+	const std::chrono::steady_clock::rep m_nInterval;
+	std::atomic<std::chrono::steady_clock::rep> m_nNext;
+	std::atomic<uint32_t> m_unSuppressed;
+};
+
+template<typename T>
+inline typename std::enable_if<std::is_arithmetic<T>::value || std::is_enum<T>::value, size_t>::type DriverLogArgSize( T )
+{
+	return 1 + 8;
+}
+
+template<typename T>
+inline size_t DriverLogArgSize( T * )
+{
+	return 1 + 8;
+}
+
+inline size_t DriverLogStringLength( const char *psz )
+{
+	return psz ? std::min( strlen( psz ), (size_t)DRIVERLOG_MAX_STRING ) : 0;
+}
+
+inline size_t DriverLogArgSize( const char *psz )
+{
+	return 1 + 2 + DriverLogStringLength( psz ) + 1;
+}
+
+inline size_t DriverLogArgSize( char *psz )
+{
+	return DriverLogArgSize( (const char *)psz );
+}
+
+inline void DriverLogPutArg( uint8_t *&p, EDriverLogArg eType, const void *pValue )
+{
+	*p++ = (uint8_t)eType;
+	memcpy( p, pValue, 8 );
+	p += 8;
+}
+
+template<typename T>
+inline typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type DriverLogPutArg( uint8_t *&p, T value )
+{
+	int64_t n = value;
+	DriverLogPutArg( p, DriverLogArg_Int, &n );
+}
+
+template<typename T>
+inline typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value>::type DriverLogPutArg( uint8_t *&p, T value )
+{
+	uint64_t un = value;
+	DriverLogPutArg( p, DriverLogArg_UInt, &un );
+}
+
+template<typename T>
+inline typename std::enable_if<std::is_enum<T>::value>::type DriverLogPutArg( uint8_t *&p, T value )
+{
+	int64_t n = (int64_t)value;
+	DriverLogPutArg( p, DriverLogArg_Int, &n );
+}
+
+template<typename T>
+inline typename std::enable_if<std::is_floating_point<T>::value>::type DriverLogPutArg( uint8_t *&p, T value )
+{
+	double fl = value;
+	DriverLogPutArg( p, DriverLogArg_Double, &fl );
+}
+
+template<typename T>
+inline void DriverLogPutArg( uint8_t *&p, T *ptr )
+{
+	uint64_t un = (uint64_t)(uintptr_t)ptr;
+	DriverLogPutArg( p, DriverLogArg_Pointer, &un );
+}
+
+inline void DriverLogPutArg( uint8_t *&p, const char *psz )
+{
+	uint16_t unLen = (uint16_t)DriverLogStringLength( psz );
+	*p++ = (uint8_t)DriverLogArg_String;
+	memcpy( p, &unLen, 2 );
+	p += 2;
+	if ( unLen > 0 )
+		memcpy( p, psz, unLen );
+	p += unLen;
+	*p++ = 0;
+}
+
+inline void DriverLogPutArg( uint8_t *&p, char *psz )
+{
+	DriverLogPutArg( p, (const char *)psz );
+}
+
+inline size_t DriverLogArgsSize()
+{
+	return 0;
+}
+
+template<typename T, typename... Rest>
+inline size_t DriverLogArgsSize( T arg, Rest... rest )
+{
+	return DriverLogArgSize( arg ) + DriverLogArgsSize( rest... );
+}
+
+inline void DriverLogPutArgs( uint8_t *& )
+{
+}
+
+template<typename T, typename... Rest>
+inline void DriverLogPutArgs( uint8_t *&p, T arg, Rest... rest )
+{
+	DriverLogPutArg( p, arg );
+	DriverLogPutArgs( p, rest... );
+}
+
+template<typename... Args>
+inline void DriverLogWrite( int nSeverity, const char *pchFormat, Args... args )
+{
+	static_assert( sizeof...( Args ) < 256, "too many log arguments" );
+	uint8_t *p = DriverLogReserve( DriverLogArgsSize( args... ), nSeverity, pchFormat, sizeof...( Args ) );
+	if ( !p )
+		return;
+	DriverLogPutArgs( p, args... );
+	DriverLogCommit();
+}
+
 
 #endif // DRIVERLOG_H
@@ -10,27 +10,36 @@ extern "C" {
 }
 
 #include "CSteamController.h"
+#include "lua_vrmath.h"
+#include "sc_math.h"
+#include "script_cache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 using namespace vr;
 
 #define TABLE_VRDISP "VRDisplayComponent"
 #define TABLE_TRACKDEV "TrackedDeviceServerDriver"
 #define TABLE_CONTROL "SteamController"
+#define META_DRIVERPOSE "DriverPose"
+#define META_POSEBUFFER "PoseBuffer"
 
-// Convert a HmdQuaternion_t into a Lua table
+// Convert a HmdQuaternion_t into a vrmath Quat
 // If the operation is successful, the top of the stack contains
-// the table and true is returned.
+// the quaternion and true is returned.
 // On failure the stack remains balanced and false is returned.
 // [-0, +1, e]
 static bool ToLuaTable(lua_State* L, const vr::HmdQuaternion_t& ev) {
     bool ret = false;
 
     if (L) {
-        lua_newtable(L); // +1
-        lua_pushstring(L, "w"); lua_pushnumber(L, ev.w); lua_settable(L, -3);
-        lua_pushstring(L, "x"); lua_pushnumber(L, ev.x); lua_settable(L, -3);
-        lua_pushstring(L, "y"); lua_pushnumber(L, ev.y); lua_settable(L, -3);
-        lua_pushstring(L, "z"); lua_pushnumber(L, ev.z); lua_settable(L, -3);
+        PushQuat(L, ev); // +1
         ret = true;
     }
 
@@ -47,11 +56,7 @@ static bool ToLuaTable(lua_State* L, const SteamControllerUpdateEvent& ev) {
 
     if (L) {
         lua_newtable(L); // +1
-        auto x = ev.orientation.x / 32767.0f;
-        auto y = ev.orientation.y / 32767.0f;
-        auto z = ev.orientation.z / 32767.0f;
-        auto w = 1.0f - sqrtf(x * x + y * y + z * z);
-        auto orientation = HmdQuaternion_t{ w, x, y, z };
+        auto orientation = DecodeOrientation(ev.orientation);
         lua_pushstring(L, "orientation"); // +1
         if (ToLuaTable(L, orientation)) { // +1
             lua_settable(L, -3); // -2
@@ -76,30 +81,37 @@ static bool ToLuaTable(lua_State* L, const SteamControllerUpdateEvent& ev) {
 
 #define TABLE_MAP_T(cont, key, conv, coercion) TABLE_GET_T(cont, key, key, conv, coercion)
 
-#define TABLE_MAP_NUMBER(cont, key) TABLE_MAP_T(cont, key, lua_tonumber)
-#define TABLE_MAP_BOOL(cont, key) TABLE_MAP_T(cont, key, lua_toboolean)
-#define TABLE_MAP_INT(cont, key) TABLE_MAP_T(cont, key, lua_tointeger)
+#define TABLE_MAP_NUMBER(cont, key) TABLE_MAP_T(cont, key, lua_tonumber, )
+#define TABLE_MAP_BOOL(cont, key) TABLE_MAP_T(cont, key, lua_toboolean, )
+#define TABLE_MAP_INT(cont, key) TABLE_MAP_T(cont, key, lua_tointeger, )
 #define TABLE_MAP_ENUM(cont, key, type) TABLE_MAP_T(cont, key, lua_tointeger, (type))
 
-#define TABLE_GET_TRIV(cont, key, field, type) { \
+#define TABLE_GET_TRIV(cont, key, field) { \
     lua_pushstring(L, X(key));                   \
     lua_gettable(L, -2);                         \
     FromLuaTable(L, cont.field);                 \
 }
 #define TABLE_MAP_TRIV(cont, key) TABLE_GET_TRIV(cont, key, key)
 
-// Convert the Lua table at the top of the stack to a HMD quat
+// Convert the vrmath Quat or Lua table at the top of the stack to a HMD quat
 // Returns true on success and false on failure.
-// Pops the table from the stack.
+// Pops the value from the stack.
 // [-1, +0, -]
 static bool FromLuaTable(lua_State* L, vr::HmdQuaternion_t& q) {
     bool ret = false;
-    
+
     if (L) {
-        TABLE_MAP_NUMBER(q, w);
-        TABLE_MAP_NUMBER(q, x);
-        TABLE_MAP_NUMBER(q, y);
-        TABLE_MAP_NUMBER(q, z);
+        auto pQ = ToQuat(L, -1);
+        if (pQ != NULL) {
+            // Native quaternion, no field lookups needed
+            q = *pQ;
+            ret = true;
+        } else {
+            TABLE_MAP_NUMBER(q, w);
+            TABLE_MAP_NUMBER(q, x);
+            TABLE_MAP_NUMBER(q, y);
+            TABLE_MAP_NUMBER(q, z);
+        }
     }
 
     lua_pop(L, 1);
@@ -136,24 +148,21 @@ public:
     BaseLuaInterface() : L(NULL), m_nRefMethodTable(LUA_NOREF), m_nRefInstance(LUA_NOREF) {}
     BaseLuaInterface(const BaseLuaInterface&) = delete;
 
-    BaseLuaInterface(lua_State* L, int nRefMethodTable) : L(L), m_nRefMethodTable(nRefMethodTable) {
+    BaseLuaInterface(lua_State* L, int nRefMethodTable) : L(L), m_nRefMethodTable(nRefMethodTable), m_nRefInstance(LUA_NOREF) {
         if (!CheckMethodTable()) {
             DriverLog("Methods are missing!");
         }
-        // Create a new instance by calling Interface:new()
-        PushMethodTable();
-        lua_getfield(L, -1, "Create");
+        // Create a new instance by calling Interface:Create()
+        PushMethod("Create");
         PushMethodTable();
-        lua_call(L, 1, 1);
-
-        m_nRefInstance = luaL_ref(L, LUA_REGISTRYINDEX);
+        if (CallMethod("Create", 1, 1)) {
+            m_nRefInstance = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
         if (m_nRefInstance != LUA_NOREF && m_nRefInstance != LUA_REFNIL) {
             OnInit();
         } else {
             DriverLog("new: instance reference is %d, a NOREF or REFNIL!", m_nRefInstance);
         }
-
-        lua_pop(L, 1);
     }
 
     // Push the method table object onto the Lua stack
@@ -173,8 +182,7 @@ public:
     void OnInit() {
         PushMethod("OnInit");
         PushInstance();
-        lua_call(L, 1, 0);
-        lua_pop(L, 1);
+        CallMethod("OnInit", 1, 0);
     }
 
     virtual ~BaseLuaInterface() {
@@ -182,8 +190,7 @@ public:
             if (m_nRefInstance != LUA_NOREF && m_nRefMethodTable != LUA_NOREF) {
                 PushMethod("OnShutdown");
                 PushInstance();
-                lua_call(L, 1, 0);
-                lua_pop(L, 1);
+                CallMethod("OnShutdown", 1, 0);
             }
             if (m_nRefInstance != LUA_NOREF) {
                 luaL_unref(L, LUA_REGISTRYINDEX, m_nRefInstance);
@@ -230,55 +237,130 @@ protected:
         lua_pushstring(L, pszKey); // +1
         lua_gettable(L, -2); // -1 +1
     }
+
+    // Call a method pushed by PushMethod with nArgs arguments (including
+    // the instance) under the script's execution budget.
+    // The method table pushed by PushMethod is popped too.
+    // On failure the error is logged and false is returned.
+    // [-(nArgs + 2), +nResults|0, -]
+    bool CallMethod(char const* pszKey, int nArgs, int nResults) {
+        if (CLuaScript::FromState(L)->Call(nArgs, nResults) != LUA_OK) {
+            DriverLog("script error in handler method %s: %s", pszKey, lua_tostring(L, -1));
+            lua_pop(L, 2);
+            return false;
+        }
+        lua_remove(L, -(nResults + 1));
+        return true;
+    }
     lua_State* L;
 
     int m_nRefMethodTable;
     int m_nRefInstance;
 };
 
-static int Lua_ISteamController_Rumble(lua_State* L) {
-    auto pSC = (CSteamController*)lua_touserdata(L, -1);
-    if (pSC) {
-        pSC->TriggerHaptic(0, 1000, 1000, 500);
-        pSC->TriggerHaptic(1, 1000, 1000, 500);
+static int Lua_ISteamController_Rumble(lua_State* L);
+static int Lua_ISteamController_GetOrientation(lua_State* L);
+
+//-----------------------------------------------------------------------------
+// Purpose: an opened Steam Controller. Owned by the driver, so that the
+// device, its reader thread and the reports queued so far outlive script
+// reloads; only the Lua handler it reports to is swapped.
+//-----------------------------------------------------------------------------
+
+class CDriverController : public CSteamController {
+public:
+    CDriverController(SteamControllerDevice* pDevice, uint32_t unId) :
+        CSteamController(pDevice),
+        m_unId(unId),
+        m_bReload(false),
+        m_pHandler(NULL),
+        m_pPredictor(NULL),
+        m_pInputBinding(NULL) {
+        memset(&m_lastUpdate, 0, sizeof(m_lastUpdate));
+        Configure(STEAMCONTROLLER_CONFIG_SEND_ORIENTATION | STEAMCONTROLLER_CONFIG_SEND_ACCELERATION | STEAMCONTROLLER_CONFIG_SEND_GYRO);
     }
-    return 0;
-}
 
-class ISteamController : public CLuaHMDDriver::BaseLuaInterface, public CSteamController {
+    virtual void OnSamples(const SteamControllerUpdateBatch& batch, clock::time_point tNewest) override;
+    virtual void OnUpdate(const SteamControllerUpdateEvent& ev, clock::time_point tReceived) override;
+    virtual void OnDisconnect() override;
+
+    // Lua handler instance of the live script; NULL if it has none
+    void SetHandler(ISteamController* pHandler) { m_pHandler = pHandler; }
+
+    // Where to send gyro samples; NULL to not send them
+    void SetPredictor(CPosePredictor* pPredictor) {
+        m_pPredictor = pPredictor;
+    }
+
+    // Where to send buttons and axes; NULL to not send them
+    void SetInputBinding(CInputBinding* pBinding) {
+        if (pBinding != m_pInputBinding && pBinding != NULL) {
+            // It holds the state of whichever controller fed it before
+            pBinding->Reset();
+        }
+        m_pInputBinding = pBinding;
+    }
+
+    const CImuFusion& GetFusion() const { return m_fusion; }
+
+    // Assigned by the controller monitor
+    uint32_t GetId() const { return m_unId; }
+
+    // Buttons and axes as of the last OnUpdate
+    const SteamControllerUpdateEvent& GetLastUpdate() const { return m_lastUpdate; }
+
+    bool UserRequestedReload() {
+        auto ret = m_bReload;
+        m_bReload = false;
+        return ret;
+    }
+
+private:
+    uint32_t m_unId;
+    bool m_bReload;
+    ISteamController* m_pHandler;
+    CPosePredictor* m_pPredictor;
+    CInputBinding* m_pInputBinding;
+    CImuFusion m_fusion;
+    SteamControllerUpdateEvent m_lastUpdate;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: instance of a script's Steam Controller handler, created for
+// every controller when the controller is attached or the script loaded
+//-----------------------------------------------------------------------------
+
+class ISteamController : public CLuaHMDDriver::BaseLuaInterface {
 public:
-    ISteamController(lua_State* L, int nRefMethodTable, SteamControllerDeviceEnum* it) :
+    ISteamController(lua_State* L, int nRefMethodTable, CDriverController* pController) :
         CLuaHMDDriver::BaseLuaInterface(L, nRefMethodTable),
-        CSteamController::CSteamController(it),
-        m_bReload(false) {
-        Configure(STEAMCONTROLLER_CONFIG_SEND_ORIENTATION);
+        m_pController(pController) {
         DriverLog("Adding Rumble method");
         AddMethod("Rumble", Lua_ISteamController_Rumble);
+        AddMethod("GetOrientation", Lua_ISteamController_GetOrientation);
         DriverLog("Calling OnConnect");
         OnConnect();
     }
 
-    virtual ~ISteamController() {
-    }
-
-    virtual void OnUpdate(const SteamControllerUpdateEvent& ev) override {
-        if (ev.buttons & STEAMCONTROLLER_BUTTON_HOME) {
-            // Reload script
-            m_bReload = true;
-            DriverLog("User requested script reload by pressing Home");
+    void OnUpdate(const SteamControllerUpdateEvent& ev) {
+        // Propagate event to Lua script
+        PushMethod("OnUpdate"); // +2
+        PushInstance(); // +1
+        if (ToLuaTable(L, ev)) { // +1
+            auto pStats = CLuaScript::FromState(L)->GetStats();
+            CScopedLatency timer(pStats != NULL ? &pStats->onUpdate : NULL);
+            CallMethod("OnUpdate", 2, 0); // -4
         } else {
-            // Propagate event to Lua script
-            PushMethod("OnUpdate"); // +2
-            PushInstance(); // +1
-            if (ToLuaTable(L, ev)) { // +1
-                lua_call(L, 2, 0); // -3
-                lua_pop(L, 1); // -1
-            } else {
-                lua_pop(L, 3);
-            }
+            lua_pop(L, 3);
         }
     }
 
+    void OnDisconnect() {
+        PushMethod("OnDisconnect"); // +2
+        PushInstance(); // +1
+        CallMethod("OnDisconnect", 1, 0); // -3
+    }
+
     virtual bool CheckMethodTable() override {
         return CLuaHMDDriver::BaseLuaInterface::CheckMethodTable() &&
             IsMethodPresent("OnConnect") &&
@@ -287,30 +369,318 @@ public:
             IsMethodPresent("GetControllerHandle");
     }
 
-    bool UserRequestedReload() {
-        auto ret = m_bReload;
-        m_bReload = false;
-        return ret;
-    }
+    CDriverController* GetController() const { return m_pController; }
 
 protected:
     void OnConnect() {
         PushMethod("OnConnect"); // +2
         PushInstance(); // +1
-        lua_pushlightuserdata(L, this); // +1
-        lua_call(L, 2, 0); // -3
-        lua_pop(L, 1); // -1
+        lua_pushlightuserdata(L, m_pController); // +1
+        CallMethod("OnConnect", 2, 0); // -4
     }
 
-    bool m_bReload;
+    CDriverController* m_pController;
+};
+
+void CDriverController::OnSamples(const SteamControllerUpdateBatch& batch, clock::time_point tNewest) {
+    m_fusion.AddSamples(batch, tNewest);
+    if (m_pPredictor != NULL) {
+        m_pPredictor->AddSamples(batch, tNewest);
+    }
+}
+
+void CDriverController::OnUpdate(const SteamControllerUpdateEvent& ev, clock::time_point tReceived) {
+    m_lastUpdate = ev;
+    if (m_pInputBinding != NULL) {
+        // Negative; the report was read before this frame
+        auto flTimeOffset = std::chrono::duration<double>(tReceived - clock::now()).count();
+        m_pInputBinding->Update(ev, flTimeOffset);
+    }
+    if (ev.buttons & STEAMCONTROLLER_BUTTON_HOME) {
+        // Reload script
+        m_bReload = true;
+        DriverLog("User requested script reload by pressing Home");
+    } else if (m_pHandler != NULL) {
+        m_pHandler->OnUpdate(ev);
+    }
+}
+
+void CDriverController::OnDisconnect() {
+    if (m_pHandler != NULL) {
+        m_pHandler->OnDisconnect();
+    }
+}
+
+// The handle passed to OnConnect is the CDriverController; it stays the
+// same across reloads
+
+// self:Rumble(handle)
+static int Lua_ISteamController_Rumble(lua_State* L) {
+    auto pSC = (CDriverController*)lua_touserdata(L, -1);
+    if (pSC) {
+        pSC->TriggerHaptic(0, 1000, 1000, 500);
+        pSC->TriggerHaptic(1, 1000, 1000, 500);
+    }
+    return 0;
+}
+
+// self:GetOrientation(handle[, q])
+// Orientation fused from the gyro and accelerometer. Stored into and
+// returned in the Quat q, or in a new Quat when q is absent.
+// Returns nil until the controller has sent an update.
+static int Lua_ISteamController_GetOrientation(lua_State* L) {
+    auto pSC = (CDriverController*)lua_touserdata(L, 2);
+    if (pSC == NULL || !pSC->GetFusion().IsInitialized()) {
+        lua_pushnil(L);
+        return 1;
+    }
+    auto pQ = ToQuat(L, 3);
+    if (pQ != NULL) {
+        *pQ = pSC->GetFusion().GetOrientation();
+        lua_pushvalue(L, 3);
+        return 1;
+    }
+    PushQuat(L, pSC->GetFusion().GetOrientation());
+    return 1;
+}
+
+// Fetch the DriverPose_t stored in the pose userdata at the given index
+// Raises a Lua error if the value is not a pose.
+// [-0, +0, v]
+static DriverPose_t* CheckDriverPose(lua_State* L, int idx) {
+    return (DriverPose_t*)luaL_checkudata(L, idx, META_DRIVERPOSE);
+}
+
+// Read a quaternion passed as a vrmath Quat or as four numbers starting at idx
+// [-0, +0, v]
+static void CheckQuaternion(lua_State* L, int idx, HmdQuaternion_t& q) {
+    auto pQ = ToQuat(L, idx);
+    if (pQ) {
+        q = *pQ;
+        return;
+    }
+    q.w = luaL_checknumber(L, idx + 0);
+    q.x = luaL_checknumber(L, idx + 1);
+    q.y = luaL_checknumber(L, idx + 2);
+    q.z = luaL_checknumber(L, idx + 3);
+}
+
+// Read a vector passed as a vrmath Vec3 or as three numbers starting at idx
+// [-0, +0, v]
+static void CheckVector(lua_State* L, int idx, double v[3]) {
+    auto pV = ToVec3(L, idx);
+    if (pV) {
+        v[0] = pV->v[0];
+        v[1] = pV->v[1];
+        v[2] = pV->v[2];
+        return;
+    }
+    v[0] = luaL_checknumber(L, idx + 0);
+    v[1] = luaL_checknumber(L, idx + 1);
+    v[2] = luaL_checknumber(L, idx + 2);
+}
+
+// pose:SetRotation(w, x, y, z) or pose:SetRotation(q)
+static int Lua_DriverPose_SetRotation(lua_State* L) {
+    CheckQuaternion(L, 2, CheckDriverPose(L, 1)->qRotation);
+    return 0;
+}
+
+// pose:SetPosition(x, y, z) or pose:SetPosition(v)
+static int Lua_DriverPose_SetPosition(lua_State* L) {
+    CheckVector(L, 2, CheckDriverPose(L, 1)->vecPosition);
+    return 0;
+}
+
+// pose:SetVelocity(x, y, z)
+static int Lua_DriverPose_SetVelocity(lua_State* L) {
+    CheckVector(L, 2, CheckDriverPose(L, 1)->vecVelocity);
+    return 0;
+}
+
+// pose:SetWorldFromDriverRotation(w, x, y, z)
+static int Lua_DriverPose_SetWorldFromDriverRotation(lua_State* L) {
+    CheckQuaternion(L, 2, CheckDriverPose(L, 1)->qWorldFromDriverRotation);
+    return 0;
+}
+
+// pose:SetWorldFromDriverTranslation(x, y, z)
+static int Lua_DriverPose_SetWorldFromDriverTranslation(lua_State* L) {
+    CheckVector(L, 2, CheckDriverPose(L, 1)->vecWorldFromDriverTranslation);
+    return 0;
+}
+
+// pose:SetDriverFromHeadRotation(w, x, y, z)
+static int Lua_DriverPose_SetDriverFromHeadRotation(lua_State* L) {
+    CheckQuaternion(L, 2, CheckDriverPose(L, 1)->qDriverFromHeadRotation);
+    return 0;
+}
+
+// pose:SetDriverFromHeadTranslation(x, y, z)
+static int Lua_DriverPose_SetDriverFromHeadTranslation(lua_State* L) {
+    CheckVector(L, 2, CheckDriverPose(L, 1)->vecDriverFromHeadTranslation);
+    return 0;
+}
+
+// pose:SetResult(result, poseIsValid, deviceIsConnected)
+static int Lua_DriverPose_SetResult(lua_State* L) {
+    auto pPose = CheckDriverPose(L, 1);
+    pPose->result = (ETrackingResult)luaL_checkinteger(L, 2);
+    pPose->poseIsValid = lua_toboolean(L, 3);
+    pPose->deviceIsConnected = lua_toboolean(L, 4);
+    return 0;
+}
+
+static const luaL_Reg g_aDriverPoseMethods[] = {
+    { "SetRotation", Lua_DriverPose_SetRotation },
+    { "SetPosition", Lua_DriverPose_SetPosition },
+    { "SetVelocity", Lua_DriverPose_SetVelocity },
+    { "SetWorldFromDriverRotation", Lua_DriverPose_SetWorldFromDriverRotation },
+    { "SetWorldFromDriverTranslation", Lua_DriverPose_SetWorldFromDriverTranslation },
+    { "SetDriverFromHeadRotation", Lua_DriverPose_SetDriverFromHeadRotation },
+    { "SetDriverFromHeadTranslation", Lua_DriverPose_SetDriverFromHeadTranslation },
+    { "SetResult", Lua_DriverPose_SetResult },
+    { NULL, NULL }
+};
+
+// Create the metatable of the pose userdata
+// [-0, +0, e]
+static void RegisterDriverPose(lua_State* L) {
+    luaL_newmetatable(L, META_DRIVERPOSE); // +1
+    lua_pushvalue(L, -1); // +1
+    lua_setfield(L, -2, "__index"); // -1
+    luaL_setfuncs(L, g_aDriverPoseMethods, 0);
+    lua_pop(L, 1); // -1
+}
+
+// Create a pose userdata initialized to an identity, invalid pose
+// The userdata is left on top of the stack and a pointer to its
+// contents is returned; the memory stays put as long as the
+// userdata is alive.
+// [-0, +1, e]
+static DriverPose_t* NewDriverPose(lua_State* L) {
+    auto pPose = (DriverPose_t*)lua_newuserdata(L, sizeof(DriverPose_t)); // +1
+    memset(pPose, 0, sizeof(DriverPose_t));
+    pPose->qWorldFromDriverRotation.w = 1;
+    pPose->qDriverFromHeadRotation.w = 1;
+    pPose->qRotation.w = 1;
+    pPose->result = TrackingResult_Uninitialized;
+    pPose->deviceIsConnected = true;
+    luaL_setmetatable(L, META_DRIVERPOSE);
+    return pPose;
+}
+
+// Fetch the pose buffer at the given index and the 0-based device index
+// following it; raises a Lua error on a bad argument.
+// [-0, +0, v]
+static CPoseBuffer* CheckPoseBuffer(lua_State* L, int idx, uint32_t* punDevice) {
+    auto pBuffer = *(CPoseBuffer**)luaL_checkudata(L, idx, META_POSEBUFFER);
+    if (punDevice != NULL) {
+        auto nDevice = luaL_checkinteger(L, idx + 1);
+        luaL_argcheck(L, nDevice >= 1 && nDevice <= (lua_Integer)pBuffer->Size(), idx + 1, "device index out of range");
+        *punDevice = (uint32_t)(nDevice - 1);
+    }
+    return pBuffer;
+}
+
+// poses:SetRotation(i, q) or poses:SetRotation(i, w, x, y, z)
+static int Lua_PoseBuffer_SetRotation(lua_State* L) {
+    uint32_t i;
+    auto pBuffer = CheckPoseBuffer(L, 1, &i);
+    CheckQuaternion(L, 3, pBuffer->m_aRotation[i]);
+    return 0;
+}
+
+// poses:SetPosition(i, v) or poses:SetPosition(i, x, y, z)
+static int Lua_PoseBuffer_SetPosition(lua_State* L) {
+    uint32_t i;
+    auto pBuffer = CheckPoseBuffer(L, 1, &i);
+    CheckVector(L, 3, pBuffer->m_aPosition[i].v);
+    return 0;
+}
+
+// poses:SetVelocity(i, v) or poses:SetVelocity(i, x, y, z)
+static int Lua_PoseBuffer_SetVelocity(lua_State* L) {
+    uint32_t i;
+    auto pBuffer = CheckPoseBuffer(L, 1, &i);
+    CheckVector(L, 3, pBuffer->m_aVelocity[i].v);
+    return 0;
+}
+
+// poses:SetAngularVelocity(i, v) or poses:SetAngularVelocity(i, x, y, z)
+static int Lua_PoseBuffer_SetAngularVelocity(lua_State* L) {
+    uint32_t i;
+    auto pBuffer = CheckPoseBuffer(L, 1, &i);
+    CheckVector(L, 3, pBuffer->m_aAngularVelocity[i].v);
+    return 0;
+}
+
+// poses:SetResult(i, result, poseIsValid, deviceIsConnected)
+static int Lua_PoseBuffer_SetResult(lua_State* L) {
+    uint32_t i;
+    auto pBuffer = CheckPoseBuffer(L, 1, &i);
+    pBuffer->m_aResult[i] = (ETrackingResult)luaL_checkinteger(L, 3);
+    pBuffer->m_aValid[i] = lua_toboolean(L, 4);
+    pBuffer->m_aConnected[i] = lua_toboolean(L, 5);
+    return 0;
+}
+
+// #poses
+static int Lua_PoseBuffer_Len(lua_State* L) {
+    lua_pushinteger(L, CheckPoseBuffer(L, 1, NULL)->Size());
+    return 1;
+}
+
+static const luaL_Reg g_aPoseBufferMethods[] = {
+    { "SetRotation", Lua_PoseBuffer_SetRotation },
+    { "SetPosition", Lua_PoseBuffer_SetPosition },
+    { "SetVelocity", Lua_PoseBuffer_SetVelocity },
+    { "SetAngularVelocity", Lua_PoseBuffer_SetAngularVelocity },
+    { "SetResult", Lua_PoseBuffer_SetResult },
+    { "__len", Lua_PoseBuffer_Len },
+    { NULL, NULL }
 };
 
+// Create the metatable of the pose buffer userdata
+// [-0, +0, e]
+static void RegisterPoseBuffer(lua_State* L) {
+    luaL_newmetatable(L, META_POSEBUFFER); // +1
+    lua_pushvalue(L, -1); // +1
+    lua_setfield(L, -2, "__index"); // -1
+    luaL_setfuncs(L, g_aPoseBufferMethods, 0);
+    lua_pop(L, 1); // -1
+}
+
+// Push a userdata referring to a pose buffer owned by the driver
+// [-0, +1, e]
+static void PushPoseBuffer(lua_State* L, CPoseBuffer* pBuffer) {
+    *(CPoseBuffer**)lua_newuserdata(L, sizeof(CPoseBuffer*)) = pBuffer; // +1
+    luaL_setmetatable(L, META_POSEBUFFER);
+}
+
+// Every call into the script is protected, so this is only reached on
+// errors outside of any call (e.g. running out of memory while the driver
+// manipulates the stack). Lua aborts the process once this returns; make
+// sure the reason ends up in the log first.
 static int Lua_AtPanic(lua_State* L) {
     const char* pszMsg = lua_tostring(L, -1);
-    DriverLog("script fatal error: %s", pszMsg);
+    DriverLog("script fatal error: %s", pszMsg != NULL ? pszMsg : "(error object is not a string)");
     return 0;
 }
 
+// Message handler for protected calls: append a traceback to the error
+static int Lua_Traceback(lua_State* L) {
+    const char* pszMsg = lua_tostring(L, 1);
+    if (pszMsg == NULL) {
+        if (luaL_callmeta(L, 1, "__tostring") && lua_type(L, -1) == LUA_TSTRING) {
+            return 1;
+        }
+        pszMsg = lua_pushfstring(L, "(error object is a %s value)", luaL_typename(L, 1));
+    }
+    luaL_traceback(L, L, pszMsg, 1);
+    return 1;
+}
+
 static int Lua_DriverLog(lua_State* L) {
     const char* pszMsg = lua_tostring(L, -1);
     DriverLog("script: %s", pszMsg);
@@ -318,9 +688,9 @@ static int Lua_DriverLog(lua_State* L) {
 }
 
 static int Lua_RegisterHandler(lua_State* L) {
-    auto driver = (CLuaHMDDriver*)lua_touserdata(L, -3);
-    if (driver == NULL) {
-        DriverLog("Lua_RegisterHandler failed because the driver pointer is NULL!");
+    auto script = (CLuaScript*)lua_touserdata(L, -3);
+    if (script == NULL) {
+        DriverLog("Lua_RegisterHandler failed because the script pointer is NULL!");
         return 0;
     }
 
@@ -328,10 +698,9 @@ static int Lua_RegisterHandler(lua_State* L) {
     // pop table off stack and pin it
     auto table = luaL_ref(L, LUA_REGISTRYINDEX);
 
-    DriverLog("Registering handler for %s (driver=%p, table=%d)", interfaceId, driver, table);
+    DriverLog("Registering handler for %s (script=%p, table=%d)", interfaceId, script, table);
 
     HandlerType_t type = k_unHandlerType_Max;
-    CLuaHMDDriver::BaseLuaInterface* pIf = NULL;
     if (strcmp(TABLE_CONTROL, interfaceId) == 0) {
         type = k_unHandlerType_SteamController;
     } else if (strcmp(TABLE_VRDISP, interfaceId) == 0) {
@@ -339,13 +708,40 @@ static int Lua_RegisterHandler(lua_State* L) {
     }
 
     if (type != k_unHandlerType_Max) {
-        driver->SetHandler(type, table);
+        script->SetHandler(type, table);
     }
     lua_pop(L, 2);
 
     return 0;
 }
 
+// Tell the driver to query the display configuration again
+static int Lua_DisplayChanged(lua_State* L) {
+    CLuaScript::FromState(L)->SetDisplayChanged();
+    return 0;
+}
+
+// GetSharedMemoryPose(pose [, delay]) -> bool
+// Fill a pose userdata from the shared memory pose source, delay seconds
+// in the past (default: the poseSharedMemoryDelayMilliseconds setting).
+// Returns false and leaves the pose alone if there is no pose to read.
+static int Lua_GetSharedMemoryPose(lua_State* L) {
+    auto pPose = CheckDriverPose(L, 1);
+    auto script = CLuaScript::FromState(L);
+    auto pSource = script->GetPoseSource();
+    if (pSource == NULL || !pSource->IsEnabled()) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+    auto flDelay = luaL_optnumber(L, 2, pSource->GetDelay());
+    auto bRead = pSource->GetPose(flDelay, *pPose);
+    if (bRead) {
+        script->SetReadSharedMemoryPose(true);
+    }
+    lua_pushboolean(L, bRead);
+    return 1;
+}
+
 static bool InitializeLuaState(lua_State* L, std::string const& sPath) {
     int res;
 
@@ -357,9 +753,21 @@ static bool InitializeLuaState(lua_State* L, std::string const& sPath) {
     // Define a DriverLog function for the script
     lua_register(L, "DriverLog", Lua_DriverLog);
     lua_register(L, "RegisterHandler", Lua_RegisterHandler);
+    lua_register(L, "DisplayChanged", Lua_DisplayChanged);
+    lua_register(L, "GetSharedMemoryPose", Lua_GetSharedMemoryPose);
+
+    // Native math types
+    luaL_requiref(L, VRMATH_LIBNAME, luaopen_vrmath, 1);
+    lua_pop(L, 1);
+
+    RegisterDriverPose(L);
+    RegisterPoseBuffer(L);
 
-    // Load and exec script file
-    res = luaL_dofile(L, sPath.c_str());
+    // Load (through the bytecode cache) and exec script file
+    res = LoadScriptCached(L, sPath);
+    if (res == LUA_OK) {
+        res = CLuaScript::FromState(L)->Call(0, 0);
+    }
 
     if(res == LUA_OK) {
         DriverLog("script loaded successfully!");
@@ -370,156 +778,1145 @@ static bool InitializeLuaState(lua_State* L, std::string const& sPath) {
     }
 }
 
-CLuaHMDDriver::CLuaHMDDriver(const char* pszPath) :
-    m_unObjectId(k_unTrackedDeviceIndexInvalid),
-    m_ulPropertyContainer(k_ulInvalidPropertyContainer),
-    m_sSerialNumber("SN00000001"),
-    m_sModelNumber("v1.hmd.vr.easimer.net"),
-    m_sScriptPath(pszPath),
+CLuaScript::CLuaScript() :
     m_pLua(NULL),
-    m_pLuaSteamController(NULL) {
+    m_bInitialized(false),
+    m_refPose(LUA_NOREF),
+    m_pLuaPose(NULL),
+    m_unInstructionBudget(0),
+    m_unTimeBudgetUs(0),
+    m_nCallDepth(0),
+    m_unHookTicks(0),
+    m_pStats(NULL),
+    m_pPoseSource(NULL),
+    m_bReadSharedMemoryPose(false),
+    m_bDisplayChanged(false),
+    m_unDistortionSamples(DISTORTION_DEFAULT_RESOLUTION),
+    m_refPoses(LUA_NOREF) {
+    memset(&m_displayConfig, 0, sizeof(m_displayConfig));
     for (int i = 0; i < k_unHandlerType_Max; i++) {
         m_arefHandlers[i] = LUA_NOREF;
     }
-    Reload();
+    for (int i = 0; i < k_unCallbackTable_Max; i++) {
+        m_arefCallbackTables[i] = LUA_NOREF;
+    }
+    for (int i = 0; i < k_unCallback_Max; i++) {
+        m_arefCallbacks[i] = LUA_NOREF;
+    }
 }
 
-CLuaHMDDriver::~CLuaHMDDriver() {
-    Unload();
+// Read a non-negative integer setting, falling back to a default when
+// it is absent
+static uint32_t GetSettingUint32(const char* pchKey, uint32_t unDefault) {
+    EVRSettingsError err = VRSettingsError_None;
+    auto nValue = VRSettings()->GetInt32(SETTINGS_SECTION, pchKey, &err);
+    if (err != VRSettingsError_None) {
+        return unDefault;
+    }
+    return nValue > 0 ? (uint32_t)nValue : 0;
 }
 
-static void PushTableFunction(lua_State* L, const char* pchTable, const char* pchFunction) {
-    lua_getglobal(L, pchTable);
-    lua_getfield(L, -1, pchFunction);
+static bool GetSettingBool(const char* pchKey, bool bDefault) {
+    EVRSettingsError err = VRSettingsError_None;
+    auto bValue = VRSettings()->GetBool(SETTINGS_SECTION, pchKey, &err);
+    return err == VRSettingsError_None ? bValue : bDefault;
 }
 
-#define DO_SIMPLE_CALLBACK(t, f)            \
-    if (m_pLua != NULL) {                   \
-        PushTableFunction(m_pLua, t, f);    \
-        lua_getglobal(m_pLua, t);           \
-        lua_call(m_pLua, 1, 0);             \
-    }
+// Read a string setting; false when it is absent or empty
+static bool GetSettingString(const char* pchKey, char* pchValue, uint32_t unValueLen) {
+    EVRSettingsError err = VRSettingsError_None;
+    VRSettings()->GetString(SETTINGS_SECTION, pchKey, pchValue, unValueLen, &err);
+    return err == VRSettingsError_None && pchValue[0] != 0;
+}
 
-EVRInitError CLuaHMDDriver::Activate(uint32_t unObjectId) {
-    EVRInitError ret = VRInitError_Init_Internal;
+CLuaHMDDriver::CLuaHMDDriver(const char* pszPath) :
+    m_unObjectId(k_unTrackedDeviceIndexInvalid),
+    m_ulPropertyContainer(k_ulInvalidPropertyContainer),
+    m_sSerialNumber("SN00000001"),
+    m_sModelNumber("v1.hmd.vr.easimer.net"),
+    m_sScriptPath(pszPath),
+    m_bGyroPrediction(true),
+    m_bCoalesceUpdates(true),
+    m_bShmPoseDirect(false),
+    m_pScript(NULL),
+    m_bReloadInProgress(false),
+    m_pPendingScript(NULL),
+    m_bReloadSwapped(false),
+    m_bReloadExiting(false),
+    m_pRetiredScript(NULL),
+    m_bThreaded(false),
+    m_bScriptThreadExiting(false),
+    m_unFrameCounter(0),
+    m_bFrameTelemetry(false),
+    m_ulScriptFrames(0),
+    m_unGCBudgetUs(0),
+    m_nGCStepSize(0) {
+    memset(&m_gcStats, 0, sizeof(m_gcStats));
+    memset(&m_telemetry, 0, sizeof(m_telemetry));
+    memset(&m_lastGoodPose, 0, sizeof(m_lastGoodPose));
+    m_lastGoodPose.qWorldFromDriverRotation.w = 1;
+    m_lastGoodPose.qDriverFromHeadRotation.w = 1;
+    m_lastGoodPose.qRotation.w = 1;
+    m_lastGoodPose.result = TrackingResult_Uninitialized;
+
+    m_bThreaded = VRSettings()->GetBool(SETTINGS_SECTION, SETTINGS_THREADED_SCRIPT);
+    auto nGCBudget = VRSettings()->GetInt32(SETTINGS_SECTION, SETTINGS_GC_BUDGET);
+    m_unGCBudgetUs = nGCBudget > 0 ? (uint32_t)nGCBudget : 0;
+    m_nGCStepSize = VRSettings()->GetInt32(SETTINGS_SECTION, SETTINGS_GC_STEP_SIZE);
+    if (m_nGCStepSize < 0) {
+        m_nGCStepSize = 0;
+    }
+    if (m_unGCBudgetUs > 0) {
+        DriverLog("Lua GC budget is %u us per frame", m_unGCBudgetUs);
+    }
+    m_unInstructionBudget = GetSettingUint32(SETTINGS_SCRIPT_INSTRUCTION_BUDGET, SCRIPT_DEFAULT_INSTRUCTION_BUDGET);
+    m_unTimeBudgetUs = GetSettingUint32(SETTINGS_SCRIPT_TIME_BUDGET, SCRIPT_DEFAULT_TIME_BUDGET);
+    DriverLog("Script call budget is %u instructions, %u us", m_unInstructionBudget, m_unTimeBudgetUs);
+    m_unDistortionSamples = GetSettingUint32(SETTINGS_DISTORTION_RESOLUTION, DISTORTION_DEFAULT_RESOLUTION);
+    m_bGyroPrediction = GetSettingBool(SETTINGS_GYRO_PREDICTION, true);
+    m_bCoalesceUpdates = GetSettingBool(SETTINGS_COALESCE_UPDATES, true);
+    m_predictor.SetPredictToPhotons(GetSettingBool(SETTINGS_PREDICT_TO_PHOTONS, false));
+    if (m_unDistortionSamples < 2) {
+        m_unDistortionSamples = 2;
+    }
 
-    m_unObjectId = unObjectId;
-    m_ulPropertyContainer = VRProperties()->TrackedDeviceToPropertyContainer(m_unObjectId);
+    char achShmName[256];
+    if (GetSettingString(SETTINGS_POSE_SHM, achShmName, sizeof(achShmName))) {
+        EVRSettingsError err = VRSettingsError_None;
+        auto flDelayMs = VRSettings()->GetFloat(SETTINGS_SECTION, SETTINGS_POSE_SHM_DELAY, &err);
+        m_shmPoseSource.SetName(achShmName);
+        m_shmPoseSource.SetDelay(err == VRSettingsError_None && flDelayMs > 0 ? flDelayMs / 1000.0 : 0.0);
+        m_bShmPoseDirect = GetSettingBool(SETTINGS_POSE_SHM_DIRECT, false);
+        DriverLog("Shared memory pose source %s, %s, %.1f ms behind", achShmName,
+            m_bShmPoseDirect ? "driving the HMD directly" : "available to the script",
+            m_shmPoseSource.GetDelay() * 1000.0);
+    }
 
-    VRProperties()->SetStringProperty(m_ulPropertyContainer, Prop_ModelNumber_String, m_sModelNumber.c_str());
-    VRProperties()->SetStringProperty(m_ulPropertyContainer, Prop_RenderModelName_String, m_sModelNumber.c_str());
-    VRProperties()->SetFloatProperty(m_ulPropertyContainer, Prop_UserIpdMeters_Float, 0.063f);
-    VRProperties()->SetFloatProperty(m_ulPropertyContainer, Prop_UserHeadToEyeDepthMeters_Float, 0.0f);
-    VRProperties()->SetFloatProperty(m_ulPropertyContainer, Prop_DisplayFrequency_Float, 60.0f);
-    VRProperties()->SetFloatProperty(m_ulPropertyContainer, Prop_SecondsFromVsyncToPhotons_Float, 0.1f);
-    VRProperties()->SetUint64Property(m_ulPropertyContainer, Prop_CurrentUniverseId_Uint64, 2);
-    VRProperties()->SetBoolProperty(m_ulPropertyContainer, Prop_IsOnDesktop_Bool, false);
+    char achBindings[1024];
+    if (!GetSettingString(SETTINGS_INPUT_BINDINGS, achBindings, sizeof(achBindings))) {
+        snprintf(achBindings, sizeof(achBindings), "%s", INPUT_BINDINGS_DEFAULT_PATH);
+    }
+    m_inputBinding.Load(achBindings);
+
+    // The first load is synchronous; the device needs a script to activate
+    m_pScript = CreateScript();
+    // Nothing else reads the pose source yet
+    m_pScript->SetPoseSource(&m_shmPoseSource);
+    memset(&m_displayConfig, 0, sizeof(m_displayConfig));
+    if (m_pScript->Load(m_sScriptPath)) {
+        PrepareScript(m_pScript);
+        PublishDisplay(m_pScript);
+    } else {
+        delete m_pScript;
+        m_pScript = NULL;
+    }
 
-    if (m_pLua != NULL) {
-        PushTableFunction(m_pLua, TABLE_TRACKDEV, "Activate");
-        lua_getglobal(m_pLua, TABLE_TRACKDEV);
-        lua_pushinteger(m_pLua, unObjectId);
-        lua_call(m_pLua, 2, 1);
-        if (lua_toboolean(m_pLua, -1)) {
-            ret = vr::VRInitError_None;
+    // The set of devices is fixed by the first script; the server can't
+    // remove devices once they have been added
+    memset(&m_frame, 0, sizeof(m_frame));
+    m_frame.hmd = m_lastGoodPose;
+    if (m_pScript != NULL) {
+        for (uint32_t i = 0; i < m_pScript->m_devices.size(); i++) {
+            m_devices.push_back(new CLuaTrackedDevice(this, i, m_pScript->m_devices[i]));
+            m_pScript->m_poses.GetPose(i, m_frame.aDevices[i]);
         }
-        lua_pop(m_pLua, 1);
+        m_frame.unDevices = (uint32_t)m_devices.size();
+        MapDevices(m_pScript);
+    }
+    m_serverFrame = m_frame;
+
+    char achPath[1024];
+    if (GetSettingString(SETTINGS_CONTROLLER_REPLAY, achPath, sizeof(achPath))) {
+        EVRSettingsError err = VRSettingsError_None;
+        auto flSpeed = VRSettings()->GetFloat(SETTINGS_SECTION, SETTINGS_CONTROLLER_REPLAY_SPEED, &err);
+        m_controllerMonitor.SetReplay(achPath, err == VRSettingsError_None ? flSpeed : 1.0f);
+    } else if (GetSettingString(SETTINGS_CONTROLLER_RECORD_DIRECTORY, achPath, sizeof(achPath))) {
+        m_controllerMonitor.SetRecordDirectory(achPath);
+    }
+    m_controllerMonitor.Start();
 
+    if (GetSettingBool(SETTINGS_CONTROL_SOCKET_ENABLED, true)) {
+        if (!GetSettingString(SETTINGS_CONTROL_SOCKET, achPath, sizeof(achPath))) {
+            snprintf(achPath, sizeof(achPath), "%s", CControlChannel::GetDefaultPath().c_str());
+        }
+        m_controlChannel.Start(achPath);
     }
 
-    return ret;
+    if (m_bThreaded) {
+        StartScriptThread();
+    }
 }
 
-void CLuaHMDDriver::Deactivate() {
-    DO_SIMPLE_CALLBACK(TABLE_TRACKDEV, "Deactivate");
-
-    m_unObjectId = k_unTrackedDeviceIndexInvalid;
+CLuaHMDDriver::~CLuaHMDDriver() {
+    StopScriptThread();
+    // The script owner is gone; nothing signals the control thread anymore
+    m_controlChannel.Stop();
+    StopReloadThread();
+    m_controllerMonitor.Stop();
+    if (m_pScript != NULL) {
+        delete m_pScript;
+        m_pScript = NULL;
+    }
+    // After the script, whose handlers may still use them while shutting
+    // down
+    for (auto pController : m_controllers) {
+        delete pController;
+    }
+    m_controllers.clear();
+    for (auto pController : m_stoppingControllers) {
+        delete pController;
+    }
+    m_stoppingControllers.clear();
+    for (auto pDevice : m_devices) {
+        delete pDevice;
+    }
+    m_devices.clear();
 }
 
-void CLuaHMDDriver::EnterStandby() {
-    DO_SIMPLE_CALLBACK(TABLE_TRACKDEV, "EnterStandby");
-}
+// Names of the script tables, indexed by CallbackTable_t
+static char const* const g_apchCallbackTables[k_unCallbackTable_Max] = {
+    TABLE_TRACKDEV,
+    TABLE_VRDISP,
+};
 
-void* CLuaHMDDriver::GetComponent(const char* pchComponentNameAndVersion) {
-    if (!_stricmp(pchComponentNameAndVersion, vr::IVRDisplayComponent_Version)) {
-        return (vr::IVRDisplayComponent*)this;
-    }
-    return nullptr;
-}
+// Script methods, indexed by Callback_t
+static struct {
+    CallbackTable_t eTable;
+    char const* pchFunction;
+} const g_aCallbackDefs[k_unCallback_Max] = {
+    { k_unCallbackTable_TrackedDeviceServerDriver, "OnInit" },
+    { k_unCallbackTable_TrackedDeviceServerDriver, "OnShutdown" },
+    { k_unCallbackTable_TrackedDeviceServerDriver, "Activate" },
+    { k_unCallbackTable_TrackedDeviceServerDriver, "Deactivate" },
+    { k_unCallbackTable_TrackedDeviceServerDriver, "EnterStandby" },
+    { k_unCallbackTable_TrackedDeviceServerDriver, "GetPose" },
+    { k_unCallbackTable_TrackedDeviceServerDriver, "OnSeatedZeroPoseReset" },
+    { k_unCallbackTable_TrackedDeviceServerDriver, "GetDevices" },
+    { k_unCallbackTable_TrackedDeviceServerDriver, "GetPoses" },
+    { k_unCallbackTable_VRDisplayComponent, "OnInit" },
+    { k_unCallbackTable_VRDisplayComponent, "OnShutdown" },
+    { k_unCallbackTable_VRDisplayComponent, "GetWindowBounds" },
+    { k_unCallbackTable_VRDisplayComponent, "GetRecommendedRenderTargetSize" },
+    { k_unCallbackTable_VRDisplayComponent, "GetEyeOutputViewport" },
+    { k_unCallbackTable_VRDisplayComponent, "GetDistortion" },
+};
 
-void CLuaHMDDriver::DebugRequest(const char* pchRequest, char* pchResponseBuffer, uint32_t unResponseBufferSize) {
-    if (unResponseBufferSize >= 1) {
-        pchResponseBuffer[0] = 0;
+// Pin the callback tables and every known method into the registry so
+// that calls don't have to look them up by name.
+// Must be called after the script has been executed.
+// [-0, +0, -]
+void CLuaScript::ResolveCallbacks() {
+    for (int i = 0; i < k_unCallbackTable_Max; i++) {
+        lua_getglobal(m_pLua, g_apchCallbackTables[i]); // +1
+        if (lua_istable(m_pLua, -1)) {
+            m_arefCallbackTables[i] = luaL_ref(m_pLua, LUA_REGISTRYINDEX); // -1
+        } else {
+            DriverLog("Script table %s is missing!", g_apchCallbackTables[i]);
+            lua_pop(m_pLua, 1); // -1
+        }
     }
-}
 
-vr::DriverPose_t CLuaHMDDriver::GetPose() {
-    if (m_pLua != NULL) {
-        DriverPose_t pose = { 0 };
-        PushTableFunction(m_pLua, TABLE_TRACKDEV, "GetPose");
-        lua_getglobal(m_pLua, TABLE_TRACKDEV);
-        lua_call(m_pLua, 1, 1);
+    for (int i = 0; i < k_unCallback_Max; i++) {
+        auto const& def = g_aCallbackDefs[i];
+        auto refTable = m_arefCallbackTables[def.eTable];
+        if (refTable == LUA_NOREF) {
+            continue;
+        }
 
-        if (FromLuaTable(m_pLua, pose)) {
-            if (pose.result != TrackingResult_Running_OK) {
-                DriverLog("Tracking result is %d!", pose.result);
-            }
-            return pose;
+        lua_rawgeti(m_pLua, LUA_REGISTRYINDEX, refTable); // +1
+        lua_getfield(m_pLua, -1, def.pchFunction); // +1
+        if (lua_isfunction(m_pLua, -1)) {
+            m_arefCallbacks[i] = luaL_ref(m_pLua, LUA_REGISTRYINDEX); // -1
         } else {
-            return { 0 };
+            DriverLog("Script method %s:%s is not defined", g_apchCallbackTables[def.eTable], def.pchFunction);
+            lua_pop(m_pLua, 1); // -1
         }
+        lua_pop(m_pLua, 1); // -1
     }
-
-    return { 0 };
 }
 
-void CLuaHMDDriver::GetWindowBounds(int32_t* pnX, int32_t* pnY, uint32_t* pnWidth, uint32_t* pnHeight) {
-    if (m_pLua != NULL) {
-        PushTableFunction(m_pLua, TABLE_VRDISP, "GetWindowBounds");
-        lua_getglobal(m_pLua, TABLE_VRDISP);
-        lua_call(m_pLua, 1, 4);
-        *pnX = lua_tonumber(m_pLua, -4);
-        *pnY = lua_tonumber(m_pLua, -3);
-        *pnWidth = lua_tonumber(m_pLua, -2);
-        *pnHeight = lua_tonumber(m_pLua, -1);
-        DriverLog("lua GetWindowBounds returned (%d, %d, %u, %u)", *pnX, *pnY, *pnWidth, *pnHeight);
-        lua_pop(m_pLua, 4);
+// Push a resolved callback and its self argument onto the Lua stack
+// Returns false and pushes nothing if the script doesn't define it.
+// [-0, +2|0, -]
+bool CLuaScript::PushCallback(Callback_t cb) {
+    if (m_pLua == NULL || m_arefCallbacks[cb] == LUA_NOREF) {
+        return false;
     }
-}
 
-bool CLuaHMDDriver::IsDisplayOnDesktop() {
+    lua_rawgeti(m_pLua, LUA_REGISTRYINDEX, m_arefCallbacks[cb]);
+    lua_rawgeti(m_pLua, LUA_REGISTRYINDEX, m_arefCallbackTables[g_aCallbackDefs[cb].eTable]);
     return true;
 }
 
-bool CLuaHMDDriver::IsDisplayRealDisplay() {
-    return false;
+// Call a callback pushed by PushCallback with nArgs extra arguments.
+// On success nResults values are left on the stack and true is returned.
+// On failure the error is logged, the stack is balanced and false is returned.
+// [-(nArgs + 2), +nResults|0, -]
+bool CLuaScript::CallCallback(Callback_t cb, int nArgs, int nResults) {
+    CScopedLatency timer(m_pStats != NULL ? &m_pStats->aCallbacks[cb] : NULL);
+    if (Call(nArgs + 1, nResults) != LUA_OK) {
+        auto const& def = g_aCallbackDefs[cb];
+        DriverLog("script error in %s:%s: %s", g_apchCallbackTables[def.eTable], def.pchFunction, lua_tostring(m_pLua, -1));
+        lua_pop(m_pLua, 1);
+        return false;
+    }
+
+    return true;
 }
 
-void CLuaHMDDriver::GetRecommendedRenderTargetSize(uint32_t* pnWidth, uint32_t* pnHeight) {
-    if (m_pLua != NULL) {
-        PushTableFunction(m_pLua, TABLE_VRDISP, "GetRecommendedRenderTargetSize");
-        lua_getglobal(m_pLua, TABLE_VRDISP);
-        lua_call(m_pLua, 1, 2);
-        *pnWidth = lua_tonumber(m_pLua, -2);
-        *pnHeight = lua_tonumber(m_pLua, -1);
-        DriverLog("lua GetRecommendedRenderTargetSize returned (%u, %u)", *pnWidth, *pnHeight);
-        lua_pop(m_pLua, 4);
+#define DO_SIMPLE_CALLBACK(cb)              \
+    if (PushCallback(cb)) {                 \
+        CallCallback(cb, 0, 0);             \
     }
+
+void CLuaScript::SetExecutionBudget(uint32_t unInstructions, uint32_t unTimeUs) {
+    m_unInstructionBudget = unInstructions;
+    m_unTimeBudgetUs = unTimeUs;
 }
 
-void CLuaHMDDriver::GetEyeOutputViewport(EVREye eEye, uint32_t* pnX, uint32_t* pnY, uint32_t* pnWidth, uint32_t* pnHeight) {
+CLuaScript* CLuaScript::FromState(lua_State* L) {
+    return *(CLuaScript**)lua_getextraspace(L);
+}
+
+// Call the function below nArgs arguments on the stack in protected mode.
+// The outermost call arms the budget hook; calls made by the script back
+// into the driver share the budget of the call that started it all.
+// On failure the error message, with a traceback, is left on the stack.
+// [-(nArgs + 1), +(nResults|1), -]
+int CLuaScript::Call(int nArgs, int nResults) {
+    auto L = m_pLua;
+    auto nHandler = lua_gettop(L) - nArgs;
+    lua_pushcfunction(L, Lua_Traceback);
+    lua_insert(L, nHandler);
+
+    bool bArm = m_nCallDepth++ == 0 && (m_unInstructionBudget > 0 || m_unTimeBudgetUs > 0);
+    if (bArm) {
+        auto nInterval = SCRIPT_HOOK_INTERVAL;
+        if (m_unInstructionBudget > 0 && m_unInstructionBudget < SCRIPT_HOOK_INTERVAL) {
+            nInterval = (int)m_unInstructionBudget;
+        }
+        m_unHookTicks = 0;
+        m_tDeadline = std::chrono::steady_clock::now() + std::chrono::microseconds(m_unTimeBudgetUs);
+        lua_sethook(L, BudgetHook, LUA_MASKCOUNT, nInterval);
+    }
+
+    auto res = lua_pcall(L, nArgs, nResults, nHandler);
+
+    if (bArm) {
+        lua_sethook(L, NULL, 0, 0);
+    }
+    m_nCallDepth--;
+    lua_remove(L, nHandler);
+    return res;
+}
+
+// Count hook: abort the running call once it is over budget
+void CLuaScript::BudgetHook(lua_State* L, lua_Debug*) {
+    auto pScript = FromState(L);
+    pScript->m_unHookTicks++;
+
+    auto unInstructions = pScript->m_unInstructionBudget;
+    if (unInstructions > 0 && (uint64_t)pScript->m_unHookTicks * lua_gethookcount(L) >= unInstructions) {
+        luaL_error(L, "script exceeded its budget of %d instructions", (int)unInstructions);
+    }
+    if (pScript->m_unTimeBudgetUs > 0 && std::chrono::steady_clock::now() >= pScript->m_tDeadline) {
+        luaL_error(L, "script exceeded its budget of %d us", (int)pScript->m_unTimeBudgetUs);
+    }
+}
+
+// Collect the answers to the display queries into m_displayConfig
+// Values the script fails to provide are left as they were.
+void CLuaScript::QueryDisplayConfig() {
+    auto L = m_pLua;
+    auto& config = m_displayConfig;
+    m_bDisplayChanged = false;
+
+    if (PushCallback(k_unCallback_VRDisp_GetWindowBounds) &&
+        CallCallback(k_unCallback_VRDisp_GetWindowBounds, 0, 4)) {
+        config.nWindowX = (int32_t)lua_tonumber(L, -4);
+        config.nWindowY = (int32_t)lua_tonumber(L, -3);
+        config.unWindowWidth = (uint32_t)lua_tonumber(L, -2);
+        config.unWindowHeight = (uint32_t)lua_tonumber(L, -1);
+        lua_pop(L, 4);
+    }
+
+    if (PushCallback(k_unCallback_VRDisp_GetRecommendedRenderTargetSize) &&
+        CallCallback(k_unCallback_VRDisp_GetRecommendedRenderTargetSize, 0, 2)) {
+        config.unRenderWidth = (uint32_t)lua_tonumber(L, -2);
+        config.unRenderHeight = (uint32_t)lua_tonumber(L, -1);
+        lua_pop(L, 2);
+    }
+
+    for (int eye = Eye_Left; eye <= Eye_Right; eye++) {
+        if (PushCallback(k_unCallback_VRDisp_GetEyeOutputViewport)) {
+            lua_pushinteger(L, eye);
+            if (CallCallback(k_unCallback_VRDisp_GetEyeOutputViewport, 1, 4)) {
+                for (int i = 0; i < 4; i++) {
+                    config.aunEyeViewport[eye][i] = (uint32_t)lua_tonumber(L, i - 4);
+                }
+                lua_pop(L, 4);
+            }
+        }
+    }
+
+    DriverLog("Display: window (%d, %d, %u, %u), render target (%u, %u)",
+        config.nWindowX, config.nWindowY, config.unWindowWidth, config.unWindowHeight,
+        config.unRenderWidth, config.unRenderHeight);
+    for (int eye = Eye_Left; eye <= Eye_Right; eye++) {
+        auto const& viewport = config.aunEyeViewport[eye];
+        DriverLog("Display: eye %d viewport (%u, %u, %u, %u)", eye, viewport[0], viewport[1], viewport[2], viewport[3]);
+    }
+}
+
+// Read an optional string field of the table at idx
+// [-0, +0, e]
+static std::string GetStringField(lua_State* L, int idx, const char* pchField, const char* pchDefault) {
+    std::string ret = pchDefault;
+    if (lua_getfield(L, idx, pchField) == LUA_TSTRING) { // +1
+        ret = lua_tostring(L, -1);
+    }
+    lua_pop(L, 1); // -1
+    return ret;
+}
+
+static ETrackedDeviceClass ParseDeviceClass(const std::string& sClass) {
+    if (sClass == "Controller") {
+        return TrackedDeviceClass_Controller;
+    } else if (sClass == "TrackingReference") {
+        return TrackedDeviceClass_TrackingReference;
+    }
+    return TrackedDeviceClass_GenericTracker;
+}
+
+static ETrackedControllerRole ParseControllerRole(const std::string& sRole) {
+    if (sRole == "LeftHand") {
+        return TrackedControllerRole_LeftHand;
+    } else if (sRole == "RightHand") {
+        return TrackedControllerRole_RightHand;
+    }
+    return TrackedControllerRole_Invalid;
+}
+
+// GetDevices() returns an array of
+//   { serial = "...", class = "Controller"|"GenericTracker"|"TrackingReference",
+//     model = "...", renderModel = "...", role = "LeftHand"|"RightHand" }
+// Every device gets a slot in the pose buffer passed to GetPoses(poses).
+void CLuaScript::QueryDevices() {
+    auto L = m_pLua;
+    m_devices.clear();
+
+    if (PushCallback(k_unCallback_TrackDev_GetDevices) &&
+        CallCallback(k_unCallback_TrackDev_GetDevices, 0, 1)) {
+        if (lua_istable(L, -1)) {
+            auto nDevices = (lua_Integer)luaL_len(L, -1);
+            for (lua_Integer i = 1; i <= nDevices; i++) {
+                if (m_devices.size() == SCRIPT_MAX_DEVICES) {
+                    DriverLog("Script declares more than %d devices, ignoring the rest", SCRIPT_MAX_DEVICES);
+                    break;
+                }
+                if (lua_geti(L, -1, i) == LUA_TTABLE) { // +1
+                    ScriptDevice_t dev;
+                    dev.sSerialNumber = GetStringField(L, -1, "serial", "");
+                    dev.sModelNumber = GetStringField(L, -1, "model", "device.vr.easimer.net");
+                    dev.sRenderModel = GetStringField(L, -1, "renderModel", "");
+                    dev.eClass = ParseDeviceClass(GetStringField(L, -1, "class", ""));
+                    dev.eRole = ParseControllerRole(GetStringField(L, -1, "role", ""));
+                    if (dev.sSerialNumber.empty()) {
+                        DriverLog("Device #%d has no serial number, ignoring it", (int)i);
+                    } else {
+                        m_devices.push_back(dev);
+                    }
+                }
+                lua_pop(L, 1); // -1
+            }
+        }
+        lua_pop(L, 1);
+    }
+
+    m_poses.Resize((uint32_t)m_devices.size());
+    PushPoseBuffer(L, &m_poses);
+    m_refPoses = luaL_ref(L, LUA_REGISTRYINDEX);
+    DriverLog("Script drives %u devices besides the HMD", (uint32_t)m_devices.size());
+}
+
+// Read up to n numbers from the array in field pchField of the table at idx
+// [-0, +0, e]
+static void ReadNumberArray(lua_State* L, int idx, const char* pchField, float* pflOut, int n) {
+    if (lua_getfield(L, idx, pchField) == LUA_TTABLE) { // +1
+        for (int i = 0; i < n; i++) {
+            if (lua_geti(L, -1, i + 1) == LUA_TNUMBER) { // +1
+                pflOut[i] = (float)lua_tonumber(L, -1);
+            }
+            lua_pop(L, 1); // -1
+        }
+    }
+    lua_pop(L, 1); // -1
+}
+
+// GetDistortion(eye) may return
+//  - nothing, for no distortion
+//  - a table { center = { u, v }, red = { k1, k2, k3 }, green = ..., blue = ... }
+//    describing radial polynomials, evaluated natively and in parallel
+//  - a function(u, v) returning red u, v, green u, v, blue u, v, which is
+//    called once per grid vertex
+void CLuaScript::BuildDistortionGrid() {
+    static char const* const apchChannels[k_unDistortionChannel_Max] = { "red", "green", "blue" };
+
+    auto L = m_pLua;
+    auto pGrid = std::make_shared<CDistortionGrid>();
+    auto unCells = m_unDistortionSamples > 1 ? m_unDistortionSamples - 1 : 1;
+    pGrid->Resize(unCells);
+
+    DistortionPolynomial_t aPolynomials[2] = {};
+    int arefFunctions[2] = { LUA_NOREF, LUA_NOREF };
+    for (int eye = Eye_Left; eye <= Eye_Right; eye++) {
+        auto& poly = aPolynomials[eye];
+        poly.aflCenter[0] = poly.aflCenter[1] = 0.5f;
+
+        if (!PushCallback(k_unCallback_VRDisp_GetDistortion)) {
+            continue;
+        }
+        lua_pushinteger(L, eye);
+        if (!CallCallback(k_unCallback_VRDisp_GetDistortion, 1, 1)) {
+            continue;
+        }
+
+        if (lua_istable(L, -1)) {
+            ReadNumberArray(L, -1, "center", poly.aflCenter, 2);
+            for (int c = 0; c < k_unDistortionChannel_Max; c++) {
+                ReadNumberArray(L, -1, apchChannels[c], poly.aflK[c], 3);
+            }
+            lua_pop(L, 1);
+        } else if (lua_isfunction(L, -1)) {
+            arefFunctions[eye] = luaL_ref(L, LUA_REGISTRYINDEX);
+        } else {
+            lua_pop(L, 1);
+        }
+    }
+
+    pGrid->BuildPolynomial(aPolynomials);
+
+    // Script-evaluated distortion has to go through the one Lua state
+    for (int eye = Eye_Left; eye <= Eye_Right; eye++) {
+        if (arefFunctions[eye] == LUA_NOREF) {
+            continue;
+        }
+
+        DriverLog("Evaluating distortion function of eye %d on a %ux%u grid", eye, unCells + 1, unCells + 1);
+        bool bOK = true;
+        for (uint32_t y = 0; y <= unCells && bOK; y++) {
+            for (uint32_t x = 0; x <= unCells; x++) {
+                lua_rawgeti(L, LUA_REGISTRYINDEX, arefFunctions[eye]);
+                lua_pushnumber(L, (lua_Number)x / unCells);
+                lua_pushnumber(L, (lua_Number)y / unCells);
+                if (Call(2, 6) != LUA_OK) {
+                    DriverLog("script error in distortion function: %s", lua_tostring(L, -1));
+                    lua_pop(L, 1);
+                    bOK = false;
+                    break;
+                }
+                DistortionCoordinates_t coords;
+                coords.rfRed[0] = (float)lua_tonumber(L, -6);
+                coords.rfRed[1] = (float)lua_tonumber(L, -5);
+                coords.rfGreen[0] = (float)lua_tonumber(L, -4);
+                coords.rfGreen[1] = (float)lua_tonumber(L, -3);
+                coords.rfBlue[0] = (float)lua_tonumber(L, -2);
+                coords.rfBlue[1] = (float)lua_tonumber(L, -1);
+                lua_pop(L, 6);
+                pGrid->SetVertex((EVREye)eye, x, y, coords);
+            }
+        }
+        luaL_unref(L, LUA_REGISTRYINDEX, arefFunctions[eye]);
+        if (!bOK) {
+            // Don't leave the eye half distorted
+            pGrid->BuildPolynomial((EVREye)eye, aPolynomials[eye]);
+        }
+    }
+
+    m_pDistortion = pGrid;
+}
+
+void CLuaScript::SetHandler(HandlerType_t type, int refHandler) {
+    m_arefHandlers[type] = refHandler;
+    DriverLog("Handler #%d set to %d", type, refHandler);
+}
+
+CLuaScript::~CLuaScript() {
+    DriverLog("Unloading script...");
+    Shutdown();
     if (m_pLua != NULL) {
-        PushTableFunction(m_pLua, TABLE_VRDISP, "GetEyeOutputViewport");
-        lua_getglobal(m_pLua, TABLE_VRDISP);
-        lua_pushnumber(m_pLua, eEye);
-        lua_call(m_pLua, 2, 4);
-        *pnX = (int32_t)lua_tonumber(m_pLua, -4);
-        *pnY = (int32_t)lua_tonumber(m_pLua, -3);
-        *pnWidth = (uint32_t)lua_tonumber(m_pLua, -2);
-        *pnHeight = (uint32_t)lua_tonumber(m_pLua, -1);
-        DriverLog("lua GetEyeOutputViewport returned (%d, %d, %u, %u) for eye %d", *pnX, *pnY, *pnWidth, *pnHeight, eEye);
-        lua_pop(m_pLua, 4);
+        // Everything goes back in bulk when m_allocator is destroyed
+        m_allocator.BeginTeardown();
+        lua_close(m_pLua);
+        m_pLua = NULL;
+    }
+}
+
+void CLuaScript::Shutdown() {
+    for (auto pSC : m_controllers) {
+        pSC->GetController()->SetHandler(NULL);
+        delete pSC;
+    }
+    m_controllers.clear();
+    if (m_pLua != NULL && m_bInitialized) {
+        m_bInitialized = false;
+        DO_SIMPLE_CALLBACK(k_unCallback_VRDisp_OnShutdown);
+        DO_SIMPLE_CALLBACK(k_unCallback_TrackDev_OnShutdown);
+    }
+}
+
+// Leave collection entirely to StepGC and FullGC
+void CLuaScript::StopAutomaticGC() {
+    lua_gc(m_pLua, LUA_GCSTOP, 0);
+}
+
+// Hand collection back to Lua's incremental collector
+void CLuaScript::RestartAutomaticGC() {
+    lua_gc(m_pLua, LUA_GCRESTART, 0);
+}
+
+// Run incremental collection steps until the budget is spent or the
+// current cycle finishes
+// Returns the time spent in microseconds.
+uint32_t CLuaScript::StepGC(uint32_t unBudgetUs, int nStepSize) {
+    auto tStart = std::chrono::steady_clock::now();
+    auto tDeadline = tStart + std::chrono::microseconds(unBudgetUs);
+    auto tNow = tStart;
+
+    do {
+        if (lua_gc(m_pLua, LUA_GCSTEP, nStepSize)) {
+            break;
+        }
+        tNow = std::chrono::steady_clock::now();
+    } while (tNow < tDeadline);
+    tNow = std::chrono::steady_clock::now();
+
+    return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(tNow - tStart).count();
+}
+
+void CLuaScript::FullGC() {
+    lua_gc(m_pLua, LUA_GCCOLLECT, 0);
+}
+
+size_t CLuaScript::GetHeapSize() const {
+    return ((size_t)lua_gc(m_pLua, LUA_GCCOUNT, 0) << 10) + lua_gc(m_pLua, LUA_GCCOUNTB, 0);
+}
+
+bool CLuaScript::Load(const std::string& sPath) {
+    DriverLog("Creating Lua state");
+    m_pLua = lua_newstate(CLuaAllocator::Alloc, &m_allocator);
+    if (m_pLua == NULL) {
+        DriverLog("Failed to create Lua state!");
+        return false;
+    }
+    *(CLuaScript**)lua_getextraspace(m_pLua) = this;
+
+    DriverLog("Loading script...");
+    if (!InitializeLuaState(m_pLua, sPath)) {
+        return false;
+    }
+
+    ResolveCallbacks();
+
+    m_pLuaPose = NewDriverPose(m_pLua);
+    m_refPose = luaL_ref(m_pLua, LUA_REGISTRYINDEX);
+
+    // Asking script to register it's handlers
+    // We pass in the pointer to this instance and the function
+    // will pass it back to us by calling RegisterHandler
+    lua_getglobal(m_pLua, "API_RegisterHandlers");
+    lua_pushlightuserdata(m_pLua, this);
+    if (Call(1, 0) != LUA_OK) {
+        DriverLog("API_RegisterHandlers failed: %s", lua_tostring(m_pLua, -1));
+        return false;
+    }
+
+    DO_SIMPLE_CALLBACK(k_unCallback_TrackDev_OnInit);
+    DO_SIMPLE_CALLBACK(k_unCallback_VRDisp_OnInit);
+    m_bInitialized = true;
+
+    QueryDisplayConfig();
+    BuildDistortionGrid();
+    QueryDevices();
+
+    DriverLog("Script has been loaded!");
+    return true;
+}
+
+bool CLuaScript::HasControllerHandler() const {
+    return m_arefHandlers[k_unHandlerType_SteamController] != LUA_NOREF;
+}
+
+void CLuaScript::AttachController(CDriverController* pController) {
+    // Every instance unreferences its method table when it goes away
+    lua_rawgeti(m_pLua, LUA_REGISTRYINDEX, m_arefHandlers[k_unHandlerType_SteamController]);
+    auto refMethodTable = luaL_ref(m_pLua, LUA_REGISTRYINDEX);
+    auto pHandler = new ISteamController(m_pLua, refMethodTable, pController);
+    m_controllers.push_back(pHandler);
+    pController->SetHandler(pHandler);
+}
+
+void CLuaScript::DetachController(CDriverController* pController) {
+    for (auto it = m_controllers.begin(); it != m_controllers.end(); ++it) {
+        if ((*it)->GetController() == pController) {
+            pController->SetHandler(NULL);
+            delete *it;
+            m_controllers.erase(it);
+            return;
+        }
+    }
+}
+
+// Push a callback of the live script
+// [-0, +2|0, -]
+bool CLuaHMDDriver::PushCallback(Callback_t cb) {
+    return m_pScript != NULL && m_pScript->PushCallback(cb);
+}
+
+// Call a callback of the live script pushed by PushCallback
+// [-(nArgs + 2), +nResults|0, -]
+bool CLuaHMDDriver::CallCallback(Callback_t cb, int nArgs, int nResults) {
+    return m_pScript->CallCallback(cb, nArgs, nResults);
+}
+
+EVRInitError CLuaHMDDriver::Activate(uint32_t unObjectId) {
+    EVRInitError ret = VRInitError_Init_Internal;
+
+    m_unObjectId = unObjectId;
+    m_ulPropertyContainer = VRProperties()->TrackedDeviceToPropertyContainer(m_unObjectId);
+
+    VRProperties()->SetStringProperty(m_ulPropertyContainer, Prop_ModelNumber_String, m_sModelNumber.c_str());
+    VRProperties()->SetStringProperty(m_ulPropertyContainer, Prop_RenderModelName_String, m_sModelNumber.c_str());
+    VRProperties()->SetFloatProperty(m_ulPropertyContainer, Prop_UserIpdMeters_Float, 0.063f);
+    VRProperties()->SetFloatProperty(m_ulPropertyContainer, Prop_UserHeadToEyeDepthMeters_Float, 0.0f);
+    VRProperties()->SetFloatProperty(m_ulPropertyContainer, Prop_DisplayFrequency_Float, 60.0f);
+    VRProperties()->SetFloatProperty(m_ulPropertyContainer, Prop_SecondsFromVsyncToPhotons_Float, 0.1f);
+    m_predictor.SetPhotonLatency(VRProperties()->GetFloatProperty(m_ulPropertyContainer, Prop_SecondsFromVsyncToPhotons_Float));
+    VRProperties()->SetUint64Property(m_ulPropertyContainer, Prop_CurrentUniverseId_Uint64, 2);
+    VRProperties()->SetBoolProperty(m_ulPropertyContainer, Prop_IsOnDesktop_Bool, false);
+    // Have the compositor sample exactly at the vertices of the lookup grid
+    VRProperties()->SetInt32Property(m_ulPropertyContainer, Prop_DistortionMeshResolution_Int32, (int32_t)m_unDistortionSamples);
+
+    if (m_inputBinding.GetDevice().empty() || m_inputBinding.GetDevice() == m_sSerialNumber) {
+        m_inputBinding.CreateComponents(m_ulPropertyContainer);
+    }
+
+    if (m_bThreaded) {
+        // The script can't refuse anymore; a refusal is only logged
+        return PushScriptRequest(k_unScriptRequest_Activate, unObjectId) ? vr::VRInitError_None : ret;
+    }
+    return ScriptActivate(unObjectId) ? vr::VRInitError_None : ret;
+}
+
+// Must be called by the thread that owns the live script.
+bool CLuaHMDDriver::ScriptActivate(uint32_t unObjectId) {
+    bool bActivated = false;
+    if (PushCallback(k_unCallback_TrackDev_Activate)) {
+        auto L = m_pScript->m_pLua;
+        lua_pushinteger(L, unObjectId);
+        if (CallCallback(k_unCallback_TrackDev_Activate, 1, 1)) {
+            bActivated = lua_toboolean(L, -1) != 0;
+            lua_pop(L, 1);
+        }
+    }
+    return bActivated;
+}
+
+void CLuaHMDDriver::Deactivate() {
+    if (m_bThreaded) {
+        PushScriptRequest(k_unScriptRequest_Deactivate);
+    } else {
+        ScriptDeactivate();
+    }
+
+    if (m_inputBinding.GetDevice().empty() || m_inputBinding.GetDevice() == m_sSerialNumber) {
+        m_inputBinding.DestroyComponents();
+    }
+    m_unObjectId = k_unTrackedDeviceIndexInvalid;
+}
+
+// Must be called by the thread that owns the live script.
+void CLuaHMDDriver::ScriptDeactivate() {
+    DO_SIMPLE_CALLBACK(k_unCallback_TrackDev_Deactivate);
+}
+
+void CLuaHMDDriver::EnterStandby() {
+    if (m_bThreaded) {
+        PushScriptRequest(k_unScriptRequest_EnterStandby);
+    } else {
+        ScriptEnterStandby();
+    }
+}
+
+// Must be called by the thread that owns the live script.
+void CLuaHMDDriver::ScriptEnterStandby() {
+    DO_SIMPLE_CALLBACK(k_unCallback_TrackDev_EnterStandby);
+
+    // Nobody is waiting on frames now; clear out the whole heap
+    if (m_pScript != NULL) {
+        m_pScript->FullGC();
+    }
+}
+
+// Queue a device call for the script thread
+bool CLuaHMDDriver::PushScriptRequest(ScriptRequestType_t eType, uint32_t unObjectId) {
+    ScriptRequest_t request = { eType, unObjectId };
+    if (!m_queueRequests.Push(request)) {
+        DriverLog("Script request queue is full, dropping request %d", eType);
+        return false;
+    }
+    m_cvFrame.notify_one();
+    return true;
+}
+
+// Run a device call queued by the server thread
+// Must be called by the script thread.
+void CLuaHMDDriver::HandleScriptRequest(const ScriptRequest_t& request) {
+    switch (request.eType) {
+    case k_unScriptRequest_Activate:
+        if (!ScriptActivate(request.unObjectId)) {
+            DriverLogAt(DRIVERLOG_SEVERITY_ERROR, "Script failed to activate device %u", request.unObjectId);
+        }
+        break;
+    case k_unScriptRequest_Deactivate:
+        ScriptDeactivate();
+        break;
+    case k_unScriptRequest_EnterStandby:
+        ScriptEnterStandby();
+        break;
+    case k_unScriptRequest_ResetStats:
+        ClearStats();
+        break;
+    }
+}
+
+void* CLuaHMDDriver::GetComponent(const char* pchComponentNameAndVersion) {
+    if (!_stricmp(pchComponentNameAndVersion, vr::IVRDisplayComponent_Version)) {
+        return (vr::IVRDisplayComponent*)this;
+    }
+    return nullptr;
+}
+
+void CLuaHMDDriver::DebugRequest(const char* pchRequest, char* pchResponseBuffer, uint32_t unResponseBufferSize) {
+    if (unResponseBufferSize >= 1) {
+        pchResponseBuffer[0] = 0;
+    }
+
+    std::string sResponse;
+    if (strcmp(pchRequest, "stats") == 0) {
+        if (m_bThreaded) {
+            std::lock_guard<std::mutex> lock(m_mtxStats);
+            sResponse = m_sStatsSnapshot;
+        } else {
+            sResponse = FormatStatsJSON();
+        }
+    } else if (strcmp(pchRequest, "reset") == 0) {
+        if (m_bThreaded) {
+            PushScriptRequest(k_unScriptRequest_ResetStats);
+        } else {
+            ClearStats();
+        }
+        sResponse = "{\"reset\":true}";
+    } else {
+        return;
+    }
+
+    if (sResponse.size() < unResponseBufferSize) {
+        memcpy(pchResponseBuffer, sResponse.c_str(), sResponse.size() + 1);
+    } else {
+        snprintf(pchResponseBuffer, unResponseBufferSize, "{\"error\":\"response needs %u bytes\"}", (uint32_t)sResponse.size() + 1);
+    }
+}
+
+// Append "name":{...} describing a histogram, in microseconds
+static void AppendHistogramJSON(std::string& sOut, const char* pchName, const CLatencyHistogram& hist) {
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+        "\"%s\":{\"count\":%llu,\"mean_us\":%.3f,\"p50_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f},",
+        pchName, (unsigned long long)hist.Count(),
+        hist.Mean() / 1000.0, hist.Percentile(0.5) / 1000.0, hist.Percentile(0.99) / 1000.0, hist.Max() / 1000.0);
+    sOut += buf;
+}
+
+// Must be called by the thread that owns the live script.
+std::string CLuaHMDDriver::FormatStatsJSON() {
+    std::string sOut = "{\"calls\":{";
+    for (int i = 0; i < k_unCallback_Max; i++) {
+        auto const& def = g_aCallbackDefs[i];
+        auto sName = std::string(g_apchCallbackTables[def.eTable]) + "." + def.pchFunction;
+        AppendHistogramJSON(sOut, sName.c_str(), m_stats.aCallbacks[i]);
+    }
+    AppendHistogramJSON(sOut, TABLE_CONTROL ".OnUpdate", m_stats.onUpdate);
+    AppendHistogramJSON(sOut, "Reload", m_stats.reload);
+    sOut.back() = '}';
+
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+        ",\"gc\":{\"budget_us\":%u,\"last_us\":%u,\"max_us\":%u,\"mean_us\":%.1f,\"heap_bytes\":%zu}",
+        m_unGCBudgetUs,
+        m_gcStats.unLastFrameUs, m_gcStats.unMaxFrameUs,
+        m_gcStats.ulFrames > 0 ? (double)m_gcStats.ulTotalUs / m_gcStats.ulFrames : 0.0,
+        m_gcStats.unHeapBytes);
+    sOut += buf;
+
+    if (m_pScript != NULL) {
+        LuaAllocatorStats_t stats;
+        m_pScript->m_allocator.GetStats(stats);
+        snprintf(buf, sizeof(buf),
+            ",\"alloc\":{\"live_bytes\":%zu,\"peak_bytes\":%zu,\"reserved_bytes\":%zu,\"allocations\":%llu,\"last_frame_allocations\":%u}",
+            stats.unLiveBytes, stats.unPeakBytes, stats.unReservedBytes,
+            (unsigned long long)stats.ulAllocations, stats.unLastFrameAllocations);
+        sOut += buf;
+    }
+
+    // Summed over all controllers
+    SteamControllerStats_t total = { 0, 0, 0 };
+    for (auto pSC : m_controllers) {
+        SteamControllerStats_t controller;
+        pSC->GetStats(controller);
+        total.ulReceived += controller.ulReceived;
+        total.ulDropped += controller.ulDropped;
+        total.ulCoalesced += controller.ulCoalesced;
+    }
+    snprintf(buf, sizeof(buf),
+        ",\"controller\":{\"count\":%zu,\"received\":%llu,\"dropped\":%llu,\"coalesced\":%llu}",
+        m_controllers.size(),
+        (unsigned long long)total.ulReceived,
+        (unsigned long long)total.ulDropped,
+        (unsigned long long)total.ulCoalesced);
+    sOut += buf;
+
+    sOut += "}";
+    return sOut;
+}
+
+// Must be called by the thread that owns the live script.
+void CLuaHMDDriver::ClearStats() {
+    for (int i = 0; i < k_unCallback_Max; i++) {
+        m_stats.aCallbacks[i].Reset();
+    }
+    m_stats.onUpdate.Reset();
+    m_stats.reload.Reset();
+
+    auto unHeapBytes = m_gcStats.unHeapBytes;
+    memset(&m_gcStats, 0, sizeof(m_gcStats));
+    m_gcStats.unHeapBytes = unHeapBytes;
+}
+
+vr::DriverPose_t CLuaHMDDriver::GetPose() {
+    if (m_bThreaded) {
+        std::lock_guard<std::mutex> lock(m_mtxServerFrame);
+        return m_serverFrame.hmd;
+    }
+
+    return ScriptGetPose();
+}
+
+vr::DriverPose_t CLuaHMDDriver::ScriptGetPose() {
+    if (m_bShmPoseDirect) {
+        DriverPose_t pose;
+        if (m_shmPoseSource.GetPose(m_shmPoseSource.GetDelay(), pose)) {
+            if (pose.poseIsValid) {
+                m_lastGoodPose = pose;
+            }
+            return pose;
+        }
+        // Nothing written yet; the script is the fallback
+    }
+
+    if (PushCallback(k_unCallback_TrackDev_GetPose)) {
+        auto L = m_pScript->m_pLua;
+        DriverPose_t pose = { 0 };
+        // The script fills the persistent pose userdata in place;
+        // returning a table is still supported but allocates every frame.
+        lua_rawgeti(L, LUA_REGISTRYINDEX, m_pScript->m_refPose);
+        m_pScript->SetReadSharedMemoryPose(false);
+        if (CallCallback(k_unCallback_TrackDev_GetPose, 1, 1)) {
+            bool bOK;
+            if (lua_istable(L, -1)) {
+                bOK = FromLuaTable(L, pose);
+            } else {
+                lua_pop(L, 1);
+                pose = *m_pScript->m_pLuaPose;
+                bOK = true;
+            }
+
+            if (bOK) {
+                if (pose.result != TrackingResult_Running_OK) {
+                    DriverLogEvery(DRIVERLOG_SEVERITY_WARNING, 1000, "Tracking result is %d!", pose.result);
+                }
+                if (pose.poseIsValid) {
+                    m_lastGoodPose = pose;
+                }
+                // The predictor knows the controller only; don't replace
+                // what an external tracker reported
+                if (m_bGyroPrediction && !m_pScript->ReadSharedMemoryPose()) {
+                    m_predictor.Apply(pose, CPosePredictor::clock::now());
+                }
+                return pose;
+            }
+        }
+
+        // The script failed or ran over its budget: hold the last pose
+        // the script got right
+        auto fallback = m_lastGoodPose;
+        if (fallback.poseIsValid) {
+            fallback.result = TrackingResult_Fallback_RotationOnly;
+        }
+        // Don't let the server extrapolate a pose that is standing still
+        for (int i = 0; i < 3; i++) {
+            fallback.vecVelocity[i] = fallback.vecAcceleration[i] = 0;
+            fallback.vecAngularVelocity[i] = fallback.vecAngularAcceleration[i] = 0;
+        }
+        return fallback;
     }
+
+    return { 0 };
+}
+
+// Fill the device poses of m_frame with a single call to GetPoses(poses)
+// Must be called by the thread that owns the live script.
+void CLuaHMDDriver::ScriptGetDevicePoses() {
+    if (m_devices.empty() || m_pScript == NULL) {
+        return;
+    }
+
+    // Without GetPoses the buffer keeps whatever the script put there
+    bool bOK = true;
+    if (PushCallback(k_unCallback_TrackDev_GetPoses)) {
+        lua_rawgeti(m_pScript->m_pLua, LUA_REGISTRYINDEX, m_pScript->m_refPoses);
+        bOK = CallCallback(k_unCallback_TrackDev_GetPoses, 1, 0);
+    }
+
+    for (uint32_t i = 0; i < m_frame.unDevices; i++) {
+        auto& pose = m_frame.aDevices[i];
+        auto nSlot = m_anDeviceSlots[i];
+        if (nSlot < 0) {
+            pose.poseIsValid = false;
+            pose.deviceIsConnected = false;
+        } else if (bOK) {
+            m_pScript->m_poses.GetPose((uint32_t)nSlot, pose);
+        } else {
+            // Hold the previous pose, like ScriptGetPose does
+            if (pose.poseIsValid) {
+                pose.result = TrackingResult_Fallback_RotationOnly;
+            }
+            for (int k = 0; k < 3; k++) {
+                pose.vecVelocity[k] = pose.vecAngularVelocity[k] = 0;
+            }
+        }
+    }
+}
+
+// Hand every pose of a frame to the server
+void CLuaHMDDriver::SubmitPoses(const PoseFrame_t& frame) {
+    auto pHost = VRServerDriverHost();
+    pHost->TrackedDevicePoseUpdated(m_unObjectId, frame.hmd, sizeof(DriverPose_t));
+    for (uint32_t i = 0; i < frame.unDevices; i++) {
+        auto unObjectId = m_devices[i]->GetObjectId();
+        if (unObjectId != k_unTrackedDeviceIndexInvalid) {
+            pHost->TrackedDevicePoseUpdated(unObjectId, frame.aDevices[i], sizeof(DriverPose_t));
+        }
+    }
+}
+
+// Find the pose buffer slot of every device in a newly live script
+void CLuaHMDDriver::MapDevices(const CLuaScript* pScript) {
+    for (uint32_t i = 0; i < m_devices.size(); i++) {
+        auto const& sSerial = m_devices[i]->GetDesc().sSerialNumber;
+        m_anDeviceSlots[i] = -1;
+        for (uint32_t j = 0; j < pScript->m_devices.size(); j++) {
+            if (pScript->m_devices[j].sSerialNumber == sSerial) {
+                m_anDeviceSlots[i] = (int)j;
+                break;
+            }
+        }
+        if (m_anDeviceSlots[i] < 0) {
+            DriverLog("Script no longer declares device %s, reporting it disconnected", sSerial.c_str());
+        }
+    }
+}
+
+vr::DriverPose_t CLuaHMDDriver::GetDevicePose(uint32_t unIndex) {
+    if (m_bThreaded) {
+        std::lock_guard<std::mutex> lock(m_mtxServerFrame);
+        return m_serverFrame.aDevices[unIndex];
+    }
+    return m_frame.aDevices[unIndex];
+}
+
+CLuaTrackedDevice::CLuaTrackedDevice(CLuaHMDDriver* pHost, uint32_t unIndex, const ScriptDevice_t& desc) :
+    m_pHost(pHost),
+    m_unIndex(unIndex),
+    m_desc(desc),
+    m_unObjectId(k_unTrackedDeviceIndexInvalid) {
+}
+
+EVRInitError CLuaTrackedDevice::Activate(uint32_t unObjectId) {
+    m_unObjectId = unObjectId;
+    auto ulContainer = VRProperties()->TrackedDeviceToPropertyContainer(unObjectId);
+
+    VRProperties()->SetStringProperty(ulContainer, Prop_ModelNumber_String, m_desc.sModelNumber.c_str());
+    if (!m_desc.sRenderModel.empty()) {
+        VRProperties()->SetStringProperty(ulContainer, Prop_RenderModelName_String, m_desc.sRenderModel.c_str());
+    }
+    if (m_desc.eRole != TrackedControllerRole_Invalid) {
+        VRProperties()->SetInt32Property(ulContainer, Prop_ControllerRoleHint_Int32, m_desc.eRole);
+    }
+    if (m_pHost->GetInputBinding().GetDevice() == m_desc.sSerialNumber) {
+        m_pHost->GetInputBinding().CreateComponents(ulContainer);
+    }
+
+    DriverLog("Activated device %s as object %u", m_desc.sSerialNumber.c_str(), unObjectId);
+    return VRInitError_None;
+}
+
+void CLuaTrackedDevice::Deactivate() {
+    if (m_pHost->GetInputBinding().GetDevice() == m_desc.sSerialNumber) {
+        m_pHost->GetInputBinding().DestroyComponents();
+    }
+    m_unObjectId = k_unTrackedDeviceIndexInvalid;
+}
+
+void CLuaTrackedDevice::DebugRequest(const char*, char* pchResponseBuffer, uint32_t unResponseBufferSize) {
+    if (unResponseBufferSize >= 1) {
+        pchResponseBuffer[0] = 0;
+    }
+}
+
+vr::DriverPose_t CLuaTrackedDevice::GetPose() {
+    return m_pHost->GetDevicePose(m_unIndex);
+}
+
+void CLuaHMDDriver::GetWindowBounds(int32_t* pnX, int32_t* pnY, uint32_t* pnWidth, uint32_t* pnHeight) {
+    std::lock_guard<std::mutex> lock(m_mtxDisplay);
+    *pnX = m_displayConfig.nWindowX;
+    *pnY = m_displayConfig.nWindowY;
+    *pnWidth = m_displayConfig.unWindowWidth;
+    *pnHeight = m_displayConfig.unWindowHeight;
+}
+
+bool CLuaHMDDriver::IsDisplayOnDesktop() {
+    return true;
+}
+
+bool CLuaHMDDriver::IsDisplayRealDisplay() {
+    return false;
+}
+
+void CLuaHMDDriver::GetRecommendedRenderTargetSize(uint32_t* pnWidth, uint32_t* pnHeight) {
+    std::lock_guard<std::mutex> lock(m_mtxDisplay);
+    *pnWidth = m_displayConfig.unRenderWidth;
+    *pnHeight = m_displayConfig.unRenderHeight;
+}
+
+void CLuaHMDDriver::GetEyeOutputViewport(EVREye eEye, uint32_t* pnX, uint32_t* pnY, uint32_t* pnWidth, uint32_t* pnHeight) {
+    std::lock_guard<std::mutex> lock(m_mtxDisplay);
+    auto const& viewport = m_displayConfig.aunEyeViewport[eEye == Eye_Right ? 1 : 0];
+    *pnX = viewport[0];
+    *pnY = viewport[1];
+    *pnWidth = viewport[2];
+    *pnHeight = viewport[3];
 }
 
 void CLuaHMDDriver::GetProjectionRaw(EVREye eEye, float* pfLeft, float* pfRight, float* pfTop, float* pfBottom) {
@@ -530,6 +1927,15 @@ void CLuaHMDDriver::GetProjectionRaw(EVREye eEye, float* pfLeft, float* pfRight,
 }
 
 DistortionCoordinates_t CLuaHMDDriver::ComputeDistortion(EVREye eEye, float fU, float fV) {
+    std::shared_ptr<const CDistortionGrid> pGrid;
+    {
+        std::lock_guard<std::mutex> lock(m_mtxDisplay);
+        pGrid = m_pDistortion;
+    }
+    if (pGrid) {
+        return pGrid->Lookup(eEye, fU, fV);
+    }
+
     DistortionCoordinates_t coordinates;
     coordinates.rfBlue[0] = fU;
     coordinates.rfBlue[1] = fV;
@@ -540,93 +1946,652 @@ DistortionCoordinates_t CLuaHMDDriver::ComputeDistortion(EVREye eEye, float fU,
     return coordinates;
 }
 
+void CLuaHMDDriver::PumpSteamController() {
+    ControllerChange_t change;
+    while (m_controllerMonitor.PollChange(change)) {
+        if (change.bAdded) {
+            auto pController = new CDriverController(change.pDevice, change.unId);
+            m_controllers.push_back(pController);
+            if (m_pScript != NULL && m_pScript->HasControllerHandler()) {
+                m_pScript->AttachController(pController);
+            }
+            continue;
+        }
+        for (size_t i = 0; i < m_controllers.size(); i++) {
+            if (m_controllers[i]->GetId() == change.unId) {
+                if (m_controllers[i]->IsConnected()) {
+                    m_controllers[i]->OnDisconnect();
+                }
+                RemoveController(i);
+                break;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < m_controllers.size();) {
+        auto pSC = m_controllers[i];
+        // The HMD is tracked by the controller attached first
+        pSC->SetPredictor(i == 0 && m_bGyroPrediction ? &m_predictor : NULL);
+        pSC->SetInputBinding(i == m_inputBinding.GetController() ? &m_inputBinding : NULL);
+        pSC->SetCoalesceUpdates(m_bCoalesceUpdates);
+        pSC->RunFrames();
+        if (pSC->UserRequestedReload()) {
+            DriverLog("User requested script reload through Steam Controller");
+            RequestReload();
+        }
+        if (!pSC->IsConnected()) {
+            // Closed after a wireless disconnect; the monitor opens it
+            // again once it is back
+            m_controllerMonitor.Release(pSC->GetId());
+            RemoveController(i);
+            continue;
+        }
+        i++;
+    }
+
+    for (auto it = m_stoppingControllers.begin(); it != m_stoppingControllers.end();) {
+        if ((*it)->IsReaderStopped()) {
+            delete *it;
+            it = m_stoppingControllers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Drop a controller along with its handler instance. Its reader thread
+// may still be blocked on the device; the controller is destroyed by a
+// later PumpSteamController once the thread has finished.
+void CLuaHMDDriver::RemoveController(size_t unIndex) {
+    auto pController = m_controllers[unIndex];
+    if (m_pScript != NULL) {
+        m_pScript->DetachController(pController);
+    }
+    pController->RequestStop();
+    m_stoppingControllers.push_back(pController);
+    m_controllers.erase(m_controllers.begin() + unIndex);
+    if (unIndex == 0) {
+        m_predictor.Reset();
+    }
+}
+
+void CLuaHMDDriver::HandleVREvent(const vr::VREvent_t& vrEvent) {
+    if (vrEvent.eventType == VREvent_SeatedZeroPoseReset) {
+        DriverLog("SeatedZeroPoseReset!");
+        DO_SIMPLE_CALLBACK(k_unCallback_TrackDev_OnSeatedZeroPoseReset);
+    }
+}
+
 void CLuaHMDDriver::RunFrame() {
     vr::VREvent_t vrEvent;
 
-    if (m_pLuaSteamController != NULL) {
-        auto pSC = (ISteamController*)m_pLuaSteamController;
-        if (pSC) {
-            pSC->RunFrames();
-            if (pSC->UserRequestedReload()) {
-                DriverLog("User requested script reload through Steam Controller");
-                Reload();
+    if (m_bThreaded) {
+        // Hand events over to the script thread; never wait for it
+        while (vr::VRServerDriverHost()->PollNextEvent(&vrEvent, sizeof(vrEvent))) {
+            if (vrEvent.eventType == VREvent_SeatedZeroPoseReset) {
+                if (!m_queueVREvents.Push(vrEvent)) {
+                    DriverLog("Script event queue is full, dropping event %u", vrEvent.eventType);
+                }
             }
-        } else {
-            DriverLog("ISteamController* conversion failed?");
         }
+
+        m_unFrameCounter.fetch_add(1, std::memory_order_release);
+        m_cvFrame.notify_one();
+
+        // Latest poses published by the script thread
+        {
+            auto const& frame = m_poseMailbox.Read();
+            std::lock_guard<std::mutex> lock(m_mtxServerFrame);
+            m_serverFrame = frame;
+        }
+        SubmitPoses(m_serverFrame);
+        return;
     }
 
+    BeginFrameTelemetry();
+
+    SwapPendingScript();
+    MarkStage(k_unControlStage_SwapScript);
+
+    PumpSteamController();
+    MarkStage(k_unControlStage_Controllers);
+
     while (vr::VRServerDriverHost()->PollNextEvent(&vrEvent, sizeof(vrEvent))) {
-        if (vrEvent.eventType == VREvent_SeatedZeroPoseReset) {
-            DriverLog("SeatedZeroPoseReset!");
-            DO_SIMPLE_CALLBACK(TABLE_TRACKDEV, "OnSeatedZeroPoseReset");
+        HandleVREvent(vrEvent);
+    }
+    MarkStage(k_unControlStage_Events);
+
+    m_frame.hmd = ScriptGetPose();
+    MarkStage(k_unControlStage_GetPose);
+    ScriptGetDevicePoses();
+    MarkStage(k_unControlStage_DevicePoses);
+    SubmitPoses(m_frame);
+    MarkStage(k_unControlStage_Submit);
+
+    EndScriptFrame();
+    MarkStage(k_unControlStage_GC);
+
+    PumpControlChannel();
+}
+
+void CLuaHMDDriver::PublishDisplay(const CLuaScript* pScript) {
+    std::lock_guard<std::mutex> lock(m_mtxDisplay);
+    m_displayConfig = pScript->m_displayConfig;
+    m_pDistortion = pScript->m_pDistortion;
+}
+
+// Create an empty script instance set up according to the driver settings
+CLuaScript* CLuaHMDDriver::CreateScript() {
+    auto pScript = new CLuaScript();
+    pScript->SetExecutionBudget(m_unInstructionBudget, m_unTimeBudgetUs);
+    pScript->SetStats(&m_stats);
+    pScript->SetDistortionResolution(m_unDistortionSamples);
+    return pScript;
+}
+
+// Set up a freshly loaded script according to the driver settings
+// Must be called by the thread that owns the live script, before the
+// script goes live.
+void CLuaHMDDriver::PrepareScript(CLuaScript* pScript) {
+    // Only the thread owning the live script may read it
+    pScript->SetPoseSource(&m_shmPoseSource);
+    if (m_unGCBudgetUs > 0) {
+        pScript->StopAutomaticGC();
+    }
+}
+
+// Spend this frame's GC budget and close the frame's allocation counters,
+// after the pose has been handed over
+// Must be called by the thread that owns the live script.
+void CLuaHMDDriver::EndScriptFrame() {
+    if (m_pScript == NULL) {
+        return;
+    }
+
+    m_pScript->m_allocator.EndFrame();
+
+    if (m_pScript->m_bDisplayChanged) {
+        DriverLog("Script changed the display configuration");
+        m_pScript->QueryDisplayConfig();
+        PublishDisplay(m_pScript);
+    }
+
+    if (m_unGCBudgetUs > 0) {
+        auto unTime = m_pScript->StepGC(m_unGCBudgetUs, m_nGCStepSize);
+        m_gcStats.unLastFrameUs = unTime;
+        if (unTime > m_gcStats.unMaxFrameUs) {
+            m_gcStats.unMaxFrameUs = unTime;
         }
+        m_gcStats.ulTotalUs += unTime;
+        m_gcStats.ulFrames++;
     }
+    m_gcStats.unHeapBytes = m_pScript->GetHeapSize();
+}
 
-    VRServerDriverHost()->TrackedDevicePoseUpdated(m_unObjectId, GetPose(), sizeof(DriverPose_t));
+// Change the GC budget of the live script and of those loaded later;
+// 0 hands collection back to the automatic collector
+// Must be called by the thread that owns the live script.
+void CLuaHMDDriver::SetGCBudget(uint32_t unBudgetUs) {
+    if (m_pScript != NULL) {
+        if (unBudgetUs > 0 && m_unGCBudgetUs == 0) {
+            m_pScript->StopAutomaticGC();
+        } else if (unBudgetUs == 0 && m_unGCBudgetUs > 0) {
+            m_pScript->RestartAutomaticGC();
+        }
+    }
+    m_unGCBudgetUs = unBudgetUs;
+    DriverLog("Lua GC budget is now %u us per frame", m_unGCBudgetUs);
 }
 
-void CLuaHMDDriver::SetHandler(HandlerType_t type, int refHandler) {
-    m_arefHandlers[type] = refHandler;
-    DriverLog("Handler #%d set to %d", type, refHandler);
+// Start timing a script frame, if anybody is subscribed to telemetry
+void CLuaHMDDriver::BeginFrameTelemetry() {
+    m_ulScriptFrames++;
+    m_bFrameTelemetry = m_controlChannel.HasSubscribers();
+    if (m_bFrameTelemetry) {
+        m_tFrameStart = m_tStage = std::chrono::steady_clock::now();
+    }
 }
 
-void CLuaHMDDriver::Unload() {
-    DriverLog("Unloading script...");
-    if (m_pLuaSteamController != NULL) {
-        delete m_pLuaSteamController;
-        m_pLuaSteamController = NULL;
+static uint32_t ElapsedNs(std::chrono::steady_clock::time_point tFrom, std::chrono::steady_clock::time_point tTo) {
+    auto llNs = std::chrono::duration_cast<std::chrono::nanoseconds>(tTo - tFrom).count();
+    return llNs < UINT32_MAX ? (uint32_t)llNs : UINT32_MAX;
+}
+
+// Record how long the stage that just ended took
+void CLuaHMDDriver::MarkStage(ControlStage_t stage) {
+    if (!m_bFrameTelemetry) {
+        return;
     }
-    if (m_pLua != NULL) {
-        DO_SIMPLE_CALLBACK(TABLE_VRDISP, "OnShutdown");
-        DO_SIMPLE_CALLBACK(TABLE_TRACKDEV, "OnShutdown");
+    auto tNow = std::chrono::steady_clock::now();
+    m_telemetry.aunStageNs[stage] = ElapsedNs(m_tStage, tNow);
+    m_tStage = tNow;
+}
 
-        lua_close(m_pLua);
-        m_pLua = NULL;
+// Run the commands of control socket clients and publish the telemetry of
+// the frame that just ended
+// Must be called by the thread that owns the live script, at the end of a
+// frame.
+void CLuaHMDDriver::PumpControlChannel() {
+    ControlCommand_t command;
+    while (m_controlChannel.PollCommand(command)) {
+        m_controlChannel.Respond(command.unClient, ExecuteControlCommand(command.achCommand));
     }
 
-    for (int i = 0; i < k_unHandlerType_Max; i++) {
-        m_arefHandlers[i] = LUA_NOREF;
+    if (!m_bFrameTelemetry) {
+        return;
+    }
+
+    auto& t = m_telemetry;
+    t.ulFrame = m_ulScriptFrames;
+    t.ulTimestampNs = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(m_tFrameStart.time_since_epoch()).count();
+    t.unFrameNs = ElapsedNs(m_tFrameStart, m_tStage);
+    t.ulHeapBytes = m_gcStats.unHeapBytes;
+
+    auto const& pose = m_frame.hmd;
+    t.adRotation[0] = pose.qRotation.w;
+    t.adRotation[1] = pose.qRotation.x;
+    t.adRotation[2] = pose.qRotation.y;
+    t.adRotation[3] = pose.qRotation.z;
+    for (int i = 0; i < 3; i++) {
+        t.adPosition[i] = pose.vecPosition[i];
+        t.adVelocity[i] = pose.vecVelocity[i];
+        t.adAngularVelocity[i] = pose.vecAngularVelocity[i];
+    }
+    t.dPoseTimeOffset = pose.poseTimeOffset;
+    t.nTrackingResult = pose.result;
+    t.unPoseValid = pose.poseIsValid ? 1 : 0;
+    t.unDevices = (uint16_t)m_frame.unDevices;
+
+    t.unControllers = 0;
+    if (!m_controllers.empty()) {
+        auto const& ev = m_controllers[0]->GetLastUpdate();
+        t.unControllers = (uint32_t)m_controllers.size();
+        t.unButtons = ev.buttons;
+        t.anLeftXY[0] = ev.leftXY.x;
+        t.anLeftXY[1] = ev.leftXY.y;
+        t.anRightXY[0] = ev.rightXY.x;
+        t.anRightXY[1] = ev.rightXY.y;
+        t.aunTriggers[0] = ev.leftTrigger;
+        t.aunTriggers[1] = ev.rightTrigger;
     }
+
+    m_controlChannel.Publish(t);
 }
 
-void CLuaHMDDriver::Reload() {
-    Unload();
+// Run one command of a control socket client; returns the JSON answer
+// Must be called by the thread that owns the live script.
+std::string CLuaHMDDriver::ExecuteControlCommand(const char* pchCommand) {
+    std::string sVerb(pchCommand, strcspn(pchCommand, " "));
+    auto pchArgument = pchCommand + sVerb.size();
+    while (*pchArgument == ' ') {
+        pchArgument++;
+    }
 
-    DriverLog("Creating Lua state");
-    m_pLua = luaL_newstate();
-    if (m_pLua) {
-        DriverLog("Loading script...");
-        if (InitializeLuaState(m_pLua, m_sScriptPath)) {
-            DriverLog("Script has been reloaded!");
-
-            // Asking script to register it's handlers
-            // We pass in the pointer to this instance and the function
-            // will pass it back to us by calling RegisterHandler
-            lua_getglobal(m_pLua, "API_RegisterHandlers");
-            lua_pushlightuserdata(m_pLua, this);
-            lua_call(m_pLua, 1, 0);
-
-            DO_SIMPLE_CALLBACK(TABLE_TRACKDEV, "OnInit");
-            DO_SIMPLE_CALLBACK(TABLE_VRDISP, "OnInit");
-
-            // Find first Steam Controller
-            DriverLog("Discovering Steam Controllers");
-            auto it = SteamController_EnumControllerDevices();
-            if (it != NULL) {
-                DriverLog("Found a Steam Controller");
-                this->m_pLuaSteamController = new ISteamController(m_pLua, m_arefHandlers[k_unHandlerType_SteamController], it);
-
-                do {
-                    it = SteamController_NextControllerDevice(it);
-                } while (it != NULL);
+    if (sVerb == "stats") {
+        return FormatStatsJSON();
+    }
+    if (sVerb == "reset") {
+        ClearStats();
+        return "{\"reset\":true}";
+    }
+    if (sVerb == "reload") {
+        DriverLog("Control socket requested script reload");
+        return RequestReload() ? "{\"reload\":true}" : "{\"error\":\"a reload is already in progress\"}";
+    }
+    if (sVerb == "recalibrate") {
+        // Same as the user resetting the seated zero pose
+        VREvent_t vrEvent;
+        memset(&vrEvent, 0, sizeof(vrEvent));
+        vrEvent.eventType = VREvent_SeatedZeroPoseReset;
+        HandleVREvent(vrEvent);
+        return "{\"recalibrate\":true}";
+    }
+    if (sVerb == "gc-budget") {
+        if (*pchArgument != 0) {
+            char* pchEnd;
+            auto ulBudget = strtoul(pchArgument, &pchEnd, 10);
+            if (!isdigit((unsigned char)*pchArgument) || *pchEnd != 0 || ulBudget > SCRIPT_MAX_GC_BUDGET) {
+                return "{\"error\":\"usage: gc-budget [microseconds per frame]\"}";
             }
+            SetGCBudget((uint32_t)ulBudget);
+        }
+        char buf[64];
+        snprintf(buf, sizeof(buf), "{\"gc_budget_us\":%u}", m_unGCBudgetUs);
+        return buf;
+    }
+    if (sVerb == "get") {
+        return InspectScriptVariable(pchArgument);
+    }
+    return "{\"error\":\"unknown command\"}";
+}
+
+// Append a string as a quoted JSON string
+static void AppendJSONString(std::string& sOut, const char* pch, size_t unLen) {
+    sOut += '"';
+    for (size_t i = 0; i < unLen; i++) {
+        auto ch = (unsigned char)pch[i];
+        if (ch == '"' || ch == '\\') {
+            sOut += '\\';
+            sOut += (char)ch;
+        } else if (ch < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", ch);
+            sOut += buf;
+        } else {
+            sOut += (char)ch;
+        }
+    }
+    sOut += '"';
+}
+
+// Append a Lua value as JSON, without calling metamethods
+// Values without a JSON counterpart are described by their type and
+// address; strings are cut at unMaxString bytes.
+static void AppendLuaValueJSON(std::string& sOut, lua_State* L, int idx, size_t unMaxString) {
+    char buf[64];
+    switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+        sOut += "null";
+        break;
+    case LUA_TBOOLEAN:
+        sOut += lua_toboolean(L, idx) ? "true" : "false";
+        break;
+    case LUA_TNUMBER:
+        if (lua_isinteger(L, idx)) {
+            snprintf(buf, sizeof(buf), "%lld", (long long)lua_tointeger(L, idx));
+        } else if (isfinite(lua_tonumber(L, idx))) {
+            snprintf(buf, sizeof(buf), "%.17g", (double)lua_tonumber(L, idx));
+        } else {
+            snprintf(buf, sizeof(buf), "\"%g\"", (double)lua_tonumber(L, idx));
+        }
+        sOut += buf;
+        break;
+    case LUA_TSTRING: {
+        size_t unLen;
+        auto pch = lua_tolstring(L, idx, &unLen);
+        AppendJSONString(sOut, pch, std::min(unLen, unMaxString));
+        break;
+    }
+    default:
+        snprintf(buf, sizeof(buf), "%s: %p", luaL_typename(L, idx), lua_topointer(L, idx));
+        AppendJSONString(sOut, buf, strlen(buf));
+        break;
+    }
+}
+
+// Describe a script global, or a field of one reached through
+// "name.field.1", as JSON. Tables are walked with raw lookups so that no
+// script code runs; numeric parts index arrays. A table is listed one
+// level deep.
+// Must be called by the thread that owns the live script.
+std::string CLuaHMDDriver::InspectScriptVariable(const char* pchName) {
+    if (*pchName == 0) {
+        return "{\"error\":\"usage: get <name.field...>\"}";
+    }
+    if (m_pScript == NULL) {
+        return "{\"error\":\"no script is loaded\"}";
+    }
+
+    auto L = m_pScript->m_pLua;
+    auto nTop = lua_gettop(L);
+    lua_pushglobaltable(L); // +1
+    for (auto pchPart = pchName; ; pchPart++) {
+        auto unLen = strcspn(pchPart, ".");
+        if (!lua_istable(L, -1)) {
+            lua_settop(L, nTop);
+            return "{\"error\":\"not a table\"}";
+        }
+        std::string sPart(pchPart, unLen);
+        char* pchEnd;
+        auto llIndex = strtoll(sPart.c_str(), &pchEnd, 10);
+        if (!sPart.empty() && *pchEnd == 0) {
+            lua_pushinteger(L, (lua_Integer)llIndex); // +1
         } else {
-            lua_close(m_pLua);
-            m_pLua = NULL;
+            lua_pushlstring(L, sPart.data(), sPart.size()); // +1
+        }
+        lua_rawget(L, -2); // -1, +1
+        lua_remove(L, -2); // -1
+        pchPart += unLen;
+        if (*pchPart == 0) {
+            break;
+        }
+    }
+
+    std::string sOut = "{\"name\":";
+    AppendJSONString(sOut, pchName, strlen(pchName));
+    sOut += ",\"type\":\"";
+    sOut += luaL_typename(L, -1);
+    sOut += "\",\"value\":";
+    if (lua_istable(L, -1)) {
+        uint32_t unFields = 0;
+        bool bTruncated = false;
+        sOut += '{';
+        lua_pushnil(L); // +1
+        while (lua_next(L, -2)) { // -1, +2
+            if (unFields == SCRIPT_INSPECT_MAX_FIELDS) {
+                bTruncated = true;
+                lua_pop(L, 2); // -2
+                break;
+            }
+            // Keys are described into a copy; converting the key itself
+            // would confuse lua_next
+            lua_pushvalue(L, -2); // +1
+            std::string sKey;
+            AppendLuaValueJSON(sKey, L, -1, SCRIPT_INSPECT_MAX_STRING);
+            lua_pop(L, 1); // -1
+            if (sKey[0] != '"') {
+                sKey = "\"" + sKey + "\"";
+            }
+            if (unFields++ > 0) {
+                sOut += ',';
+            }
+            sOut += sKey;
+            sOut += ':';
+            AppendLuaValueJSON(sOut, L, -1, SCRIPT_INSPECT_MAX_STRING);
+            lua_pop(L, 1); // -1
+        }
+        sOut += '}';
+        if (bTruncated) {
+            sOut += ",\"truncated\":true";
         }
     } else {
-        DriverLog("Failed to create Lua state!");
+        AppendLuaValueJSON(sOut, L, -1, CONTROL_MAX_RESPONSE);
+    }
+    sOut += '}';
+
+    lua_settop(L, nTop);
+    return sOut;
+}
+
+// Refresh the statistics DebugRequest answers with, every so often
+// Must be called by the script thread.
+void CLuaHMDDriver::PublishStats() {
+    auto tNow = std::chrono::steady_clock::now();
+    if (tNow < m_tNextStatsSnapshot) {
+        return;
     }
+    m_tNextStatsSnapshot = tNow + std::chrono::milliseconds(SCRIPT_STATS_SNAPSHOT_INTERVAL_MS);
+
+    auto sStats = FormatStatsJSON();
+    std::lock_guard<std::mutex> lock(m_mtxStats);
+    m_sStatsSnapshot.swap(sStats);
+}
+
+void CLuaHMDDriver::StartScriptThread() {
+    DriverLog("Starting script thread");
+    m_bScriptThreadExiting = false;
+    m_scriptThread = std::thread(&CLuaHMDDriver::ScriptThreadFunction, this);
+}
+
+void CLuaHMDDriver::StopScriptThread() {
+    if (m_scriptThread.joinable()) {
+        DriverLog("Joining script thread");
+        m_bScriptThreadExiting = true;
+        m_cvFrame.notify_one();
+        m_scriptThread.join();
+    }
+}
+
+// Upper bound on how long the script thread sleeps between frames.
+// Also bounds the delay caused by a frame signal that arrives just
+// before the script thread starts waiting.
+#define SCRIPT_THREAD_MAX_WAIT std::chrono::milliseconds(4)
+
+void CLuaHMDDriver::ScriptThreadFunction() {
+    vr::VREvent_t vrEvent;
+    ScriptRequest_t request;
+    auto unLastFrame = m_unFrameCounter.load(std::memory_order_acquire);
+
+    while (!m_bScriptThreadExiting) {
+        BeginFrameTelemetry();
+
+        SwapPendingScript();
+        MarkStage(k_unControlStage_SwapScript);
+
+        while (m_queueRequests.Pop(request)) {
+            HandleScriptRequest(request);
+        }
+        while (m_queueVREvents.Pop(vrEvent)) {
+            HandleVREvent(vrEvent);
+        }
+        MarkStage(k_unControlStage_Events);
+
+        PumpSteamController();
+        MarkStage(k_unControlStage_Controllers);
+
+        m_frame.hmd = ScriptGetPose();
+        MarkStage(k_unControlStage_GetPose);
+        ScriptGetDevicePoses();
+        MarkStage(k_unControlStage_DevicePoses);
+        m_poseMailbox.Write(m_frame);
+        MarkStage(k_unControlStage_Submit);
+
+        EndScriptFrame();
+        MarkStage(k_unControlStage_GC);
+
+        PumpControlChannel();
+        PublishStats();
+
+        // Wait for the next server frame
+        std::unique_lock<std::mutex> lock(m_mtxFrame);
+        m_cvFrame.wait_for(lock, SCRIPT_THREAD_MAX_WAIT, [&]() {
+            return m_bScriptThreadExiting || m_unFrameCounter.load(std::memory_order_acquire) != unLastFrame ||
+                !m_queueRequests.IsEmpty();
+        });
+        unLastFrame = m_unFrameCounter.load(std::memory_order_acquire);
+    }
+}
+
+// Start building a fresh script instance in the background
+// The live script keeps running until the new one is swapped in by
+// SwapPendingScript; if the new one fails to load it is discarded.
+// Returns false if a reload is in progress already.
+bool CLuaHMDDriver::RequestReload() {
+    if (m_bReloadInProgress.exchange(true)) {
+        DriverLog("A reload is already in progress");
+        return false;
+    }
+
+    if (m_reloadThread.joinable()) {
+        m_reloadThread.join();
+    }
+
+    m_bReloadSwapped = false;
+    m_pRetiredScript = NULL;
+    m_reloadThread = std::thread(&CLuaHMDDriver::ReloadThreadFunction, this);
+    return true;
 }
 
+void CLuaHMDDriver::StopReloadThread() {
+    if (m_reloadThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m_mtxReload);
+            m_bReloadExiting = true;
+        }
+        m_cvReload.notify_one();
+        m_reloadThread.join();
+    }
+}
+
+void CLuaHMDDriver::ReloadThreadFunction() {
+    DriverLog("Reloading script in the background");
+    auto pScript = CreateScript();
+    bool bLoaded;
+    {
+        CScopedLatency timer(&m_stats.reload);
+        bLoaded = pScript->Load(m_sScriptPath);
+    }
+    if (!bLoaded) {
+        DriverLog("Reload failed, keeping the current script");
+        delete pScript;
+        m_bReloadInProgress = false;
+        return;
+    }
+
+    m_pPendingScript.store(pScript, std::memory_order_release);
+
+    // Wait until the frame thread has swapped the new script in
+    CLuaScript* pRetired = NULL;
+    {
+        std::unique_lock<std::mutex> lock(m_mtxReload);
+        m_cvReload.wait(lock, [&]() { return m_bReloadSwapped || m_bReloadExiting; });
+        pRetired = m_pRetiredScript;
+        m_pRetiredScript = NULL;
+    }
+
+    // Shutting down before the swap happened
+    pScript = m_pPendingScript.exchange(NULL, std::memory_order_acq_rel);
+    if (pScript != NULL) {
+        delete pScript;
+    }
+
+    // Tear down the old instance here instead of on the frame thread
+    if (pRetired != NULL) {
+        delete pRetired;
+    }
+
+    DriverLog("Script has been reloaded!");
+    m_bReloadInProgress = false;
+}
+
+// Swap in a script built by the reload thread, if there is one
+// Must be called by the thread that owns the live script, at a frame
+// boundary.
+void CLuaHMDDriver::SwapPendingScript() {
+    if (m_pPendingScript.load(std::memory_order_relaxed) == NULL) {
+        return;
+    }
+
+    auto pScript = m_pPendingScript.exchange(NULL, std::memory_order_acq_rel);
+    if (pScript == NULL) {
+        return;
+    }
+
+    // The controllers keep running and keep their queued reports; only
+    // the handler instances they report to are replaced. The old script
+    // shuts down here, while nothing else touches the controllers; the
+    // reload thread only frees it.
+    if (m_pScript != NULL) {
+        m_pScript->Shutdown();
+        m_pScript->SetPoseSource(NULL);
+    }
+    for (auto pController : m_controllers) {
+        if (pScript->HasControllerHandler()) {
+            pScript->AttachController(pController);
+        }
+    }
+
+    // Only now; the GC budget may change until the swap
+    PrepareScript(pScript);
+
+    {
+        std::lock_guard<std::mutex> lock(m_mtxReload);
+        m_pRetiredScript = m_pScript;
+        m_pScript = pScript;
+        m_bReloadSwapped = true;
+    }
+    m_cvReload.notify_one();
+
+    PublishDisplay(pScript);
+    MapDevices(pScript);
+}
@@ -2,15 +2,345 @@
 
 #pragma once
 #include <openvr_driver.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include "CSteamController.h"
+#include "control_channel.h"
+#include "controller_monitor.h"
+#include "distortion_grid.h"
+#include "imu_fusion.h"
+#include "input_binding.h"
+#include "latency_histogram.h"
+#include "lua_allocator.h"
+#include "pose_buffer.h"
+#include "pose_prediction.h"
+#include "shm_pose_source.h"
+#include "spsc_queue.h"
+#include "triple_buffer.h"
 
 struct lua_State;
+class CDriverController;
+class ISteamController;
+
+// Driver settings section and keys
+#define SETTINGS_SECTION "driver_easimer"
+#define SETTINGS_THREADED_SCRIPT "threadedScript"
+// Lua GC time budget per frame in microseconds; 0 keeps the automatic
+// incremental collector
+#define SETTINGS_GC_BUDGET "gcBudgetMicroseconds"
+// Size of one LUA_GCSTEP slice in kilobytes; 0 runs basic steps
+#define SETTINGS_GC_STEP_SIZE "gcStepSize"
+// Execution budget of a single call into the script; 0 disables a limit
+#define SETTINGS_SCRIPT_INSTRUCTION_BUDGET "scriptInstructionBudget"
+#define SETTINGS_SCRIPT_TIME_BUDGET "scriptTimeBudgetMicroseconds"
+
+// Budgets used when the settings are absent
+#define SCRIPT_DEFAULT_INSTRUCTION_BUDGET 1000000
+#define SCRIPT_DEFAULT_TIME_BUDGET 5000
+// The budget is checked every this many VM instructions
+#define SCRIPT_HOOK_INTERVAL 1000
+
+// Number of distortion samples per side requested from the compositor
+// through Prop_DistortionMeshResolution_Int32
+#define SETTINGS_DISTORTION_RESOLUTION "distortionMeshResolution"
+
+// Fill angular velocity, acceleration and poseTimeOffset of the HMD pose
+// from the controller's gyro (default on)
+#define SETTINGS_GYRO_PREDICTION "gyroPrediction"
+// Also rotate the HMD pose forward to the time its photons are shown
+// (default off)
+#define SETTINGS_PREDICT_TO_PHOTONS "predictToPhotons"
+
+// Merge controller updates that arrive within one frame and don't change
+// the buttons before calling SteamController:OnUpdate (default on)
+#define SETTINGS_COALESCE_UPDATES "coalesceControllerUpdates"
+
+// Directory that receives a recording of a controller's reports every
+// time one is opened (default: no recording)
+#define SETTINGS_CONTROLLER_RECORD_DIRECTORY "controllerRecordDirectory"
+// Recording to feed the script instead of a real controller, and how fast;
+// 1 is the recorded speed, 0 as fast as possible (default 1)
+#define SETTINGS_CONTROLLER_REPLAY "controllerReplay"
+#define SETTINGS_CONTROLLER_REPLAY_SPEED "controllerReplaySpeed"
+
+// Name of a pose_shm segment an external tracker writes poses into
+// (default: none)
+#define SETTINGS_POSE_SHM "poseSharedMemory"
+// Report the shared memory pose as the HMD pose without calling the
+// script's GetPose (default off)
+#define SETTINGS_POSE_SHM_DIRECT "poseSharedMemoryDirect"
+// Interpolate shared memory poses this far in the past instead of
+// reporting the newest one, in milliseconds (default 0)
+#define SETTINGS_POSE_SHM_DELAY "poseSharedMemoryDelayMilliseconds"
+
+// Serve telemetry and commands on a local Unix socket (default on), and
+// where (default: driver_easimer.sock in $XDG_RUNTIME_DIR)
+#define SETTINGS_CONTROL_SOCKET_ENABLED "controlSocketEnabled"
+#define SETTINGS_CONTROL_SOCKET "controlSocket"
+
+// JSON file binding controller input to IVRDriverInput components; see
+// CInputBinding (default: input_bindings.json next to the script)
+#define SETTINGS_INPUT_BINDINGS "inputBindings"
+#define INPUT_BINDINGS_DEFAULT_PATH "drivers/easimer/scripts/input_bindings.json"
+
+// Capacity of the server thread -> script thread event queue
+#define SCRIPT_EVENT_QUEUE_SIZE 64
+// Capacity of the server thread -> script thread queue of device calls
+#define SCRIPT_REQUEST_QUEUE_SIZE 8
+// How often the script thread refreshes the statistics DebugRequest
+// answers with, in milliseconds
+#define SCRIPT_STATS_SNAPSHOT_INTERVAL_MS 500
+
+// Upper bound on the devices a script may declare besides the HMD
+#define SCRIPT_MAX_DEVICES 16
+
+// Largest GC budget the control socket accepts, in microseconds
+#define SCRIPT_MAX_GC_BUDGET 100000
+// Fields listed and bytes of a string shown when the control socket
+// inspects a script table
+#define SCRIPT_INSPECT_MAX_FIELDS 64
+#define SCRIPT_INSPECT_MAX_STRING 256
 
 enum HandlerType_t {
 	k_unHandlerType_SteamController = 0,
 	k_unHandlerType_Max
 };
 
+// Script tables whose methods the driver calls back into
+enum CallbackTable_t {
+	k_unCallbackTable_TrackedDeviceServerDriver = 0,
+	k_unCallbackTable_VRDisplayComponent,
+	k_unCallbackTable_Max
+};
+
+// Script methods that are resolved once on Reload()
+enum Callback_t {
+	k_unCallback_TrackDev_OnInit = 0,
+	k_unCallback_TrackDev_OnShutdown,
+	k_unCallback_TrackDev_Activate,
+	k_unCallback_TrackDev_Deactivate,
+	k_unCallback_TrackDev_EnterStandby,
+	k_unCallback_TrackDev_GetPose,
+	k_unCallback_TrackDev_OnSeatedZeroPoseReset,
+	k_unCallback_TrackDev_GetDevices,
+	k_unCallback_TrackDev_GetPoses,
+	k_unCallback_VRDisp_OnInit,
+	k_unCallback_VRDisp_OnShutdown,
+	k_unCallback_VRDisp_GetWindowBounds,
+	k_unCallback_VRDisp_GetRecommendedRenderTargetSize,
+	k_unCallback_VRDisp_GetEyeOutputViewport,
+	k_unCallback_VRDisp_GetDistortion,
+	k_unCallback_Max
+};
+
+// Answers to the IVRDisplayComponent queries, collected from the script
+// once after OnInit and again whenever it calls DisplayChanged()
+struct DisplayConfig_t {
+	int32_t nWindowX, nWindowY;
+	uint32_t unWindowWidth, unWindowHeight;
+	uint32_t unRenderWidth, unRenderHeight;
+	// x, y, width, height, indexed by vr::EVREye
+	uint32_t aunEyeViewport[2][4];
+};
+
+// A device declared by the script through GetDevices()
+struct ScriptDevice_t {
+	std::string sSerialNumber;
+	std::string sModelNumber;
+	std::string sRenderModel;
+	vr::ETrackedDeviceClass eClass;
+	vr::ETrackedControllerRole eRole;
+};
+
+// Device calls of the server that run script code; in threaded mode they
+// are queued for the script thread instead of waiting for it
+enum ScriptRequestType_t {
+	k_unScriptRequest_Activate = 0,
+	k_unScriptRequest_Deactivate,
+	k_unScriptRequest_EnterStandby,
+	k_unScriptRequest_ResetStats,
+};
+
+struct ScriptRequest_t {
+	ScriptRequestType_t eType;
+	// Activate only
+	uint32_t unObjectId;
+};
+
+// Every pose of one frame, as handed from the script thread to the
+// server thread
+struct PoseFrame_t {
+	vr::DriverPose_t hmd;
+	uint32_t unDevices;
+	vr::DriverPose_t aDevices[SCRIPT_MAX_DEVICES];
+};
+
+// Latency of every entry point into the script; owned by the driver so
+// that it survives reloads
+struct ScriptStats_t {
+	CLatencyHistogram aCallbacks[k_unCallback_Max];
+	CLatencyHistogram onUpdate;
+	CLatencyHistogram reload;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: one loaded instance of the driver script; owns the Lua state
+// and every reference into it, so that a reload can build a complete new
+// instance off-thread and swap it in as a whole
+//-----------------------------------------------------------------------------
+
+class CLuaScript {
+public:
+	CLuaScript();
+	~CLuaScript();
+	CLuaScript(const CLuaScript&) = delete;
+	void operator=(const CLuaScript&) = delete;
+
+	// Create the state, run the script, register handlers and call OnInit
+	bool Load(const std::string& sPath);
+	// Drop the controller handler instances and call the shutdown
+	// callbacks; the destructor does so if nobody did before. Must be
+	// called by the thread owning the controllers while they may be
+	// attached.
+	void Shutdown();
+
+	bool PushCallback(Callback_t cb);
+	bool CallCallback(Callback_t cb, int nArgs, int nResults);
+	void SetHandler(HandlerType_t type, int refHandler);
+
+	// Limit how long a single call into the script may run; must be set
+	// before Load
+	void SetExecutionBudget(uint32_t unInstructions, uint32_t unTimeUs);
+	void SetStats(ScriptStats_t* pStats) { m_pStats = pStats; }
+	ScriptStats_t* GetStats() const { return m_pStats; }
+	// Poses from an external tracker; owned by the driver and only set
+	// while the thread owning the live script runs this one, so a script
+	// loading in the background can't read them
+	void SetPoseSource(CShmPoseSource* pSource) { m_pPoseSource = pSource; }
+	CShmPoseSource* GetPoseSource() const { return m_pPoseSource; }
+	// Set when the script read a pose from the source; poses built from one
+	// are already predicted by the tracker
+	void SetReadSharedMemoryPose(bool bRead) { m_bReadSharedMemoryPose = bRead; }
+	bool ReadSharedMemoryPose() const { return m_bReadSharedMemoryPose; }
+
+	// lua_pcall under the execution budget with a traceback handler
+	int Call(int nArgs, int nResults);
+
+	// The script instance owning a Lua state
+	static CLuaScript* FromState(lua_State* L);
+
+	// Ask the script for the display configuration
+	void QueryDisplayConfig();
+	void SetDisplayChanged() { m_bDisplayChanged = true; }
+
+	// Ask the script which devices it drives besides the HMD
+	void QueryDevices();
+
+	// Evaluate the script's lens distortion into a lookup grid with the
+	// given number of samples per side; must be set before Load
+	void SetDistortionResolution(uint32_t unSamples) { m_unDistortionSamples = unSamples; }
+	void BuildDistortionGrid();
+
+	// Steam Controllers; only if the script registered a handler for them
+	bool HasControllerHandler() const;
+	// Create a handler instance reporting on the controller
+	void AttachController(CDriverController* pController);
+	// Drop the handler instance of the controller
+	void DetachController(CDriverController* pController);
+
+	// Garbage collector scheduling
+	void StopAutomaticGC();
+	void RestartAutomaticGC();
+	uint32_t StepGC(uint32_t unBudgetUs, int nStepSize);
+	void FullGC();
+	size_t GetHeapSize() const;
+
+private:
+	void ResolveCallbacks();
+	static void BudgetHook(lua_State* L, struct lua_Debug* ar);
+
+	friend class CLuaHMDDriver;
+
+	CLuaAllocator m_allocator;
+	lua_State* m_pLua;
+	bool m_bInitialized;
+
+	// Persistent pose userdata handed to GetPose and its contents
+	int m_refPose;
+	vr::DriverPose_t* m_pLuaPose;
+
+	// References to handlers' method table
+	int m_arefHandlers[k_unHandlerType_Max];
+
+	// References to the callback tables (passed as self) and their methods
+	int m_arefCallbackTables[k_unCallbackTable_Max];
+	int m_arefCallbacks[k_unCallback_Max];
+
+	// A Lua handler instance per Steam Controller, in the order they were
+	// attached; the controllers themselves belong to the driver
+	std::vector<ISteamController*> m_controllers;
+
+	// Execution budget; enforced by a count hook armed by the outermost Call
+	uint32_t m_unInstructionBudget;
+	uint32_t m_unTimeBudgetUs;
+	int m_nCallDepth;
+	uint32_t m_unHookTicks;
+	std::chrono::steady_clock::time_point m_tDeadline;
+
+	// Where call latencies are recorded; may be NULL
+	ScriptStats_t* m_pStats;
+	CShmPoseSource* m_pPoseSource;
+	bool m_bReadSharedMemoryPose;
+
+	// Snapshot taken by QueryDisplayConfig; m_bDisplayChanged is set by
+	// the script through DisplayChanged()
+	DisplayConfig_t m_displayConfig;
+	bool m_bDisplayChanged;
+
+	// Built once by Load; immutable afterwards and shared with the driver
+	uint32_t m_unDistortionSamples;
+	std::shared_ptr<const CDistortionGrid> m_pDistortion;
+
+	// Devices declared by the script and the pose buffer that
+	// GetPoses(poses) fills for all of them at once
+	std::vector<ScriptDevice_t> m_devices;
+	CPoseBuffer m_poses;
+	int m_refPoses;
+};
+
+class CLuaHMDDriver;
+
+//-----------------------------------------------------------------------------
+// Purpose: additional device driven by the script of a CLuaHMDDriver;
+// its pose comes out of the host's per-frame pose batch
+//-----------------------------------------------------------------------------
+
+class CLuaTrackedDevice : public vr::ITrackedDeviceServerDriver {
+public:
+	CLuaTrackedDevice(CLuaHMDDriver* pHost, uint32_t unIndex, const ScriptDevice_t& desc);
+	virtual ~CLuaTrackedDevice() {}
+
+	virtual vr::EVRInitError Activate(uint32_t unObjectId) override;
+	virtual void Deactivate() override;
+	virtual void EnterStandby() override {}
+	virtual void* GetComponent(const char*) override { return NULL; }
+	virtual void DebugRequest(const char* pchRequest, char* pchResponseBuffer, uint32_t unResponseBufferSize) override;
+	virtual vr::DriverPose_t GetPose() override;
+
+	const ScriptDevice_t& GetDesc() const { return m_desc; }
+	vr::TrackedDeviceIndex_t GetObjectId() const { return m_unObjectId; }
+
+private:
+	CLuaHMDDriver* m_pHost;
+	uint32_t m_unIndex;
+	ScriptDevice_t m_desc;
+	vr::TrackedDeviceIndex_t m_unObjectId;
+};
+
 //-----------------------------------------------------------------------------
 // Purpose: HMD driver that calls back to a Lua script
 //-----------------------------------------------------------------------------
@@ -39,13 +369,57 @@ public:
 	void RunFrame();
 	const std::string& GetSerialNumber() const { return m_sSerialNumber; }
 
+	// Devices declared by the script loaded first; they live as long as
+	// the HMD and keep their identity across reloads
+	const std::vector<CLuaTrackedDevice*>& GetDevices() const { return m_devices; }
+	vr::DriverPose_t GetDevicePose(uint32_t unIndex);
+
+	// Input components; created on the device the binding file names
+	CInputBinding& GetInputBinding() { return m_inputBinding; }
+
 	class BaseLuaInterface;
-	void SetHandler(HandlerType_t type, int refHandler);
 
 private:
 
-	void Reload();
-	void Unload();
+	bool RequestReload();
+	void StopReloadThread();
+	void ReloadThreadFunction();
+	void SwapPendingScript();
+
+	vr::DriverPose_t ScriptGetPose();
+	void ScriptGetDevicePoses();
+	void SubmitPoses(const PoseFrame_t& frame);
+	void MapDevices(const CLuaScript* pScript);
+	void PumpSteamController();
+	void RemoveController(size_t unIndex);
+	void HandleVREvent(const vr::VREvent_t& vrEvent);
+	void HandleScriptRequest(const ScriptRequest_t& request);
+	bool PushScriptRequest(ScriptRequestType_t eType, uint32_t unObjectId = 0);
+	bool ScriptActivate(uint32_t unObjectId);
+	void ScriptDeactivate();
+	void ScriptEnterStandby();
+	void PublishStats();
+
+	void StartScriptThread();
+	void StopScriptThread();
+	void ScriptThreadFunction();
+
+	bool PushCallback(Callback_t cb);
+	bool CallCallback(Callback_t cb, int nArgs, int nResults);
+
+	CLuaScript* CreateScript();
+	void PublishDisplay(const CLuaScript* pScript);
+	void PrepareScript(CLuaScript* pScript);
+	void SetGCBudget(uint32_t unBudgetUs);
+	std::string FormatStatsJSON();
+	void ClearStats();
+	void EndScriptFrame();
+
+	void BeginFrameTelemetry();
+	void MarkStage(ControlStage_t stage);
+	void PumpControlChannel();
+	std::string ExecuteControlCommand(const char* pchCommand);
+	std::string InspectScriptVariable(const char* pchName);
 
 private:
 	vr::TrackedDeviceIndex_t m_unObjectId;
@@ -57,11 +431,106 @@ private:
 
 	vr::HmdQuaternion_t m_qCalibration;
 
-	lua_State* m_pLua;
+	// Last valid pose returned by the script; reported with
+	// TrackingResult_Fallback_RotationOnly when GetPose fails
+	vr::DriverPose_t m_lastGoodPose;
+	// Owned by the thread running the script
+	CPosePredictor m_predictor;
+	bool m_bGyroPrediction;
+	bool m_bCoalesceUpdates;
+	// Shared memory poses, read by the thread running the script; in
+	// direct mode they replace the script's GetPose
+	CShmPoseSource m_shmPoseSource;
+	bool m_bShmPoseDirect;
+	// Fed by the controller the binding file names
+	CInputBinding m_inputBinding;
+	// Opens controllers as they are plugged in; PumpSteamController takes
+	// them over and attaches them to the live script
+	CControllerMonitor m_controllerMonitor;
+	// Owned by the thread running the script, in the order they were
+	// opened; they stay open across reloads
+	std::vector<CDriverController*> m_controllers;
+	// Unplugged controllers whose reader thread hasn't finished yet;
+	// destroyed once it has, so that a frame never waits for a join
+	std::vector<CDriverController*> m_stoppingControllers;
+	uint32_t m_unInstructionBudget;
+	uint32_t m_unTimeBudgetUs;
 
-	// References to handlers' method table
-	int m_arefHandlers[k_unHandlerType_Max];
+	// The live script; NULL if it failed to load
+	CLuaScript* m_pScript;
+
+	// Background reload: the reload thread builds a new script and
+	// publishes it in m_pPendingScript; the thread owning m_pScript swaps
+	// it in at the next frame boundary and hands the old one back in
+	// m_pRetiredScript for the reload thread to destroy.
+	std::thread m_reloadThread;
+	std::atomic<bool> m_bReloadInProgress;
+	std::atomic<CLuaScript*> m_pPendingScript;
+	std::mutex m_mtxReload;
+	std::condition_variable m_cvReload;
+	bool m_bReloadSwapped;
+	bool m_bReloadExiting;
+	CLuaScript* m_pRetiredScript;
+
+	// Threaded mode: the script thread owns m_pScript and publishes poses
+	// into m_poseMailbox; RunFrame only forwards the latest pose and
+	// queues VR events for the script thread. The server's device calls
+	// are queued the same way, so the server never waits on script code.
+	bool m_bThreaded;
+	std::thread m_scriptThread;
+	std::atomic<bool> m_bScriptThreadExiting;
+	std::mutex m_mtxFrame;
+	std::condition_variable m_cvFrame;
+	std::atomic<uint32_t> m_unFrameCounter;
+	CTripleBuffer<PoseFrame_t> m_poseMailbox;
+	// The frame RunFrame last took out of the mailbox, which only has a
+	// single reader; GetPose and GetDevicePose return copies of it from
+	// whichever thread the server calls them on
+	std::mutex m_mtxServerFrame;
+	PoseFrame_t m_serverFrame;
+	CSPSCQueue<vr::VREvent_t, SCRIPT_EVENT_QUEUE_SIZE> m_queueVREvents;
+	CSPSCQueue<ScriptRequest_t, SCRIPT_REQUEST_QUEUE_SIZE> m_queueRequests;
+	// Statistics as of the script thread's last snapshot, for DebugRequest
+	std::mutex m_mtxStats;
+	std::string m_sStatsSnapshot;
+	std::chrono::steady_clock::time_point m_tNextStatsSnapshot;
+
+	// Local control socket; its thread only talks to the thread owning
+	// the script, through the channel's queues. The telemetry of the
+	// current frame is only collected while somebody subscribed to it.
+	CControlChannel m_controlChannel;
+	ControlTelemetry_t m_telemetry;
+	bool m_bFrameTelemetry;
+	uint64_t m_ulScriptFrames;
+	std::chrono::steady_clock::time_point m_tFrameStart;
+	std::chrono::steady_clock::time_point m_tStage;
+
+	// Frame-budgeted GC: automatic collection is stopped and EndScriptFrame spends
+	// at most m_unGCBudgetUs per frame on incremental steps
+	uint32_t m_unGCBudgetUs;
+	int m_nGCStepSize;
+	// Written by whichever thread runs the script
+	struct {
+		uint32_t unLastFrameUs;
+		uint32_t unMaxFrameUs;
+		uint64_t ulTotalUs;
+		uint64_t ulFrames;
+		size_t unHeapBytes;
+	} m_gcStats;
+
+	ScriptStats_t m_stats;
+
+	// Display configuration and distortion grid of the live script; the
+	// display queries only read these
+	std::mutex m_mtxDisplay;
+	DisplayConfig_t m_displayConfig;
+	std::shared_ptr<const CDistortionGrid> m_pDistortion;
+	uint32_t m_unDistortionSamples;
 
-	// Lua Handler for SteamController
-	void* m_pLuaSteamController;
+	// Extra devices, the slot of each in the live script's pose buffer
+	// (-1 if the live script no longer declares it) and the poses of the
+	// current frame; written by the thread owning the script
+	std::vector<CLuaTrackedDevice*> m_devices;
+	int m_anDeviceSlots[SCRIPT_MAX_DEVICES];
+	PoseFrame_t m_frame;
 };
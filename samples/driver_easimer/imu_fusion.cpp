@@ -0,0 +1,125 @@
+// === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
+
+#include "imu_fusion.h"
+#include "sc_math.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace vr;
+
+// Longest interval integrated in one step; a longer gap means lost packets
+static const double k_flMaxSampleDelta = 0.05;
+
+// Normalize v in place and return its original length
+static double Normalize(double v[3]) {
+    auto flLen = sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+    if (flLen > 0) {
+        for (int i = 0; i < 3; i++) {
+            v[i] /= flLen;
+        }
+    }
+    return flLen;
+}
+
+CImuFusion::CImuFusion() {
+    Reset();
+}
+
+void CImuFusion::Reset() {
+    m_bInitialized = false;
+    m_q = { 1, 0, 0, 0 };
+    m_bHaveGravity = false;
+    for (int i = 0; i < 3; i++) {
+        m_aflGravity[i] = 0;
+        m_aflIntegralError[i] = 0;
+    }
+    m_unLastTimeStamp = m_unCalibrationTimeStamp = 0;
+    m_flSecondsPerTick = FUSION_DEFAULT_SAMPLE_PERIOD;
+}
+
+double CImuFusion::SampleDelta(uint32_t unTimeStamp, clock::time_point tReceived) {
+    // Unsigned arithmetic handles the counter wrapping around
+    auto unTicks = unTimeStamp - m_unLastTimeStamp;
+    m_unLastTimeStamp = unTimeStamp;
+
+    auto flElapsed = std::chrono::duration<double>(tReceived - m_tCalibration).count();
+    if (flElapsed >= 1.0) {
+        auto unCalibrationTicks = unTimeStamp - m_unCalibrationTimeStamp;
+        if (unCalibrationTicks > 0) {
+            auto flMeasured = flElapsed / unCalibrationTicks;
+            if (flMeasured > 1e-5 && flMeasured < k_flMaxSampleDelta) {
+                m_flSecondsPerTick += 0.5 * (flMeasured - m_flSecondsPerTick);
+            }
+        }
+        m_unCalibrationTimeStamp = unTimeStamp;
+        m_tCalibration = tReceived;
+    }
+
+    return std::min(unTicks * m_flSecondsPerTick, k_flMaxSampleDelta);
+}
+
+void CImuFusion::AddSamples(const SteamControllerUpdateBatch& batch, clock::time_point tNewest) {
+    for (uint32_t i = 0; i < batch.count; i++) {
+        AddSample(batch, i, tNewest);
+    }
+}
+
+void CImuFusion::AddSample(const SteamControllerUpdateBatch& batch, uint32_t i, clock::time_point tReceived) {
+    auto const& accel = batch.acceleration[i];
+    auto const& gyro = batch.angularVelocity[i];
+    auto const& orientation = batch.orientation[i];
+    double aflAccel[3] = { (double)accel.x, (double)accel.y, (double)accel.z };
+    auto flG = Normalize(aflAccel) / STEAMCONTROLLER_ACCEL_ONE_G;
+    auto bAtRest = fabs(flG - 1.0) < FUSION_ACCEL_TOLERANCE;
+
+    if (!m_bInitialized) {
+        m_q = DecodeOrientation(orientation);
+        m_unLastTimeStamp = m_unCalibrationTimeStamp = batch.timeStamp[i];
+        m_tCalibration = tReceived;
+        m_bInitialized = true;
+    }
+
+    if (!m_bHaveGravity && bAtRest) {
+        // Whatever the controller calls up, keep it up
+        RotateVector(m_q, false, aflAccel, m_aflGravity);
+        m_bHaveGravity = true;
+    }
+
+    auto flDt = SampleDelta(batch.timeStamp[i], tReceived);
+    if (flDt <= 0) {
+        return;
+    }
+
+    double aflGyro[3];
+    DecodeAngularVelocity(gyro, aflGyro);
+
+    if (m_bHaveGravity && bAtRest) {
+        // Error between the measured and the estimated gravity direction
+        double aflExpected[3];
+        RotateVector(m_q, true, m_aflGravity, aflExpected);
+        double aflError[3] = {
+            aflAccel[1] * aflExpected[2] - aflAccel[2] * aflExpected[1],
+            aflAccel[2] * aflExpected[0] - aflAccel[0] * aflExpected[2],
+            aflAccel[0] * aflExpected[1] - aflAccel[1] * aflExpected[0],
+        };
+        for (int i = 0; i < 3; i++) {
+            m_aflIntegralError[i] += FUSION_KI * aflError[i] * flDt;
+            aflGyro[i] += FUSION_KP * aflError[i] + m_aflIntegralError[i];
+        }
+    }
+
+    // q += 0.5 * q * (0, gyro) * dt
+    auto h = 0.5 * flDt;
+    auto qw = m_q.w, qx = m_q.x, qy = m_q.y, qz = m_q.z;
+    m_q.w += h * (-qx * aflGyro[0] - qy * aflGyro[1] - qz * aflGyro[2]);
+    m_q.x += h * (qw * aflGyro[0] + qy * aflGyro[2] - qz * aflGyro[1]);
+    m_q.y += h * (qw * aflGyro[1] - qx * aflGyro[2] + qz * aflGyro[0]);
+    m_q.z += h * (qw * aflGyro[2] + qx * aflGyro[1] - qy * aflGyro[0]);
+
+    auto flNorm = sqrt(m_q.w * m_q.w + m_q.x * m_q.x + m_q.y * m_q.y + m_q.z * m_q.z);
+    m_q.w /= flNorm;
+    m_q.x /= flNorm;
+    m_q.y /= flNorm;
+    m_q.z /= flNorm;
+}
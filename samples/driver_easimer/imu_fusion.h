@@ -0,0 +1,63 @@
+// === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
+
+#pragma once
+#include <openvr_driver.h>
+#include <chrono>
+#include "CSteamController.h"
+
+// Mahony filter gains; Kp pulls the estimate toward the measured gravity,
+// Ki cancels constant gyro bias
+#define FUSION_KP 0.5
+#define FUSION_KI 0.005
+// Accelerometer readings further than this fraction from 1 g are motion,
+// not gravity, and don't correct the tilt
+#define FUSION_ACCEL_TOLERANCE 0.1
+// Sample period assumed until the controller's packet rate is measured
+#define FUSION_DEFAULT_SAMPLE_PERIOD 0.004
+
+//-----------------------------------------------------------------------------
+// Purpose: Mahony orientation filter over the controller's gyro and
+// accelerometer. Every update event is integrated as it is read, so the
+// estimate doesn't depend on the frame rate or on the script.
+// The estimate starts out as the controller's own orientation, so it
+// lives in the same space the scripts already calibrate against.
+//-----------------------------------------------------------------------------
+
+class CImuFusion {
+public:
+	typedef std::chrono::steady_clock clock;
+
+	CImuFusion();
+
+	// Integrate every sample of a batch; tNewest is when the last one was read
+	void AddSamples(const SteamControllerUpdateBatch& batch, clock::time_point tNewest);
+
+	bool IsInitialized() const { return m_bInitialized; }
+	const vr::HmdQuaternion_t& GetOrientation() const { return m_q; }
+	// Measured time between two packet counter ticks
+	double GetSecondsPerTick() const { return m_flSecondsPerTick; }
+
+	void Reset();
+
+private:
+	void AddSample(const SteamControllerUpdateBatch& batch, uint32_t i, clock::time_point tReceived);
+
+	// Time elapsed since the previous sample
+	double SampleDelta(uint32_t unTimeStamp, clock::time_point tReceived);
+
+	bool m_bInitialized;
+	vr::HmdQuaternion_t m_q;
+	// Direction of gravity in the estimate's space, as the accelerometer
+	// sees it at rest
+	double m_aflGravity[3];
+	bool m_bHaveGravity;
+	double m_aflIntegralError[3];
+
+	// Packets are timed by their counter so that a burst read at once
+	// still integrates over the right interval; the counter is calibrated
+	// against the wall clock
+	uint32_t m_unLastTimeStamp;
+	uint32_t m_unCalibrationTimeStamp;
+	clock::time_point m_tCalibration;
+	double m_flSecondsPerTick;
+};
@@ -0,0 +1,272 @@
+// === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
+
+#include "input_binding.h"
+#include "driverlog.h"
+
+#include <json/json.h>
+
+#include <fstream>
+#include <string.h>
+
+using namespace vr;
+
+static const struct {
+    const char* pchName;
+    uint32_t unButton;
+} g_aButtonNames[] = {
+    { "RT", STEAMCONTROLLER_BUTTON_RT },
+    { "LT", STEAMCONTROLLER_BUTTON_LT },
+    { "RS", STEAMCONTROLLER_BUTTON_RS },
+    { "LS", STEAMCONTROLLER_BUTTON_LS },
+    { "Y", STEAMCONTROLLER_BUTTON_Y },
+    { "B", STEAMCONTROLLER_BUTTON_B },
+    { "X", STEAMCONTROLLER_BUTTON_X },
+    { "A", STEAMCONTROLLER_BUTTON_A },
+    { "DPAD_UP", STEAMCONTROLLER_BUTTON_DPAD_UP },
+    { "DPAD_RIGHT", STEAMCONTROLLER_BUTTON_DPAD_RIGHT },
+    { "DPAD_LEFT", STEAMCONTROLLER_BUTTON_DPAD_LEFT },
+    { "DPAD_DOWN", STEAMCONTROLLER_BUTTON_DPAD_DOWN },
+    { "PREV", STEAMCONTROLLER_BUTTON_PREV },
+    { "HOME", STEAMCONTROLLER_BUTTON_HOME },
+    { "NEXT", STEAMCONTROLLER_BUTTON_NEXT },
+    { "LG", STEAMCONTROLLER_BUTTON_LG },
+    { "RG", STEAMCONTROLLER_BUTTON_RG },
+    { "STICK", STEAMCONTROLLER_BUTTON_STICK },
+    { "RPAD", STEAMCONTROLLER_BUTTON_RPAD },
+    { "LFINGER", STEAMCONTROLLER_BUTTON_LFINGER },
+    { "RFINGER", STEAMCONTROLLER_BUTTON_RFINGER },
+};
+
+// Names of the axes, indexed by InputAxis_t
+static const char* const g_apchAxisNames[k_unInputAxis_Max] = {
+    "leftX",
+    "leftY",
+    "rightX",
+    "rightY",
+    "leftTrigger",
+    "rightTrigger",
+};
+
+static bool IsTrigger(InputAxis_t eAxis) {
+    return eAxis == k_unInputAxis_LeftTrigger || eAxis == k_unInputAxis_RightTrigger;
+}
+
+// Raw values of every axis of an update, indexed by InputAxis_t
+static void GetAxes(const SteamControllerUpdateEvent& ev, int32_t* pnAxes) {
+    pnAxes[k_unInputAxis_LeftX] = ev.leftXY.x;
+    pnAxes[k_unInputAxis_LeftY] = ev.leftXY.y;
+    pnAxes[k_unInputAxis_RightX] = ev.rightXY.x;
+    pnAxes[k_unInputAxis_RightY] = ev.rightXY.y;
+    pnAxes[k_unInputAxis_LeftTrigger] = ev.leftTrigger;
+    pnAxes[k_unInputAxis_RightTrigger] = ev.rightTrigger;
+}
+
+// Pads map to [-1, 1], triggers to [0, 1]
+static float NormalizeAxis(InputAxis_t eAxis, int32_t nValue) {
+    if (IsTrigger(eAxis)) {
+        return (float)nValue / 255.0f;
+    }
+    auto flValue = (float)nValue / 32767.0f;
+    return flValue < -1.0f ? -1.0f : flValue;
+}
+
+// Read an optional string member; jsoncpp throws when converting objects
+// and arrays, so anything but a string or null is rejected up front
+static bool GetString(const Json::Value& object, const char* pchKey, std::string& sValue) {
+    auto const& value = object[pchKey];
+    if (value.isNull()) {
+        sValue.clear();
+        return true;
+    }
+    if (!value.isString()) {
+        return false;
+    }
+    sValue = value.asString();
+    return true;
+}
+
+CInputBinding::CInputBinding() :
+    m_unController(0),
+    m_unBoundButtons(0),
+    m_unBoundAxes(0),
+    m_bCreated(false),
+    m_bResend(false),
+    m_bHaveState(false),
+    m_unButtons(0) {
+    memset(m_anAxes, 0, sizeof(m_anAxes));
+}
+
+bool CInputBinding::Load(const std::string& sPath) {
+    std::ifstream file(sPath);
+    if (!file) {
+        DriverLog("No input bindings at %s", sPath.c_str());
+        return false;
+    }
+
+    Json::Value root;
+    Json::Reader reader;
+    if (!reader.parse(file, root) || !root.isObject()) {
+        DriverLogAt(DRIVERLOG_SEVERITY_ERROR, "Input bindings %s are malformed: %s", sPath.c_str(),
+            reader.getFormattedErrorMessages().c_str());
+        return false;
+    }
+
+    auto const& components = root["components"];
+    if (!components.isArray()) {
+        DriverLogAt(DRIVERLOG_SEVERITY_ERROR, "Input bindings %s have no components array", sPath.c_str());
+        return false;
+    }
+
+    std::vector<BooleanComponent_t> booleans;
+    std::vector<ScalarComponent_t> scalars;
+    for (Json::ArrayIndex i = 0; i < components.size(); i++) {
+        auto const& component = components[i];
+        if (!component.isObject()) {
+            DriverLogAt(DRIVERLOG_SEVERITY_ERROR, "Input binding #%u is not an object", i);
+            return false;
+        }
+        std::string sComponentPath, sButton, sAxis;
+        if (!GetString(component, "path", sComponentPath) || !GetString(component, "button", sButton) ||
+            !GetString(component, "axis", sAxis)) {
+            DriverLogAt(DRIVERLOG_SEVERITY_ERROR, "Input binding #%u has a path, button or axis that is not a string", i);
+            return false;
+        }
+        if (sComponentPath.empty() || sButton.empty() == sAxis.empty()) {
+            DriverLogAt(DRIVERLOG_SEVERITY_ERROR, "Input binding #%u needs a path and either a button or an axis", i);
+            return false;
+        }
+
+        if (!sButton.empty()) {
+            BooleanComponent_t binding = { sComponentPath, 0, k_ulInvalidInputComponentHandle };
+            for (auto const& button : g_aButtonNames) {
+                if (sButton == button.pchName) {
+                    binding.unButton = button.unButton;
+                }
+            }
+            if (binding.unButton == 0) {
+                DriverLogAt(DRIVERLOG_SEVERITY_ERROR, "Input binding %s names unknown button %s", sComponentPath.c_str(), sButton.c_str());
+                return false;
+            }
+            booleans.push_back(binding);
+        } else {
+            ScalarComponent_t binding = { sComponentPath, k_unInputAxis_Max, k_ulInvalidInputComponentHandle };
+            for (int j = 0; j < k_unInputAxis_Max; j++) {
+                if (sAxis == g_apchAxisNames[j]) {
+                    binding.eAxis = (InputAxis_t)j;
+                }
+            }
+            if (binding.eAxis == k_unInputAxis_Max) {
+                DriverLogAt(DRIVERLOG_SEVERITY_ERROR, "Input binding %s names unknown axis %s", sComponentPath.c_str(), sAxis.c_str());
+                return false;
+            }
+            scalars.push_back(binding);
+        }
+    }
+
+    std::string sDevice, sProfile;
+    auto const& controller = root["controller"];
+    if (!GetString(root, "device", sDevice) || !GetString(root, "profile", sProfile) ||
+        !(controller.isNull() || controller.isUInt())) {
+        DriverLogAt(DRIVERLOG_SEVERITY_ERROR, "Input bindings %s need a string device and profile and an unsigned controller", sPath.c_str());
+        return false;
+    }
+
+    m_sDevice = sDevice;
+    m_unController = controller.isNull() ? 0 : controller.asUInt();
+    m_sProfile = sProfile;
+    m_booleans.swap(booleans);
+    m_scalars.swap(scalars);
+    m_unBoundButtons = 0;
+    for (auto const& binding : m_booleans) {
+        m_unBoundButtons |= binding.unButton;
+    }
+    m_unBoundAxes = 0;
+    for (auto const& binding : m_scalars) {
+        m_unBoundAxes |= 1u << binding.eAxis;
+    }
+
+    DriverLog("Loaded %u boolean and %u scalar input components for %s from %s",
+        (uint32_t)m_booleans.size(), (uint32_t)m_scalars.size(),
+        m_sDevice.empty() ? "the HMD" : m_sDevice.c_str(), sPath.c_str());
+    return true;
+}
+
+void CInputBinding::CreateComponents(PropertyContainerHandle_t ulContainer) {
+    if (IsEmpty() || m_bCreated.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    if (!m_sProfile.empty()) {
+        VRProperties()->SetStringProperty(ulContainer, Prop_InputProfilePath_String, m_sProfile.c_str());
+    }
+
+    auto pInput = VRDriverInput();
+    for (auto& binding : m_booleans) {
+        auto err = pInput->CreateBooleanComponent(ulContainer, binding.sPath.c_str(), &binding.ulHandle);
+        if (err != VRInputError_None) {
+            DriverLogAt(DRIVERLOG_SEVERITY_WARNING, "Can't create input component %s: error %d", binding.sPath.c_str(), err);
+        }
+    }
+    for (auto& binding : m_scalars) {
+        auto eUnits = IsTrigger(binding.eAxis) ? VRScalarUnits_NormalizedOneSided : VRScalarUnits_NormalizedTwoSided;
+        auto err = pInput->CreateScalarComponent(ulContainer, binding.sPath.c_str(), &binding.ulHandle, VRScalarType_Absolute, eUnits);
+        if (err != VRInputError_None) {
+            DriverLogAt(DRIVERLOG_SEVERITY_WARNING, "Can't create input component %s: error %d", binding.sPath.c_str(), err);
+        }
+    }
+
+    m_bResend.store(true, std::memory_order_relaxed);
+    m_bCreated.store(true, std::memory_order_release);
+}
+
+void CInputBinding::DestroyComponents() {
+    // The server drops the handles of a deactivated device by itself
+    m_bCreated.store(false, std::memory_order_release);
+}
+
+void CInputBinding::Update(const SteamControllerUpdateEvent& ev, double flTimeOffset) {
+    if (!m_bCreated.load(std::memory_order_acquire)) {
+        return;
+    }
+    if (m_bResend.exchange(false, std::memory_order_relaxed)) {
+        m_bHaveState = false;
+    }
+
+    int32_t anAxes[k_unInputAxis_Max];
+    GetAxes(ev, anAxes);
+
+    // Bit per button and per axis that differs from the last update
+    uint32_t unChangedButtons = m_unBoundButtons;
+    uint32_t unChangedAxes = m_unBoundAxes;
+    if (m_bHaveState) {
+        unChangedButtons &= ev.buttons ^ m_unButtons;
+        uint32_t unDiffering = 0;
+        for (int i = 0; i < k_unInputAxis_Max; i++) {
+            unDiffering |= (uint32_t)(anAxes[i] != m_anAxes[i]) << i;
+        }
+        unChangedAxes &= unDiffering;
+    }
+    m_bHaveState = true;
+    m_unButtons = ev.buttons;
+    memcpy(m_anAxes, anAxes, sizeof(m_anAxes));
+
+    if ((unChangedButtons | unChangedAxes) == 0) {
+        return;
+    }
+
+    auto pInput = VRDriverInput();
+    if (unChangedButtons != 0) {
+        for (auto const& binding : m_booleans) {
+            if (binding.unButton & unChangedButtons) {
+                pInput->UpdateBooleanComponent(binding.ulHandle, (ev.buttons & binding.unButton) != 0, flTimeOffset);
+            }
+        }
+    }
+    if (unChangedAxes != 0) {
+        for (auto const& binding : m_scalars) {
+            if (unChangedAxes & (1u << binding.eAxis)) {
+                pInput->UpdateScalarComponent(binding.ulHandle, NormalizeAxis(binding.eAxis, anAxes[binding.eAxis]), flTimeOffset);
+            }
+        }
+    }
+}
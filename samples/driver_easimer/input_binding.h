@@ -0,0 +1,106 @@
+// === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
+
+#pragma once
+#include <openvr_driver.h>
+#include <atomic>
+#include <string>
+#include <vector>
+extern "C" {
+#include <steamcontroller.h>
+}
+
+// Controller axes a scalar component can be bound to
+enum InputAxis_t {
+	k_unInputAxis_LeftX = 0,
+	k_unInputAxis_LeftY,
+	k_unInputAxis_RightX,
+	k_unInputAxis_RightY,
+	k_unInputAxis_LeftTrigger,
+	k_unInputAxis_RightTrigger,
+	k_unInputAxis_Max
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: IVRDriverInput components of one device, fed from a Steam
+// Controller according to a JSON binding file:
+//
+//	{
+//		"device": "SN00000001",		(serial number; default: the HMD)
+//		"controller": 0,			(index of the controller; default 0)
+//		"profile": "{easimer}/input/easimer_profile.json",	(optional)
+//		"components": [
+//			{ "path": "/input/a/click", "button": "A" },
+//			{ "path": "/input/trigger/value", "axis": "rightTrigger" }
+//		]
+//	}
+//
+// Buttons are named after STEAMCONTROLLER_BUTTON_*, without the prefix;
+// axes are leftX, leftY, rightX, rightY, leftTrigger and rightTrigger.
+// Every update is compared against the previous one, the buttons as one
+// bitmask and the axes as one vector, and only components whose input
+// changed are updated.
+//-----------------------------------------------------------------------------
+
+class CInputBinding {
+public:
+	CInputBinding();
+
+	CInputBinding(const CInputBinding&) = delete;
+	void operator=(const CInputBinding&) = delete;
+
+	// Read the binding file; false if it is missing or malformed, which
+	// leaves no components bound
+	bool Load(const std::string& sPath);
+	bool IsEmpty() const { return m_booleans.empty() && m_scalars.empty(); }
+
+	// Serial number of the device the components belong to; empty for
+	// the HMD
+	const std::string& GetDevice() const { return m_sDevice; }
+	uint32_t GetController() const { return m_unController; }
+
+	// Server thread: create the components on the device being activated,
+	// and drop them when it is deactivated
+	void CreateComponents(vr::PropertyContainerHandle_t ulContainer);
+	void DestroyComponents();
+
+	// Thread running the controllers: forget the previous state, so that
+	// the next update sets every component, e.g. for another controller
+	void Reset() { m_bHaveState = false; }
+	// Update the components whose input differs from the last update;
+	// flTimeOffset is when the report was read, relative to now
+	void Update(const SteamControllerUpdateEvent& ev, double flTimeOffset);
+
+private:
+	struct BooleanComponent_t {
+		std::string sPath;
+		uint32_t unButton;
+		vr::VRInputComponentHandle_t ulHandle;
+	};
+
+	struct ScalarComponent_t {
+		std::string sPath;
+		InputAxis_t eAxis;
+		vr::VRInputComponentHandle_t ulHandle;
+	};
+
+	std::string m_sDevice;
+	uint32_t m_unController;
+	std::string m_sProfile;
+	std::vector<BooleanComponent_t> m_booleans;
+	std::vector<ScalarComponent_t> m_scalars;
+	// Buttons any boolean component is bound to
+	uint32_t m_unBoundButtons;
+	// Axes any scalar component is bound to, as a bit per InputAxis_t
+	uint32_t m_unBoundAxes;
+
+	// Set once the handles are valid; Update runs on another thread in
+	// threaded mode. Fresh components need every value once, which
+	// m_bResend asks Update for.
+	std::atomic<bool> m_bCreated;
+	std::atomic<bool> m_bResend;
+
+	// State as of the last update
+	bool m_bHaveState;
+	uint32_t m_unButtons;
+	int32_t m_anAxes[k_unInputAxis_Max];
+};
@@ -0,0 +1,143 @@
+// === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+//-----------------------------------------------------------------------------
+// Purpose: fixed-size HDR-style latency histogram
+// Values are bucketed by their highest set bit and the next
+// k_unSubBucketBits bits, giving ~6% relative precision from 1 ns up to
+// the full 64-bit range in 4 KiB. Recording is wait-free and may happen
+// on any thread; readers get an approximate snapshot.
+//-----------------------------------------------------------------------------
+
+class CLatencyHistogram {
+public:
+	CLatencyHistogram() {
+		Reset();
+	}
+	CLatencyHistogram(const CLatencyHistogram&) = delete;
+	void operator=(const CLatencyHistogram&) = delete;
+
+	void Record(uint64_t ulNanoseconds) {
+		m_aCounts[BucketIndex(ulNanoseconds)].fetch_add(1, std::memory_order_relaxed);
+		m_ulCount.fetch_add(1, std::memory_order_relaxed);
+		m_ulSum.fetch_add(ulNanoseconds, std::memory_order_relaxed);
+		auto ulMax = m_ulMax.load(std::memory_order_relaxed);
+		while (ulNanoseconds > ulMax && !m_ulMax.compare_exchange_weak(ulMax, ulNanoseconds, std::memory_order_relaxed)) {
+		}
+	}
+
+	void Reset() {
+		for (auto& count : m_aCounts) {
+			count.store(0, std::memory_order_relaxed);
+		}
+		m_ulCount.store(0, std::memory_order_relaxed);
+		m_ulSum.store(0, std::memory_order_relaxed);
+		m_ulMax.store(0, std::memory_order_relaxed);
+	}
+
+	uint64_t Count() const { return m_ulCount.load(std::memory_order_relaxed); }
+	uint64_t Max() const { return m_ulMax.load(std::memory_order_relaxed); }
+
+	uint64_t Mean() const {
+		auto ulCount = Count();
+		return ulCount > 0 ? m_ulSum.load(std::memory_order_relaxed) / ulCount : 0;
+	}
+
+	// Upper bound of the bucket holding the given fraction (0..1] of the
+	// recorded values
+	uint64_t Percentile(double flFraction) const {
+		auto ulCount = Count();
+		if (ulCount == 0) {
+			return 0;
+		}
+		auto ulTarget = (uint64_t)(flFraction * ulCount + 0.5);
+		if (ulTarget < 1) {
+			ulTarget = 1;
+		}
+
+		uint64_t ulSeen = 0;
+		for (uint32_t i = 0; i < k_unBuckets; i++) {
+			ulSeen += m_aCounts[i].load(std::memory_order_relaxed);
+			if (ulSeen >= ulTarget) {
+				auto ulBound = BucketUpperBound(i);
+				// Never report more than what was actually seen
+				auto ulMax = Max();
+				return ulBound < ulMax ? ulBound : ulMax;
+			}
+		}
+		return Max();
+	}
+
+private:
+	static const uint32_t k_unSubBucketBits = 4;
+	static const uint32_t k_unSubBuckets = 1 << k_unSubBucketBits;
+	static const uint32_t k_unBuckets = (64 - k_unSubBucketBits + 1) * k_unSubBuckets;
+
+	static uint32_t HighestBit(uint64_t v) {
+#if defined(_MSC_VER)
+		unsigned long idx;
+		_BitScanReverse64(&idx, v);
+		return (uint32_t)idx;
+#else
+		return 63 - (uint32_t)__builtin_clzll(v);
+#endif
+	}
+
+	static uint32_t BucketIndex(uint64_t v) {
+		if (v < k_unSubBuckets) {
+			return (uint32_t)v;
+		}
+		auto unShift = HighestBit(v) - k_unSubBucketBits;
+		// v >> unShift lies in [k_unSubBuckets, 2 * k_unSubBuckets)
+		return (unShift + 1) * k_unSubBuckets + (uint32_t)(v >> unShift) - k_unSubBuckets;
+	}
+
+	static uint64_t BucketUpperBound(uint32_t unIndex) {
+		if (unIndex < k_unSubBuckets) {
+			return unIndex;
+		}
+		auto unShift = unIndex / k_unSubBuckets - 1;
+		uint64_t ulMantissa = k_unSubBuckets + unIndex % k_unSubBuckets;
+		return ((ulMantissa + 1) << unShift) - 1;
+	}
+
+	std::atomic<uint32_t> m_aCounts[k_unBuckets];
+	std::atomic<uint64_t> m_ulCount;
+	std::atomic<uint64_t> m_ulSum;
+	std::atomic<uint64_t> m_ulMax;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: record the lifetime of the scope into a histogram (if any)
+//-----------------------------------------------------------------------------
+
+class CScopedLatency {
+public:
+	CScopedLatency(CLatencyHistogram* pHistogram) :
+		m_pHistogram(pHistogram),
+		m_tStart(std::chrono::steady_clock::now()) {
+	}
+
+	~CScopedLatency() {
+		if (m_pHistogram != NULL) {
+			auto tElapsed = std::chrono::steady_clock::now() - m_tStart;
+			m_pHistogram->Record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(tElapsed).count());
+		}
+	}
+
+	CScopedLatency(const CScopedLatency&) = delete;
+	void operator=(const CScopedLatency&) = delete;
+
+private:
+	CLatencyHistogram* m_pHistogram;
+	std::chrono::steady_clock::time_point m_tStart;
+};
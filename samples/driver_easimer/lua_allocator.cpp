@@ -0,0 +1,204 @@
+// === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
+
+#include "lua_allocator.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static_assert(sizeof(void*) * 2 <= LUA_ALLOC_GRANULARITY, "Block header must fit in one granule");
+
+// Size class of a small block; class i holds blocks of (i + 1) granules
+static inline size_t SizeClass(size_t unSize) {
+    return (unSize - 1) / LUA_ALLOC_GRANULARITY;
+}
+
+static inline size_t ClassSize(size_t unClass) {
+    return (unClass + 1) * LUA_ALLOC_GRANULARITY;
+}
+
+CLuaAllocator::CLuaAllocator() :
+    m_pBump(NULL),
+    m_pBumpEnd(NULL),
+    m_bTearingDown(false),
+    m_unLiveBytes(0),
+    m_unPeakBytes(0),
+    m_unReservedBytes(0),
+    m_ulAllocations(0),
+    m_ulFrameStartAllocations(0),
+    m_unLastFrameAllocations(0) {
+    for (size_t i = 0; i < LUA_ALLOC_SIZE_CLASSES; i++) {
+        m_apFreeLists[i] = NULL;
+    }
+    m_chunks.pPrev = m_chunks.pNext = &m_chunks;
+    m_largeBlocks.pPrev = m_largeBlocks.pNext = &m_largeBlocks;
+}
+
+CLuaAllocator::~CLuaAllocator() {
+    ReleaseAll(&m_largeBlocks);
+    ReleaseAll(&m_chunks);
+}
+
+void* CLuaAllocator::Alloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+    return ((CLuaAllocator*)ud)->Realloc(ptr, osize, nsize);
+}
+
+void CLuaAllocator::BeginTeardown() {
+    m_bTearingDown = true;
+}
+
+void CLuaAllocator::EndFrame() {
+    m_unLastFrameAllocations = (uint32_t)(m_ulAllocations - m_ulFrameStartAllocations);
+    m_ulFrameStartAllocations = m_ulAllocations;
+}
+
+void CLuaAllocator::GetStats(LuaAllocatorStats_t& stats) const {
+    stats.unLiveBytes = m_unLiveBytes;
+    stats.unPeakBytes = m_unPeakBytes;
+    stats.unReservedBytes = m_unReservedBytes;
+    stats.ulAllocations = m_ulAllocations;
+    stats.unLastFrameAllocations = m_unLastFrameAllocations;
+}
+
+// Follows the lua_Alloc contract: when ptr is not NULL, osize is the size
+// it was allocated with, so blocks need no size header
+void* CLuaAllocator::Realloc(void* ptr, size_t osize, size_t nsize) {
+    if (nsize == 0) {
+        if (ptr != NULL) {
+            m_unLiveBytes -= osize;
+            if (!m_bTearingDown) {
+                if (osize <= LUA_ALLOC_MAX_SMALL) {
+                    FreeSmall(ptr, SizeClass(osize));
+                } else {
+                    FreeLarge(ptr);
+                }
+            }
+        }
+        return NULL;
+    }
+
+    void* pNew = NULL;
+    if (ptr == NULL) {
+        osize = 0;
+        if (nsize <= LUA_ALLOC_MAX_SMALL) {
+            pNew = AllocSmall(SizeClass(nsize));
+        } else {
+            pNew = AllocLarge(nsize);
+        }
+    } else if (osize <= LUA_ALLOC_MAX_SMALL && nsize <= LUA_ALLOC_MAX_SMALL && SizeClass(osize) == SizeClass(nsize)) {
+        // Still fits the same block
+        pNew = ptr;
+    } else if (osize > LUA_ALLOC_MAX_SMALL && nsize > LUA_ALLOC_MAX_SMALL) {
+        pNew = ReallocLarge(ptr, nsize);
+    } else {
+        // Moving between a small and a large block, or between classes
+        if (nsize <= LUA_ALLOC_MAX_SMALL) {
+            pNew = AllocSmall(SizeClass(nsize));
+        } else {
+            pNew = AllocLarge(nsize);
+        }
+        if (pNew != NULL) {
+            memcpy(pNew, ptr, osize < nsize ? osize : nsize);
+            if (!m_bTearingDown) {
+                if (osize <= LUA_ALLOC_MAX_SMALL) {
+                    FreeSmall(ptr, SizeClass(osize));
+                } else {
+                    FreeLarge(ptr);
+                }
+            }
+        }
+    }
+
+    // On failure Lua keeps using the old block
+    if (pNew != NULL) {
+        m_unLiveBytes = m_unLiveBytes - osize + nsize;
+        if (m_unLiveBytes > m_unPeakBytes) {
+            m_unPeakBytes = m_unLiveBytes;
+        }
+        m_ulAllocations++;
+    }
+    return pNew;
+}
+
+void* CLuaAllocator::AllocSmall(size_t unClass) {
+    auto pBlock = m_apFreeLists[unClass];
+    if (pBlock != NULL) {
+        m_apFreeLists[unClass] = pBlock->pNext;
+        return pBlock;
+    }
+
+    auto unSize = ClassSize(unClass);
+    if ((size_t)(m_pBumpEnd - m_pBump) < unSize) {
+        // The rest of the current chunk is abandoned; it is smaller than
+        // the largest size class
+        auto pChunk = (BlockHeader_t*)malloc(LUA_ALLOC_CHUNK_SIZE);
+        if (pChunk == NULL) {
+            return NULL;
+        }
+        Link(&m_chunks, pChunk);
+        m_unReservedBytes += LUA_ALLOC_CHUNK_SIZE;
+        m_pBump = (char*)pChunk + LUA_ALLOC_GRANULARITY;
+        m_pBumpEnd = (char*)pChunk + LUA_ALLOC_CHUNK_SIZE;
+    }
+
+    auto pRet = m_pBump;
+    m_pBump += unSize;
+    return pRet;
+}
+
+void CLuaAllocator::FreeSmall(void* ptr, size_t unClass) {
+    auto pBlock = (FreeBlock_t*)ptr;
+    pBlock->pNext = m_apFreeLists[unClass];
+    m_apFreeLists[unClass] = pBlock;
+}
+
+void* CLuaAllocator::AllocLarge(size_t unSize) {
+    auto pBlock = (BlockHeader_t*)malloc(LUA_ALLOC_GRANULARITY + unSize);
+    if (pBlock == NULL) {
+        return NULL;
+    }
+    Link(&m_largeBlocks, pBlock);
+    return (char*)pBlock + LUA_ALLOC_GRANULARITY;
+}
+
+void* CLuaAllocator::ReallocLarge(void* ptr, size_t unSize) {
+    auto pOld = (BlockHeader_t*)((char*)ptr - LUA_ALLOC_GRANULARITY);
+    // Take the block out of the list first: realloc may move it
+    auto pPrev = pOld->pPrev;
+    Unlink(pOld);
+    auto pBlock = (BlockHeader_t*)realloc(pOld, LUA_ALLOC_GRANULARITY + unSize);
+    if (pBlock == NULL) {
+        Link(pPrev, pOld);
+        return NULL;
+    }
+    Link(pPrev, pBlock);
+    return (char*)pBlock + LUA_ALLOC_GRANULARITY;
+}
+
+void CLuaAllocator::FreeLarge(void* ptr) {
+    auto pBlock = (BlockHeader_t*)((char*)ptr - LUA_ALLOC_GRANULARITY);
+    Unlink(pBlock);
+    free(pBlock);
+}
+
+// Insert pBlock after pList
+void CLuaAllocator::Link(BlockHeader_t* pList, BlockHeader_t* pBlock) {
+    pBlock->pPrev = pList;
+    pBlock->pNext = pList->pNext;
+    pList->pNext->pPrev = pBlock;
+    pList->pNext = pBlock;
+}
+
+void CLuaAllocator::Unlink(BlockHeader_t* pBlock) {
+    pBlock->pPrev->pNext = pBlock->pNext;
+    pBlock->pNext->pPrev = pBlock->pPrev;
+}
+
+void CLuaAllocator::ReleaseAll(BlockHeader_t* pList) {
+    auto pBlock = pList->pNext;
+    while (pBlock != pList) {
+        auto pNext = pBlock->pNext;
+        free(pBlock);
+        pBlock = pNext;
+    }
+    pList->pPrev = pList->pNext = pList;
+}
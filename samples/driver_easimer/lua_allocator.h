@@ -0,0 +1,91 @@
+// === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Blocks up to this size are served from size-class free lists
+#define LUA_ALLOC_MAX_SMALL 512
+#define LUA_ALLOC_GRANULARITY 16
+#define LUA_ALLOC_SIZE_CLASSES (LUA_ALLOC_MAX_SMALL / LUA_ALLOC_GRANULARITY)
+// Small blocks are carved out of chunks of this size
+#define LUA_ALLOC_CHUNK_SIZE (64 * 1024)
+
+struct LuaAllocatorStats_t {
+	size_t unLiveBytes;
+	size_t unPeakBytes;
+	// Memory held in small-block chunks
+	size_t unReservedBytes;
+	uint64_t ulAllocations;
+	uint32_t unLastFrameAllocations;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: lua_Alloc implementation backing one lua_State
+// Small blocks come from per-size-class free lists over 64 KiB chunks,
+// large blocks from the system allocator, tracked so that everything can
+// be released at once when the state goes away. Not thread-safe; the
+// state is only ever used by one thread at a time.
+//-----------------------------------------------------------------------------
+
+class CLuaAllocator {
+public:
+	CLuaAllocator();
+	~CLuaAllocator();
+	CLuaAllocator(const CLuaAllocator&) = delete;
+	void operator=(const CLuaAllocator&) = delete;
+
+	// lua_Alloc entry point; ud is the CLuaAllocator
+	static void* Alloc(void* ud, void* ptr, size_t osize, size_t nsize);
+
+	// Called right before lua_close: frees become no-ops and the memory
+	// is returned in bulk by the destructor
+	void BeginTeardown();
+
+	// Mark a frame boundary for the per-frame allocation counter
+	void EndFrame();
+
+	void GetStats(LuaAllocatorStats_t& stats) const;
+
+private:
+	struct FreeBlock_t {
+		FreeBlock_t* pNext;
+	};
+
+	// Header of every chunk and large block; 16 bytes so that the
+	// payload keeps malloc's alignment
+	struct BlockHeader_t {
+		BlockHeader_t* pPrev;
+		BlockHeader_t* pNext;
+	};
+
+	void* Realloc(void* ptr, size_t osize, size_t nsize);
+	void* AllocSmall(size_t unClass);
+	void FreeSmall(void* ptr, size_t unClass);
+	void* AllocLarge(size_t unSize);
+	void* ReallocLarge(void* ptr, size_t unSize);
+	void FreeLarge(void* ptr);
+
+	static void Link(BlockHeader_t* pList, BlockHeader_t* pBlock);
+	static void Unlink(BlockHeader_t* pBlock);
+	static void ReleaseAll(BlockHeader_t* pList);
+
+	FreeBlock_t* m_apFreeLists[LUA_ALLOC_SIZE_CLASSES];
+
+	// Circular lists with a sentinel head
+	BlockHeader_t m_chunks;
+	BlockHeader_t m_largeBlocks;
+
+	// Unused tail of the newest chunk
+	char* m_pBump;
+	char* m_pBumpEnd;
+
+	bool m_bTearingDown;
+
+	size_t m_unLiveBytes;
+	size_t m_unPeakBytes;
+	size_t m_unReservedBytes;
+	uint64_t m_ulAllocations;
+	uint64_t m_ulFrameStartAllocations;
+	uint32_t m_unLastFrameAllocations;
+};
@@ -0,0 +1,877 @@
+// === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
+
+#include "lua_vrmath.h"
+
+extern "C" {
+#include "lauxlib.h"
+#include "lua.h"
+}
+
+#include <math.h>
+
+using namespace vr;
+
+#define META_QUAT "vrmath.Quat"
+#define META_VEC3 "vrmath.Vec3"
+#define META_MAT34 "vrmath.Mat34"
+
+// Below this cosine slerp degenerates to nlerp
+#define SLERP_NLERP_THRESHOLD 0.9995
+
+//-----------------------------------------------------------------------------
+// Math helpers
+//-----------------------------------------------------------------------------
+
+static inline HmdQuaternion_t QuatMul(const HmdQuaternion_t& lhs, const HmdQuaternion_t& rhs) {
+    HmdQuaternion_t ret;
+    ret.w = lhs.w * rhs.w - lhs.x * rhs.x - lhs.y * rhs.y - lhs.z * rhs.z;
+    ret.x = lhs.w * rhs.x + lhs.x * rhs.w + lhs.y * rhs.z - lhs.z * rhs.y;
+    ret.y = lhs.w * rhs.y + lhs.y * rhs.w + lhs.z * rhs.x - lhs.x * rhs.z;
+    ret.z = lhs.w * rhs.z + lhs.z * rhs.w + lhs.x * rhs.y - lhs.y * rhs.x;
+    return ret;
+}
+
+static inline double QuatDot(const HmdQuaternion_t& lhs, const HmdQuaternion_t& rhs) {
+    return lhs.w * rhs.w + lhs.x * rhs.x + lhs.y * rhs.y + lhs.z * rhs.z;
+}
+
+static inline HmdQuaternion_t QuatConjugate(const HmdQuaternion_t& q) {
+    return { q.w, -q.x, -q.y, -q.z };
+}
+
+static inline HmdQuaternion_t QuatInverse(const HmdQuaternion_t& q) {
+    auto len = QuatDot(q, q);
+    if (len == 0) {
+        return q;
+    }
+    return { q.w / len, -q.x / len, -q.y / len, -q.z / len };
+}
+
+static inline HmdQuaternion_t QuatNormalize(const HmdQuaternion_t& q) {
+    auto len = sqrt(QuatDot(q, q));
+    if (len == 0) {
+        return q;
+    }
+    return { q.w / len, q.x / len, q.y / len, q.z / len };
+}
+
+static inline HmdQuaternion_t QuatNlerp(const HmdQuaternion_t& a, const HmdQuaternion_t& b, double t) {
+    // Take the shortest path
+    auto s = QuatDot(a, b) < 0 ? -t : t;
+    auto u = 1 - t;
+    return QuatNormalize({
+        u * a.w + s * b.w,
+        u * a.x + s * b.x,
+        u * a.y + s * b.y,
+        u * a.z + s * b.z,
+    });
+}
+
+HmdQuaternion_t QuatSlerp(const HmdQuaternion_t& a, const HmdQuaternion_t& b, double t) {
+    auto cosTheta = QuatDot(a, b);
+    auto sign = 1.0;
+    if (cosTheta < 0) {
+        cosTheta = -cosTheta;
+        sign = -1.0;
+    }
+
+    if (cosTheta > SLERP_NLERP_THRESHOLD) {
+        return QuatNlerp(a, b, t);
+    }
+
+    auto theta = acos(cosTheta);
+    auto sinTheta = sin(theta);
+    auto wa = sin((1 - t) * theta) / sinTheta;
+    auto wb = sign * sin(t * theta) / sinTheta;
+    return {
+        wa * a.w + wb * b.w,
+        wa * a.x + wb * b.x,
+        wa * a.y + wb * b.y,
+        wa * a.z + wb * b.z,
+    };
+}
+
+// Rotate v by the unit quaternion q
+static inline HmdVector3d_t QuatRotate(const HmdQuaternion_t& q, const HmdVector3d_t& v) {
+    // t = 2 * cross(q.xyz, v)
+    double tx = 2 * (q.y * v.v[2] - q.z * v.v[1]);
+    double ty = 2 * (q.z * v.v[0] - q.x * v.v[2]);
+    double tz = 2 * (q.x * v.v[1] - q.y * v.v[0]);
+    // v + w * t + cross(q.xyz, t)
+    HmdVector3d_t ret;
+    ret.v[0] = v.v[0] + q.w * tx + (q.y * tz - q.z * ty);
+    ret.v[1] = v.v[1] + q.w * ty + (q.z * tx - q.x * tz);
+    ret.v[2] = v.v[2] + q.w * tz + (q.x * ty - q.y * tx);
+    return ret;
+}
+
+static inline HmdMatrix34_t Mat34Identity() {
+    HmdMatrix34_t ret = { {
+        { 1, 0, 0, 0 },
+        { 0, 1, 0, 0 },
+        { 0, 0, 1, 0 },
+    } };
+    return ret;
+}
+
+static inline HmdMatrix34_t Mat34FromRotationTranslation(const HmdQuaternion_t& q, const HmdVector3d_t& t) {
+    HmdMatrix34_t ret;
+    double xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+    double xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+    double wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+
+    ret.m[0][0] = (float)(1 - 2 * (yy + zz));
+    ret.m[0][1] = (float)(2 * (xy - wz));
+    ret.m[0][2] = (float)(2 * (xz + wy));
+    ret.m[0][3] = (float)t.v[0];
+    ret.m[1][0] = (float)(2 * (xy + wz));
+    ret.m[1][1] = (float)(1 - 2 * (xx + zz));
+    ret.m[1][2] = (float)(2 * (yz - wx));
+    ret.m[1][3] = (float)t.v[1];
+    ret.m[2][0] = (float)(2 * (xz - wy));
+    ret.m[2][1] = (float)(2 * (yz + wx));
+    ret.m[2][2] = (float)(1 - 2 * (xx + yy));
+    ret.m[2][3] = (float)t.v[2];
+    return ret;
+}
+
+// Extract the rotation part of an affine transform as a quaternion
+static inline HmdQuaternion_t Mat34GetRotation(const HmdMatrix34_t& m) {
+    HmdQuaternion_t q;
+    double trace = m.m[0][0] + m.m[1][1] + m.m[2][2];
+    if (trace > 0) {
+        double s = 0.5 / sqrt(trace + 1);
+        q.w = 0.25 / s;
+        q.x = (m.m[2][1] - m.m[1][2]) * s;
+        q.y = (m.m[0][2] - m.m[2][0]) * s;
+        q.z = (m.m[1][0] - m.m[0][1]) * s;
+    } else if (m.m[0][0] > m.m[1][1] && m.m[0][0] > m.m[2][2]) {
+        double s = 2 * sqrt(1 + m.m[0][0] - m.m[1][1] - m.m[2][2]);
+        q.w = (m.m[2][1] - m.m[1][2]) / s;
+        q.x = 0.25 * s;
+        q.y = (m.m[0][1] + m.m[1][0]) / s;
+        q.z = (m.m[0][2] + m.m[2][0]) / s;
+    } else if (m.m[1][1] > m.m[2][2]) {
+        double s = 2 * sqrt(1 + m.m[1][1] - m.m[0][0] - m.m[2][2]);
+        q.w = (m.m[0][2] - m.m[2][0]) / s;
+        q.x = (m.m[0][1] + m.m[1][0]) / s;
+        q.y = 0.25 * s;
+        q.z = (m.m[1][2] + m.m[2][1]) / s;
+    } else {
+        double s = 2 * sqrt(1 + m.m[2][2] - m.m[0][0] - m.m[1][1]);
+        q.w = (m.m[1][0] - m.m[0][1]) / s;
+        q.x = (m.m[0][2] + m.m[2][0]) / s;
+        q.y = (m.m[1][2] + m.m[2][1]) / s;
+        q.z = 0.25 * s;
+    }
+    return q;
+}
+
+// Compose two affine transforms (lhs applied after rhs)
+static inline HmdMatrix34_t Mat34Mul(const HmdMatrix34_t& lhs, const HmdMatrix34_t& rhs) {
+    HmdMatrix34_t ret;
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 4; c++) {
+            ret.m[r][c] =
+                lhs.m[r][0] * rhs.m[0][c] +
+                lhs.m[r][1] * rhs.m[1][c] +
+                lhs.m[r][2] * rhs.m[2][c];
+        }
+        ret.m[r][3] += lhs.m[r][3];
+    }
+    return ret;
+}
+
+static inline HmdVector3d_t Mat34Transform(const HmdMatrix34_t& m, const HmdVector3d_t& v) {
+    HmdVector3d_t ret;
+    for (int r = 0; r < 3; r++) {
+        ret.v[r] = m.m[r][0] * v.v[0] + m.m[r][1] * v.v[1] + m.m[r][2] * v.v[2] + m.m[r][3];
+    }
+    return ret;
+}
+
+// Invert an affine transform; returns false if it is singular
+static inline bool Mat34Invert(const HmdMatrix34_t& m, HmdMatrix34_t& out) {
+    double a = m.m[0][0], b = m.m[0][1], c = m.m[0][2];
+    double d = m.m[1][0], e = m.m[1][1], f = m.m[1][2];
+    double g = m.m[2][0], h = m.m[2][1], i = m.m[2][2];
+
+    double A = e * i - f * h, B = -(d * i - f * g), C = d * h - e * g;
+    double det = a * A + b * B + c * C;
+    if (det == 0) {
+        return false;
+    }
+    double inv = 1 / det;
+
+    HmdMatrix34_t ret;
+    ret.m[0][0] = (float)(A * inv);
+    ret.m[0][1] = (float)(-(b * i - c * h) * inv);
+    ret.m[0][2] = (float)((b * f - c * e) * inv);
+    ret.m[1][0] = (float)(B * inv);
+    ret.m[1][1] = (float)((a * i - c * g) * inv);
+    ret.m[1][2] = (float)(-(a * f - c * d) * inv);
+    ret.m[2][0] = (float)(C * inv);
+    ret.m[2][1] = (float)(-(a * h - b * g) * inv);
+    ret.m[2][2] = (float)((a * e - b * d) * inv);
+    for (int r = 0; r < 3; r++) {
+        ret.m[r][3] = -(ret.m[r][0] * m.m[0][3] + ret.m[r][1] * m.m[1][3] + ret.m[r][2] * m.m[2][3]);
+    }
+    out = ret;
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Userdata access
+//-----------------------------------------------------------------------------
+
+HmdQuaternion_t* ToQuat(lua_State* L, int idx) {
+    return (HmdQuaternion_t*)luaL_testudata(L, idx, META_QUAT);
+}
+
+HmdVector3d_t* ToVec3(lua_State* L, int idx) {
+    return (HmdVector3d_t*)luaL_testudata(L, idx, META_VEC3);
+}
+
+HmdMatrix34_t* ToMat34(lua_State* L, int idx) {
+    return (HmdMatrix34_t*)luaL_testudata(L, idx, META_MAT34);
+}
+
+static HmdQuaternion_t* CheckQuat(lua_State* L, int idx) {
+    return (HmdQuaternion_t*)luaL_checkudata(L, idx, META_QUAT);
+}
+
+static HmdVector3d_t* CheckVec3(lua_State* L, int idx) {
+    return (HmdVector3d_t*)luaL_checkudata(L, idx, META_VEC3);
+}
+
+static HmdMatrix34_t* CheckMat34(lua_State* L, int idx) {
+    return (HmdMatrix34_t*)luaL_checkudata(L, idx, META_MAT34);
+}
+
+HmdQuaternion_t* PushQuat(lua_State* L, const HmdQuaternion_t& q) {
+    auto pQ = (HmdQuaternion_t*)lua_newuserdata(L, sizeof(HmdQuaternion_t));
+    *pQ = q;
+    luaL_setmetatable(L, META_QUAT);
+    return pQ;
+}
+
+HmdVector3d_t* PushVec3(lua_State* L, const HmdVector3d_t& v) {
+    auto pV = (HmdVector3d_t*)lua_newuserdata(L, sizeof(HmdVector3d_t));
+    *pV = v;
+    luaL_setmetatable(L, META_VEC3);
+    return pV;
+}
+
+HmdMatrix34_t* PushMat34(lua_State* L, const HmdMatrix34_t& m) {
+    auto pM = (HmdMatrix34_t*)lua_newuserdata(L, sizeof(HmdMatrix34_t));
+    *pM = m;
+    luaL_setmetatable(L, META_MAT34);
+    return pM;
+}
+
+// Read a quaternion given either as a Quat or as four numbers at idx
+static HmdQuaternion_t CheckQuatArgs(lua_State* L, int idx) {
+    auto pQ = ToQuat(L, idx);
+    if (pQ) {
+        return *pQ;
+    }
+    return {
+        luaL_checknumber(L, idx + 0),
+        luaL_checknumber(L, idx + 1),
+        luaL_checknumber(L, idx + 2),
+        luaL_checknumber(L, idx + 3),
+    };
+}
+
+// Read a vector given either as a Vec3 or as three numbers at idx
+static HmdVector3d_t CheckVec3Args(lua_State* L, int idx) {
+    auto pV = ToVec3(L, idx);
+    if (pV) {
+        return *pV;
+    }
+    HmdVector3d_t ret;
+    ret.v[0] = luaL_checknumber(L, idx + 0);
+    ret.v[1] = luaL_checknumber(L, idx + 1);
+    ret.v[2] = luaL_checknumber(L, idx + 2);
+    return ret;
+}
+
+// Map a single character field name to a component index
+// Returns -1 if the key isn't one of the given component names.
+static int ComponentIndex(lua_State* L, int idx, const char* pchNames) {
+    size_t len;
+    auto pchKey = lua_tolstring(L, idx, &len);
+    if (pchKey == NULL || len != 1) {
+        return -1;
+    }
+    for (int i = 0; pchNames[i]; i++) {
+        if (pchNames[i] == pchKey[0]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Shared __index: component fields first, then the method table in upvalue 1
+#define COMPONENT_INDEX(name, type, check, names, fields)      \
+static int name(lua_State* L) {                                 \
+    type* p = check(L, 1);                                      \
+    if (lua_type(L, 2) == LUA_TSTRING) {                        \
+        int i = ComponentIndex(L, 2, names);                    \
+        if (i >= 0) {                                           \
+            lua_pushnumber(L, fields[i]);                       \
+            return 1;                                           \
+        }                                                       \
+    }                                                           \
+    lua_pushvalue(L, 2);                                        \
+    lua_rawget(L, lua_upvalueindex(1));                         \
+    return 1;                                                   \
+}
+
+#define COMPONENT_NEWINDEX(name, type, check, names, fields)   \
+static int name(lua_State* L) {                                 \
+    type* p = check(L, 1);                                      \
+    int i = ComponentIndex(L, 2, names);                        \
+    if (i < 0) {                                                \
+        return luaL_error(L, "invalid field '%s'", lua_tostring(L, 2)); \
+    }                                                           \
+    fields[i] = luaL_checknumber(L, 3);                         \
+    return 0;                                                   \
+}
+
+//-----------------------------------------------------------------------------
+// Quat
+//-----------------------------------------------------------------------------
+
+// Quaternion components in wxyz order
+#define QUAT_FIELDS(p) ((double*)&(p)->w)
+
+COMPONENT_INDEX(Lua_Quat_Index, HmdQuaternion_t, CheckQuat, "wxyz", QUAT_FIELDS(p))
+COMPONENT_NEWINDEX(Lua_Quat_NewIndex, HmdQuaternion_t, CheckQuat, "wxyz", QUAT_FIELDS(p))
+
+// vrmath.Quat([w, x, y, z]) or vrmath.Quat(q)
+static int Lua_Quat_New(lua_State* L) {
+    if (lua_gettop(L) == 0) {
+        PushQuat(L, { 1, 0, 0, 0 });
+    } else {
+        PushQuat(L, CheckQuatArgs(L, 1));
+    }
+    return 1;
+}
+
+// q * r -> Quat, q * v -> rotated Vec3
+static int Lua_Quat_Mul(lua_State* L) {
+    auto pLhs = CheckQuat(L, 1);
+    auto pVec = ToVec3(L, 2);
+    if (pVec) {
+        PushVec3(L, QuatRotate(*pLhs, *pVec));
+    } else {
+        PushQuat(L, QuatMul(*pLhs, *CheckQuat(L, 2)));
+    }
+    return 1;
+}
+
+static int Lua_Quat_Eq(lua_State* L) {
+    auto pLhs = CheckQuat(L, 1);
+    auto pRhs = CheckQuat(L, 2);
+    lua_pushboolean(L, pLhs->w == pRhs->w && pLhs->x == pRhs->x && pLhs->y == pRhs->y && pLhs->z == pRhs->z);
+    return 1;
+}
+
+static int Lua_Quat_ToString(lua_State* L) {
+    auto pQ = CheckQuat(L, 1);
+    lua_pushfstring(L, "Quat(%f, %f, %f, %f)", pQ->w, pQ->x, pQ->y, pQ->z);
+    return 1;
+}
+
+static int Lua_Quat_Copy(lua_State* L) {
+    PushQuat(L, *CheckQuat(L, 1));
+    return 1;
+}
+
+static int Lua_Quat_Conjugate(lua_State* L) {
+    PushQuat(L, QuatConjugate(*CheckQuat(L, 1)));
+    return 1;
+}
+
+static int Lua_Quat_Inverse(lua_State* L) {
+    PushQuat(L, QuatInverse(*CheckQuat(L, 1)));
+    return 1;
+}
+
+static int Lua_Quat_Normalized(lua_State* L) {
+    PushQuat(L, QuatNormalize(*CheckQuat(L, 1)));
+    return 1;
+}
+
+static int Lua_Quat_Length(lua_State* L) {
+    auto pQ = CheckQuat(L, 1);
+    lua_pushnumber(L, sqrt(QuatDot(*pQ, *pQ)));
+    return 1;
+}
+
+static int Lua_Quat_Dot(lua_State* L) {
+    lua_pushnumber(L, QuatDot(*CheckQuat(L, 1), *CheckQuat(L, 2)));
+    return 1;
+}
+
+// q:Rotate(v) -> Vec3
+static int Lua_Quat_Rotate(lua_State* L) {
+    PushVec3(L, QuatRotate(*CheckQuat(L, 1), CheckVec3Args(L, 2)));
+    return 1;
+}
+
+// vrmath.Slerp(a, b, t) -> Quat
+static int Lua_Quat_Slerp(lua_State* L) {
+    PushQuat(L, QuatSlerp(*CheckQuat(L, 1), *CheckQuat(L, 2), luaL_checknumber(L, 3)));
+    return 1;
+}
+
+// vrmath.Nlerp(a, b, t) -> Quat
+static int Lua_Quat_Nlerp(lua_State* L) {
+    PushQuat(L, QuatNlerp(*CheckQuat(L, 1), *CheckQuat(L, 2), luaL_checknumber(L, 3)));
+    return 1;
+}
+
+// In-place variants; these return self and never allocate
+
+// q:Set(w, x, y, z) or q:Set(r)
+static int Lua_Quat_Set(lua_State* L) {
+    *CheckQuat(L, 1) = CheckQuatArgs(L, 2);
+    lua_settop(L, 1);
+    return 1;
+}
+
+// q:MulInPlace(r): q = q * r
+static int Lua_Quat_MulInPlace(lua_State* L) {
+    auto pQ = CheckQuat(L, 1);
+    *pQ = QuatMul(*pQ, *CheckQuat(L, 2));
+    lua_settop(L, 1);
+    return 1;
+}
+
+// q:SetMul(a, b): q = a * b
+static int Lua_Quat_SetMul(lua_State* L) {
+    *CheckQuat(L, 1) = QuatMul(*CheckQuat(L, 2), *CheckQuat(L, 3));
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int Lua_Quat_ConjugateInPlace(lua_State* L) {
+    auto pQ = CheckQuat(L, 1);
+    *pQ = QuatConjugate(*pQ);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int Lua_Quat_InvertInPlace(lua_State* L) {
+    auto pQ = CheckQuat(L, 1);
+    *pQ = QuatInverse(*pQ);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int Lua_Quat_NormalizeInPlace(lua_State* L) {
+    auto pQ = CheckQuat(L, 1);
+    *pQ = QuatNormalize(*pQ);
+    lua_settop(L, 1);
+    return 1;
+}
+
+// q:SetSlerp(a, b, t): q = slerp(a, b, t)
+static int Lua_Quat_SetSlerp(lua_State* L) {
+    *CheckQuat(L, 1) = QuatSlerp(*CheckQuat(L, 2), *CheckQuat(L, 3), luaL_checknumber(L, 4));
+    lua_settop(L, 1);
+    return 1;
+}
+
+// q:SetNlerp(a, b, t): q = nlerp(a, b, t)
+static int Lua_Quat_SetNlerp(lua_State* L) {
+    *CheckQuat(L, 1) = QuatNlerp(*CheckQuat(L, 2), *CheckQuat(L, 3), luaL_checknumber(L, 4));
+    lua_settop(L, 1);
+    return 1;
+}
+
+static const luaL_Reg g_aQuatMethods[] = {
+    { "Copy", Lua_Quat_Copy },
+    { "Conjugate", Lua_Quat_Conjugate },
+    { "Inverse", Lua_Quat_Inverse },
+    { "Normalized", Lua_Quat_Normalized },
+    { "Length", Lua_Quat_Length },
+    { "Dot", Lua_Quat_Dot },
+    { "Rotate", Lua_Quat_Rotate },
+    { "Set", Lua_Quat_Set },
+    { "MulInPlace", Lua_Quat_MulInPlace },
+    { "SetMul", Lua_Quat_SetMul },
+    { "ConjugateInPlace", Lua_Quat_ConjugateInPlace },
+    { "InvertInPlace", Lua_Quat_InvertInPlace },
+    { "NormalizeInPlace", Lua_Quat_NormalizeInPlace },
+    { "SetSlerp", Lua_Quat_SetSlerp },
+    { "SetNlerp", Lua_Quat_SetNlerp },
+    { NULL, NULL }
+};
+
+static const luaL_Reg g_aQuatMeta[] = {
+    { "__newindex", Lua_Quat_NewIndex },
+    { "__mul", Lua_Quat_Mul },
+    { "__eq", Lua_Quat_Eq },
+    { "__tostring", Lua_Quat_ToString },
+    { NULL, NULL }
+};
+
+//-----------------------------------------------------------------------------
+// Vec3
+//-----------------------------------------------------------------------------
+
+#define VEC3_FIELDS(p) ((p)->v)
+
+COMPONENT_INDEX(Lua_Vec3_Index, HmdVector3d_t, CheckVec3, "xyz", VEC3_FIELDS(p))
+COMPONENT_NEWINDEX(Lua_Vec3_NewIndex, HmdVector3d_t, CheckVec3, "xyz", VEC3_FIELDS(p))
+
+// vrmath.Vec3([x, y, z]) or vrmath.Vec3(v)
+static int Lua_Vec3_New(lua_State* L) {
+    if (lua_gettop(L) == 0) {
+        HmdVector3d_t v = { { 0, 0, 0 } };
+        PushVec3(L, v);
+    } else {
+        PushVec3(L, CheckVec3Args(L, 1));
+    }
+    return 1;
+}
+
+static int Lua_Vec3_Add(lua_State* L) {
+    auto pLhs = CheckVec3(L, 1);
+    auto pRhs = CheckVec3(L, 2);
+    HmdVector3d_t ret = { { pLhs->v[0] + pRhs->v[0], pLhs->v[1] + pRhs->v[1], pLhs->v[2] + pRhs->v[2] } };
+    PushVec3(L, ret);
+    return 1;
+}
+
+static int Lua_Vec3_Sub(lua_State* L) {
+    auto pLhs = CheckVec3(L, 1);
+    auto pRhs = CheckVec3(L, 2);
+    HmdVector3d_t ret = { { pLhs->v[0] - pRhs->v[0], pLhs->v[1] - pRhs->v[1], pLhs->v[2] - pRhs->v[2] } };
+    PushVec3(L, ret);
+    return 1;
+}
+
+static int Lua_Vec3_Unm(lua_State* L) {
+    auto pV = CheckVec3(L, 1);
+    HmdVector3d_t ret = { { -pV->v[0], -pV->v[1], -pV->v[2] } };
+    PushVec3(L, ret);
+    return 1;
+}
+
+// v * s or s * v
+static int Lua_Vec3_Mul(lua_State* L) {
+    int iVec = ToVec3(L, 1) ? 1 : 2;
+    auto pV = CheckVec3(L, iVec);
+    auto s = luaL_checknumber(L, 3 - iVec);
+    HmdVector3d_t ret = { { pV->v[0] * s, pV->v[1] * s, pV->v[2] * s } };
+    PushVec3(L, ret);
+    return 1;
+}
+
+static int Lua_Vec3_Eq(lua_State* L) {
+    auto pLhs = CheckVec3(L, 1);
+    auto pRhs = CheckVec3(L, 2);
+    lua_pushboolean(L, pLhs->v[0] == pRhs->v[0] && pLhs->v[1] == pRhs->v[1] && pLhs->v[2] == pRhs->v[2]);
+    return 1;
+}
+
+static int Lua_Vec3_ToString(lua_State* L) {
+    auto pV = CheckVec3(L, 1);
+    lua_pushfstring(L, "Vec3(%f, %f, %f)", pV->v[0], pV->v[1], pV->v[2]);
+    return 1;
+}
+
+static int Lua_Vec3_Copy(lua_State* L) {
+    PushVec3(L, *CheckVec3(L, 1));
+    return 1;
+}
+
+static int Lua_Vec3_Dot(lua_State* L) {
+    auto pLhs = CheckVec3(L, 1);
+    auto pRhs = CheckVec3(L, 2);
+    lua_pushnumber(L, pLhs->v[0] * pRhs->v[0] + pLhs->v[1] * pRhs->v[1] + pLhs->v[2] * pRhs->v[2]);
+    return 1;
+}
+
+static int Lua_Vec3_Cross(lua_State* L) {
+    auto pA = CheckVec3(L, 1)->v;
+    auto pB = CheckVec3(L, 2)->v;
+    HmdVector3d_t ret = { {
+        pA[1] * pB[2] - pA[2] * pB[1],
+        pA[2] * pB[0] - pA[0] * pB[2],
+        pA[0] * pB[1] - pA[1] * pB[0],
+    } };
+    PushVec3(L, ret);
+    return 1;
+}
+
+static int Lua_Vec3_Length(lua_State* L) {
+    auto pV = CheckVec3(L, 1)->v;
+    lua_pushnumber(L, sqrt(pV[0] * pV[0] + pV[1] * pV[1] + pV[2] * pV[2]));
+    return 1;
+}
+
+static inline void Vec3Normalize(HmdVector3d_t& v) {
+    auto len = sqrt(v.v[0] * v.v[0] + v.v[1] * v.v[1] + v.v[2] * v.v[2]);
+    if (len != 0) {
+        v.v[0] /= len;
+        v.v[1] /= len;
+        v.v[2] /= len;
+    }
+}
+
+static int Lua_Vec3_Normalized(lua_State* L) {
+    auto v = *CheckVec3(L, 1);
+    Vec3Normalize(v);
+    PushVec3(L, v);
+    return 1;
+}
+
+// In-place variants; these return self and never allocate
+
+// v:Set(x, y, z) or v:Set(u)
+static int Lua_Vec3_Set(lua_State* L) {
+    *CheckVec3(L, 1) = CheckVec3Args(L, 2);
+    lua_settop(L, 1);
+    return 1;
+}
+
+// v:AddInPlace(u): v = v + u
+static int Lua_Vec3_AddInPlace(lua_State* L) {
+    auto pV = CheckVec3(L, 1)->v;
+    auto pU = CheckVec3(L, 2)->v;
+    pV[0] += pU[0];
+    pV[1] += pU[1];
+    pV[2] += pU[2];
+    lua_settop(L, 1);
+    return 1;
+}
+
+// v:ScaleInPlace(s): v = v * s
+static int Lua_Vec3_ScaleInPlace(lua_State* L) {
+    auto pV = CheckVec3(L, 1)->v;
+    auto s = luaL_checknumber(L, 2);
+    pV[0] *= s;
+    pV[1] *= s;
+    pV[2] *= s;
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int Lua_Vec3_NormalizeInPlace(lua_State* L) {
+    Vec3Normalize(*CheckVec3(L, 1));
+    lua_settop(L, 1);
+    return 1;
+}
+
+// v:RotateInPlace(q): v = q * v
+static int Lua_Vec3_RotateInPlace(lua_State* L) {
+    auto pV = CheckVec3(L, 1);
+    *pV = QuatRotate(*CheckQuat(L, 2), *pV);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static const luaL_Reg g_aVec3Methods[] = {
+    { "Copy", Lua_Vec3_Copy },
+    { "Dot", Lua_Vec3_Dot },
+    { "Cross", Lua_Vec3_Cross },
+    { "Length", Lua_Vec3_Length },
+    { "Normalized", Lua_Vec3_Normalized },
+    { "Set", Lua_Vec3_Set },
+    { "AddInPlace", Lua_Vec3_AddInPlace },
+    { "ScaleInPlace", Lua_Vec3_ScaleInPlace },
+    { "NormalizeInPlace", Lua_Vec3_NormalizeInPlace },
+    { "RotateInPlace", Lua_Vec3_RotateInPlace },
+    { NULL, NULL }
+};
+
+static const luaL_Reg g_aVec3Meta[] = {
+    { "__newindex", Lua_Vec3_NewIndex },
+    { "__add", Lua_Vec3_Add },
+    { "__sub", Lua_Vec3_Sub },
+    { "__unm", Lua_Vec3_Unm },
+    { "__mul", Lua_Vec3_Mul },
+    { "__eq", Lua_Vec3_Eq },
+    { "__tostring", Lua_Vec3_ToString },
+    { NULL, NULL }
+};
+
+//-----------------------------------------------------------------------------
+// Mat34
+//-----------------------------------------------------------------------------
+
+// vrmath.Mat34() -> identity, vrmath.Mat34(q, t) -> rotation and translation
+static int Lua_Mat34_New(lua_State* L) {
+    if (lua_gettop(L) == 0) {
+        PushMat34(L, Mat34Identity());
+    } else {
+        auto q = CheckQuatArgs(L, 1);
+        auto t = CheckVec3Args(L, ToQuat(L, 1) ? 2 : 5);
+        PushMat34(L, Mat34FromRotationTranslation(q, t));
+    }
+    return 1;
+}
+
+// m * n -> Mat34, m * v -> transformed Vec3
+static int Lua_Mat34_Mul(lua_State* L) {
+    auto pLhs = CheckMat34(L, 1);
+    auto pVec = ToVec3(L, 2);
+    if (pVec) {
+        PushVec3(L, Mat34Transform(*pLhs, *pVec));
+    } else {
+        PushMat34(L, Mat34Mul(*pLhs, *CheckMat34(L, 2)));
+    }
+    return 1;
+}
+
+static int Lua_Mat34_ToString(lua_State* L) {
+    auto pM = CheckMat34(L, 1);
+    lua_pushfstring(L, "Mat34([%f %f %f %f] [%f %f %f %f] [%f %f %f %f])",
+        pM->m[0][0], pM->m[0][1], pM->m[0][2], pM->m[0][3],
+        pM->m[1][0], pM->m[1][1], pM->m[1][2], pM->m[1][3],
+        pM->m[2][0], pM->m[2][1], pM->m[2][2], pM->m[2][3]);
+    return 1;
+}
+
+static int Lua_Mat34_Copy(lua_State* L) {
+    PushMat34(L, *CheckMat34(L, 1));
+    return 1;
+}
+
+// m:Get(row, col) with 1-based indices
+static int Lua_Mat34_Get(lua_State* L) {
+    auto pM = CheckMat34(L, 1);
+    auto r = luaL_checkinteger(L, 2);
+    auto c = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, r >= 1 && r <= 3, 2, "row out of range");
+    luaL_argcheck(L, c >= 1 && c <= 4, 3, "column out of range");
+    lua_pushnumber(L, pM->m[r - 1][c - 1]);
+    return 1;
+}
+
+// m:GetRotation() -> Quat
+static int Lua_Mat34_GetRotation(lua_State* L) {
+    PushQuat(L, Mat34GetRotation(*CheckMat34(L, 1)));
+    return 1;
+}
+
+// m:GetTranslation() -> Vec3
+static int Lua_Mat34_GetTranslation(lua_State* L) {
+    auto pM = CheckMat34(L, 1);
+    HmdVector3d_t ret = { { pM->m[0][3], pM->m[1][3], pM->m[2][3] } };
+    PushVec3(L, ret);
+    return 1;
+}
+
+// m:Inverse() -> Mat34, or nil if m is singular
+static int Lua_Mat34_Inverse(lua_State* L) {
+    HmdMatrix34_t inv;
+    if (Mat34Invert(*CheckMat34(L, 1), inv)) {
+        PushMat34(L, inv);
+    } else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+// In-place variants; these return self and never allocate
+
+// m:Set(row, col, value) with 1-based indices
+static int Lua_Mat34_Set(lua_State* L) {
+    auto pM = CheckMat34(L, 1);
+    auto r = luaL_checkinteger(L, 2);
+    auto c = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, r >= 1 && r <= 3, 2, "row out of range");
+    luaL_argcheck(L, c >= 1 && c <= 4, 3, "column out of range");
+    pM->m[r - 1][c - 1] = (float)luaL_checknumber(L, 4);
+    lua_settop(L, 1);
+    return 1;
+}
+
+// m:SetRotationTranslation(q, t)
+static int Lua_Mat34_SetRotationTranslation(lua_State* L) {
+    auto pM = CheckMat34(L, 1);
+    *pM = Mat34FromRotationTranslation(*CheckQuat(L, 2), *CheckVec3(L, 3));
+    lua_settop(L, 1);
+    return 1;
+}
+
+// m:SetMul(a, b): m = a * b
+static int Lua_Mat34_SetMul(lua_State* L) {
+    *CheckMat34(L, 1) = Mat34Mul(*CheckMat34(L, 2), *CheckMat34(L, 3));
+    lua_settop(L, 1);
+    return 1;
+}
+
+// m:InvertInPlace() -> self, or nil if m is singular (m is left untouched)
+static int Lua_Mat34_InvertInPlace(lua_State* L) {
+    auto pM = CheckMat34(L, 1);
+    if (!Mat34Invert(*pM, *pM)) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
+static const luaL_Reg g_aMat34Methods[] = {
+    { "Copy", Lua_Mat34_Copy },
+    { "Get", Lua_Mat34_Get },
+    { "GetRotation", Lua_Mat34_GetRotation },
+    { "GetTranslation", Lua_Mat34_GetTranslation },
+    { "Inverse", Lua_Mat34_Inverse },
+    { "Set", Lua_Mat34_Set },
+    { "SetRotationTranslation", Lua_Mat34_SetRotationTranslation },
+    { "SetMul", Lua_Mat34_SetMul },
+    { "InvertInPlace", Lua_Mat34_InvertInPlace },
+    { NULL, NULL }
+};
+
+static const luaL_Reg g_aMat34Meta[] = {
+    { "__mul", Lua_Mat34_Mul },
+    { "__tostring", Lua_Mat34_ToString },
+    { NULL, NULL }
+};
+
+//-----------------------------------------------------------------------------
+// Library
+//-----------------------------------------------------------------------------
+
+// Create a metatable whose __index is pfnIndex with the method table as
+// its upvalue, or the method table itself if pfnIndex is NULL.
+// [-0, +0, e]
+static void RegisterType(lua_State* L, const char* pchName, const luaL_Reg* pMethods, const luaL_Reg* pMeta, lua_CFunction pfnIndex) {
+    luaL_newmetatable(L, pchName); // +1
+    luaL_setfuncs(L, pMeta, 0);
+
+    lua_newtable(L); // +1
+    luaL_setfuncs(L, pMethods, 0);
+    if (pfnIndex != NULL) {
+        lua_pushcclosure(L, pfnIndex, 1); // -1 +1
+    }
+    lua_setfield(L, -2, "__index"); // -1
+    lua_pop(L, 1); // -1
+}
+
+static const luaL_Reg g_aVRMathFuncs[] = {
+    { "Quat", Lua_Quat_New },
+    { "Vec3", Lua_Vec3_New },
+    { "Mat34", Lua_Mat34_New },
+    { "Slerp", Lua_Quat_Slerp },
+    { "Nlerp", Lua_Quat_Nlerp },
+    { NULL, NULL }
+};
+
+int luaopen_vrmath(lua_State* L) {
+    RegisterType(L, META_QUAT, g_aQuatMethods, g_aQuatMeta, Lua_Quat_Index);
+    RegisterType(L, META_VEC3, g_aVec3Methods, g_aVec3Meta, Lua_Vec3_Index);
+    RegisterType(L, META_MAT34, g_aMat34Methods, g_aMat34Meta, NULL);
+
+    luaL_newlib(L, g_aVRMathFuncs);
+    return 1;
+}
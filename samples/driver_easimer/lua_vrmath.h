@@ -0,0 +1,39 @@
+// === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
+
+#pragma once
+#include <openvr_driver.h>
+
+struct lua_State;
+
+#define VRMATH_LIBNAME "vrmath"
+
+//-----------------------------------------------------------------------------
+// Purpose: native quaternion, vector and 3x4 matrix types for scripts
+//-----------------------------------------------------------------------------
+
+// Open the vrmath library; leaves the library table on the stack
+// [-0, +1, e]
+int luaopen_vrmath(lua_State* L);
+
+// Push a new Quat userdata holding q and return a pointer to its contents
+// [-0, +1, e]
+vr::HmdQuaternion_t* PushQuat(lua_State* L, const vr::HmdQuaternion_t& q);
+
+// Push a new Vec3 userdata holding v and return a pointer to its contents
+// [-0, +1, e]
+vr::HmdVector3d_t* PushVec3(lua_State* L, const vr::HmdVector3d_t& v);
+
+// Push a new Mat34 userdata holding m and return a pointer to its contents
+// [-0, +1, e]
+vr::HmdMatrix34_t* PushMat34(lua_State* L, const vr::HmdMatrix34_t& m);
+
+// Return the contents of the vrmath userdata at idx, or NULL if the
+// value there is of a different type.
+// [-0, +0, -]
+vr::HmdQuaternion_t* ToQuat(lua_State* L, int idx);
+vr::HmdVector3d_t* ToVec3(lua_State* L, int idx);
+vr::HmdMatrix34_t* ToMat34(lua_State* L, int idx);
+
+// Spherical interpolation from a to b along the shorter arc; also used by
+// native code
+vr::HmdQuaternion_t QuatSlerp(const vr::HmdQuaternion_t& a, const vr::HmdQuaternion_t& b, double t);
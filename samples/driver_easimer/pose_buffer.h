@@ -0,0 +1,60 @@
+// === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
+
+#pragma once
+#include <openvr_driver.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+//-----------------------------------------------------------------------------
+// Purpose: poses of every script-declared device, stored as a structure
+// of arrays so that the script fills all of them in one call and each
+// field is written without touching the rest of the pose
+//-----------------------------------------------------------------------------
+
+class CPoseBuffer {
+public:
+	CPoseBuffer() : m_unSize(0) {}
+
+	void Resize(uint32_t unSize) {
+		vr::HmdQuaternion_t qIdentity = { 1, 0, 0, 0 };
+		vr::HmdVector3d_t vZero = { { 0, 0, 0 } };
+		m_unSize = unSize;
+		m_aRotation.assign(unSize, qIdentity);
+		m_aPosition.assign(unSize, vZero);
+		m_aVelocity.assign(unSize, vZero);
+		m_aAngularVelocity.assign(unSize, vZero);
+		m_aResult.assign(unSize, vr::TrackingResult_Uninitialized);
+		m_aValid.assign(unSize, 0);
+		m_aConnected.assign(unSize, 1);
+	}
+
+	uint32_t Size() const { return m_unSize; }
+
+	// Assemble the DriverPose_t of device i
+	void GetPose(uint32_t i, vr::DriverPose_t& pose) const {
+		memset(&pose, 0, sizeof(pose));
+		pose.qWorldFromDriverRotation.w = 1;
+		pose.qDriverFromHeadRotation.w = 1;
+		pose.qRotation = m_aRotation[i];
+		for (int k = 0; k < 3; k++) {
+			pose.vecPosition[k] = m_aPosition[i].v[k];
+			pose.vecVelocity[k] = m_aVelocity[i].v[k];
+			pose.vecAngularVelocity[k] = m_aAngularVelocity[i].v[k];
+		}
+		pose.result = m_aResult[i];
+		pose.poseIsValid = m_aValid[i] != 0;
+		pose.deviceIsConnected = m_aConnected[i] != 0;
+	}
+
+	std::vector<vr::HmdQuaternion_t> m_aRotation;
+	std::vector<vr::HmdVector3d_t> m_aPosition;
+	std::vector<vr::HmdVector3d_t> m_aVelocity;
+	std::vector<vr::HmdVector3d_t> m_aAngularVelocity;
+	std::vector<vr::ETrackingResult> m_aResult;
+	std::vector<uint8_t> m_aValid;
+	std::vector<uint8_t> m_aConnected;
+
+private:
+	uint32_t m_unSize;
+};
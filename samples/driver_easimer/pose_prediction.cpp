@@ -0,0 +1,104 @@
+// === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
+
+#include "pose_prediction.h"
+#include "sc_math.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace vr;
+
+static HmdQuaternion_t Multiply(const HmdQuaternion_t& a, const HmdQuaternion_t& b) {
+    HmdQuaternion_t r;
+    r.w = a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z;
+    r.x = a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y;
+    r.y = a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x;
+    r.z = a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w;
+    return r;
+}
+
+CPosePredictor::CPosePredictor() :
+    m_bPredictToPhotons(false),
+    m_flPhotonLatency(0),
+    m_bHaveSample(false) {
+    for (int i = 0; i < 3; i++) {
+        m_aflAngularVelocity[i] = m_aflAngularAcceleration[i] = 0;
+    }
+}
+
+void CPosePredictor::AddSamples(const SteamControllerUpdateBatch& batch, clock::time_point tNewest) {
+    if (batch.count == 0) {
+        return;
+    }
+    // Only the latest rate matters; older ones in the batch would only
+    // add noise to the derivative
+    auto const& orientation = batch.orientation[batch.count - 1];
+    auto const& gyro = batch.angularVelocity[batch.count - 1];
+
+    // The gyro is in the controller's frame, the pose in the world's
+    double aflLocal[3];
+    DecodeAngularVelocity(gyro, aflLocal);
+    double aflVelocity[3];
+    RotateVector(DecodeOrientation(orientation), false, aflLocal, aflVelocity);
+
+    double flDt = 0;
+    if (m_bHaveSample) {
+        flDt = std::chrono::duration<double>(tNewest - m_tSample).count();
+    }
+    for (int i = 0; i < 3; i++) {
+        if (flDt > 1e-4 && flDt < PREDICTION_MAX_SAMPLE_AGE) {
+            // Finite difference, smoothed; differentiating the gyro amplifies
+            // its noise
+            auto flAcceleration = (aflVelocity[i] - m_aflAngularVelocity[i]) / flDt;
+            m_aflAngularAcceleration[i] += PREDICTION_ACCELERATION_SMOOTHING * (flAcceleration - m_aflAngularAcceleration[i]);
+        } else if (flDt >= PREDICTION_MAX_SAMPLE_AGE || !m_bHaveSample) {
+            m_aflAngularAcceleration[i] = 0;
+        }
+        m_aflAngularVelocity[i] = aflVelocity[i];
+    }
+
+    m_tSample = tNewest;
+    m_bHaveSample = true;
+}
+
+void CPosePredictor::Apply(DriverPose_t& pose, clock::time_point tNow) const {
+    if (!m_bHaveSample || !pose.poseIsValid) {
+        return;
+    }
+
+    auto flAge = std::chrono::duration<double>(tNow - m_tSample).count();
+    if (flAge > PREDICTION_MAX_SAMPLE_AGE) {
+        // The controller went quiet; a stale velocity would make the view drift
+        for (int i = 0; i < 3; i++) {
+            pose.vecAngularVelocity[i] = pose.vecAngularAcceleration[i] = 0;
+        }
+        pose.poseTimeOffset = 0;
+        return;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        pose.vecAngularVelocity[i] = m_aflAngularVelocity[i];
+        pose.vecAngularAcceleration[i] = m_aflAngularAcceleration[i];
+    }
+    // The pose describes the moment the sample arrived
+    pose.poseTimeOffset = -flAge;
+
+    if (!m_bPredictToPhotons) {
+        return;
+    }
+
+    auto flHorizon = std::min(flAge + m_flPhotonLatency.load(std::memory_order_relaxed), (double)PREDICTION_MAX_HORIZON);
+    double aflAngle[3];
+    for (int i = 0; i < 3; i++) {
+        aflAngle[i] = m_aflAngularVelocity[i] * flHorizon + 0.5 * m_aflAngularAcceleration[i] * flHorizon * flHorizon;
+        pose.vecAngularVelocity[i] = m_aflAngularVelocity[i] + m_aflAngularAcceleration[i] * flHorizon;
+    }
+    auto flTheta = sqrt(aflAngle[0] * aflAngle[0] + aflAngle[1] * aflAngle[1] + aflAngle[2] * aflAngle[2]);
+    if (flTheta > 1e-9) {
+        auto flScale = sin(flTheta / 2) / flTheta;
+        HmdQuaternion_t dq = { cos(flTheta / 2), aflAngle[0] * flScale, aflAngle[1] * flScale, aflAngle[2] * flScale };
+        pose.qRotation = Multiply(dq, pose.qRotation);
+    }
+    // The pose now lies flHorizon after the sample
+    pose.poseTimeOffset = flHorizon - flAge;
+}
@@ -0,0 +1,52 @@
+// === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
+
+#pragma once
+#include <openvr_driver.h>
+#include <atomic>
+#include <chrono>
+#include "CSteamController.h"
+
+// Weight of a new angular acceleration estimate in the running average
+#define PREDICTION_ACCELERATION_SMOOTHING 0.3
+// Samples older than this are not used for prediction, in seconds
+#define PREDICTION_MAX_SAMPLE_AGE 0.1
+// Longest forward prediction, in seconds
+#define PREDICTION_MAX_HORIZON 0.05
+
+//-----------------------------------------------------------------------------
+// Purpose: derives angular velocity and acceleration from the controller's
+// gyro and stamps poses with them so that the runtime can extrapolate.
+// Optionally rotates the pose forward to the time its photons are shown.
+// Samples and poses must come from the same thread.
+//-----------------------------------------------------------------------------
+
+class CPosePredictor {
+public:
+	typedef std::chrono::steady_clock clock;
+
+	CPosePredictor();
+
+	// Report velocities only, or also rotate the pose forward to photon time
+	void SetPredictToPhotons(bool bEnable) { m_bPredictToPhotons = bEnable; }
+	// May be called from any thread
+	void SetPhotonLatency(float flSeconds) { m_flPhotonLatency.store(flSeconds, std::memory_order_relaxed); }
+
+	// Feed the newest sample of a batch, read at tNewest
+	void AddSamples(const SteamControllerUpdateBatch& batch, clock::time_point tNewest);
+
+	// Fill the angular terms and poseTimeOffset of a pose computed from the
+	// latest sample
+	void Apply(vr::DriverPose_t& pose, clock::time_point tNow) const;
+
+	void Reset() { m_bHaveSample = false; }
+
+private:
+	bool m_bPredictToPhotons;
+	std::atomic<float> m_flPhotonLatency;
+
+	bool m_bHaveSample;
+	clock::time_point m_tSample;
+	// Driver (world) space, rad/s and rad/s^2
+	double m_aflAngularVelocity[3];
+	double m_aflAngularAcceleration[3];
+};
@@ -0,0 +1,43 @@
+// === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
+
+#pragma once
+#include <openvr_driver.h>
+#include <algorithm>
+#include <cmath>
+#include "CSteamController.h"
+
+// Gyro reading of one LSB, in radians per second
+static const double k_flGyroRadiansPerLSB = STEAMCONTROLLER_GYRO_FULL_SCALE_DPS / 32768.0 * 3.14159265358979323846 / 180.0;
+
+// The controller reports the imaginary part of its orientation only
+inline vr::HmdQuaternion_t DecodeOrientation(const SteamControllerVector& orientation) {
+	vr::HmdQuaternion_t q;
+	q.x = orientation.x / 32767.0;
+	q.y = orientation.y / 32767.0;
+	q.z = orientation.z / 32767.0;
+	q.w = sqrt(std::max(0.0, 1.0 - (q.x * q.x + q.y * q.y + q.z * q.z)));
+	return q;
+}
+
+// Gyro reading in rad/s, in the controller's frame
+inline void DecodeAngularVelocity(const SteamControllerVector& gyro, double out[3]) {
+	out[0] = gyro.x * k_flGyroRadiansPerLSB;
+	out[1] = gyro.y * k_flGyroRadiansPerLSB;
+	out[2] = gyro.z * k_flGyroRadiansPerLSB;
+}
+
+// Rotate v by the unit quaternion q (bInverse: by the conjugate of q)
+inline void RotateVector(const vr::HmdQuaternion_t& q, bool bInverse, const double v[3], double out[3]) {
+	auto x = bInverse ? -q.x : q.x;
+	auto y = bInverse ? -q.y : q.y;
+	auto z = bInverse ? -q.z : q.z;
+	// t = 2 * cross(q.xyz, v); out = v + w * t + cross(q.xyz, t)
+	double t[3] = {
+		2 * (y * v[2] - z * v[1]),
+		2 * (z * v[0] - x * v[2]),
+		2 * (x * v[1] - y * v[0]),
+	};
+	out[0] = v[0] + q.w * t[0] + (y * t[2] - z * t[1]);
+	out[1] = v[1] + q.w * t[1] + (z * t[0] - x * t[2]);
+	out[2] = v[2] + q.w * t[2] + (x * t[1] - y * t[0]);
+}
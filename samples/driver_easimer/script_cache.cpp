@@ -0,0 +1,352 @@
+// === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
+
+#include "script_cache.h"
+#include "driverlog.h"
+
+extern "C" {
+#include "lauxlib.h"
+#include "lua.h"
+}
+
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define SCRIPT_CACHE_MAGIC 0x434c5a45 // "EZLC"
+// Bump when the layout changes; the Lua version is mixed in as well since
+// bytecode isn't portable between Lua versions
+#define SCRIPT_CACHE_VERSION ((1 << 16) | LUA_VERSION_NUM)
+
+// Layout of a cache file:
+//   ScriptCacheHeader_t
+//   char[unPathLength]        script path (not NUL-terminated)
+//   uint8_t[unBytecodeSize]   output of lua_dump
+struct ScriptCacheHeader_t {
+    uint32_t unMagic;
+    uint32_t unVersion;
+    int64_t nSourceMTime;
+    uint64_t ulSourceSize;
+    uint64_t ulSourceHash;
+    uint32_t unPathLength;
+    uint32_t unBytecodeSize;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: read-only memory mapping of a whole file
+//-----------------------------------------------------------------------------
+
+class CMappedFile {
+public:
+    CMappedFile() :
+#if defined(_WIN32)
+        m_hFile(INVALID_HANDLE_VALUE), m_hMapping(NULL),
+#else
+        m_fd(-1),
+#endif
+        m_pData(NULL), m_unSize(0) {
+    }
+
+    ~CMappedFile() {
+        Close();
+    }
+
+    bool Open(const char* pchPath) {
+#if defined(_WIN32)
+        m_hFile = CreateFileA(pchPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (m_hFile == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_hFile, &size) || size.QuadPart == 0) {
+            Close();
+            return false;
+        }
+        m_unSize = (size_t)size.QuadPart;
+        m_hMapping = CreateFileMappingA(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (m_hMapping == NULL) {
+            Close();
+            return false;
+        }
+        m_pData = MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+#else
+        m_fd = open(pchPath, O_RDONLY);
+        if (m_fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(m_fd, &st) != 0 || st.st_size == 0) {
+            Close();
+            return false;
+        }
+        m_unSize = (size_t)st.st_size;
+        m_pData = mmap(NULL, m_unSize, PROT_READ, MAP_PRIVATE, m_fd, 0);
+        if (m_pData == MAP_FAILED) {
+            m_pData = NULL;
+        }
+#endif
+        if (m_pData == NULL) {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close() {
+#if defined(_WIN32)
+        if (m_pData != NULL) {
+            UnmapViewOfFile(m_pData);
+        }
+        if (m_hMapping != NULL) {
+            CloseHandle(m_hMapping);
+            m_hMapping = NULL;
+        }
+        if (m_hFile != INVALID_HANDLE_VALUE) {
+            CloseHandle(m_hFile);
+            m_hFile = INVALID_HANDLE_VALUE;
+        }
+#else
+        if (m_pData != NULL) {
+            munmap(m_pData, m_unSize);
+        }
+        if (m_fd >= 0) {
+            close(m_fd);
+            m_fd = -1;
+        }
+#endif
+        m_pData = NULL;
+        m_unSize = 0;
+    }
+
+    const uint8_t* Data() const { return (const uint8_t*)m_pData; }
+    size_t Size() const { return m_unSize; }
+
+private:
+#if defined(_WIN32)
+    HANDLE m_hFile;
+    HANDLE m_hMapping;
+#else
+    int m_fd;
+#endif
+    void* m_pData;
+    size_t m_unSize;
+};
+
+// Get the modification time (in the finest resolution available) and the
+// size of a file
+static bool GetFileInfo(const std::string& sPath, int64_t& nMTime, uint64_t& ulSize) {
+#if defined(_WIN32)
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    if (!GetFileAttributesExA(sPath.c_str(), GetFileExInfoStandard, &attr)) {
+        return false;
+    }
+    nMTime = ((int64_t)attr.ftLastWriteTime.dwHighDateTime << 32) | attr.ftLastWriteTime.dwLowDateTime;
+    ulSize = ((uint64_t)attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+#else
+    struct stat st;
+    if (stat(sPath.c_str(), &st) != 0) {
+        return false;
+    }
+#if defined(__APPLE__)
+    nMTime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    nMTime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    ulSize = (uint64_t)st.st_size;
+#endif
+    return true;
+}
+
+// 64-bit FNV-1a
+static uint64_t HashContents(const uint8_t* pData, size_t unSize) {
+    uint64_t ulHash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < unSize; i++) {
+        ulHash ^= pData[i];
+        ulHash *= 0x100000001b3ull;
+    }
+    return ulHash;
+}
+
+static bool ReadWholeFile(const std::string& sPath, std::string& sContents) {
+    auto pFile = fopen(sPath.c_str(), "rb");
+    if (pFile == NULL) {
+        return false;
+    }
+
+    char buf[4096];
+    size_t unRead;
+    sContents.clear();
+    while ((unRead = fread(buf, 1, sizeof(buf), pFile)) > 0) {
+        sContents.append(buf, unRead);
+    }
+    bool bOK = ferror(pFile) == 0;
+    fclose(pFile);
+    return bOK;
+}
+
+// Name of a temporary file no other writer of the same cache uses, in
+// this process or another one
+static std::string GetTempPath(const std::string& sCachePath) {
+    static std::atomic<uint32_t> s_unNextTemp(0);
+#if defined(_WIN32)
+    auto ulPid = (unsigned long)GetCurrentProcessId();
+#else
+    auto ulPid = (unsigned long)getpid();
+#endif
+    char achSuffix[64];
+    snprintf(achSuffix, sizeof(achSuffix), ".%lu.%u.tmp", ulPid, s_unNextTemp.fetch_add(1, std::memory_order_relaxed));
+    return sCachePath + achSuffix;
+}
+
+// Write the cache file through a temporary file so that readers never
+// see a partially written cache
+static bool WriteCacheFile(const std::string& sCachePath, const ScriptCacheHeader_t& hdr, const std::string& sPath, const void* pBytecode) {
+    auto sTempPath = GetTempPath(sCachePath);
+    auto pFile = fopen(sTempPath.c_str(), "wb");
+    if (pFile == NULL) {
+        return false;
+    }
+
+    bool bOK =
+        fwrite(&hdr, sizeof(hdr), 1, pFile) == 1 &&
+        fwrite(sPath.data(), 1, sPath.size(), pFile) == sPath.size() &&
+        fwrite(pBytecode, 1, hdr.unBytecodeSize, pFile) == hdr.unBytecodeSize;
+    bOK = (fclose(pFile) == 0) && bOK;
+
+    if (bOK) {
+#if defined(_WIN32)
+        bOK = MoveFileExA(sTempPath.c_str(), sCachePath.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+        bOK = rename(sTempPath.c_str(), sCachePath.c_str()) == 0;
+#endif
+    }
+
+    if (!bOK) {
+        remove(sTempPath.c_str());
+    }
+    return bOK;
+}
+
+static int Writer_Append(lua_State*, const void* p, size_t sz, void* ud) {
+    ((std::string*)ud)->append((const char*)p, sz);
+    return 0;
+}
+
+struct ReaderState_t {
+    const char* pData;
+    size_t unSize;
+};
+
+// Hands the whole buffer to lua_load in a single call
+static const char* Reader_Buffer(lua_State*, void* ud, size_t* size) {
+    auto pState = (ReaderState_t*)ud;
+    auto pData = pState->pData;
+    *size = pState->unSize;
+    pState->pData = NULL;
+    pState->unSize = 0;
+    return pData;
+}
+
+int LoadScriptCached(lua_State* L, const std::string& sPath) {
+    auto sCachePath = sPath + SCRIPT_CACHE_SUFFIX;
+    auto sChunkName = "@" + sPath;
+
+    int64_t nMTime;
+    uint64_t ulSize;
+    if (!GetFileInfo(sPath, nMTime, ulSize)) {
+        // Let the regular loader produce the error message
+        return luaL_loadfile(L, sPath.c_str());
+    }
+
+    // Source contents and hash are only computed when needed
+    std::string sSource;
+    bool bHaveSource = false;
+    uint64_t ulHash = 0;
+
+    CMappedFile cache;
+    if (cache.Open(sCachePath.c_str()) && cache.Size() >= sizeof(ScriptCacheHeader_t)) {
+        ScriptCacheHeader_t hdr;
+        memcpy(&hdr, cache.Data(), sizeof(hdr));
+        auto unPayload = cache.Size() - sizeof(hdr);
+
+        bool bValid =
+            hdr.unMagic == SCRIPT_CACHE_MAGIC &&
+            hdr.unVersion == SCRIPT_CACHE_VERSION &&
+            hdr.unPathLength == sPath.size() &&
+            (uint64_t)hdr.unPathLength + hdr.unBytecodeSize == unPayload &&
+            memcmp(cache.Data() + sizeof(hdr), sPath.data(), sPath.size()) == 0 &&
+            hdr.ulSourceSize == ulSize;
+
+        bool bHit = false;
+        bool bTouched = false;
+        if (bValid) {
+            if (hdr.nSourceMTime == nMTime) {
+                bHit = true;
+            } else if (ReadWholeFile(sPath, sSource)) {
+                // mtime changed; only a content change invalidates the cache
+                bHaveSource = true;
+                ulHash = HashContents((const uint8_t*)sSource.data(), sSource.size());
+                bHit = bTouched = ulHash == hdr.ulSourceHash;
+            }
+        }
+
+        if (bHit) {
+            auto pBytecode = cache.Data() + sizeof(hdr) + hdr.unPathLength;
+            ReaderState_t reader = { (const char*)pBytecode, hdr.unBytecodeSize };
+            if (lua_load(L, Reader_Buffer, &reader, sChunkName.c_str(), "b") == LUA_OK) {
+                DriverLog("Loaded %s from the bytecode cache", sPath.c_str());
+                if (bTouched) {
+                    hdr.nSourceMTime = nMTime;
+                    WriteCacheFile(sCachePath, hdr, sPath, pBytecode);
+                }
+                return LUA_OK;
+            }
+            DriverLog("Bytecode cache of %s is corrupt: %s", sPath.c_str(), lua_tostring(L, -1));
+            lua_pop(L, 1);
+        }
+    }
+    cache.Close();
+
+    // Miss: compile from source
+    if (!bHaveSource) {
+        if (!ReadWholeFile(sPath, sSource)) {
+            return luaL_loadfile(L, sPath.c_str());
+        }
+        ulHash = HashContents((const uint8_t*)sSource.data(), sSource.size());
+    }
+
+    auto res = luaL_loadbufferx(L, sSource.data(), sSource.size(), sChunkName.c_str(), "t");
+    if (res != LUA_OK) {
+        return res;
+    }
+
+    // Keep debug info so that error messages and tracebacks stay useful
+    std::string sBytecode;
+    if (lua_dump(L, Writer_Append, &sBytecode, 0) == 0) {
+        ScriptCacheHeader_t hdr;
+        hdr.unMagic = SCRIPT_CACHE_MAGIC;
+        hdr.unVersion = SCRIPT_CACHE_VERSION;
+        hdr.nSourceMTime = nMTime;
+        hdr.ulSourceSize = sSource.size();
+        hdr.ulSourceHash = ulHash;
+        hdr.unPathLength = (uint32_t)sPath.size();
+        hdr.unBytecodeSize = (uint32_t)sBytecode.size();
+        if (WriteCacheFile(sCachePath, hdr, sPath, sBytecode.data())) {
+            DriverLog("Wrote bytecode cache %s", sCachePath.c_str());
+        } else {
+            DriverLog("Failed to write bytecode cache %s", sCachePath.c_str());
+        }
+    }
+
+    return LUA_OK;
+}
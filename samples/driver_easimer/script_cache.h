@@ -0,0 +1,24 @@
+// === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
+
+#pragma once
+#include <string>
+
+struct lua_State;
+
+// Suffix appended to the script path to get the path of its cache file
+#define SCRIPT_CACHE_SUFFIX ".cache"
+
+//-----------------------------------------------------------------------------
+// Purpose: precompiled bytecode cache for driver scripts
+//-----------------------------------------------------------------------------
+
+// Load the script at sPath, going through its bytecode cache.
+// On a hit the chunk is loaded from the memory-mapped cache file. On a
+// miss the source is compiled and the cache is (re)written with lua_dump.
+// The cache is keyed by the script path, its mtime and a hash of its
+// contents: a changed mtime only invalidates it if the contents changed.
+// Behaves like luaL_loadfile: on success the compiled chunk is left on
+// the stack and LUA_OK is returned, otherwise an error message is left
+// on the stack and an error code is returned.
+// [-0, +1, m]
+int LoadScriptCached(lua_State* L, const std::string& sPath);
@@ -10,47 +10,13 @@ TrackingResults_Running_OK				= 200
 TrackingResults_Running_OutOfRange		= 201
 TrackingResult_Fallback_RotationOnly	= 300
 
-Quat = {}
-Quat.__mul = function(lhs, rhs)
-	local w = lhs.w * rhs.w - lhs.x * rhs.x - lhs.y * rhs.y - lhs.z * rhs.z
-	local x = lhs.w * rhs.x + lhs.x * rhs.w + lhs.y * rhs.z - lhs.z * rhs.y
-	local y = lhs.w * rhs.y + lhs.y * rhs.w + lhs.z * rhs.x - lhs.x * rhs.z
-	local z = lhs.w * rhs.z + lhs.z * rhs.w + lhs.x * rhs.y - lhs.y * rhs.x
+-- Native quaternion type, see vrmath in lua_vrmath.cpp
+Quat = vrmath.Quat
 
-	return Quat:new(w, x, y, z)
-end
-
-function Quat:identity()
-	return Quat:new(1, 0, 0, 0)
-end
-
-function Quat:new(w, x, y, z)
-	local ret = {}
-	ret.w = w
-	ret.x = x
-	ret.y = y
-	ret.z = z
-	self.__index = self
-	setmetatable(ret, self)
-	return ret
-end
-
-function Quat:conjugate()
-	return Quat:new(self.w, -self.x, -self.y, -self.z)
-end
-
-function Quat:inverse()
-	local qa = self:conjugate()
-	local len = self.w * self.w + self.x * self.x + self.y * self.y + self.z * self.z
-	qa.w = qa.w / len
-	qa.x = qa.x / len
-	qa.y = qa.y / len
-	qa.z = qa.z / len
-	return qa
-end
-
-lastOrientationUpdate = Quat:identity()
-calibrationData = Quat:identity()
+lastOrientationUpdate = Quat()
+calibrationData = Quat()
+-- Scratch quaternion reused by GetPose to avoid allocating every frame
+poseRotation = Quat()
 
 function TrackedDeviceServerDriver:OnInit()
 	DriverLog("TrackedDeviceServerDriver:OnInit")
@@ -60,6 +26,8 @@ function TrackedDeviceServerDriver:OnShutdown()
 	DriverLog("TrackedDeviceServerDriver:OnShutdown")
 end
 
+-- The driver queries the display configuration once after OnInit; call
+-- DisplayChanged() after changing any of these values later on
 function VRDisplayComponent:OnInit()
 	DriverLog("VRDisplayComponent:OnInit")
 	self.nRenderWidth = 1000 
@@ -94,6 +62,14 @@ function VRDisplayComponent:GetRecommendedRenderTargetSize()
 	return self.nRenderWidth, self.nRenderHeight
 end
 
+-- Lens distortion of an eye, evaluated once per load into a lookup grid.
+-- Return nothing for none, radial polynomial coefficients per channel, e.g.
+--   { center = { 0.5, 0.5 }, red = { 0.20, 0.02, 0 }, green = { 0.22, 0.02, 0 }, blue = { 0.24, 0.02, 0 } }
+-- or a function(u, v) returning red u, v, green u, v, blue u, v.
+function VRDisplayComponent:GetDistortion(eye)
+	return nil
+end
+
 -- Returns a tuple of (WindowX, WindowY, WindowW, WindowH)
 function VRDisplayComponent:GetEyeOutputViewport(eye)
 	local y = 0
@@ -111,27 +87,45 @@ function VRDisplayComponent:GetEyeOutputViewport(eye)
 	return x, y, width, height
 end
 
-function TrackedDeviceServerDriver:GetPose()
-	local ret = {}
-	ret.poseIsValid = true
-	ret.result = TrackingResults_Running_OK 
-	ret.deviceIsConnected = true
+-- Fills the persistent pose object in place
+-- Only the fields that change have to be set; the rest keep their
+-- values from the previous frame. Returning a table instead of
+-- filling pose also works, but allocates every frame.
+-- With the poseSharedMemory setting an external tracker can provide the
+-- pose; GetSharedMemoryPose(pose) copies its latest one into pose and
+-- returns false while there is none, and while a reload is still loading
+-- the script. Gyro prediction leaves poses alone
+-- once GetSharedMemoryPose succeeded, e.g.
+--   if GetSharedMemoryPose(pose) then return end
+function TrackedDeviceServerDriver:GetPose(pose)
+	poseRotation:SetMul(lastOrientationUpdate, calibrationData)
+	pose:SetResult(TrackingResults_Running_OK, true, true)
+	pose:SetRotation(poseRotation)
+end
 
-	ret.qWorldFromDriverRotation = Quat:identity()
-	ret.qDriverFromHeadRotation = Quat:identity()
-	ret.qRotation = lastOrientationUpdate * calibrationData
-	ret.vecWorldFromDriverTranslation = {0, 0, 0}
+-- Extra devices (controllers, trackers) driven by this script, queried
+-- once after OnInit. Return nothing for an HMD-only driver, or e.g.
+--   { { serial = "easimer_ctl_l", class = "Controller", model = "easimer", role = "LeftHand" } }
+function TrackedDeviceServerDriver:GetDevices()
+end
 
-	return ret
+-- Called once per frame with a pose buffer holding every device from
+-- GetDevices; index i is the i-th device, e.g.
+--   poses:SetRotation(1, q)
+--   poses:SetResult(1, TrackingResults_Running_OK, true, true)
+function TrackedDeviceServerDriver:GetPoses(poses)
 end
 
 function TrackedDeviceServerDriver:OnSeatedZeroPoseReset()
-	calibrationData = lastOrientationUpdate:inverse()
+	calibrationData = lastOrientationUpdate:Inverse()
 	DriverLog("Recalibrated!")
-	DriverLog("New inverse transform: " .. calibrationData.w .. " " .. calibrationData.x .. " " .. calibrationData.y .. " " .. calibrationData.z)
+	DriverLog("New inverse transform: " .. tostring(calibrationData))
 end
 
+-- Every controller gets its own SteamController instance; the first one
+-- to connect drives the HMD until it disconnects
 SteamController = {}
+local hmdController = nil
 
 function SteamController:OnInit() end
 function SteamController:OnShutdown() end
@@ -146,17 +140,33 @@ function SteamController:OnConnect(handle)
 	DriverLog("SteamController:OnConnect")
 	self.handle = handle
 	DriverLog("Handle set to " .. tostring(self.handle))
+	if hmdController == nil then
+		hmdController = handle
+	end
 	self:Rumble(self.handle)
 	DriverLog("SteamController:Rumble")
 end
 
+-- Called once per frame with the newest update, or for every update when
+-- coalesceControllerUpdates is off. Button changes are never merged away.
 function SteamController:OnUpdate(ev)
-	local q = ev.orientation
-	lastOrientationUpdate = Quat:new(q.w, q.x, q.y, q.z)
+	if hmdController == nil then
+		hmdController = self.handle
+	elseif self.handle ~= hmdController then
+		return
+	end
+	-- Prefer the driver's gyro/accelerometer fusion over the controller's
+	-- own orientation
+	if self:GetOrientation(self.handle, lastOrientationUpdate) == nil then
+		lastOrientationUpdate:Set(ev.orientation)
+	end
 end
 
 function SteamController:OnDisconnect()
-	DriverLog("SteamController " .. self.handle .. " has disconnected!")
+	DriverLog("SteamController " .. tostring(self.handle) .. " has disconnected!")
+	if hmdController == self.handle then
+		hmdController = nil
+	end
 	self.handle = nil
 end
 
@@ -0,0 +1,146 @@
+// === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
+
+#include "shm_pose_source.h"
+#include "driverlog.h"
+#include "lua_vrmath.h"
+
+#include <string.h>
+
+using namespace vr;
+
+static const uint64_t k_ulStaleNs = (uint64_t)SHM_POSE_STALE_MS * 1000000;
+static const uint64_t k_ulReopenIntervalNs = (uint64_t)SHM_POSE_REOPEN_INTERVAL_MS * 1000000;
+
+CShmPoseSource::CShmPoseSource() :
+    m_flDelay(0),
+    m_pShm(NULL),
+    m_ulNextOpenNs(0) {
+}
+
+CShmPoseSource::~CShmPoseSource() {
+    Unmap();
+}
+
+void CShmPoseSource::SetName(const std::string& sName) {
+    Unmap();
+    m_sName = sName;
+    m_ulNextOpenNs = 0;
+}
+
+bool CShmPoseSource::Map(uint64_t ulNow) {
+    if (m_pShm != NULL) {
+        return true;
+    }
+    if (m_sName.empty() || ulNow < m_ulNextOpenNs) {
+        return false;
+    }
+
+    m_ulNextOpenNs = ulNow + k_ulReopenIntervalNs;
+    m_pShm = PoseShm_Open(m_sName.c_str());
+    if (m_pShm != NULL) {
+        DriverLog("Reading poses from shared memory %s", m_sName.c_str());
+    }
+    return m_pShm != NULL;
+}
+
+void CShmPoseSource::Unmap() {
+    if (m_pShm != NULL) {
+        PoseShm_Close(m_pShm);
+        m_pShm = NULL;
+    }
+}
+
+bool CShmPoseSource::GetNewest(PoseShmSample& sample, uint64_t* pulIndex) {
+    auto ulNow = PoseShm_NowNs();
+    if (!Map(ulNow) || !PoseShm_ReadNewest(m_pShm, &sample, pulIndex)) {
+        return false;
+    }
+
+    // The writer may have gone away and a new one replaced the segment;
+    // map it again, but keep reporting what the old one has meanwhile
+    if (ulNow > sample.timestampNs + k_ulStaleNs && ulNow >= m_ulNextOpenNs) {
+        Unmap();
+        Map(ulNow);
+    }
+    return true;
+}
+
+static void Lerp(const double* a, const double* b, double t, double* out, int n) {
+    for (int i = 0; i < n; i++) {
+        out[i] = a[i] + (b[i] - a[i]) * t;
+    }
+}
+
+bool CShmPoseSource::GetAt(uint64_t ulTimeNs, PoseShmSample& sample) {
+    uint64_t ulNewest;
+    if (!GetNewest(sample, &ulNewest)) {
+        return false;
+    }
+    if (sample.timestampNs <= ulTimeNs) {
+        return true;
+    }
+
+    // Walk back from the sample in hand to the first one at or before
+    // ulTimeNs; the writer may have published more meanwhile
+    auto newer = sample;
+    for (uint64_t i = 1; i < POSESHM_CAPACITY && i <= ulNewest; i++) {
+        PoseShmSample older;
+        if (!PoseShm_Read(m_pShm, ulNewest - i, &older) || older.timestampNs >= newer.timestampNs) {
+            // Overwritten meanwhile; the oldest one read will do
+            break;
+        }
+        if (older.timestampNs <= ulTimeNs) {
+            auto t = (double)(ulTimeNs - older.timestampNs) / (double)(newer.timestampNs - older.timestampNs);
+            sample.timestampNs = ulTimeNs;
+            Lerp(older.position, newer.position, t, sample.position, 3);
+            Lerp(older.velocity, newer.velocity, t, sample.velocity, 3);
+            Lerp(older.angularVelocity, newer.angularVelocity, t, sample.angularVelocity, 3);
+            auto q = QuatSlerp(
+                { older.rotation[0], older.rotation[1], older.rotation[2], older.rotation[3] },
+                { newer.rotation[0], newer.rotation[1], newer.rotation[2], newer.rotation[3] }, t);
+            sample.rotation[0] = q.w;
+            sample.rotation[1] = q.x;
+            sample.rotation[2] = q.y;
+            sample.rotation[3] = q.z;
+            sample.flags = older.flags & newer.flags;
+            return true;
+        }
+        newer = older;
+    }
+
+    sample = newer;
+    return true;
+}
+
+bool CShmPoseSource::GetPose(double flDelay, DriverPose_t& pose) {
+    auto ulNow = PoseShm_NowNs();
+    auto ulDelay = flDelay > 0 ? (uint64_t)(flDelay * 1e9) : 0;
+    PoseShmSample sample;
+    if (!(ulDelay > 0 ? GetAt(ulNow - ulDelay, sample) : GetNewest(sample))) {
+        return false;
+    }
+
+    memset(&pose, 0, sizeof(pose));
+    pose.qWorldFromDriverRotation.w = 1;
+    pose.qDriverFromHeadRotation.w = 1;
+    pose.qRotation = { sample.rotation[0], sample.rotation[1], sample.rotation[2], sample.rotation[3] };
+    for (int i = 0; i < 3; i++) {
+        pose.vecPosition[i] = sample.position[i];
+        pose.vecVelocity[i] = sample.velocity[i];
+        pose.vecAngularVelocity[i] = sample.angularVelocity[i];
+    }
+    // Negative: the pose was measured before this call, and the runtime
+    // moves it forward along the velocities
+    pose.poseTimeOffset = -((double)ulNow - (double)sample.timestampNs) / 1e9;
+    pose.deviceIsConnected = true;
+
+    auto bStale = ulNow > sample.timestampNs + ulDelay + k_ulStaleNs;
+    if ((sample.flags & POSESHM_SAMPLE_VALID) && !bStale) {
+        pose.poseIsValid = true;
+        pose.result = TrackingResult_Running_OK;
+    } else {
+        pose.poseIsValid = false;
+        pose.result = TrackingResult_Running_OutOfRange;
+    }
+    return true;
+}
@@ -0,0 +1,59 @@
+// === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
+
+#pragma once
+#include <openvr_driver.h>
+#include <string>
+extern "C" {
+#include <pose_shm.h>
+}
+
+// A sample older than this is reported as out of range, in milliseconds
+#define SHM_POSE_STALE_MS 250
+// How often a missing or stale segment is looked up again, in milliseconds
+#define SHM_POSE_REOPEN_INTERVAL_MS 1000
+
+//-----------------------------------------------------------------------------
+// Purpose: poses written by an external tracking process into a pose_shm
+// segment. The segment is mapped directly; reading a pose copies one or two
+// samples out of it and never waits for the writer. A segment that doesn't
+// exist yet, or a writer that went quiet, is looked up again periodically.
+// Must be used from a single thread.
+//-----------------------------------------------------------------------------
+
+class CShmPoseSource {
+public:
+	CShmPoseSource();
+	~CShmPoseSource();
+
+	CShmPoseSource(const CShmPoseSource&) = delete;
+	void operator=(const CShmPoseSource&) = delete;
+
+	// Name of the segment; empty disables the source
+	void SetName(const std::string& sName);
+	bool IsEnabled() const { return !m_sName.empty(); }
+
+	// How far in the past GetPose interpolates by default; 0 reports the
+	// newest sample
+	void SetDelay(double flSeconds) { m_flDelay = flSeconds; }
+	double GetDelay() const { return m_flDelay; }
+
+	// The newest sample and, if pulIndex isn't NULL, its number
+	bool GetNewest(PoseShmSample& sample, uint64_t* pulIndex = NULL);
+	// The sample at ulTimeNs, interpolated between the two around it;
+	// the newest one if it is older than that
+	bool GetAt(uint64_t ulTimeNs, PoseShmSample& sample);
+
+	// The pose flDelay seconds ago, stamped so that the runtime can
+	// extrapolate it to the present; false if there is no sample at all
+	bool GetPose(double flDelay, vr::DriverPose_t& pose);
+
+private:
+	// Map the segment if it isn't; false if it can't be right now
+	bool Map(uint64_t ulNow);
+	void Unmap();
+
+	std::string m_sName;
+	double m_flDelay;
+	PoseShm* m_pShm;
+	uint64_t m_ulNextOpenNs;
+};
@@ -0,0 +1,60 @@
+// === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
+
+#pragma once
+#include <atomic>
+#include <stddef.h>
+
+//-----------------------------------------------------------------------------
+// Purpose: bounded lock-free queue for exactly one producer and one consumer
+// thread. Capacity must be a power of two; one slot is always kept free.
+//-----------------------------------------------------------------------------
+
+template<typename T, size_t N>
+class CSPSCQueue {
+	static_assert(N >= 2 && (N & (N - 1)) == 0, "Capacity must be a power of two");
+public:
+	CSPSCQueue() : m_unHead(0), m_unTail(0) {}
+	CSPSCQueue(const CSPSCQueue&) = delete;
+	void operator=(const CSPSCQueue&) = delete;
+
+	// Producer: returns false if the queue is full
+	bool Push(const T& value) {
+		auto unTail = m_unTail.load(std::memory_order_relaxed);
+		auto unNext = (unTail + 1) & (N - 1);
+		if (unNext == m_unHead.load(std::memory_order_acquire)) {
+			return false;
+		}
+		m_aBuffer[unTail] = value;
+		m_unTail.store(unNext, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer: returns false if the queue is empty
+	bool Pop(T& value) {
+		auto unHead = m_unHead.load(std::memory_order_relaxed);
+		if (unHead == m_unTail.load(std::memory_order_acquire)) {
+			return false;
+		}
+		value = m_aBuffer[unHead];
+		m_unHead.store((unHead + 1) & (N - 1), std::memory_order_release);
+		return true;
+	}
+
+	// Consumer: drop every queued element
+	void Clear() {
+		m_unHead.store(m_unTail.load(std::memory_order_acquire), std::memory_order_release);
+	}
+
+	bool IsEmpty() const {
+		return m_unHead.load(std::memory_order_acquire) == m_unTail.load(std::memory_order_acquire);
+	}
+
+private:
+	// Head and tail are written by different threads; pad them apart so
+	// they don't share a cache line. Padding instead of alignas keeps the
+	// queue embeddable in heap objects under C++11.
+	std::atomic<size_t> m_unHead;
+	char m_padding[64];
+	std::atomic<size_t> m_unTail;
+	T m_aBuffer[N];
+};
@@ -0,0 +1,53 @@
+// === Copyright (c) 2017-2020 easimer.net. All rights reserved. ===
+
+#pragma once
+#include <atomic>
+#include <stdint.h>
+
+//-----------------------------------------------------------------------------
+// Purpose: lock-free mailbox holding the latest value published by one
+// writer thread for one reader thread. Neither side ever waits; the reader
+// always sees the newest complete value.
+//-----------------------------------------------------------------------------
+
+template<typename T>
+class CTripleBuffer {
+public:
+	CTripleBuffer() : m_unBack(0), m_unMiddle(1), m_unFront(2) {
+		m_aSlots[0] = m_aSlots[1] = m_aSlots[2] = T();
+	}
+	CTripleBuffer(const CTripleBuffer&) = delete;
+	void operator=(const CTripleBuffer&) = delete;
+
+	// Writer: publish a new value
+	void Write(const T& value) {
+		m_aSlots[m_unBack] = value;
+		// Swap the back slot with the middle one and flag it fresh
+		auto unOld = m_unMiddle.exchange(m_unBack | k_unFresh, std::memory_order_acq_rel);
+		m_unBack = unOld & k_unIndexMask;
+	}
+
+	// Reader: fetch the latest published value
+	// Returns the previous value again if nothing new was published.
+	const T& Read() {
+		if (m_unMiddle.load(std::memory_order_relaxed) & k_unFresh) {
+			auto unOld = m_unMiddle.exchange(m_unFront, std::memory_order_acq_rel);
+			m_unFront = unOld & k_unIndexMask;
+		}
+		return m_aSlots[m_unFront];
+	}
+
+	// Reader: true if a value was published since the last Read()
+	bool HasNew() const {
+		return (m_unMiddle.load(std::memory_order_relaxed) & k_unFresh) != 0;
+	}
+
+private:
+	static const uint8_t k_unFresh = 0x4;
+	static const uint8_t k_unIndexMask = 0x3;
+
+	T m_aSlots[3];
+	uint8_t m_unBack; // owned by the writer
+	std::atomic<uint8_t> m_unMiddle; // shared, carries the fresh flag
+	uint8_t m_unFront; // owned by the reader
+};
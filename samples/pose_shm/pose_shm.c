@@ -0,0 +1,252 @@
+#include "pose_shm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#define POSESHM_READ_ATTEMPTS   16    /**< Reads of a slot before giving up on a busy writer. */
+#define POSESHM_MAX_NAME        256
+
+struct PoseShm {
+  PoseShmLayout *layout;
+  bool          writable;
+  uint64_t      next;         /**< Writer only: number of the next sample. */
+#if _WIN32
+  HANDLE        mapping;
+#endif
+};
+
+/*
+  The segment is shared between processes, so C11 atomics can't be
+  assumed on both sides; these are the few operations the protocol needs.
+*/
+#if defined(_MSC_VER)
+static uint32_t LoadAcquire32(const uint32_t *p)          { return (uint32_t)InterlockedOr((volatile LONG *)p, 0); }
+static uint64_t LoadAcquire64(const uint64_t *p)          { return (uint64_t)InterlockedOr64((volatile LONG64 *)p, 0); }
+static void     StoreRelease32(uint32_t *p, uint32_t v)   { InterlockedExchange((volatile LONG *)p, (LONG)v); }
+static void     StoreRelease64(uint64_t *p, uint64_t v)   { InterlockedExchange64((volatile LONG64 *)p, (LONG64)v); }
+static void     Fence(void)                               { MemoryBarrier(); }
+#define FenceAcquire Fence
+#define FenceRelease Fence
+#else
+static uint32_t LoadAcquire32(const uint32_t *p)          { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static uint64_t LoadAcquire64(const uint64_t *p)          { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static void     StoreRelease32(uint32_t *p, uint32_t v)   { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+static void     StoreRelease64(uint64_t *p, uint64_t v)   { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+static void     FenceAcquire(void)                        { __atomic_thread_fence(__ATOMIC_ACQUIRE); }
+static void     FenceRelease(void)                        { __atomic_thread_fence(__ATOMIC_RELEASE); }
+#endif
+
+uint64_t PoseShm_NowNs(void) {
+#if _WIN32
+  LARGE_INTEGER frequency, counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000 +
+    (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000 / frequency.QuadPart;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+static bool IsValidLayout(const PoseShmLayout *pLayout) {
+  return LoadAcquire32(&pLayout->header.magic) == POSESHM_MAGIC &&
+    pLayout->header.version == POSESHM_VERSION &&
+    pLayout->header.capacity == POSESHM_CAPACITY &&
+    pLayout->header.sampleSize == sizeof(PoseShmSample);
+}
+
+/** Map the segment; the platform specific part of creating and opening it. */
+static PoseShmLayout * Map(PoseShm *pShm, const char *name, bool create) {
+  char fullName[POSESHM_MAX_NAME];
+#if _WIN32
+  snprintf(fullName, sizeof(fullName), "Local\\%s", name);
+  if (create)
+    pShm->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(PoseShmLayout), fullName);
+  else
+    pShm->mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, fullName);
+  if (!pShm->mapping)
+    return NULL;
+
+  void *pView = MapViewOfFile(pShm->mapping, create ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, sizeof(PoseShmLayout));
+  if (!pView) {
+    CloseHandle(pShm->mapping);
+    return NULL;
+  }
+  return (PoseShmLayout *)pView;
+#else
+  (void)pShm;
+  /* POSIX names are a single path component starting with a slash */
+  snprintf(fullName, sizeof(fullName), "%s%s", name[0] == '/' ? "" : "/", name);
+  int fd = shm_open(fullName, create ? O_RDWR | O_CREAT : O_RDONLY, 0600);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  if (create ? ftruncate(fd, sizeof(PoseShmLayout)) != 0 : fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(PoseShmLayout)) {
+    close(fd);
+    return NULL;
+  }
+
+  void *pView = mmap(NULL, sizeof(PoseShmLayout), create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  /* The mapping keeps the segment alive */
+  close(fd);
+  return pView != MAP_FAILED ? (PoseShmLayout *)pView : NULL;
+#endif
+}
+
+/**
+ * Create the segment, or take over the one a previous writer left behind
+ * so that readers that have it mapped keep working. There must be a
+ * single writer at a time.
+ *
+ * @param name  Name of the segment, without platform prefixes.
+ */
+PoseShm * PoseShm_Create(const char *name) {
+  if (!name)
+    return NULL;
+
+  PoseShm *pShm = calloc(1, sizeof(PoseShm));
+  pShm->writable = true;
+  pShm->layout   = Map(pShm, name, true);
+  if (!pShm->layout) {
+    fprintf(stderr, "Creating shared memory %s failed\n", name);
+    free(pShm);
+    return NULL;
+  }
+
+  PoseShmLayout *pLayout = pShm->layout;
+  if (IsValidLayout(pLayout)) {
+    pShm->next = pLayout->header.published;
+    return pShm;
+  }
+
+  memset(pLayout, 0, sizeof(PoseShmLayout));
+  pLayout->header.version    = POSESHM_VERSION;
+  pLayout->header.capacity   = POSESHM_CAPACITY;
+  pLayout->header.sampleSize = sizeof(PoseShmSample);
+  StoreRelease32(&pLayout->header.magic, POSESHM_MAGIC);
+  return pShm;
+}
+
+/**
+ * Map a segment created by a writer, read-only.
+ *
+ * @return NULL if there is no segment of that name or it has another layout.
+ */
+PoseShm * PoseShm_Open(const char *name) {
+  if (!name)
+    return NULL;
+
+  PoseShm *pShm = calloc(1, sizeof(PoseShm));
+  pShm->layout = Map(pShm, name, false);
+  if (!pShm->layout) {
+    free(pShm);
+    return NULL;
+  }
+
+  if (!IsValidLayout(pShm->layout)) {
+    PoseShm_Close(pShm);
+    return NULL;
+  }
+  return pShm;
+}
+
+/** Unmap a segment. The segment itself stays until the system removes it. */
+void PoseShm_Close(PoseShm *pShm) {
+  if (!pShm)
+    return;
+
+#if _WIN32
+  UnmapViewOfFile(pShm->layout);
+  CloseHandle(pShm->mapping);
+#else
+  munmap(pShm->layout, sizeof(PoseShmLayout));
+#endif
+  free(pShm);
+}
+
+/** Publish a sample. Never waits for readers. */
+void PoseShm_Write(PoseShm *pShm, const PoseShmSample *pSample) {
+  if (!pShm || !pShm->writable || !pSample)
+    return;
+
+  PoseShmLayout *pLayout  = pShm->layout;
+  uint64_t      index     = pShm->next++;
+  PoseShmSlot   *pSlot    = &pLayout->slots[index % POSESHM_CAPACITY];
+  /* A writer that died mid-write leaves the sequence odd; start over
+     from the next even value so that odd keeps meaning busy */
+  uint32_t      sequence  = (pSlot->sequence + 1) & ~1u;
+
+  StoreRelease32(&pSlot->sequence, sequence + 1);
+  FenceRelease();
+  pSlot->index  = index;
+  pSlot->sample = *pSample;
+  StoreRelease32(&pSlot->sequence, sequence + 2);
+
+  StoreRelease64(&pLayout->header.published, index + 1);
+}
+
+/** Number of samples written so far. */
+uint64_t PoseShm_Published(const PoseShm *pShm) {
+  return pShm ? LoadAcquire64(&pShm->layout->header.published) : 0;
+}
+
+/**
+ * Copy a sample out of the ring.
+ *
+ * @param index   Number of the sample, below PoseShm_Published().
+ * @return false if the sample was overwritten already, or the writer kept the slot busy.
+ */
+bool PoseShm_Read(const PoseShm *pShm, uint64_t index, PoseShmSample *pSample) {
+  if (!pShm || !pSample)
+    return false;
+
+  const PoseShmSlot *pSlot = &pShm->layout->slots[index % POSESHM_CAPACITY];
+  for (int attempt = 0; attempt < POSESHM_READ_ATTEMPTS; attempt++) {
+    uint32_t before = LoadAcquire32(&pSlot->sequence);
+    if (before & 1)
+      continue;
+
+    uint64_t slotIndex = pSlot->index;
+    memcpy(pSample, &pSlot->sample, sizeof(PoseShmSample));
+    FenceAcquire();
+    if (LoadAcquire32(&pSlot->sequence) == before)
+      return slotIndex == index;
+  }
+  return false;
+}
+
+/**
+ * Copy the newest sample.
+ *
+ * @param pIndex  Receives the number of the sample; may be NULL.
+ * @return false if nothing was written yet.
+ */
+bool PoseShm_ReadNewest(const PoseShm *pShm, PoseShmSample *pSample, uint64_t *pIndex) {
+  for (int attempt = 0; attempt < POSESHM_READ_ATTEMPTS; attempt++) {
+    uint64_t published = PoseShm_Published(pShm);
+    if (published == 0)
+      return false;
+
+    /* Fails only if the writer went around the whole ring meanwhile */
+    if (PoseShm_Read(pShm, published - 1, pSample)) {
+      if (pIndex)
+        *pIndex = published - 1;
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+  Poses handed from a tracking process to the driver through shared memory.
+
+  One process creates the segment and writes samples into a ring; any
+  number of readers map it read-only. Every slot of the ring is guarded by
+  a sequence lock, so neither side ever waits for the other: the writer
+  makes the sequence odd, fills the slot and makes it even again, and a
+  reader retries when the sequence was odd or changed while it copied.
+
+  On POSIX systems the segment is a shm_open() object, elsewhere a named
+  file mapping in the session namespace.
+*/
+
+#define POSESHM_MAGIC             0x50534D48    /**< "HMSP" in memory on little endian machines. */
+#define POSESHM_VERSION           1
+#define POSESHM_CAPACITY          64            /**< Samples kept in the ring. */
+#define POSESHM_DEFAULT_NAME      "easimer-pose"
+
+#define POSESHM_SAMPLE_VALID      (1<<0)        /**< The tracker knows where the device is. */
+
+/** A timestamped 6DoF pose. */
+typedef struct {
+  uint64_t  timestampNs;          /**< PoseShm_NowNs() when the pose was measured. */
+  double    position[3];          /**< Meters, in the driver's world space. */
+  double    rotation[4];          /**< Unit quaternion w, x, y, z. */
+  double    velocity[3];          /**< Meters per second; zero if unknown. */
+  double    angularVelocity[3];   /**< Axis times radians per second, in the same space as
+                                       DriverPose_t::vecAngularVelocity; zero if unknown. */
+  uint32_t  flags;                /**< POSESHM_SAMPLE_* */
+  uint32_t  reserved;
+} PoseShmSample;
+
+typedef struct {
+  uint32_t  sequence;             /**< Odd while the writer updates the slot. */
+  uint32_t  reserved;
+  uint64_t  index;                /**< Number of the sample in the slot. */
+  PoseShmSample sample;
+} PoseShmSlot;
+
+typedef struct {
+  uint32_t  magic;                /**< POSESHM_MAGIC once the rest of the header is valid. */
+  uint32_t  version;
+  uint32_t  capacity;
+  uint32_t  sampleSize;
+  uint64_t  published;            /**< Samples written so far; the newest is published - 1. */
+  uint8_t   reserved[40];
+} PoseShmHeader;
+
+/** Layout of the whole segment. */
+typedef struct {
+  PoseShmHeader header;
+  PoseShmSlot   slots[POSESHM_CAPACITY];
+} PoseShmLayout;
+
+typedef struct PoseShm PoseShm;
+
+/** Host time in nanoseconds on the clock samples are stamped with. */
+uint64_t  PoseShm_NowNs(void);
+
+PoseShm * PoseShm_Create(const char *name);
+PoseShm * PoseShm_Open(const char *name);
+void      PoseShm_Close(PoseShm *pShm);
+
+void      PoseShm_Write(PoseShm *pShm, const PoseShmSample *pSample);
+
+uint64_t  PoseShm_Published(const PoseShm *pShm);
+bool      PoseShm_Read(const PoseShm *pShm, uint64_t index, PoseShmSample *pSample);
+bool      PoseShm_ReadNewest(const PoseShm *pShm, PoseShmSample *pSample, uint64_t *pIndex);
+
+#ifdef __cplusplus
+}
+#endif
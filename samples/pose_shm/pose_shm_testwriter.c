@@ -0,0 +1,91 @@
+/*
+  Writes a synthetic pose into the shared memory segment the driver reads:
+  the head sways sideways and turns left and right.
+
+  pose_shm_testwriter [name] [rate in Hz] [seconds, 0 = forever]
+*/
+
+#include "pose_shm.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define TESTWRITER_DEFAULT_RATE   500
+#define TESTWRITER_SWAY           0.1     /**< Meters to either side. */
+#define TESTWRITER_SWAY_HZ        0.25
+#define TESTWRITER_YAW            0.5     /**< Radians to either side. */
+#define TESTWRITER_YAW_HZ         0.1
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+static void SleepUntilNs(uint64_t deadline) {
+  uint64_t now = PoseShm_NowNs();
+  if (now >= deadline)
+    return;
+#if _WIN32
+  Sleep((DWORD)((deadline - now) / 1000000));
+#else
+  uint64_t delta = deadline - now;
+  struct timespec delay = { (time_t)(delta / 1000000000), (long)(delta % 1000000000) };
+  nanosleep(&delay, NULL);
+#endif
+}
+
+int main(int argc, char **argv) {
+  const char  *name    = argc > 1 ? argv[1] : POSESHM_DEFAULT_NAME;
+  double      rate     = argc > 2 ? atof(argv[2]) : TESTWRITER_DEFAULT_RATE;
+  double      duration = argc > 3 ? atof(argv[3]) : 0;
+
+  if (rate <= 0) {
+    fprintf(stderr, "usage: %s [name] [rate in Hz] [seconds, 0 = forever]\n", argv[0]);
+    return 1;
+  }
+
+  PoseShm *pShm = PoseShm_Create(name);
+  if (!pShm)
+    return 1;
+  printf("Writing %g poses per second into %s\n", rate, name);
+
+  uint64_t  period  = (uint64_t)(1e9 / rate);
+  uint64_t  start   = PoseShm_NowNs();
+  uint64_t  next    = start;
+  uint64_t  written = 0;
+
+  while (duration <= 0 || (double)(next - start) / 1e9 < duration) {
+    SleepUntilNs(next);
+
+    PoseShmSample sample = { 0 };
+    sample.timestampNs = PoseShm_NowNs();
+    double t = (double)(sample.timestampNs - start) / 1e9;
+
+    double swayPhase = 2 * M_PI * TESTWRITER_SWAY_HZ * t;
+    sample.position[0] = TESTWRITER_SWAY * sin(swayPhase);
+    sample.velocity[0] = TESTWRITER_SWAY * 2 * M_PI * TESTWRITER_SWAY_HZ * cos(swayPhase);
+
+    /* Yaw about +Y */
+    double yawPhase = 2 * M_PI * TESTWRITER_YAW_HZ * t;
+    double yaw      = TESTWRITER_YAW * sin(yawPhase);
+    sample.rotation[0] = cos(yaw / 2);
+    sample.rotation[2] = sin(yaw / 2);
+    sample.angularVelocity[1] = TESTWRITER_YAW * 2 * M_PI * TESTWRITER_YAW_HZ * cos(yawPhase);
+
+    sample.flags = POSESHM_SAMPLE_VALID;
+    PoseShm_Write(pShm, &sample);
+
+    written++;
+    next += period;
+  }
+
+  printf("Wrote %llu poses\n", (unsigned long long)written);
+  PoseShm_Close(pShm);
+  return 0;
+}
@@ -37,6 +37,15 @@ void Debug_DumpHex(const void *pData, size_t count);
 #define STEAMCONTROLLER_GET_CHIPID                 0xBA // 1011 1010
 #define STEAMCONTROLLER_WRITE_EEPROM               0xC1 // 1100 0001
 
+typedef struct SteamControllerRecorder SteamControllerRecorder;
+
+struct SteamControllerDevice {
+  const SteamControllerTransport  *transport;
+  void                            *context;
+  bool                            isWireless;
+  SteamControllerRecorder         *recorder;    /**< Where input reports are copied to, or NULL. */
+};
+
 typedef struct {
   uint8_t reportPage;
   uint8_t featureId;
@@ -47,8 +56,18 @@ typedef struct {
 bool SteamController_HIDSetFeatureReport(const SteamControllerDevice *pDevice, SteamController_HIDFeatureReport *pReport);
 bool SteamController_HIDGetFeatureReport(const SteamControllerDevice *pDevice, SteamController_HIDFeatureReport *pReport);
 
+SteamControllerDevice * SteamController_WrapTransport(const SteamControllerTransport *pTransport, void *context, bool isWireless);
+
 bool    SteamController_Initialize(const SteamControllerDevice *pDevice);
 uint8_t SteamController_ReadRaw(const SteamControllerDevice *pDevice, uint8_t *buffer, uint8_t maxLen);
+uint8_t SteamController_ReadRawTimeout(const SteamControllerDevice *pDevice, uint8_t *buffer, uint8_t maxLen, uint32_t timeoutMs);
+uint8_t SteamController_DecodeEvent(uint8_t *eventData, uint16_t len, SteamControllerEvent *pEvent);
+
+void    SteamController_RecordReport(SteamControllerRecorder *pRecorder, const uint8_t *report, uint8_t len);
+void    SteamController_CloseRecorder(SteamControllerRecorder *pRecorder);
+
+uint64_t  SteamController_MonotonicUs(void);
+void      SteamController_SleepUs(uint64_t us);
 
 
 static inline uint8_t LowByte(uint16_t value)   { return value & 0xff; }
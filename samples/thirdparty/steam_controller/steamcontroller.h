@@ -145,20 +145,89 @@ typedef union {
   SteamControllerConnectionEvent  connection;
 } SteamControllerEvent;
 
+/**
+ * Motion data of a run of update events, one array per field.
+ * The arrays are owned by the caller and hold at least capacity entries.
+ */
+typedef struct {
+  uint32_t                  capacity;
+  uint32_t                  count;
+
+  uint32_t                 *timeStamp;
+  uint32_t                 *buttons;
+  SteamControllerVector    *orientation;
+  SteamControllerVector    *acceleration;
+  SteamControllerVector    *angularVelocity;
+} SteamControllerUpdateBatch;
+
 // ----------------------------------------------------------------------------------------------
 // Controller device enumeration
 
 SCAPI SteamControllerDeviceEnum * SCCC SteamController_EnumControllerDevices();
 SCAPI SteamControllerDeviceEnum * SCCC SteamController_NextControllerDevice(SteamControllerDeviceEnum *pCurrent);
+SCAPI const char *                SCCC SteamController_GetDevicePath(const SteamControllerDeviceEnum *pEnum);
 
 // ----------------------------------------------------------------------------------------------
 // Controller initialization
 
 SCAPI SteamControllerDevice * SCCC SteamController_Open(const SteamControllerDeviceEnum *pEnum);
+/** Open a controller to read its reports only, leaving its configuration to whoever else drives it. */
+SCAPI SteamControllerDevice * SCCC SteamController_OpenListenOnly(const SteamControllerDeviceEnum *pEnum);
 SCAPI void                    SCCC SteamController_Close(SteamControllerDevice *pDevice);
 SCAPI bool                    SCCC SteamController_IsWirelessDongle(const SteamControllerDevice *pDevice);
 SCAPI bool                    SCCC SteamController_TurnOff(const SteamControllerDevice *pDevice);
 
+#if defined(__linux__)
+/**
+ * Operations the Linux backend performs on hidraw device nodes.
+ * Return values follow the system calls; read returns 0 when no report
+ * is queued and poll returns 0 on timeout.
+ */
+typedef struct {
+  int   (*open)(const char *path, void *userData);
+  void  (*close)(int fd, void *userData);
+  int   (*poll)(int fd, int timeoutMs, void *userData);
+  int   (*read)(int fd, uint8_t *buffer, size_t len, void *userData);
+  int   (*setFeature)(int fd, const uint8_t *report, size_t len, void *userData);
+  int   (*getFeature)(int fd, uint8_t *report, size_t len, void *userData);
+  void  *userData;
+} SteamControllerLinuxIO;
+
+SCAPI void                    SCCC SteamController_SetLinuxIO(const SteamControllerLinuxIO *pIO);
+SCAPI SteamControllerDevice * SCCC SteamController_OpenPath(const char *path, bool isWireless);
+#endif
+
+// ----------------------------------------------------------------------------------------------
+// Transports
+
+/**
+ * What a device sends its reports through. The platform backends talk to
+ * the HID driver; other transports can feed the library from anywhere.
+ * Feature reports are 65 bytes, starting with the report page and the
+ * feature id. Each call makes a single attempt; the library retries.
+ */
+typedef struct {
+  /** Read one input report, waiting up to timeoutMs. Returns its length, 0 if there was none. */
+  uint8_t (*readReport)(void *context, uint8_t *buffer, uint8_t maxLen, uint32_t timeoutMs);
+  bool    (*setFeatureReport)(void *context, const uint8_t *report, size_t len);
+  /** Fetch the response to the last feature report sent. */
+  bool    (*getFeatureReport)(void *context, uint8_t *report, size_t len);
+  void    (*close)(void *context);
+} SteamControllerTransport;
+
+SCAPI SteamControllerDevice * SCCC SteamController_OpenTransport(const SteamControllerTransport *pTransport, void *context, bool isWireless);
+
+// ----------------------------------------------------------------------------------------------
+// Recording and replay
+
+#define   STEAMCONTROLLER_REPLAY_AS_FAST_AS_POSSIBLE   0.0f   /**< Replay speed that never waits for a report. */
+
+SCAPI bool                    SCCC SteamController_StartRecording(SteamControllerDevice *pDevice, const char *path);
+SCAPI void                    SCCC SteamController_StopRecording(SteamControllerDevice *pDevice);
+SCAPI SteamControllerDevice * SCCC SteamController_OpenReplay(const char *path, float speed);
+SCAPI bool                    SCCC SteamController_IsReplay(const SteamControllerDevice *pDevice);
+SCAPI bool                    SCCC SteamController_IsReplayFinished(const SteamControllerDevice *pDevice);
+
 // ----------------------------------------------------------------------------------------------
 // Wireless dongle control
 
@@ -197,6 +266,9 @@ bool      SCAPI SCCC SteamController_SetTimeOut(const SteamControllerDevice *pDe
 // State
 
 uint8_t   SCAPI SCCC SteamController_ReadEvent(const SteamControllerDevice *pDevice, SteamControllerEvent *pEvent);
+uint8_t   SCAPI SCCC SteamController_ReadEventTimeout(const SteamControllerDevice *pDevice, SteamControllerEvent *pEvent, uint32_t timeoutMs);
+uint32_t  SCAPI SCCC SteamController_ReadEvents(const SteamControllerDevice *pDevice, SteamControllerEvent *pEvents, uint32_t maxCount, uint32_t timeoutUs);
+uint32_t  SCAPI SCCC SteamController_DecodeUpdates(const SteamControllerEvent *pEvents, uint32_t count, SteamControllerUpdateBatch *pBatch);
 void      SCAPI SCCC SteamController_UpdateState(SteamControllerState *pState, const SteamControllerEvent *pEvent);
 
 // ----------------------------------------------------------------------------------------------
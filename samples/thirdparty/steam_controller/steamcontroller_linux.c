@@ -0,0 +1,298 @@
+#if __linux__
+
+#include "steamcontroller.h"
+#include "common.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <linux/hidraw.h>
+
+typedef struct {
+  int   fd;
+} HidrawDevice;
+
+struct SteamControllerDeviceEnum {
+  struct SteamControllerDeviceEnum *next;
+  char      devicePath[32];
+  uint16_t  productId;
+};
+
+// ----------------------------------------------------------------------------------------------
+// Default I/O: the kernel's hidraw driver
+
+static int DefaultOpen(const char *path, void *userData) {
+  (void)userData;
+  return open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+}
+
+static void DefaultClose(int fd, void *userData) {
+  (void)userData;
+  close(fd);
+}
+
+static int DefaultPoll(int fd, int timeoutMs, void *userData) {
+  (void)userData;
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  int ret;
+  do {
+    ret = poll(&pfd, 1, timeoutMs);
+  } while (ret < 0 && errno == EINTR);
+  if (ret > 0 && (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) && !(pfd.revents & POLLIN))
+    return -1;
+  return ret;
+}
+
+static int DefaultRead(int fd, uint8_t *buffer, size_t len, void *userData) {
+  (void)userData;
+  ssize_t ret;
+  do {
+    ret = read(fd, buffer, len);
+  } while (ret < 0 && errno == EINTR);
+  if (ret < 0)
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+  return (int)ret;
+}
+
+static int DefaultSetFeature(int fd, const uint8_t *report, size_t len, void *userData) {
+  (void)userData;
+  return ioctl(fd, HIDIOCSFEATURE(len), report);
+}
+
+static int DefaultGetFeature(int fd, uint8_t *report, size_t len, void *userData) {
+  (void)userData;
+  return ioctl(fd, HIDIOCGFEATURE(len), report);
+}
+
+static const SteamControllerLinuxIO g_defaultIO = {
+  DefaultOpen,
+  DefaultClose,
+  DefaultPoll,
+  DefaultRead,
+  DefaultSetFeature,
+  DefaultGetFeature,
+  NULL
+};
+
+static SteamControllerLinuxIO g_customIO;
+static const SteamControllerLinuxIO *g_pIO = &g_defaultIO;
+
+/**
+ * Replace the functions the backend uses to talk to device nodes.
+ * Must be called before any device is opened.
+ *
+ * @param pIO   Functions to use, or NULL to go back to hidraw.
+ */
+SCAPI void SCCC SteamController_SetLinuxIO(const SteamControllerLinuxIO *pIO) {
+  if (pIO) {
+    g_customIO = *pIO;
+    g_pIO = &g_customIO;
+  } else {
+    g_pIO = &g_defaultIO;
+  }
+}
+
+// ----------------------------------------------------------------------------------------------
+// Enumeration
+
+/** Read a small sysfs attribute of a hidraw node. */
+static size_t ReadSysfs(const char *node, const char *attribute, void *buffer, size_t maxLen) {
+  char path[256];
+  snprintf(path, sizeof(path), "/sys/class/hidraw/%s/device/%s", node, attribute);
+
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return 0;
+
+  size_t len = fread(buffer, 1, maxLen, f);
+  fclose(f);
+  return len;
+}
+
+/** Get the vendor and product ID of a hidraw node from its uevent. */
+static bool GetHIDID(const char *node, uint16_t *pVendorId, uint16_t *pProductId) {
+  char uevent[1024];
+  size_t len = ReadSysfs(node, "uevent", uevent, sizeof(uevent) - 1);
+  uevent[len] = 0;
+
+  // HID_ID=<bus>:<vendor>:<product>
+  const char *id = strstr(uevent, "HID_ID=");
+  unsigned bus, vendor, product;
+  if (!id || sscanf(id, "HID_ID=%x:%x:%x", &bus, &vendor, &product) != 3)
+    return false;
+
+  *pVendorId  = (uint16_t)vendor;
+  *pProductId = (uint16_t)product;
+  return true;
+}
+
+/**
+ * The controller also shows up as a keyboard and a mouse; only the
+ * interface whose report descriptor starts with the vendor defined usage
+ * page (0xFF00) carries controller reports.
+ */
+static bool IsVendorInterface(const char *node) {
+  uint8_t descriptor[3];
+  if (ReadSysfs(node, "report_descriptor", descriptor, sizeof(descriptor)) != sizeof(descriptor))
+    return false;
+  return descriptor[0] == 0x06 && descriptor[1] == 0x00 && descriptor[2] == 0xFF;
+}
+
+SCAPI SteamControllerDeviceEnum * SCCC SteamController_EnumControllerDevices() {
+  DIR *dir = opendir("/sys/class/hidraw");
+  if (!dir)
+    return NULL;
+
+  SteamControllerDeviceEnum *pEnum = NULL;
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, "hidraw", 6) != 0)
+      continue;
+
+    uint16_t vendorId, productId;
+    if (!GetHIDID(entry->d_name, &vendorId, &productId))
+      continue;
+
+    if (vendorId != USB_VID_VALVE)
+      continue;
+
+    if (productId != USB_PID_STEAMCONTROLLER_WIRED && productId != USB_PID_STEAMCONTROLLER_WIRELESS)
+      continue;
+
+    if (!IsVendorInterface(entry->d_name))
+      continue;
+
+    SteamControllerDeviceEnum *pNewEnum = malloc(sizeof(SteamControllerDeviceEnum));
+    pNewEnum->next = pEnum;
+    snprintf(pNewEnum->devicePath, sizeof(pNewEnum->devicePath), "/dev/%s", entry->d_name);
+    pNewEnum->productId = productId;
+    pEnum = pNewEnum;
+  }
+
+  closedir(dir);
+
+  return pEnum;
+}
+
+SCAPI SteamControllerDeviceEnum * SCCC SteamController_NextControllerDevice(SteamControllerDeviceEnum *pCurrent) {
+  if (!pCurrent)
+    return NULL;
+
+  SteamControllerDeviceEnum *pNext = pCurrent->next;
+
+  free(pCurrent);
+
+  return pNext;
+}
+
+/**
+ * Name of the device node an enumerated controller was found at. It stays
+ * the same for as long as the controller is plugged in.
+ */
+SCAPI const char * SCCC SteamController_GetDevicePath(const SteamControllerDeviceEnum *pEnum) {
+  if (!pEnum)
+    return NULL;
+  return pEnum->devicePath;
+}
+
+// ----------------------------------------------------------------------------------------------
+// Devices
+
+static uint8_t HidrawReadReport(void *context, uint8_t *buffer, uint8_t maxLen, uint32_t timeoutMs) {
+  HidrawDevice *pHidraw = context;
+
+  // Reports that are already queued are read without a poll
+  int len = g_pIO->read(pHidraw->fd, buffer, maxLen, g_pIO->userData);
+  if (len == 0 && timeoutMs > 0) {
+    if (g_pIO->poll(pHidraw->fd, (int)timeoutMs, g_pIO->userData) <= 0)
+      return 0;
+    len = g_pIO->read(pHidraw->fd, buffer, maxLen, g_pIO->userData);
+  }
+
+  return len > 0 ? (uint8_t)len : 0;
+}
+
+static bool HidrawSetFeatureReport(void *context, const uint8_t *report, size_t len) {
+  HidrawDevice *pHidraw = context;
+
+  if (g_pIO->setFeature(pHidraw->fd, report, len, g_pIO->userData) >= 0)
+    return true;
+
+  fprintf(stderr, "HIDIOCSFEATURE failed: %s\n", strerror(errno));
+  return false;
+}
+
+static bool HidrawGetFeatureReport(void *context, uint8_t *report, size_t len) {
+  HidrawDevice *pHidraw = context;
+
+  if (g_pIO->getFeature(pHidraw->fd, report, len, g_pIO->userData) >= 0)
+    return true;
+
+  fprintf(stderr, "HIDIOCGFEATURE failed: %s\n", strerror(errno));
+  return false;
+}
+
+static void HidrawClose(void *context) {
+  HidrawDevice *pHidraw = context;
+
+  g_pIO->close(pHidraw->fd, g_pIO->userData);
+  free(pHidraw);
+}
+
+static const SteamControllerTransport g_hidrawTransport = {
+  HidrawReadReport,
+  HidrawSetFeatureReport,
+  HidrawGetFeatureReport,
+  HidrawClose
+};
+
+static SteamControllerDevice * OpenNode(const char *path, bool isWireless, bool setUp) {
+  if (!path)
+    return NULL;
+
+  int fd = g_pIO->open(path, g_pIO->userData);
+  if (fd < 0) {
+    fprintf(stderr, "Opening %s failed: %s\n", path, strerror(errno));
+    return NULL;
+  }
+
+  HidrawDevice *pHidraw = malloc(sizeof(HidrawDevice));
+  pHidraw->fd = fd;
+
+  if (!setUp)
+    return SteamController_WrapTransport(&g_hidrawTransport, pHidraw, isWireless);
+  return SteamController_OpenTransport(&g_hidrawTransport, pHidraw, isWireless);
+}
+
+/**
+ * Open a device node directly, without enumerating it.
+ * Together with SteamController_SetLinuxIO this lets tests drive the
+ * library from a pipe or a file.
+ *
+ * @param path        Device node, e.g. /dev/hidraw3.
+ * @param isWireless  Whether the node belongs to a wireless dongle.
+ */
+SCAPI SteamControllerDevice * SCCC SteamController_OpenPath(const char *path, bool isWireless) {
+  return OpenNode(path, isWireless, true);
+}
+
+SCAPI SteamControllerDevice * SCCC SteamController_Open(const SteamControllerDeviceEnum *pEnum) {
+  if (!pEnum)
+    return NULL;
+
+  return OpenNode(pEnum->devicePath, pEnum->productId == USB_PID_STEAMCONTROLLER_WIRELESS, true);
+}
+
+SCAPI SteamControllerDevice * SCCC SteamController_OpenListenOnly(const SteamControllerDeviceEnum *pEnum) {
+  if (!pEnum)
+    return NULL;
+
+  return OpenNode(pEnum->devicePath, pEnum->productId == USB_PID_STEAMCONTROLLER_WIRELESS, false);
+}
+
+#endif
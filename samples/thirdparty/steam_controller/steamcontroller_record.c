@@ -0,0 +1,240 @@
+#include "steamcontroller.h"
+#include "common.h"
+
+/*
+  Recording format, all integers little endian:
+
+  header    "SCRL", uint8 version, uint8 flags, uint16 reserved
+  record    uint32 microseconds since the previous record (the first one:
+            since the recording started), uint8 length, report[length]
+
+  Only input reports are recorded; a replayed device accepts any feature
+  report and answers requests with an empty response.
+*/
+
+#define RECORDING_MAGIC           "SCRL"
+#define RECORDING_VERSION         1
+#define RECORDING_HEADER_SIZE     8
+#define RECORDING_RECORD_SIZE     5     /**< Size of a record without its report. */
+#define RECORDING_FLAG_WIRELESS   1     /**< Recorded from a wireless dongle. */
+
+struct SteamControllerRecorder {
+  FILE      *file;
+  uint64_t  lastUs;     /**< Host time of the last report written. */
+};
+
+/**
+ * Copy every input report read from a device into a file, with the host
+ * time it was read at. Must not be called while another thread reads from
+ * the device.
+ *
+ * @param pDevice   Device to record.
+ * @param path      File to write; it is replaced.
+ */
+SCAPI bool SCCC SteamController_StartRecording(SteamControllerDevice *pDevice, const char *path) {
+  if (!pDevice || !path)
+    return false;
+
+  SteamController_StopRecording(pDevice);
+
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    fprintf(stderr, "Opening recording %s failed\n", path);
+    return false;
+  }
+
+  uint8_t header[RECORDING_HEADER_SIZE] = { 0 };
+  memcpy(header, RECORDING_MAGIC, 4);
+  header[4] = RECORDING_VERSION;
+  header[5] = pDevice->isWireless ? RECORDING_FLAG_WIRELESS : 0;
+  if (fwrite(header, 1, sizeof(header), file) != sizeof(header)) {
+    fclose(file);
+    return false;
+  }
+
+  SteamControllerRecorder *pRecorder = malloc(sizeof(SteamControllerRecorder));
+  pRecorder->file   = file;
+  pRecorder->lastUs = SteamController_MonotonicUs();
+  pDevice->recorder = pRecorder;
+  return true;
+}
+
+/** Flush and close the recording of a device, if there is one. Same restrictions as starting it. */
+SCAPI void SCCC SteamController_StopRecording(SteamControllerDevice *pDevice) {
+  if (!pDevice || !pDevice->recorder)
+    return;
+
+  SteamController_CloseRecorder(pDevice->recorder);
+  pDevice->recorder = NULL;
+}
+
+void SteamController_RecordReport(SteamControllerRecorder *pRecorder, const uint8_t *report, uint8_t len) {
+  uint64_t now   = SteamController_MonotonicUs();
+  uint64_t delta = now - pRecorder->lastUs;
+  pRecorder->lastUs = now;
+
+  uint8_t record[RECORDING_RECORD_SIZE + 255];
+  StoreU32(record, delta > UINT32_MAX ? UINT32_MAX : (uint32_t)delta);
+  record[4] = len;
+  memcpy(record + RECORDING_RECORD_SIZE, report, len);
+
+  // Buffered by stdio; the reader thread isn't held up by the disk
+  fwrite(record, 1, RECORDING_RECORD_SIZE + len, pRecorder->file);
+}
+
+void SteamController_CloseRecorder(SteamControllerRecorder *pRecorder) {
+  fclose(pRecorder->file);
+  free(pRecorder);
+}
+
+// ----------------------------------------------------------------------------------------------
+// Replay
+
+typedef struct {
+  uint8_t   *data;          /**< The whole recording. */
+  size_t    size;
+  size_t    offset;         /**< Next record. */
+  uint64_t  nextUs;         /**< Recording time of the next record. */
+  float     speed;
+  bool      started;
+  uint64_t  startUs;        /**< Host time of the first read. */
+  volatile bool finished;
+} SteamControllerReplay;
+
+static inline uint32_t LoadU32(const uint8_t *pSource) {
+  return (uint32_t)pSource[0] | ((uint32_t)pSource[1] << 8) | ((uint32_t)pSource[2] << 16) | ((uint32_t)pSource[3] << 24);
+}
+
+/** Whether a whole record starts at the replay's offset. */
+static bool HasRecord(const SteamControllerReplay *pReplay) {
+  if (pReplay->size - pReplay->offset < RECORDING_RECORD_SIZE)
+    return false;
+  return pReplay->size - pReplay->offset - RECORDING_RECORD_SIZE >= pReplay->data[pReplay->offset + 4];
+}
+
+static uint8_t ReplayReadReport(void *context, uint8_t *buffer, uint8_t maxLen, uint32_t timeoutMs) {
+  SteamControllerReplay *pReplay = context;
+
+  if (!HasRecord(pReplay)) {
+    pReplay->finished = true;
+    if (timeoutMs > 0)
+      SteamController_SleepUs(timeoutMs * 1000ull);
+    return 0;
+  }
+
+  const uint8_t *record = pReplay->data + pReplay->offset;
+  uint64_t nextUs = pReplay->nextUs + LoadU32(record);
+
+  if (pReplay->speed > 0) {
+    uint64_t now = SteamController_MonotonicUs();
+    if (!pReplay->started) {
+      pReplay->startUs = now;
+      pReplay->started = true;
+    }
+
+    uint64_t due = pReplay->startUs + (uint64_t)(nextUs / pReplay->speed);
+    if (due > now) {
+      if (due - now > timeoutMs * 1000ull) {
+        if (timeoutMs > 0)
+          SteamController_SleepUs(timeoutMs * 1000ull);
+        return 0;
+      }
+      SteamController_SleepUs(due - now);
+    }
+  }
+
+  uint8_t len = record[4];
+  if (len > maxLen)
+    len = maxLen;
+  memcpy(buffer, record + RECORDING_RECORD_SIZE, len);
+
+  pReplay->offset += RECORDING_RECORD_SIZE + record[4];
+  pReplay->nextUs = nextUs;
+  return len;
+}
+
+static bool ReplaySetFeatureReport(void *context, const uint8_t *report, size_t len) {
+  (void)context;
+  (void)report;
+  (void)len;
+  return true;
+}
+
+static bool ReplayGetFeatureReport(void *context, uint8_t *report, size_t len) {
+  (void)context;
+  // Keep the page and feature id of the request
+  if (len > 2)
+    memset(report + 2, 0, len - 2);
+  return true;
+}
+
+static void ReplayClose(void *context) {
+  SteamControllerReplay *pReplay = context;
+  free(pReplay->data);
+  free(pReplay);
+}
+
+static const SteamControllerTransport g_replayTransport = {
+  ReplayReadReport,
+  ReplaySetFeatureReport,
+  ReplayGetFeatureReport,
+  ReplayClose
+};
+
+/**
+ * Open a recording as if it were a controller. The reports are read in the
+ * order and, unless speed is STEAMCONTROLLER_REPLAY_AS_FAST_AS_POSSIBLE,
+ * with the spacing they were recorded with. Timing starts at the first read.
+ *
+ * @param path    File written by SteamController_StartRecording.
+ * @param speed   1 for the original speed, 2 for twice as fast, and so on.
+ */
+SCAPI SteamControllerDevice * SCCC SteamController_OpenReplay(const char *path, float speed) {
+  if (!path)
+    return NULL;
+
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    fprintf(stderr, "Opening recording %s failed\n", path);
+    return NULL;
+  }
+
+  // Recordings are small; reading them up front keeps the disk out of the timing
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  uint8_t *data = size > 0 ? malloc((size_t)size) : NULL;
+  if (!data || fread(data, 1, (size_t)size, file) != (size_t)size ||
+      size < RECORDING_HEADER_SIZE || memcmp(data, RECORDING_MAGIC, 4) != 0 || data[4] != RECORDING_VERSION) {
+    fprintf(stderr, "%s is not a controller recording\n", path);
+    free(data);
+    fclose(file);
+    return NULL;
+  }
+  fclose(file);
+
+  SteamControllerReplay *pReplay = malloc(sizeof(SteamControllerReplay));
+  pReplay->data     = data;
+  pReplay->size     = (size_t)size;
+  pReplay->offset   = RECORDING_HEADER_SIZE;
+  pReplay->nextUs   = 0;
+  pReplay->speed    = speed > 0 ? speed : STEAMCONTROLLER_REPLAY_AS_FAST_AS_POSSIBLE;
+  pReplay->started  = false;
+  pReplay->startUs  = 0;
+  pReplay->finished = false;
+
+  return SteamController_OpenTransport(&g_replayTransport, pReplay, (data[5] & RECORDING_FLAG_WIRELESS) != 0);
+}
+
+/** Whether a device was opened with SteamController_OpenReplay. */
+SCAPI bool SCCC SteamController_IsReplay(const SteamControllerDevice *pDevice) {
+  return pDevice && pDevice->transport == &g_replayTransport;
+}
+
+/** Whether a replayed device has handed out its last report. False for other devices. */
+SCAPI bool SCCC SteamController_IsReplayFinished(const SteamControllerDevice *pDevice) {
+  if (!pDevice || pDevice->transport != &g_replayTransport)
+    return false;
+  return ((const SteamControllerReplay*)pDevice->context)->finished;
+}
@@ -22,7 +22,121 @@ uint8_t SCAPI SCCC SteamController_ReadEvent(const SteamControllerDevice *pDevic
   if (!len)
     return 0;
 
-  uint8_t *eventData = eventDataBuf;
+  return SteamController_DecodeEvent(eventDataBuf, len, pEvent);
+}
+
+/**
+ * Wait for the next event from the device.
+ * 
+ * @param pController   Device to use.
+ * @param pEvent        Where to store event data.
+ * @param timeoutMs     How long to wait for an event, in milliseconds.
+ * 
+ * @return The type of the received event. If no event was received in time this is 0;
+ *         reports that are not events are skipped.
+ */
+uint8_t SCAPI SCCC SteamController_ReadEventTimeout(const SteamControllerDevice *pDevice, SteamControllerEvent *pEvent, uint32_t timeoutMs) {
+  if (!pDevice)
+    return 0;
+
+  if (!pEvent)
+    return 0;
+
+  uint8_t   eventDataBuf[65];
+  uint8_t   eventType = 0;
+
+  /* Reports that aren't events don't end the wait */
+  while (!eventType) {
+    uint16_t len = SteamController_ReadRawTimeout(pDevice, eventDataBuf, 65, timeoutMs);
+    if (!len)
+      return 0;
+
+    eventType = SteamController_DecodeEvent(eventDataBuf, len, pEvent);
+  }
+
+  return eventType;
+}
+
+/**
+ * Read every event the device has queued.
+ * Waits up to timeoutUs for the first event, then takes whatever else is
+ * already queued without waiting again.
+ * 
+ * @param pController   Device to use.
+ * @param pEvents       Where to store event data.
+ * @param maxCount      Capacity of pEvents.
+ * @param timeoutUs     How long to wait for the first event, in microseconds.
+ * 
+ * @return The number of events stored.
+ */
+uint32_t SCAPI SCCC SteamController_ReadEvents(const SteamControllerDevice *pDevice, SteamControllerEvent *pEvents, uint32_t maxCount, uint32_t timeoutUs) {
+  if (!pDevice)
+    return 0;
+
+  if (!pEvents)
+    return 0;
+
+  uint8_t   eventDataBuf[65];
+  uint32_t  timeoutMs = (timeoutUs + 999) / 1000;
+  uint32_t  count = 0;
+
+  while (count < maxCount) {
+    uint16_t len = SteamController_ReadRawTimeout(pDevice, eventDataBuf, 65, count == 0 ? timeoutMs : 0);
+    if (!len)
+      break;
+
+    if (SteamController_DecodeEvent(eventDataBuf, len, &pEvents[count]))
+      count++;
+  }
+
+  return count;
+}
+
+/**
+ * Copy the motion data of the update events among pEvents into a batch.
+ * Other events are skipped. The batch is appended to until it is full.
+ * 
+ * @param pEvents       Events to decode.
+ * @param count         Number of events.
+ * @param pBatch        Batch to append to.
+ * 
+ * @return The number of events consumed; less than count if the batch filled up.
+ */
+uint32_t SCAPI SCCC SteamController_DecodeUpdates(const SteamControllerEvent *pEvents, uint32_t count, SteamControllerUpdateBatch *pBatch) {
+  if (!pEvents || !pBatch)
+    return 0;
+
+  uint32_t i;
+  uint32_t n = pBatch->count;
+  for (i = 0; i < count; i++) {
+    const SteamControllerUpdateEvent *pUpdate = &pEvents[i].update;
+    if (pUpdate->eventType != STEAMCONTROLLER_EVENT_UPDATE)
+      continue;
+    if (n == pBatch->capacity)
+      break;
+
+    pBatch->timeStamp[n]        = pUpdate->timeStamp;
+    pBatch->buttons[n]          = pUpdate->buttons;
+    pBatch->orientation[n]      = pUpdate->orientation;
+    pBatch->acceleration[n]     = pUpdate->acceleration;
+    pBatch->angularVelocity[n]  = pUpdate->angularVelocity;
+    n++;
+  }
+  pBatch->count = n;
+
+  return i;
+}
+
+/**
+ * Decode a raw report into an event.
+ * 
+ * @param eventData     Report as read from the device, including the report ID if any.
+ * @param len           Length of the report.
+ * @param pEvent        Where to store event data.
+ * 
+ * @return The type of the decoded event, 0 if the report is not an event.
+ */
+uint8_t SteamController_DecodeEvent(uint8_t *eventData, uint16_t len, SteamControllerEvent *pEvent) {
   if (!*eventData) {
     eventData++;
     len--;
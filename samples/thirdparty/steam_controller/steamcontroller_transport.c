@@ -0,0 +1,124 @@
+#include "steamcontroller.h"
+#include "common.h"
+
+#if _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/** Host time in microseconds that never goes backwards. */
+uint64_t SteamController_MonotonicUs(void) {
+#if _WIN32
+  LARGE_INTEGER frequency, counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000 +
+    (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+void SteamController_SleepUs(uint64_t us) {
+#if _WIN32
+  Sleep((DWORD)((us + 999) / 1000));
+#else
+  struct timespec delay = { (time_t)(us / 1000000), (long)(us % 1000000) * 1000 };
+  nanosleep(&delay, NULL);
+#endif
+}
+
+/** Wrap a transport into a device without talking to the controller. */
+SteamControllerDevice * SteamController_WrapTransport(const SteamControllerTransport *pTransport, void *context, bool isWireless) {
+  if (!pTransport)
+    return NULL;
+
+  SteamControllerDevice *pDevice = malloc(sizeof(SteamControllerDevice));
+  pDevice->transport  = pTransport;
+  pDevice->context    = context;
+  pDevice->isWireless = isWireless;
+  pDevice->recorder   = NULL;
+  return pDevice;
+}
+
+/**
+ * Wrap a transport into a device and set the controller up.
+ *
+ * @param pTransport  Functions to talk to the controller with. Must outlive the device.
+ * @param context     Passed to the functions; closed with the device.
+ * @param isWireless  Whether the transport leads to a wireless dongle.
+ */
+SCAPI SteamControllerDevice * SCCC SteamController_OpenTransport(const SteamControllerTransport *pTransport, void *context, bool isWireless) {
+  SteamControllerDevice *pDevice = SteamController_WrapTransport(pTransport, context, isWireless);
+  if (pDevice)
+    SteamController_Initialize(pDevice);
+  return pDevice;
+}
+
+SCAPI void SCCC SteamController_Close(SteamControllerDevice *pDevice) {
+  if (!pDevice)
+    return;
+
+  SteamController_StopRecording(pDevice);
+  pDevice->transport->close(pDevice->context);
+  free(pDevice);
+}
+
+bool SCAPI SCCC SteamController_IsWirelessDongle(const SteamControllerDevice *pDevice) {
+  if (!pDevice)
+    return false;
+  return pDevice->isWireless;
+}
+
+bool SteamController_HIDSetFeatureReport(const SteamControllerDevice *pDevice, SteamController_HIDFeatureReport *pReport) {
+  if (!pDevice || !pReport)
+    return false;
+
+  for (int i=0; i<50; i++) {
+    if (pDevice->transport->setFeatureReport(pDevice->context, (const uint8_t*)pReport, sizeof(SteamController_HIDFeatureReport)))
+      return true;
+
+    SteamController_SleepUs(1000);
+  }
+
+  return false;
+}
+
+bool SteamController_HIDGetFeatureReport(const SteamControllerDevice *pDevice, SteamController_HIDFeatureReport *pReport) {
+  if (!pDevice || !pReport)
+    return false;
+
+  uint8_t featureId   = pReport->featureId;
+
+  SteamController_HIDSetFeatureReport(pDevice, pReport);
+
+  for (int i=0; i<50; i++) {
+    if (pDevice->transport->getFeatureReport(pDevice->context, (uint8_t*)pReport, sizeof(SteamController_HIDFeatureReport))) {
+      if (featureId == pReport->featureId)
+        return true;
+      continue;
+    }
+
+    SteamController_SleepUs(1000);
+  }
+
+  return false;
+}
+
+uint8_t SteamController_ReadRaw(const SteamControllerDevice *pDevice, uint8_t *buffer, uint8_t maxLen) {
+  return SteamController_ReadRawTimeout(pDevice, buffer, maxLen, 0);
+}
+
+uint8_t SteamController_ReadRawTimeout(const SteamControllerDevice *pDevice, uint8_t *buffer, uint8_t maxLen, uint32_t timeoutMs) {
+  if (!pDevice)
+    return 0;
+
+  uint8_t len = pDevice->transport->readReport(pDevice->context, buffer, maxLen, timeoutMs);
+  if (len > 0 && pDevice->recorder)
+    SteamController_RecordReport(pDevice->recorder, buffer, len);
+
+  return len;
+}
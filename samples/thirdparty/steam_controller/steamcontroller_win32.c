@@ -10,17 +10,17 @@
 
 #include <stdio.h>
 
-struct SteamControllerDevice {
+typedef struct {
   HANDLE      devHandle;
   HANDLE      reportEvent;
   OVERLAPPED  overlapped;
-  bool    isWireless;
-};
+} Win32HIDDevice;
 
 struct SteamControllerDeviceEnum {
   struct SteamControllerDeviceEnum *next;
   SP_DEVICE_INTERFACE_DETAIL_DATA *pDevIntfDetailData;
   HIDD_ATTRIBUTES hidAttribs;
+  char devicePath[512];
 };
 
 SCAPI SteamControllerDeviceEnum * SCCC SteamController_EnumControllerDevices() {
@@ -83,6 +83,11 @@ SCAPI SteamControllerDeviceEnum * SCCC SteamController_EnumControllerDevices() {
     pNewEnum->next = pEnum;
     pNewEnum->pDevIntfDetailData = pDevIntfDetailData;
     pNewEnum->hidAttribs = hidAttribs;
+#ifdef UNICODE
+    WideCharToMultiByte(CP_UTF8, 0, pDevIntfDetailData->DevicePath, -1, pNewEnum->devicePath, sizeof(pNewEnum->devicePath), NULL, NULL);
+#else
+    snprintf(pNewEnum->devicePath, sizeof(pNewEnum->devicePath), "%s", pDevIntfDetailData->DevicePath);
+#endif
     pEnum = pNewEnum;
   }
 
@@ -103,98 +108,111 @@ SCAPI SteamControllerDeviceEnum * SCCC SteamController_NextControllerDevice(Stea
   return pNext;
 }
 
-SCAPI SteamControllerDevice * SCCC SteamController_Open(const SteamControllerDeviceEnum *pEnum) {
-  if (!pEnum)  
+/**
+ * Interface path an enumerated controller was found at. It stays the same
+ * for as long as the controller is plugged in.
+ */
+SCAPI const char * SCCC SteamController_GetDevicePath(const SteamControllerDeviceEnum *pEnum) {
+  if (!pEnum)
     return NULL;
+  return pEnum->devicePath;
+}
 
-  SteamControllerDevice *pDevice = malloc(sizeof(SteamControllerDevice));
-  pDevice->isWireless = pEnum->hidAttribs.ProductID == USB_PID_STEAMCONTROLLER_WIRELESS;
-  pDevice->devHandle  = CreateFile(
-    pEnum->pDevIntfDetailData->DevicePath, 
-    GENERIC_READ | GENERIC_WRITE,
-    FILE_SHARE_READ | FILE_SHARE_WRITE,
-    0,
-    OPEN_EXISTING,
-    0,
-    NULL
-  );
+static uint8_t Win32ReadReport(void *context, uint8_t *buffer, uint8_t maxLen, uint32_t timeoutMs) {
+  Win32HIDDevice *pHID = context;
+  DWORD bytesRead = 0;
+
+  ResetEvent(pHID->reportEvent);
+  if (!ReadFile(pHID->devHandle, buffer, maxLen, &bytesRead, &pHID->overlapped)) {
+    if (GetLastError() != ERROR_IO_PENDING)
+      return 0;
 
-  pDevice->reportEvent = CreateEvent(NULL, true, false, NULL);
-  pDevice->overlapped.hEvent = pDevice->reportEvent;
-  pDevice->overlapped.Offset = 0;
-  pDevice->overlapped.OffsetHigh = 0;
+    if (WaitForSingleObject(pHID->reportEvent, timeoutMs) != WAIT_OBJECT_0) {
+      // The read may still complete; buffer has to stay valid until it is really cancelled
+      CancelIo(pHID->devHandle);
+    }
+    if (!GetOverlappedResult(pHID->devHandle, &pHID->overlapped, &bytesRead, TRUE))
+      return 0;
+  }
 
-  SteamController_Initialize(pDevice);
-  return pDevice;
+  return bytesRead & 0xff;
 }
 
-SCAPI void SCCC SteamController_Close(SteamControllerDevice *pDevice) {
-  if (!pDevice)
-    return;
+static bool Win32SetFeatureReport(void *context, const uint8_t *report, size_t len) {
+  Win32HIDDevice *pHID = context;
 
-  CloseHandle(pDevice->reportEvent);
-  CloseHandle(pDevice->devHandle);
-  free(pDevice);
-}
+  fprintf(stderr, "SteamController_HIDSetFeatureReport %02x\n", report[1]);
 
-bool SteamController_HIDSetFeatureReport(const SteamControllerDevice *pDevice, SteamController_HIDFeatureReport *pReport) {
-  if (!pDevice || !pReport || !pDevice->devHandle)
-    return false;
+  if (HidD_SetFeature(pHID->devHandle, (PVOID)report, (ULONG)len))
+    return true;
 
-  fprintf(stderr, "SteamController_HIDSetFeatureReport %02x\n", pReport->featureId);
+  fprintf(stderr, "HidD_SetFeature failed. Last error: %08lx\n", GetLastError());
+  return false;
+}
 
-  for (int i=0; i<50; i++) {
-    bool ok = HidD_SetFeature(pDevice->devHandle, pReport, sizeof(SteamController_HIDFeatureReport));
-    if (ok)
-      return true;
+static bool Win32GetFeatureReport(void *context, uint8_t *report, size_t len) {
+  Win32HIDDevice *pHID = context;
 
-    fprintf(stderr, "HidD_SetFeature failed. Last error: %08lx\n", GetLastError());
-    Sleep(1);
-  }
+  fprintf(stderr, "SteamController_HIDGetFeatureReport %02x\n", report[1]);
+
+  if (HidD_GetFeature(pHID->devHandle, report, (ULONG)len))
+    return true;
 
+  fprintf(stderr, "HidD_GetFeature failed. Last error: %08lx\n", GetLastError());
   return false;
 }
 
-bool SteamController_HIDGetFeatureReport(const SteamControllerDevice *pDevice, SteamController_HIDFeatureReport *pReport) {
-  if (!pDevice || !pReport || !pDevice->devHandle)
-    return false;
+static void Win32Close(void *context) {
+  Win32HIDDevice *pHID = context;
 
-  uint8_t featureId   = pReport->featureId;
-
-  SteamController_HIDSetFeatureReport(pDevice, pReport);
+  CloseHandle(pHID->reportEvent);
+  CloseHandle(pHID->devHandle);
+  free(pHID);
+}
 
-  fprintf(stderr, "SteamController_HIDGetFeatureReport %02x\n", pReport->featureId);
+static const SteamControllerTransport g_win32Transport = {
+  Win32ReadReport,
+  Win32SetFeatureReport,
+  Win32GetFeatureReport,
+  Win32Close
+};
 
-  for (int i=0; i<50; i++) {
-    bool ok = HidD_GetFeature(pDevice->devHandle, pReport, sizeof(SteamController_HIDFeatureReport));
-    if (ok) {
-      if (featureId == pReport->featureId)
-        return true;
-      continue;
-    }
+static SteamControllerDevice * OpenEnum(const SteamControllerDeviceEnum *pEnum, bool setUp) {
+  if (!pEnum)  
+    return NULL;
 
-    fprintf(stderr, "HidD_SetFeature failed. Last error: %08lx\n", GetLastError());
-    Sleep(1);
+  Win32HIDDevice *pHID = malloc(sizeof(Win32HIDDevice));
+  pHID->devHandle  = CreateFile(
+    pEnum->pDevIntfDetailData->DevicePath, 
+    GENERIC_READ | GENERIC_WRITE,
+    FILE_SHARE_READ | FILE_SHARE_WRITE,
+    0,
+    OPEN_EXISTING,
+    FILE_FLAG_OVERLAPPED,
+    NULL
+  );
+  if (pHID->devHandle == INVALID_HANDLE_VALUE) {
+    free(pHID);
+    return NULL;
   }
 
-  return false;
-}
+  pHID->reportEvent = CreateEvent(NULL, true, false, NULL);
+  pHID->overlapped.hEvent = pHID->reportEvent;
+  pHID->overlapped.Offset = 0;
+  pHID->overlapped.OffsetHigh = 0;
 
-bool SCAPI SCCC SteamController_IsWirelessDongle(const SteamControllerDevice *pDevice) {
-  if (!pDevice)
-    return false;
-  return pDevice->isWireless;
+  bool isWireless = pEnum->hidAttribs.ProductID == USB_PID_STEAMCONTROLLER_WIRELESS;
+  if (!setUp)
+    return SteamController_WrapTransport(&g_win32Transport, pHID, isWireless);
+  return SteamController_OpenTransport(&g_win32Transport, pHID, isWireless);
 }
 
-uint8_t SteamController_ReadRaw(const SteamControllerDevice *pDevice, uint8_t *buffer, uint8_t maxLen) {
-  if (!pDevice)
-    return 0;
-
-  DWORD bytesRead = 0;
-  ReadFile(pDevice->devHandle, buffer, maxLen, &bytesRead, (OVERLAPPED*)&pDevice->overlapped);
-  WaitForSingleObject(pDevice->reportEvent, 0);
+SCAPI SteamControllerDevice * SCCC SteamController_Open(const SteamControllerDeviceEnum *pEnum) {
+  return OpenEnum(pEnum, true);
+}
 
-  return bytesRead & 0xff;
+SCAPI SteamControllerDevice * SCCC SteamController_OpenListenOnly(const SteamControllerDeviceEnum *pEnum) {
+  return OpenEnum(pEnum, false);
 }
 
 #endif